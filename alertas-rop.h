@@ -0,0 +1,362 @@
+/*
+Subsistema de alertas compartilhado pelas proteções contra ROP (janela-deslizante.cpp e pilha-sombra.cpp).
+
+As funções de análise não escrevem mais no arquivo de saída: "AlertaRegistra" apenas grava um evento
+binário de tamanho fixo na fila da própria thread (sem travas, com um único produtor e um único
+consumidor). Uma thread interna do Pin esvazia periodicamente as filas, agrega os eventos por
+(thread, tipo, local), com o nº de ocorrências e os instantes da primeira e da última, e escreve os
+agregados que mudaram desde o último relatório, respeitando um limite de linhas por segundo. As
+linhas que excedem o limite não são perdidas: continuam sendo agregadas e saem nos relatórios
+seguintes ou no final da execução. Se a fila de uma thread encher, o evento é descartado e contado.
+
+A saída pode ser em texto (mensagem da ferramenta seguida dos dados da agregação) ou em JSON, um
+objeto por linha. O texto de cada tipo de alerta é fornecido pela ferramenta ("AlertasInicia").
+
+Uso: chamar "AlertasInicia" no "main", depois de PIN_Init e antes de registrar a função de término
+da ferramenta, para que os alertas pendentes sejam escritos antes do seu resumo final. Em um "fork"
+(ver "saida-processo.h"), o filho descarta as filas das outras threads e os alertas já agregados
+pelo pai e recria a thread interna; a ferramenta deve reabrir a saída antes, registrando as suas
+funções de "fork" antes de chamar "AlertasInicia".
+*/
+
+#ifndef ALERTAS_ROP_H
+#define ALERTAS_ROP_H
+
+#include "pin.H"          // para usar APIs do Pin
+#include <stdio.h>        // para usar "fprintf"
+#include <time.h>         // para usar "clock_gettime"
+#include <map>            // para agregar os alertas
+#include <vector>         // para guardar as filas das threads
+#include <ostream>        // para escrever os alertas
+#include "saida-processo.h" // para tratar o "fork"
+
+// Formatos de saída dos alertas
+enum FormatoAlertas{
+   ALERTAS_TEXTO,  // mensagem da ferramenta seguida dos dados da agregação
+   ALERTAS_JSON    // um objeto JSON por linha
+};
+
+// Evento de alerta, gravado pela função de análise na fila da thread
+struct EventoAlerta{
+   UINT32 tipo;      // tipo de alerta, definido pela ferramenta
+   UINT32 tid;       // thread que gerou o alerta
+   ADDRINT local;    // endereço do código onde o alerta ocorreu
+   ADDRINT valor1;   // dados específicos do tipo de alerta
+   ADDRINT valor2;
+   UINT64 instante;  // nanossegundos desde "AlertasInicia"
+};
+
+// Funções da ferramenta que descrevem um alerta: em texto, a mensagem; em JSON, os campos
+// específicos do tipo (ex.: "alerta":"limiar","limiar":10), sem as chaves do objeto
+typedef VOID (*DescreveAlerta)(std::ostream &saida, UINT32 tipo, ADDRINT valor1, ADDRINT valor2);
+
+// Nº de eventos da fila de cada thread (potência de 2)
+static const UINT32 ALERTAS_TAM_FILA = 256;
+
+// Fila de alertas de uma thread. Os contadores do produtor e do consumidor ficam em linhas
+// diferentes da cache para evitar "false sharing".
+struct FilaAlertas{
+   volatile UINT64 produzidos;        // eventos gravados pela thread
+   UINT64 descartados;                // eventos descartados por falta de espaço (só a thread escreve)
+   UINT8 lixo1[64 - 2 * sizeof(UINT64)];
+   volatile UINT64 consumidos;        // eventos já agregados pela thread interna
+   volatile BOOL terminada;           // a thread terminou; a fila é liberada depois de esvaziada
+   UINT8 lixo2[64 - sizeof(UINT64) - sizeof(BOOL)];
+   EventoAlerta eventos[ALERTAS_TAM_FILA];
+};
+
+// Chave de agregação dos alertas
+struct ChaveAlerta{
+   UINT32 tid;
+   UINT32 tipo;
+   ADDRINT local;
+
+   bool operator<(const ChaveAlerta &outra) const{
+      if(tid != outra.tid) return(tid < outra.tid);
+      if(tipo != outra.tipo) return(tipo < outra.tipo);
+      return(local < outra.local);
+   }
+};
+
+// Alertas agregados de uma chave
+struct AgregadoAlerta{
+   UINT64 ocorrencias;  // total de ocorrências
+   UINT64 pendentes;    // ocorrências ainda não relatadas
+   UINT64 primeira;     // instante da primeira ocorrência
+   UINT64 ultima;       // instante da última ocorrência
+   ADDRINT valor1;      // dados da última ocorrência
+   ADDRINT valor2;
+};
+
+// Estado do subsistema de alertas
+static struct{
+   std::ostream *saida;                         // onde os alertas são escritos
+   FormatoAlertas formato;
+   UINT32 por_segundo;                          // limite de linhas por segundo (0: sem limite)
+   UINT32 intervalo_ms;                         // intervalo entre os relatórios da thread interna
+   DescreveAlerta descreve_texto;
+   DescreveAlerta descreve_json;
+   struct timespec inicio;                      // referência dos instantes dos eventos
+   TLS_KEY chave_fila;                          // fila de cada thread
+   PIN_LOCK trava_filas;                        // protege "filas"
+   PIN_LOCK trava_escrita;                      // mantida pela thread interna enquanto agrega e escreve
+   std::vector<FilaAlertas *> filas;            // filas das threads (usadas pela thread interna)
+   std::map<ChaveAlerta, AgregadoAlerta> agregados;
+   ChaveAlerta cursor;                          // última chave relatada; o próximo relatório continua dela
+   UINT64 eventos;                              // total de eventos agregados
+   UINT64 descartados;                          // eventos descartados das filas já liberadas
+   PIN_SEMAPHORE acorda;                        // acorda a thread interna para terminar
+   PIN_THREAD_UID uid_escritora;
+   volatile BOOL parar;
+} alertas;
+
+// Instante atual, em nanossegundos desde "AlertasInicia"
+static UINT64 AlertasInstante(){
+   struct timespec agora;
+   clock_gettime(CLOCK_MONOTONIC, &agora);
+   return(static_cast<UINT64>(agora.tv_sec - alertas.inicio.tv_sec) * 1000000000ULL + agora.tv_nsec - alertas.inicio.tv_nsec);
+}
+
+// Registra um alerta na fila da thread. Chamada pelas funções de análise; não usa travas nem
+// escreve no arquivo de saída. Se a fila estiver cheia, o evento é descartado e contado.
+static VOID AlertaRegistra(THREADID tid, UINT32 tipo, ADDRINT local, ADDRINT valor1, ADDRINT valor2){
+   FilaAlertas *fila = static_cast<FilaAlertas *>(PIN_GetThreadData(alertas.chave_fila, tid));
+   UINT64 produzidos = fila->produzidos;
+   if(produzidos - __atomic_load_n(&fila->consumidos, __ATOMIC_ACQUIRE) == ALERTAS_TAM_FILA){
+      fila->descartados++;
+      return;
+   }
+
+   EventoAlerta *evento = &fila->eventos[produzidos & (ALERTAS_TAM_FILA - 1)];
+   evento->tipo = tipo;
+   evento->tid = tid;
+   evento->local = local;
+   evento->valor1 = valor1;
+   evento->valor2 = valor2;
+   evento->instante = AlertasInstante();
+   __atomic_store_n(&fila->produzidos, produzidos + 1, __ATOMIC_RELEASE);
+}
+
+// Esvazia as filas das threads, agregando os eventos. Libera as filas das threads que terminaram.
+static VOID AlertasColeta(){
+   PIN_GetLock(&alertas.trava_filas, 0);
+   for(size_t i = 0; i < alertas.filas.size(); ){
+      FilaAlertas *fila = alertas.filas[i];
+      BOOL terminada = fila->terminada;
+      UINT64 produzidos = __atomic_load_n(&fila->produzidos, __ATOMIC_ACQUIRE);
+      UINT64 consumidos = fila->consumidos;
+
+      for(; consumidos < produzidos; consumidos++){
+         const EventoAlerta &evento = fila->eventos[consumidos & (ALERTAS_TAM_FILA - 1)];
+         ChaveAlerta chave = {evento.tid, evento.tipo, evento.local};
+         std::map<ChaveAlerta, AgregadoAlerta>::iterator it = alertas.agregados.find(chave);
+         if(it == alertas.agregados.end()){
+            AgregadoAlerta novo = {0, 0, evento.instante, evento.instante, 0, 0};
+            it = alertas.agregados.insert(std::make_pair(chave, novo)).first;
+         }
+         it->second.ocorrencias++;
+         it->second.pendentes++;
+         it->second.ultima = evento.instante;
+         it->second.valor1 = evento.valor1;
+         it->second.valor2 = evento.valor2;
+         alertas.eventos++;
+      }
+      __atomic_store_n(&fila->consumidos, consumidos, __ATOMIC_RELEASE);
+
+      // a thread já terminou e todos os seus eventos foram agregados
+      if(terminada){
+         alertas.descartados += fila->descartados;
+         delete fila;
+         alertas.filas[i] = alertas.filas.back();
+         alertas.filas.pop_back();
+      }
+      else{
+         i++;
+      }
+   }
+   PIN_ReleaseLock(&alertas.trava_filas);
+}
+
+// Escreve um alerta agregado
+static VOID AlertasEscreveAgregado(const ChaveAlerta &chave, const AgregadoAlerta &agregado){
+   std::ostream &saida = *alertas.saida;
+   if(alertas.formato == ALERTAS_JSON){
+      saida << "{\"tid\":" << chave.tid << ",\"local\":\"" << hexstr(chave.local, sizeof(ADDRINT)) << "\",";
+      alertas.descreve_json(saida, chave.tipo, agregado.valor1, agregado.valor2);
+      saida << ",\"ocorrencias\":" << agregado.ocorrencias << ",\"novas\":" << agregado.pendentes
+            << ",\"primeira_ns\":" << agregado.primeira << ",\"ultima_ns\":" << agregado.ultima << "}" << std::endl;
+   }
+   else{
+      alertas.descreve_texto(saida, chave.tipo, agregado.valor1, agregado.valor2);
+      saida << " [thread " << chave.tid << ", local " << hexstr(chave.local, sizeof(ADDRINT)) << ", "
+            << agregado.ocorrencias << " ocorrência(s), " << agregado.pendentes << " desde o último relatório, primeira em "
+            << agregado.primeira / 1000000 << " ms, última em " << agregado.ultima / 1000000 << " ms]" << std::endl;
+   }
+}
+
+// Escreve os alertas agregados com ocorrências ainda não relatadas. Com "limita", escreve no máximo
+// o nº de linhas permitido em um intervalo, continuando do ponto onde o relatório anterior parou
+// para que todas as chaves sejam relatadas em algum momento.
+static VOID AlertasEscreve(BOOL limita){
+   UINT64 orcamento = static_cast<UINT64>(-1);
+   if(limita && alertas.por_segundo > 0){
+      orcamento = static_cast<UINT64>(alertas.por_segundo) * alertas.intervalo_ms / 1000;
+      if(orcamento == 0){
+         orcamento = 1;
+      }
+   }
+
+   std::map<ChaveAlerta, AgregadoAlerta>::iterator it = alertas.agregados.upper_bound(alertas.cursor);
+   for(size_t n = alertas.agregados.size(); n > 0 && orcamento > 0; n--){
+      if(it == alertas.agregados.end()){
+         it = alertas.agregados.begin();
+      }
+      if(it->second.pendentes > 0){
+         AlertasEscreveAgregado(it->first, it->second);
+         it->second.pendentes = 0;
+         alertas.cursor = it->first;
+         orcamento--;
+      }
+      ++it;
+   }
+   alertas.saida->flush();
+}
+
+// Thread interna que agrega e escreve os alertas a cada "intervalo_ms"
+static VOID AlertasEscritora(VOID *arg){
+   while(!alertas.parar){
+      PIN_SemaphoreTimedWait(&alertas.acorda, alertas.intervalo_ms);
+      PIN_GetLock(&alertas.trava_escrita, 0);
+      AlertasColeta();
+      AlertasEscreve(TRUE);
+      PIN_ReleaseLock(&alertas.trava_escrita);
+   }
+}
+
+// Cria a fila de alertas de uma nova thread
+static VOID AlertasIniciaThread(THREADID tid, CONTEXT *contexto, INT32 flags, VOID *v){
+   FilaAlertas *fila = new FilaAlertas();
+   PIN_SetThreadData(alertas.chave_fila, fila, tid);
+
+   PIN_GetLock(&alertas.trava_filas, tid + 1);
+   alertas.filas.push_back(fila);
+   PIN_ReleaseLock(&alertas.trava_filas);
+}
+
+// Marca a fila de uma thread que terminou, para ser liberada pela thread interna
+static VOID AlertasTerminaThread(THREADID tid, const CONTEXT *contexto, INT32 codigo, VOID *v){
+   FilaAlertas *fila = static_cast<FilaAlertas *>(PIN_GetThreadData(alertas.chave_fila, tid));
+   fila->terminada = TRUE;
+}
+
+// Encerra a thread interna antes do término da aplicação
+static VOID AlertasPreparaFim(VOID *v){
+   alertas.parar = TRUE;
+   PIN_SemaphoreSet(&alertas.acorda);
+   PIN_WaitForThreadTermination(alertas.uid_escritora, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// Agrega os eventos restantes e escreve, sem limite, todos os alertas ainda não relatados
+// e o resumo dos alertas
+static VOID AlertasFim(INT32 codigo, VOID *v){
+   AlertasColeta();
+   AlertasEscreve(FALSE);
+
+   UINT64 descartados = alertas.descartados;
+   for(size_t i = 0; i < alertas.filas.size(); i++){
+      descartados += alertas.filas[i]->descartados;
+   }
+
+   std::ostream &saida = *alertas.saida;
+   if(alertas.formato == ALERTAS_JSON){
+      saida << "{\"resumo\":true,\"eventos\":" << alertas.eventos << ",\"locais\":" << alertas.agregados.size()
+            << ",\"descartados\":" << descartados << "}" << std::endl;
+   }
+   else{
+      saida << " #### Alertas: " << alertas.eventos << " evento(s) em " << alertas.agregados.size()
+            << " local(is); " << descartados << " descartado(s) por filas cheias" << std::endl;
+   }
+}
+
+// Antes de um "fork": espera a thread interna terminar de escrever (a saída fica esvaziada) e
+// mantém as travas, para que o filho receba as filas e os agregados consistentes
+static VOID AlertasForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_GetLock(&alertas.trava_escrita, tid + 1);
+   PIN_GetLock(&alertas.trava_filas, tid + 1);
+}
+
+// Depois de um "fork", no pai: libera as travas
+static VOID AlertasForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_ReleaseLock(&alertas.trava_filas);
+   PIN_ReleaseLock(&alertas.trava_escrita);
+}
+
+// Depois de um "fork", no filho: mantém só a fila da thread que chamou "fork", sem os eventos ainda
+// não agregados (que o pai relata), descarta os agregados do pai e recria a thread interna
+static VOID AlertasForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_InitLock(&alertas.trava_filas);
+   PIN_InitLock(&alertas.trava_escrita);
+
+   FilaAlertas *propria = static_cast<FilaAlertas *>(PIN_GetThreadData(alertas.chave_fila, tid));
+   for(size_t i = 0; i < alertas.filas.size(); i++){
+      if(alertas.filas[i] != propria){
+         delete alertas.filas[i];
+      }
+   }
+   alertas.filas.assign(1, propria);
+   propria->consumidos = propria->produzidos;
+   propria->descartados = 0;
+
+   alertas.agregados.clear();
+   alertas.cursor = ChaveAlerta();
+   alertas.eventos = 0;
+   alertas.descartados = 0;
+   clock_gettime(CLOCK_MONOTONIC, &alertas.inicio);
+
+   alertas.parar = FALSE;
+   PIN_SemaphoreInit(&alertas.acorda);
+   if(PIN_SpawnInternalThread(AlertasEscritora, NULL, 0, &alertas.uid_escritora) == INVALID_THREADID){
+      fprintf(stderr, "Nao foi possivel criar a thread interna de alertas no processo %d\n", PIN_GetPid());
+      PIN_ExitProcess(1);
+   }
+}
+
+// Obtém o formato de saída a partir do nome ("texto" ou "json"). Retorna FALSE se o nome for inválido.
+static BOOL AlertasFormato(const string &nome, FormatoAlertas *formato){
+   if(nome == "texto"){
+      *formato = ALERTAS_TEXTO;
+      return(TRUE);
+   }
+   if(nome == "json"){
+      *formato = ALERTAS_JSON;
+      return(TRUE);
+   }
+   return(FALSE);
+}
+
+// Inicia o subsistema de alertas: registra as funções de início e término de threads e de término da
+// aplicação e cria a thread interna. Retorna FALSE se a thread interna não puder ser criada.
+static BOOL AlertasInicia(std::ostream *saida, FormatoAlertas formato, UINT32 por_segundo, UINT32 intervalo_ms,
+                          DescreveAlerta descreve_texto, DescreveAlerta descreve_json){
+   alertas.saida = saida;
+   alertas.formato = formato;
+   alertas.por_segundo = por_segundo;
+   alertas.intervalo_ms = intervalo_ms > 0 ? intervalo_ms : 1;
+   alertas.descreve_texto = descreve_texto;
+   alertas.descreve_json = descreve_json;
+   clock_gettime(CLOCK_MONOTONIC, &alertas.inicio);
+   alertas.chave_fila = PIN_CreateThreadDataKey(0);
+   PIN_InitLock(&alertas.trava_filas);
+   PIN_InitLock(&alertas.trava_escrita);
+   PIN_SemaphoreInit(&alertas.acorda);
+
+   PIN_AddThreadStartFunction(AlertasIniciaThread, NULL);
+   PIN_AddThreadFiniFunction(AlertasTerminaThread, NULL);
+   PIN_AddPrepareForFiniFunction(AlertasPreparaFim, NULL);
+   PIN_AddFiniFunction(AlertasFim, NULL);
+   SaidaProcessoAoFork(AlertasForkAntes, AlertasForkPai, AlertasForkFilho, NULL);
+
+   return(PIN_SpawnInternalThread(AlertasEscritora, NULL, 0, &alertas.uid_escritora) != INVALID_THREADID);
+}
+
+#endif // ALERTAS_ROP_H
@@ -0,0 +1,220 @@
+/*
+Arena para o estado por thread das pintools (janelas, pilhas sombra, contadores, filas de alertas).
+
+Entrega blocos de tamanho fixo, zerados e alinhados ao início de uma linha da cache, de modo que o
+estado de threads diferentes nunca compartilhe uma linha ("false sharing") sem depender de campos de
+preenchimento manuais. Os blocos vêm de áreas ("pedaços") cada vez maiores, reservadas com
+"posix_memalign": o pedaço i tem ARENA_BLOCOS_INICIAIS << i blocos. Os blocos liberados quando as
+threads terminam vão para uma lista de livres e são reaproveitados pelas próximas threads, então um
+servidor que cria uma thread por requisição não acumula memória: o consumo acompanha o nº máximo de
+threads vivas ao mesmo tempo. A arena mantém o nº de blocos vivos e o pico, relatados pelas
+ferramentas ao final ("ArenaEstatisticas").
+
+Todas as funções usam a trava da arena e podem ser chamadas de qualquer thread. Alocação e liberação
+acontecem apenas no início e no término das threads, fora das funções de análise.
+
+Em um "fork" (ver "saida-processo.h"), a trava fica com o pai de "ArenaForkAntes" a "ArenaForkPai"; no
+filho, "ArenaForkFilho" devolve os blocos das threads que não existem nele.
+*/
+
+#ifndef ARENA_THREADS_H
+#define ARENA_THREADS_H
+
+#include "pin.H"          // para usar APIs do Pin
+#include <stdio.h>        // para usar "fprintf"
+#include <stdlib.h>       // para usar "posix_memalign"
+#include <string.h>       // para usar "memset"
+#include <vector>         // para guardar os pedaços e os blocos livres
+
+// Tamanho da linha da cache em bytes, ao qual os blocos são alinhados
+static const size_t ARENA_LINHA_CACHE = 64;
+
+// Nº de blocos do primeiro pedaço; cada pedaço seguinte tem o dobro
+static const size_t ARENA_BLOCOS_INICIAIS = 16;
+
+// Arena de blocos de tamanho fixo
+struct ArenaThreads{
+   size_t tam_bloco;                  // tamanho de cada bloco, múltiplo da linha da cache
+   PIN_LOCK trava;                    // protege todos os campos abaixo
+   std::vector<UINT8 *> pedacos;      // áreas reservadas
+   std::vector<UINT8> vivo;           // indica, para cada bloco já entregue, se está em uso
+   std::vector<VOID *> livres;        // blocos liberados, reaproveitados do último para o primeiro
+   size_t criados;                    // blocos já entregues ao menos uma vez (em ordem, pedaço a pedaço)
+   UINT64 vivos;                      // blocos em uso
+   UINT64 pico;                       // maior nº de blocos em uso ao mesmo tempo
+   UINT64 reaproveitados;             // alocações atendidas pela lista de livres
+};
+
+// Estatísticas de uma arena
+struct EstatisticasArena{
+   size_t tam_bloco;                  // tamanho de cada bloco em bytes
+   UINT64 vivos;                      // blocos em uso
+   UINT64 pico;                       // maior nº de blocos em uso ao mesmo tempo
+   UINT64 reaproveitados;             // alocações atendidas por blocos de threads que terminaram
+   UINT64 bytes_reservados;           // memória reservada pelos pedaços
+};
+
+// Inicia uma arena de blocos de "tam_bloco" bytes (arredondado para linhas inteiras da cache)
+static VOID ArenaInicia(ArenaThreads *arena, size_t tam_bloco){
+   arena->tam_bloco = (tam_bloco + ARENA_LINHA_CACHE - 1) / ARENA_LINHA_CACHE * ARENA_LINHA_CACHE;
+   if(arena->tam_bloco == 0){
+      arena->tam_bloco = ARENA_LINHA_CACHE;
+   }
+   PIN_InitLock(&arena->trava);
+   arena->criados = 0;
+   arena->vivos = 0;
+   arena->pico = 0;
+   arena->reaproveitados = 0;
+}
+
+// Obtém o pedaço e a posição, dentro dele, do bloco de índice "indice"
+static VOID ArenaLocaliza(size_t indice, size_t *pedaco, size_t *posicao){
+   size_t p = 0;
+   size_t blocos = ARENA_BLOCOS_INICIAIS;
+   while(indice >= blocos){
+      indice -= blocos;
+      blocos <<= 1;
+      p++;
+   }
+   *pedaco = p;
+   *posicao = indice;
+}
+
+// Obtém o índice do bloco "bloco", procurando o pedaço que o contém
+static size_t ArenaIndice(ArenaThreads *arena, VOID *bloco){
+   UINT8 *endereco = static_cast<UINT8 *>(bloco);
+   size_t primeiro = 0;
+   size_t blocos = ARENA_BLOCOS_INICIAIS;
+   for(size_t p = 0; p < arena->pedacos.size(); p++){
+      UINT8 *inicio = arena->pedacos[p];
+      if(endereco >= inicio && endereco < inicio + blocos * arena->tam_bloco){
+         return(primeiro + (endereco - inicio) / arena->tam_bloco);
+      }
+      primeiro += blocos;
+      blocos <<= 1;
+   }
+   return(static_cast<size_t>(-1));
+}
+
+// Entrega um bloco zerado e alinhado. Reaproveita o bloco liberado mais recentemente, se houver;
+// senão, usa o próximo bloco do último pedaço, reservando um novo pedaço quando ele acaba.
+static VOID *ArenaAloca(ArenaThreads *arena){
+   PIN_GetLock(&arena->trava, 0);
+
+   VOID *bloco;
+   if(!arena->livres.empty()){
+      bloco = arena->livres.back();
+      arena->livres.pop_back();
+      arena->reaproveitados++;
+      arena->vivo[ArenaIndice(arena, bloco)] = 1;
+   }
+   else{
+      size_t pedaco, posicao;
+      ArenaLocaliza(arena->criados, &pedaco, &posicao);
+      if(pedaco == arena->pedacos.size()){
+         VOID *area = NULL;
+         if(posix_memalign(&area, ARENA_LINHA_CACHE, (ARENA_BLOCOS_INICIAIS << pedaco) * arena->tam_bloco) != 0){
+            fprintf(stderr, "Erro ao alocar memoria para o estado das threads\n");
+            PIN_ExitProcess(1);
+         }
+         arena->pedacos.push_back(static_cast<UINT8 *>(area));
+      }
+      bloco = arena->pedacos[pedaco] + posicao * arena->tam_bloco;
+      arena->vivo.push_back(1);
+      arena->criados++;
+   }
+
+   arena->vivos++;
+   if(arena->vivos > arena->pico){
+      arena->pico = arena->vivos;
+   }
+
+   PIN_ReleaseLock(&arena->trava);
+
+   memset(bloco, 0, arena->tam_bloco);
+   return(bloco);
+}
+
+// Devolve um bloco à arena, para ser reaproveitado pela próxima thread
+static VOID ArenaLibera(ArenaThreads *arena, VOID *bloco){
+   if(bloco == NULL){
+      return;
+   }
+
+   PIN_GetLock(&arena->trava, 0);
+   arena->vivo[ArenaIndice(arena, bloco)] = 0;
+   arena->livres.push_back(bloco);
+   arena->vivos--;
+   PIN_ReleaseLock(&arena->trava);
+}
+
+// Chama "funcao" para cada bloco em uso (ex.: para somar os contadores das threads ainda vivas ao
+// final da execução). A trava da arena fica ativa durante as chamadas, que não devem alocar nem
+// liberar blocos da mesma arena.
+static VOID ArenaParaCada(ArenaThreads *arena, VOID (*funcao)(VOID *bloco, VOID *arg), VOID *arg){
+   PIN_GetLock(&arena->trava, 0);
+   for(size_t indice = 0; indice < arena->criados; indice++){
+      if(arena->vivo[indice]){
+         size_t pedaco, posicao;
+         ArenaLocaliza(indice, &pedaco, &posicao);
+         funcao(arena->pedacos[pedaco] + posicao * arena->tam_bloco, arg);
+      }
+   }
+   PIN_ReleaseLock(&arena->trava);
+}
+
+// Antes de um "fork": mantém a trava da arena, para que o filho receba uma cópia consistente
+static VOID ArenaForkAntes(ArenaThreads *arena){
+   PIN_GetLock(&arena->trava, 0);
+}
+
+// Depois de um "fork", no pai: libera a trava
+static VOID ArenaForkPai(ArenaThreads *arena){
+   PIN_ReleaseLock(&arena->trava);
+}
+
+// Depois de um "fork", no filho: reinicia a trava e devolve à lista de livres os blocos em uso para
+// os quais "mantem" retorna FALSE (os das threads que não existem no filho). "mantem" pode liberar
+// os recursos apontados pelo bloco devolvido. O pico e os reaproveitamentos passam a contar do "fork".
+static VOID ArenaForkFilho(ArenaThreads *arena, BOOL (*mantem)(VOID *bloco, VOID *arg), VOID *arg){
+   PIN_InitLock(&arena->trava);
+   for(size_t indice = 0; indice < arena->criados; indice++){
+      if(arena->vivo[indice]){
+         size_t pedaco, posicao;
+         ArenaLocaliza(indice, &pedaco, &posicao);
+         VOID *bloco = arena->pedacos[pedaco] + posicao * arena->tam_bloco;
+         if(!mantem(bloco, arg)){
+            arena->vivo[indice] = 0;
+            arena->livres.push_back(bloco);
+            arena->vivos--;
+         }
+      }
+   }
+   arena->pico = arena->vivos;
+   arena->reaproveitados = 0;
+}
+
+// Função "mantem" de "ArenaForkFilho" que mantém apenas o bloco "arg"
+static BOOL ArenaMantemBloco(VOID *bloco, VOID *arg){
+   return(bloco == arg);
+}
+
+// Obtém as estatísticas da arena
+static EstatisticasArena ArenaEstatisticas(ArenaThreads *arena){
+   EstatisticasArena estatisticas;
+
+   PIN_GetLock(&arena->trava, 0);
+   estatisticas.tam_bloco = arena->tam_bloco;
+   estatisticas.vivos = arena->vivos;
+   estatisticas.pico = arena->pico;
+   estatisticas.reaproveitados = arena->reaproveitados;
+   estatisticas.bytes_reservados = 0;
+   for(size_t p = 0; p < arena->pedacos.size(); p++){
+      estatisticas.bytes_reservados += (ARENA_BLOCOS_INICIAIS << p) * arena->tam_bloco;
+   }
+   PIN_ReleaseLock(&arena->trava);
+
+   return(estatisticas);
+}
+
+#endif // ARENA_THREADS_H
@@ -0,0 +1,53 @@
+/*
+ *  Alvo de teste: cadeias profundas de CALL/RET e recursão.
+ *  Exercita o caminho de CALL/RET da pilha-sombra e do lbrmatch e a contagem por BBL do inscount0.
+ *
+ *  Uso: chamadas [escala]
+ *  Imprime o nº de eventos (pares CALL/RET executados), usado pelo "run.sh" para calcular
+ *  chamadas de análise por segundo, e um valor de controle que impede o compilador de
+ *  eliminar o trabalho.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned long chamadas = 0;
+
+__attribute__((noinline)) static unsigned long folha(unsigned long x)
+{
+    chamadas++;
+    return (x * 2654435761UL) ^ (x >> 7);
+}
+
+// Cadeia de "nivel" + 1 chamadas aninhadas. A soma após a chamada recursiva impede
+// que o compilador a transforme em um desvio ("tail call").
+__attribute__((noinline)) static unsigned long cadeia(int nivel, unsigned long x)
+{
+    chamadas++;
+    if (nivel == 0)
+        return folha(x);
+    return cadeia(nivel - 1, x + nivel) + 1;
+}
+
+__attribute__((noinline)) static unsigned long fib(int n)
+{
+    chamadas++;
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+int main(int argc, char *argv[])
+{
+    int escala = argc > 1 ? atoi(argv[1]) : 1;
+    unsigned long controle = 0;
+
+    for (int r = 0; r < escala; r++)
+    {
+        for (int i = 0; i < 400000; i++)
+            controle += cadeia(64, i);
+        controle += fib(30);
+    }
+
+    printf("eventos %lu\n", chamadas);
+    printf("controle %lu\n", controle);
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ *  Alvo de teste: laços dominados por chamadas indiretas (métodos virtuais e ponteiros
+ *  para função). Exercita a janela-deslizante (desvios indiretos) e a LBR de CALLs
+ *  indiretos do lbrmatch.
+ *
+ *  Uso: indiretas [escala]
+ *  Imprime o nº de eventos (chamadas indiretas executadas) e um valor de controle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned long chamadas = 0;
+
+struct Forma
+{
+    virtual unsigned long Area(unsigned long x) const = 0;
+    virtual ~Forma() {}
+};
+
+struct Quadrado : Forma
+{
+    unsigned long Area(unsigned long x) const { chamadas++; return x * x; }
+};
+
+struct Retangulo : Forma
+{
+    unsigned long Area(unsigned long x) const { chamadas++; return x * (x + 3); }
+};
+
+struct Triangulo : Forma
+{
+    unsigned long Area(unsigned long x) const { chamadas++; return x * (x + 1) / 2; }
+};
+
+struct Circulo : Forma
+{
+    unsigned long Area(unsigned long x) const { chamadas++; return (x * x * 355) / 113; }
+};
+
+__attribute__((noinline)) static unsigned long Dobra(unsigned long x) { chamadas++; return x << 1; }
+__attribute__((noinline)) static unsigned long Metade(unsigned long x) { chamadas++; return x >> 1; }
+__attribute__((noinline)) static unsigned long Inverte(unsigned long x) { chamadas++; return ~x; }
+__attribute__((noinline)) static unsigned long Gira(unsigned long x) { chamadas++; return (x << 13) | (x >> 51); }
+
+int main(int argc, char *argv[])
+{
+    int escala = argc > 1 ? atoi(argv[1]) : 1;
+    const int NUM_OBJETOS = 1024;
+
+    // sequência pseudoaleatória fixa (LCG), para que as execuções sejam deterministas
+    Forma *objetos[NUM_OBJETOS];
+    unsigned long (*funcoes[NUM_OBJETOS])(unsigned long);
+    unsigned long semente = 12345;
+    for (int i = 0; i < NUM_OBJETOS; i++)
+    {
+        semente = semente * 6364136223846793005UL + 1442695040888963407UL;
+        switch ((semente >> 33) & 3)
+        {
+        case 0: objetos[i] = new Quadrado; funcoes[i] = Dobra; break;
+        case 1: objetos[i] = new Retangulo; funcoes[i] = Metade; break;
+        case 2: objetos[i] = new Triangulo; funcoes[i] = Inverte; break;
+        default: objetos[i] = new Circulo; funcoes[i] = Gira; break;
+        }
+    }
+
+    unsigned long controle = 0;
+    for (int r = 0; r < escala * 40000; r++)
+    {
+        for (int i = 0; i < NUM_OBJETOS; i++)
+        {
+            controle += objetos[i]->Area(i + r);
+            controle = funcoes[(i + r) & (NUM_OBJETOS - 1)](controle);
+        }
+    }
+
+    for (int i = 0; i < NUM_OBJETOS; i++)
+        delete objetos[i];
+
+    printf("eventos %lu\n", chamadas);
+    printf("controle %lu\n", controle);
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *  Executa um comando e imprime, em stderr, o tempo de parede em segundos e o pico de
+ *  memória residente (RSS) em KB dos processos filhos:
+ *
+ *      medir <comando> [argumentos...]
+ *      ...saída do comando...
+ *      medir: 1.234 52340
+ *
+ *  Usado pelo "run.sh" no lugar de "/usr/bin/time", que nem sempre está instalado.
+ *  O código de saída é o do comando.
+ */
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Uso: medir <comando> [argumentos...]\n");
+        return 1;
+    }
+
+    struct timespec inicio, fim;
+    clock_gettime(CLOCK_MONOTONIC, &inicio);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execvp(argv[1], &argv[1]);
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    int estado = 0;
+    waitpid(pid, &estado, 0);
+    clock_gettime(CLOCK_MONOTONIC, &fim);
+
+    struct rusage uso;
+    getrusage(RUSAGE_CHILDREN, &uso);
+
+    fprintf(stderr, "medir: %.3f %ld\n",
+            (fim.tv_sec - inicio.tv_sec) + (fim.tv_nsec - inicio.tv_nsec) / 1e9, uso.ru_maxrss);
+    return WIFEXITED(estado) ? WEXITSTATUS(estado) : 1;
+}
@@ -0,0 +1,72 @@
+/*
+ *  Alvo de teste: acessos à memória. Um núcleo sequencial ("streaming": leitura de um
+ *  vetor e escrita em outro) e um de perseguição de ponteiros (lista circular em ordem
+ *  aleatória, com uma falta na cache a cada acesso). Exercita o pinatrace_instrument.
+ *
+ *  Uso: memoria [escala]
+ *  Imprime o nº de eventos (leituras e escritas feitas pelos núcleos) e um valor de controle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char *argv[])
+{
+    int escala = argc > 1 ? atoi(argv[1]) : 1;
+    const size_t NUM_ELEMENTOS = 4 * 1024 * 1024; // 32 MB por vetor
+    unsigned long acessos = 0;
+
+    unsigned long *origem = (unsigned long *) malloc(NUM_ELEMENTOS * sizeof(unsigned long));
+    unsigned long *destino = (unsigned long *) malloc(NUM_ELEMENTOS * sizeof(unsigned long));
+    size_t *proximo = (size_t *) malloc(NUM_ELEMENTOS * sizeof(size_t));
+    if (origem == NULL || destino == NULL || proximo == NULL)
+    {
+        fprintf(stderr, "memoria insuficiente\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < NUM_ELEMENTOS; i++)
+    {
+        origem[i] = i;
+        proximo[i] = i;
+    }
+
+    // permutação pseudoaleatória fixa (Sattolo), que forma um único ciclo
+    unsigned long semente = 12345;
+    for (size_t i = NUM_ELEMENTOS - 1; i > 0; i--)
+    {
+        semente = semente * 6364136223846793005UL + 1442695040888963407UL;
+        size_t j = (semente >> 33) % i;
+        size_t t = proximo[i];
+        proximo[i] = proximo[j];
+        proximo[j] = t;
+    }
+
+    unsigned long controle = 0;
+    for (int r = 0; r < escala; r++)
+    {
+        // núcleo sequencial
+        for (int passada = 0; passada < 4; passada++)
+        {
+            for (size_t i = 0; i < NUM_ELEMENTOS; i++)
+                destino[i] = origem[i] * 3 + passada;
+            acessos += 2 * NUM_ELEMENTOS;
+        }
+        controle += destino[NUM_ELEMENTOS / 2];
+
+        // perseguição de ponteiros
+        size_t atual = 0;
+        for (size_t i = 0; i < NUM_ELEMENTOS; i++)
+            atual = proximo[atual];
+        acessos += NUM_ELEMENTOS;
+        controle += atual;
+    }
+
+    free(origem);
+    free(destino);
+    free(proximo);
+
+    printf("eventos %lu\n", acessos);
+    printf("controle %lu\n", controle);
+    return 0;
+}
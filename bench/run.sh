@@ -0,0 +1,118 @@
+#!/bin/sh
+#
+# Mede o custo das pintools sobre os alvos de teste deste diretório.
+#
+# Uso: PIN_ROOT=<kit do Pin> [FERRAMENTAS_DIR=<dir. dos .so>] [FERRAMENTAS_BASE_DIR=<dir. dos .so de referência>]
+#        bench/run.sh [escala] [max_threads]
+#
+# Compila os alvos (chamadas, indiretas, memoria e threads) com g++, executa cada um de forma
+# nativa e sob cada pintool encontrada em FERRAMENTAS_DIR (padrão: obj-intel64 na raiz do
+# repositório, onde o makefile do Pin as coloca) e imprime, para cada par alvo/ferramenta:
+#   - o tempo de parede em segundos;
+#   - a lentidão em relação à execução nativa;
+#   - eventos por segundo (chamadas de análise aproximadas: pares CALL/RET, chamadas
+#     indiretas ou acessos à memória, conforme o alvo);
+#   - o pico de memória residente (RSS) em KB.
+# O alvo "threads" é executado com 1, 2, 4, ... até max_threads (padrão: nº de núcleos).
+# Com FERRAMENTAS_BASE_DIR (ex.: as pintools compiladas de um commit anterior), cada ferramenta
+# também encontrada nesse diretório é medida de novo a partir dele, na linha "<ferramenta>@base",
+# para comparar o custo antes e depois de uma mudança na mesma máquina e na mesma execução.
+# Sem PIN_ROOT, apenas as execuções nativas são medidas.
+
+set -e
+
+DIR=$(cd "$(dirname "$0")" && pwd)
+RAIZ=$(dirname "$DIR")
+ESCALA=${1:-1}
+MAX_THREADS=${2:-$(nproc 2>/dev/null || echo 4)}
+FERRAMENTAS_DIR=${FERRAMENTAS_DIR:-$RAIZ/obj-intel64}
+FERRAMENTAS="inscount0 pinatrace_instrument janela-deslizante pilha-sombra lbrmatch protecao-rop"
+CXX=${CXX:-g++}
+TRABALHO=$(mktemp -d "${TMPDIR:-/tmp}/pin-bench.XXXXXX")
+trap 'rm -rf "$TRABALHO"' EXIT
+
+# Opções passadas a cada ferramenta: saídas no diretório de trabalho e, no pinatrace,
+# o modo binário (o modo texto geraria arquivos de vários GB)
+opcoes_ferramenta() {
+    case "$1" in
+        pinatrace_instrument) echo "-mode buffer -o $TRABALHO/$1.out" ;;
+        pilha-sombra) echo "-rapido 1 -o $TRABALHO/$1.out" ;;
+        *) echo "-o $TRABALHO/$1.out" ;;
+    esac
+}
+
+# compila os alvos e o medidor; "-fno-optimize-sibling-calls" preserva os pares CALL/RET
+$CXX -O2 -o "$TRABALHO/medir" "$DIR/medir.cpp"
+for alvo in chamadas indiretas memoria; do
+    $CXX -O2 -fno-optimize-sibling-calls -o "$TRABALHO/$alvo" "$DIR/$alvo.cpp"
+done
+$CXX -O2 -fno-optimize-sibling-calls -pthread -o "$TRABALHO/threads" "$DIR/threads.cpp"
+
+# mede uma execução: imprime "tempo rss eventos"
+mede() {
+    "$TRABALHO/medir" "$@" >"$TRABALHO/saida" 2>"$TRABALHO/erro" || {
+        echo "falha ao executar: $*" >&2
+        cat "$TRABALHO/erro" >&2
+        return 1
+    }
+    tempo_rss=$(grep '^medir:' "$TRABALHO/erro" | tail -1 | cut -d' ' -f2-)
+    eventos=$(grep '^eventos' "$TRABALHO/saida" | cut -d' ' -f2)
+    echo "$tempo_rss $eventos"
+}
+
+# imprime uma linha da tabela: alvo ferramenta tempo rss eventos tempo_nativo
+linha() {
+    awk -v alvo="$1" -v ferr="$2" -v t="$3" -v rss="$4" -v ev="$5" -v tn="$6" 'BEGIN {
+        printf "%-12s %-22s %9.3f %9.1f %12.3g %10d\n", alvo, ferr, t, (tn > 0 ? t / tn : 0), (t > 0 ? ev / t : 0), rss
+    }'
+}
+
+# mantém apenas as ferramentas compiladas
+if [ -z "$PIN_ROOT" ]; then
+    echo "PIN_ROOT não definido: medindo apenas as execuções nativas" >&2
+    FERRAMENTAS=
+fi
+encontradas=
+for ferramenta in $FERRAMENTAS; do
+    if [ -f "$FERRAMENTAS_DIR/$ferramenta.so" ]; then
+        encontradas="$encontradas $ferramenta"
+    else
+        echo "$FERRAMENTAS_DIR/$ferramenta.so não encontrado; ferramenta ignorada" >&2
+    fi
+done
+FERRAMENTAS=$encontradas
+
+printf "%-12s %-22s %9s %9s %12s %10s\n" alvo ferramenta "tempo(s)" "lentidão" "eventos/s" "RSS(KB)"
+
+executa_alvo() {
+    nome=$1
+    shift
+    set -- $(mede "$@") "$@"
+    tempo_nativo=$1
+    linha "$nome" nativo "$1" "$2" "$3" "$1"
+    shift 3
+
+    for ferramenta in $FERRAMENTAS; do
+        resultado=$(mede "$PIN_ROOT/pin" -t "$FERRAMENTAS_DIR/$ferramenta.so" $(opcoes_ferramenta "$ferramenta") -- "$@") || continue
+        set -- $resultado "$@"
+        linha "$nome" "$ferramenta" "$1" "$2" "$3" "$tempo_nativo"
+        shift 3
+
+        if [ -n "$FERRAMENTAS_BASE_DIR" ] && [ -f "$FERRAMENTAS_BASE_DIR/$ferramenta.so" ]; then
+            resultado=$(mede "$PIN_ROOT/pin" -t "$FERRAMENTAS_BASE_DIR/$ferramenta.so" $(opcoes_ferramenta "$ferramenta") -- "$@") || continue
+            set -- $resultado "$@"
+            linha "$nome" "$ferramenta@base" "$1" "$2" "$3" "$tempo_nativo"
+            shift 3
+        fi
+    done
+}
+
+for alvo in chamadas indiretas memoria; do
+    executa_alvo "$alvo" "$TRABALHO/$alvo" "$ESCALA"
+done
+
+n=1
+while [ "$n" -le "$MAX_THREADS" ]; do
+    executa_alvo "threads-$n" "$TRABALHO/threads" "$n" "$ESCALA"
+    n=$((n * 2))
+done
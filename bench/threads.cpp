@@ -0,0 +1,89 @@
+/*
+ *  Alvo de teste: escalabilidade com o nº de threads. Cada thread executa a mesma
+ *  quantidade de trabalho (cadeias de chamadas, chamadas indiretas e acessos a um vetor
+ *  privado), de modo que, sem disputa por estado compartilhado, o tempo total se mantém
+ *  constante quando o nº de threads cresce (até o nº de núcleos). Mostra o custo de
+ *  estado por thread mal isolado (ex.: "false sharing") nas pintools.
+ *
+ *  Uso: threads <nº de threads> [escala]
+ *  Imprime o nº de eventos (chamadas executadas por todas as threads) e um valor de controle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+struct Resultado
+{
+    unsigned long chamadas;
+    unsigned long controle;
+    unsigned char lixo[64 - 2 * sizeof(unsigned long)]; // evita "false sharing" no próprio alvo
+};
+
+__attribute__((noinline)) static unsigned long Folha(Resultado *r, unsigned long x)
+{
+    r->chamadas++;
+    return (x * 2654435761UL) ^ (x >> 7);
+}
+
+__attribute__((noinline)) static unsigned long Cadeia(Resultado *r, int nivel, unsigned long x)
+{
+    r->chamadas++;
+    if (nivel == 0)
+        return Folha(r, x);
+    return Cadeia(r, nivel - 1, x + nivel) + 1;
+}
+
+__attribute__((noinline)) static unsigned long Soma(Resultado *r, unsigned long x) { r->chamadas++; return x + 7; }
+__attribute__((noinline)) static unsigned long Mistura(Resultado *r, unsigned long x) { r->chamadas++; return x ^ (x >> 3); }
+
+static void Trabalho(Resultado *r, int escala)
+{
+    unsigned long (*funcoes[2])(Resultado *, unsigned long) = { Soma, Mistura };
+    std::vector<unsigned long> vetor(64 * 1024);
+
+    for (int e = 0; e < escala; e++)
+    {
+        for (int i = 0; i < 100000; i++)
+        {
+            r->controle += Cadeia(r, 32, i);
+            r->controle = funcoes[i & 1](r, r->controle);
+            for (size_t j = i & 63; j < vetor.size(); j += 64)
+                vetor[j] += r->controle;
+        }
+    }
+    r->controle += vetor[0];
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Uso: threads <num threads> [escala]\n");
+        return 1;
+    }
+    int num_threads = atoi(argv[1]);
+    int escala = argc > 2 ? atoi(argv[2]) : 1;
+
+    std::vector<Resultado> resultados(num_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+    {
+        resultados[t].chamadas = 0;
+        resultados[t].controle = t;
+        threads.push_back(std::thread(Trabalho, &resultados[t], escala));
+    }
+
+    unsigned long chamadas = 0, controle = 0;
+    for (int t = 0; t < num_threads; t++)
+    {
+        threads[t].join();
+        chamadas += resultados[t].chamadas;
+        controle += resultados[t].controle;
+    }
+
+    printf("eventos %lu\n", chamadas);
+    printf("controle %lu\n", controle);
+    return 0;
+}
@@ -0,0 +1,380 @@
+/*
+Medição do custo das próprias pintools (opção -stats, desligada por padrão), compartilhada por todas as ferramentas.
+
+Separa o custo da instrumentação (tempo gasto pelas funções de instrumentação da ferramenta, nº de
+traces, BBLs e instruções instrumentados, código gerado na cache do Pin) do custo da análise (quantas
+vezes cada função de análise executou, por thread, e quantos ciclos gastou). O resto do tempo de
+execução é do próprio programa alvo e do Pin.
+
+A ferramenta envolve cada ponto de análise com "EstatisticasAntes..." e "EstatisticasDepois...". O
+primeiro insere uma função "If" em linha que conta a execução e decrementa a contagem até a próxima
+amostra; quando ela chega a zero, a parte "Then" lê o contador de ciclos (rdtsc). A função inserida
+depois da análise fecha a amostra aberta, se houver. Só uma a cada "-stats_amostra" execuções (em
+média, com intervalos sorteados para não coincidir com padrões periódicos do programa) é medida, e
+os ciclos totais de cada rotina são estimados a partir das amostras. Os ciclos medidos incluem o
+custo das próprias funções de medição, de algumas dezenas de ciclos.
+
+Com a opção desligada, nenhuma função é inserida e o custo é nulo. Os contadores de cada thread vêm
+de "arena-threads.h" e ficam no registrador reservado pela medição. Ao final, um objeto JSON com
+todos os resultados é escrito no arquivo da opção -stats.
+
+O Pin não informa o tempo gasto na sua própria compilação JIT; o tempo de instrumentação relatado é
+o das funções de instrumentação da ferramenta, e a cache de código é descrita pela API CODECACHE_*.
+
+Uso: chamar "EstatisticasInicia" no "main", depois de PIN_Init, com os nomes das rotinas medidas.
+As funções de instrumentação são chamadas pelo Pin com a sua trava interna, uma de cada vez, por
+isso os contadores de instrumentação não usam travas.
+
+Em um "fork" (ver "saida-processo.h"), o filho zera todos os contadores, mantendo só o bloco da
+thread que chamou "fork", e escreve o seu próprio arquivo, <arquivo>.<pid>.
+*/
+
+#ifndef ESTATISTICAS_H
+#define ESTATISTICAS_H
+
+#include "pin.H"             // para usar APIs do Pin
+#include <stdio.h>           // para escrever o arquivo de saída
+#include <stdlib.h>          // para usar "malloc"
+#include <string.h>          // para usar "memcpy"
+#include <time.h>            // para usar "clock_gettime"
+#include <vector>            // para guardar os contadores das threads que terminaram
+#include "arena-threads.h"   // para alocar os contadores das threads
+#include "saida-processo.h"  // para tratar o "fork" e obter o nome do arquivo de saída
+
+// Contadores de uma rotina de análise
+struct ContadorRotina{
+   UINT64 execucoes;  // nº de execuções
+   UINT64 amostras;   // execuções medidas
+   UINT64 ciclos;     // ciclos medidos nas amostras
+};
+
+// Contadores de uma thread, num bloco da arena com uma entrada de "rotinas" por rotina medida
+struct EstatisticasThread{
+   UINT32 tid;                 // thread dona dos contadores
+   UINT32 aberta;              // rotina da amostra em andamento, mais 1 (0: nenhuma)
+   UINT64 contagem;            // execuções restantes até a próxima amostra
+   UINT64 semente;             // estado do gerador que sorteia os intervalos entre amostras
+   UINT64 inicio;              // contador de ciclos no início da amostra em andamento
+   ContadorRotina rotinas[1];
+};
+
+// Estado da medição
+static struct{
+   BOOL ativa;                             // opção -stats usada
+   string arquivo;                         // arquivo de saída (JSON)
+   string ferramenta;                      // nome da ferramenta, incluído na saída
+   std::vector<string> rotinas;            // nomes das rotinas medidas
+   UINT64 amostragem;                      // intervalo médio entre amostras, em execuções
+   REG reg;                                // registrador reservado com os contadores da thread
+   ArenaThreads arena;                     // blocos "EstatisticasThread"
+   PIN_LOCK trava;                         // protege "terminadas"
+   std::vector<EstatisticasThread *> terminadas; // cópias dos contadores das threads que já terminaram
+   UINT64 ciclos_inicio;                   // contador de ciclos em "EstatisticasInicia"
+   struct timespec inicio;                 // instante de "EstatisticasInicia"
+   UINT64 traces;                          // traces instrumentados pela ferramenta
+   UINT64 bbls;                            // BBLs instrumentados
+   UINT64 instrucoes;                      // instruções instrumentadas
+   UINT64 ciclos_instrumentacao;           // ciclos gastos nas funções de instrumentação da ferramenta
+   UINT64 traces_inseridos;                // traces colocados na cache de código pelo Pin
+   UINT64 bytes_inseridos;                 // código gerado para esses traces
+   UINT64 esvaziamentos;                   // vezes em que a cache de código foi esvaziada
+} estatisticas;
+
+// Lê o contador de ciclos do processador
+static inline UINT64 EstatisticasCiclos(){
+   UINT32 baixo, alto;
+   __asm__ __volatile__("rdtsc" : "=a"(baixo), "=d"(alto));
+   return((static_cast<UINT64>(alto) << 32) | baixo);
+}
+
+// Sorteia o nº de execuções até a próxima amostra, entre 1 e 2 * amostragem - 1 (média "amostragem")
+static UINT64 EstatisticasSorteia(EstatisticasThread *thread){
+   UINT64 x = thread->semente;
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   thread->semente = x;
+   return(1 + x % (2 * estatisticas.amostragem - 1));
+}
+
+// Parte "If" inserida antes de cada ponto de análise: conta a execução da rotina e indica se
+// chegou a vez de medir. Não contém chamadas nem desvios, para que o Pin faça o seu "inline".
+static ADDRINT PIN_FAST_ANALYSIS_CALL EstatisticasConta(EstatisticasThread *thread, UINT32 rotina){
+   thread->rotinas[rotina].execucoes++;
+   return(--thread->contagem == 0);
+}
+
+// Parte "Then": abre a amostra da rotina e sorteia o intervalo até a próxima
+static VOID EstatisticasAbre(EstatisticasThread *thread, UINT32 rotina){
+   thread->contagem = EstatisticasSorteia(thread);
+   thread->aberta = rotina + 1;
+   thread->inicio = EstatisticasCiclos();
+}
+
+// Parte "If" inserida depois de cada ponto de análise: indica se há uma amostra aberta
+static ADDRINT PIN_FAST_ANALYSIS_CALL EstatisticasAberta(EstatisticasThread *thread){
+   return(thread->aberta);
+}
+
+// Parte "Then": fecha a amostra aberta, somando os ciclos à rotina
+static VOID EstatisticasFecha(EstatisticasThread *thread){
+   UINT64 ciclos = EstatisticasCiclos() - thread->inicio;
+   ContadorRotina *contador = &thread->rotinas[thread->aberta - 1];
+   contador->amostras++;
+   contador->ciclos += ciclos;
+   thread->aberta = 0;
+}
+
+// Insere a contagem e a abertura de amostras antes dos pontos de análise da rotina "rotina" em "ins".
+// Deve ser chamada antes de inserir as funções de análise, no mesmo "ponto". Com "predicado", a
+// contagem só ocorre se a instrução for de fato executada (como em INS_InsertPredicatedCall).
+static VOID EstatisticasAntesIns(INS ins, IPOINT ponto, UINT32 rotina, BOOL predicado = FALSE){
+   if(!estatisticas.ativa){
+      return;
+   }
+   if(predicado){
+      INS_InsertIfPredicatedCall(ins, ponto, (AFUNPTR)EstatisticasConta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+      INS_InsertThenPredicatedCall(ins, ponto, (AFUNPTR)EstatisticasAbre, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+   }
+   else{
+      INS_InsertIfCall(ins, ponto, (AFUNPTR)EstatisticasConta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+      INS_InsertThenCall(ins, ponto, (AFUNPTR)EstatisticasAbre, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+   }
+}
+
+// Insere o fechamento das amostras depois dos pontos de análise inseridos em "ins"
+static VOID EstatisticasDepoisIns(INS ins, IPOINT ponto, BOOL predicado = FALSE){
+   if(!estatisticas.ativa){
+      return;
+   }
+   if(predicado){
+      INS_InsertIfPredicatedCall(ins, ponto, (AFUNPTR)EstatisticasAberta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+      INS_InsertThenPredicatedCall(ins, ponto, (AFUNPTR)EstatisticasFecha, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+   }
+   else{
+      INS_InsertIfCall(ins, ponto, (AFUNPTR)EstatisticasAberta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+      INS_InsertThenCall(ins, ponto, (AFUNPTR)EstatisticasFecha, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+   }
+}
+
+// Versões de "EstatisticasAntesIns" e "EstatisticasDepoisIns" para pontos de análise de um BBL
+static VOID EstatisticasAntesBbl(BBL bbl, IPOINT ponto, UINT32 rotina){
+   if(!estatisticas.ativa){
+      return;
+   }
+   BBL_InsertIfCall(bbl, ponto, (AFUNPTR)EstatisticasConta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+   BBL_InsertThenCall(bbl, ponto, (AFUNPTR)EstatisticasAbre, IARG_REG_VALUE, estatisticas.reg, IARG_UINT32, rotina, IARG_END);
+}
+
+static VOID EstatisticasDepoisBbl(BBL bbl, IPOINT ponto){
+   if(!estatisticas.ativa){
+      return;
+   }
+   BBL_InsertIfCall(bbl, ponto, (AFUNPTR)EstatisticasAberta, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+   BBL_InsertThenCall(bbl, ponto, (AFUNPTR)EstatisticasFecha, IARG_REG_VALUE, estatisticas.reg, IARG_END);
+}
+
+// Marca o início de uma função de instrumentação. O valor retornado é passado a
+// "EstatisticasTraceInstrumentado" ou "EstatisticasInsInstrumentada" no fim da função.
+static UINT64 EstatisticasInstrumentacao(){
+   return(estatisticas.ativa ? EstatisticasCiclos() : 0);
+}
+
+// Contabiliza a instrumentação de um trace iniciada no instante "inicio"
+static VOID EstatisticasTraceInstrumentado(UINT64 inicio, TRACE trace){
+   if(!estatisticas.ativa){
+      return;
+   }
+   estatisticas.ciclos_instrumentacao += EstatisticasCiclos() - inicio;
+   estatisticas.traces++;
+   estatisticas.bbls += TRACE_NumBbl(trace);
+   estatisticas.instrucoes += TRACE_NumIns(trace);
+}
+
+// Contabiliza a instrumentação de uma instrução iniciada no instante "inicio"
+static VOID EstatisticasInsInstrumentada(UINT64 inicio){
+   if(!estatisticas.ativa){
+      return;
+   }
+   estatisticas.ciclos_instrumentacao += EstatisticasCiclos() - inicio;
+   estatisticas.instrucoes++;
+}
+
+// Chamada pelo Pin quando um trace é colocado na cache de código
+static VOID EstatisticasTraceInserido(TRACE trace){
+   estatisticas.traces_inseridos++;
+   estatisticas.bytes_inseridos += TRACE_CodeCacheSize(trace);
+}
+
+// Chamada pelo Pin quando a cache de código é esvaziada
+static VOID EstatisticasCacheEsvaziada(){
+   estatisticas.esvaziamentos++;
+}
+
+// Obtém um bloco para os contadores da nova thread e guarda-o no seu registrador reservado
+static VOID EstatisticasIniciaThread(THREADID tid, CONTEXT *contexto, INT32 flags, VOID *v){
+   EstatisticasThread *thread = static_cast<EstatisticasThread *>(ArenaAloca(&estatisticas.arena));
+   thread->tid = tid;
+   thread->semente = 0x9E3779B97F4A7C15ULL * (tid + 1);
+   thread->contagem = EstatisticasSorteia(thread);
+   PIN_SetContextReg(contexto, estatisticas.reg, reinterpret_cast<ADDRINT>(thread));
+}
+
+// Copia os contadores de uma thread para "terminadas". Deve ser chamada com "estatisticas.trava" adquirida.
+static VOID EstatisticasGuarda(VOID *bloco, VOID *v){
+   EstatisticasThread *copia = static_cast<EstatisticasThread *>(malloc(estatisticas.arena.tam_bloco));
+   memcpy(copia, bloco, estatisticas.arena.tam_bloco);
+   estatisticas.terminadas.push_back(copia);
+}
+
+// Guarda os contadores da thread que terminou e devolve o seu bloco à arena
+static VOID EstatisticasTerminaThread(THREADID tid, const CONTEXT *contexto, INT32 codigo, VOID *v){
+   VOID *bloco = reinterpret_cast<VOID *>(PIN_GetContextReg(contexto, estatisticas.reg));
+
+   PIN_GetLock(&estatisticas.trava, tid + 1);
+   EstatisticasGuarda(bloco, NULL);
+   PIN_ReleaseLock(&estatisticas.trava);
+
+   ArenaLibera(&estatisticas.arena, bloco);
+}
+
+// Escreve os contadores de uma rotina em JSON. Os ciclos totais são estimados pela média das amostras.
+static VOID EstatisticasEscreveRotina(FILE *saida, const string &nome, const ContadorRotina &contador){
+   UINT64 estimados = contador.amostras > 0 ?
+      static_cast<UINT64>(static_cast<double>(contador.ciclos) / contador.amostras * contador.execucoes) : 0;
+   fprintf(saida, "\"%s\":{\"execucoes\":%llu,\"amostras\":%llu,\"ciclos_amostras\":%llu,\"ciclos_estimados\":%llu}",
+           nome.c_str(), (unsigned long long)contador.execucoes, (unsigned long long)contador.amostras,
+           (unsigned long long)contador.ciclos, (unsigned long long)estimados);
+}
+
+// Escreve o objeto JSON com os resultados no arquivo da opção -stats
+static VOID EstatisticasFim(INT32 codigo, VOID *v){
+   UINT64 ciclos = EstatisticasCiclos() - estatisticas.ciclos_inicio;
+   struct timespec agora;
+   clock_gettime(CLOCK_MONOTONIC, &agora);
+   double segundos = (agora.tv_sec - estatisticas.inicio.tv_sec) + (agora.tv_nsec - estatisticas.inicio.tv_nsec) * 1e-9;
+
+   // threads ainda vivas
+   PIN_GetLock(&estatisticas.trava, 0);
+   ArenaParaCada(&estatisticas.arena, EstatisticasGuarda, NULL);
+   PIN_ReleaseLock(&estatisticas.trava);
+
+   string arquivo = SaidaProcessoNome(estatisticas.arquivo);
+   FILE *saida = fopen(arquivo.c_str(), "w");
+   if(saida == NULL){
+      fprintf(stderr, "Nao foi possivel criar o arquivo %s\n", arquivo.c_str());
+      return;
+   }
+
+   fprintf(saida, "{\"ferramenta\":\"%s\",\"segundos\":%.6f,\"ciclos\":%llu,\"ciclos_por_segundo\":%.0f,\"amostragem\":%llu,\n",
+           estatisticas.ferramenta.c_str(), segundos, (unsigned long long)ciclos, segundos > 0 ? ciclos / segundos : 0.0,
+           (unsigned long long)estatisticas.amostragem);
+   fprintf(saida, " \"instrumentacao\":{\"traces\":%llu,\"bbls\":%llu,\"instrucoes\":%llu,\"ciclos\":%llu},\n",
+           (unsigned long long)estatisticas.traces, (unsigned long long)estatisticas.bbls,
+           (unsigned long long)estatisticas.instrucoes, (unsigned long long)estatisticas.ciclos_instrumentacao);
+   fprintf(saida, " \"cache_codigo\":{\"traces_inseridos\":%llu,\"bytes_inseridos\":%llu,\"esvaziamentos\":%llu,"
+           "\"traces_na_cache\":%u,\"stubs_na_cache\":%u,\"bytes_usados\":%u,\"bytes_stubs\":%u,\"bytes_reservados\":%u,"
+           "\"limite\":%u,\"tam_bloco\":%u},\n",
+           (unsigned long long)estatisticas.traces_inseridos, (unsigned long long)estatisticas.bytes_inseridos,
+           (unsigned long long)estatisticas.esvaziamentos, CODECACHE_NumTracesInCache(), CODECACHE_NumExitStubsInCache(),
+           CODECACHE_CodeMemUsed(), CODECACHE_ExitStubMemUsed(), CODECACHE_CodeMemReserved(), CODECACHE_CacheSizeLimit(),
+           CODECACHE_BlockSize());
+
+   // totais de cada rotina e, em seguida, os contadores de cada thread
+   std::vector<ContadorRotina> totais(estatisticas.rotinas.size());
+   for(size_t t = 0; t < estatisticas.terminadas.size(); t++){
+      for(size_t r = 0; r < totais.size(); r++){
+         totais[r].execucoes += estatisticas.terminadas[t]->rotinas[r].execucoes;
+         totais[r].amostras += estatisticas.terminadas[t]->rotinas[r].amostras;
+         totais[r].ciclos += estatisticas.terminadas[t]->rotinas[r].ciclos;
+      }
+   }
+   fprintf(saida, " \"rotinas\":{");
+   for(size_t r = 0; r < totais.size(); r++){
+      fputs(r > 0 ? "," : "", saida);
+      EstatisticasEscreveRotina(saida, estatisticas.rotinas[r], totais[r]);
+   }
+   fprintf(saida, "},\n \"threads\":[");
+   for(size_t t = 0; t < estatisticas.terminadas.size(); t++){
+      fprintf(saida, "%s\n  {\"tid\":%u,\"rotinas\":{", t > 0 ? "," : "", estatisticas.terminadas[t]->tid);
+      for(size_t r = 0; r < totais.size(); r++){
+         fputs(r > 0 ? "," : "", saida);
+         EstatisticasEscreveRotina(saida, estatisticas.rotinas[r], estatisticas.terminadas[t]->rotinas[r]);
+      }
+      fprintf(saida, "}}");
+   }
+   fprintf(saida, "]}\n");
+   fclose(saida);
+}
+
+// Antes de um "fork": mantém as travas, para que o filho receba os contadores consistentes
+static VOID EstatisticasForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_GetLock(&estatisticas.trava, tid + 1);
+   ArenaForkAntes(&estatisticas.arena);
+}
+
+// Depois de um "fork", no pai: libera as travas
+static VOID EstatisticasForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   ArenaForkPai(&estatisticas.arena);
+   PIN_ReleaseLock(&estatisticas.trava);
+}
+
+// Depois de um "fork", no filho: descarta os contadores das threads do pai e zera os da thread que
+// chamou "fork" e os de instrumentação, que passam a contar do "fork"
+static VOID EstatisticasForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_InitLock(&estatisticas.trava);
+   for(size_t t = 0; t < estatisticas.terminadas.size(); t++){
+      free(estatisticas.terminadas[t]);
+   }
+   estatisticas.terminadas.clear();
+
+   EstatisticasThread *thread = reinterpret_cast<EstatisticasThread *>(PIN_GetContextReg(contexto, estatisticas.reg));
+   ArenaForkFilho(&estatisticas.arena, ArenaMantemBloco, thread);
+   memset(thread->rotinas, 0, estatisticas.rotinas.size() * sizeof(ContadorRotina));
+
+   estatisticas.ciclos_inicio = EstatisticasCiclos();
+   clock_gettime(CLOCK_MONOTONIC, &estatisticas.inicio);
+   estatisticas.traces = 0;
+   estatisticas.bbls = 0;
+   estatisticas.instrucoes = 0;
+   estatisticas.ciclos_instrumentacao = 0;
+   estatisticas.traces_inseridos = 0;
+   estatisticas.bytes_inseridos = 0;
+   estatisticas.esvaziamentos = 0;
+}
+
+// Inicia a medição, se "arquivo" não for vazio: reserva o registrador dos contadores e registra as
+// funções de início e término de threads, da cache de código e de término da aplicação. "rotinas"
+// são os nomes das "num_rotinas" rotinas medidas, na ordem dos índices usados nas funções
+// "EstatisticasAntes...". Retorna FALSE se o registrador não puder ser reservado.
+static BOOL EstatisticasInicia(const string &arquivo, const char *ferramenta, const char *const *rotinas, UINT32 num_rotinas, UINT32 amostragem){
+   estatisticas.ativa = !arquivo.empty();
+   if(!estatisticas.ativa){
+      return(TRUE);
+   }
+
+   estatisticas.reg = PIN_ClaimToolRegister();
+   if(!REG_valid(estatisticas.reg)){
+      return(FALSE);
+   }
+
+   estatisticas.arquivo = arquivo;
+   estatisticas.ferramenta = ferramenta;
+   estatisticas.rotinas.assign(rotinas, rotinas + num_rotinas);
+   estatisticas.amostragem = amostragem > 0 ? amostragem : 1;
+   ArenaInicia(&estatisticas.arena, sizeof(EstatisticasThread) + (num_rotinas > 0 ? num_rotinas - 1 : 0) * sizeof(ContadorRotina));
+   PIN_InitLock(&estatisticas.trava);
+   estatisticas.ciclos_inicio = EstatisticasCiclos();
+   clock_gettime(CLOCK_MONOTONIC, &estatisticas.inicio);
+
+   PIN_AddThreadStartFunction(EstatisticasIniciaThread, NULL);
+   PIN_AddThreadFiniFunction(EstatisticasTerminaThread, NULL);
+   CODECACHE_AddTraceInsertedFunction(EstatisticasTraceInserido, NULL);
+   CODECACHE_AddCacheFlushedFunction(EstatisticasCacheEsvaziada, NULL);
+   PIN_AddFiniFunction(EstatisticasFim, NULL);
+   SaidaProcessoAoFork(EstatisticasForkAntes, EstatisticasForkPai, EstatisticasForkFilho, NULL);
+
+   return(TRUE);
+}
+
+#endif // ESTATISTICAS_H
@@ -30,26 +30,549 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 END_LEGAL */
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <map>
+#include <string.h>
 #include "pin.H"
+#include "estatisticas.h"
+#include "relatorio-intervalo.h"
+#include "saida-processo.h"
+#include "arena-threads.h"
 
 ofstream OutFile;
 
-// The running count of instructions is kept here
-// make it static to help the compiler optimize docount
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "inscount.out", "specify output file name");
+
+KNOB<BOOL> KnobProfile(KNOB_MODE_WRITEONCE, "pintool",
+    "profile", "0", "attribute instruction counts to images and routines (BBLs run by several "
+    "threads at once contend for their shared counter, so -profile slows threaded targets)");
+
+KNOB<UINT32> KnobTop(KNOB_MODE_WRITEONCE, "pintool",
+    "top", "20", "number of hot routines to report with -profile");
+
+KNOB<BOOL> KnobMix(KNOB_MODE_WRITEONCE, "pintool",
+    "mix", "0", "report the dynamic instruction mix by class, XED category and XED iclass");
+
+KNOB<string> KnobStats(KNOB_MODE_WRITEONCE, "pintool",
+    "stats", "", "write instrumentation and analysis-routine costs to this JSON file (empty: off)");
+
+KNOB<UINT32> KnobStatsSample(KNOB_MODE_WRITEONCE, "pintool",
+    "stats_amostra", "1000", "mean number of executions between timed analysis calls (-stats)");
+
+KNOB<string> KnobReport(KNOB_MODE_WRITEONCE, "pintool",
+    "relatorio", "", "append periodic JSON snapshots of the counters to this file (empty: off)");
+
+KNOB<UINT32> KnobReportMs(KNOB_MODE_WRITEONCE, "pintool",
+    "relatorio_ms", "1000", "milliseconds between snapshots with -relatorio (0: only by instructions)");
+
+KNOB<UINT64> KnobReportIns(KNOB_MODE_WRITEONCE, "pintool",
+    "relatorio_ins", "0", "also write a snapshot every N instructions with -relatorio (0: off)");
+
+KNOB<BOOL> KnobPidSuffix(KNOB_MODE_WRITEONCE, "pintool",
+    "sufixo_pid", "0", "append .<pid> to the output files also in the first process (use with -follow_execv)");
+
+// Rotinas de análise medidas com -stats (ver estatisticas.h)
+static const char * const rotinasMedidas[] = {"docount", "docountProfile", "domix"};
+
+// Tamanho da linha de cache, usado para alinhar os contadores das threads
+static const UINT32 LINHA_CACHE = 64;
+
+// Contador de instruções de uma thread. Força o contador de cada thread a
+// ocupar sua própria linha de cache para evitar "false sharing" entre
+// threads (como a JanelaThread de janela-deslizante.cpp). Os contadores vêm
+// de "arenaCounts", que os alinha ao início de uma linha.
+struct ThreadCount
+{
+    UINT64 count;
+    UINT8 pad[LINHA_CACHE - sizeof(UINT64)];
+};
+
+// Registrador reservado para a ferramenta que guarda, em cada thread, o
+// endereço do seu ThreadCount. Isso evita uma chamada a PIN_GetThreadData
+// e permite que o Pin faça o "inline" de docount.
+static REG countReg;
+
+// Totais das threads que já terminaram, somados em ThreadFini
+static PIN_LOCK countLock;
 static UINT64 icount = 0;
+static vector<pair<THREADID, UINT64> > threadTotals;
 
-// Essa função é executada antes que toda instrução execute
-VOID docount() { icount++; }
-    
-// Pin calls this function every time a new instruction is encountered
-VOID Instruction(INS ins, VOID *v)
+// Contadores das threads vivas, lidos pelos relatórios periódicos
+// (-relatorio, ver relatorio-intervalo.h). Também protegidos por countLock.
+static vector<ThreadCount *> liveCounts;
+
+// Arena dos contadores das threads (ThreadMix com -mix, ver arena-threads.h)
+static ArenaThreads arenaCounts;
+
+// Campos dos relatórios periódicos, preenchidos por CollectReport
+static const char * const reportFields[] = {"instructions", "threads"};
+
+// Perfil por imagem e rotina (-profile). Cada rotina encontrada durante a
+// instrumentação recebe um RtnProfile; cada BBL instrumentado recebe um
+// BblSlot que aponta para a rotina à qual pertence. Em tempo de execução,
+// o BBL apenas soma seu número de instruções ao próprio slot; a atribuição
+// às rotinas e imagens é feita somente em Fini.
+struct RtnProfile
+{
+    string name;
+    string image;
+    UINT64 icount;
+};
+
+struct BblSlot
+{
+    UINT64 icount;
+    RtnProfile * rtn;
+};
+
+// Os slots são alocados em blocos para que seus endereços nunca mudem
+static const UINT32 SLOTS_PER_CHUNK = 4096;
+static vector<BblSlot *> slotChunks;
+static UINT32 slotsUsed = SLOTS_PER_CHUNK;
+
+// Rotinas indexadas pelo endereço de início (0 para código sem rotina)
+static map<ADDRINT, RtnProfile *> routines;
+
+// Mix dinâmico de instruções (-mix). Cada instrução é classificada uma única
+// vez, durante a instrumentação: em classes que podem se sobrepor (acesso à
+// memória, desvios, largura SIMD, x87, strings, atômicas), na sua categoria
+// XED e no seu iclass XED (INS_Opcode). Cada BBL recebe um BblMix com os
+// totais do bloco e, em tempo de execução, "domix" soma esse vetor ao
+// histograma da thread. Os histogramas são somados em ThreadFini.
+enum MixClass
+{
+    MIX_LOAD, MIX_STORE, MIX_COND_BRANCH, MIX_UNCOND_BRANCH, MIX_INDIRECT, MIX_CALL, MIX_RET,
+    MIX_SYSCALL, MIX_SIMD64, MIX_SIMD128, MIX_SIMD256, MIX_SIMD512, MIX_X87, MIX_STRING, MIX_ATOMIC,
+    MIX_NUM
+};
+
+static const char * const mixNames[MIX_NUM] = {
+    "load", "store", "cond-branch", "uncond-branch", "indirect", "call", "ret",
+    "syscall", "simd-64", "simd-128", "simd-256", "simd-512", "x87", "string", "atomic"};
+
+// As classes ocupam um vetor de tamanho fixo, múltiplo de 4, para que o
+// compilador vetorize a soma em "domix"
+static const UINT32 MIX_SLOTS = 16;
+
+// Posições do histograma esparso: iclasses em [0, XED_ICLASS_LAST) e
+// categorias a partir de CATEGORY_BASE
+static const UINT32 CATEGORY_BASE = XED_ICLASS_LAST;
+static const UINT32 NUM_BINS = XED_ICLASS_LAST + XED_CATEGORY_LAST;
+
+// Mix estático de um BBL. "bins" e "counts" guardam apenas as posições do
+// histograma que o BBL usa.
+struct BblMix
 {
-    // Insere uma chamada para "docount" antes de todas as instruções
-    INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)docount, IARG_END);
+    UINT64 classes[MIX_SLOTS];
+    UINT32 numIns;
+    UINT32 numBins;
+    UINT32 * bins;
+    UINT32 * counts;
+    BblSlot * slot;        // slot do BBL com -profile, ou NULL
+};
+
+// Histograma de uma thread. "total" fica no início para que ThreadFini leia
+// o contador da mesma forma que sem -mix.
+struct ThreadMix
+{
+    ThreadCount total;
+    UINT64 classes[MIX_SLOTS];
+    UINT64 bins[NUM_BINS];
+};
+
+// Histogramas das threads que já terminaram, somados em ThreadFini
+static UINT64 mixClasses[MIX_SLOTS];
+static UINT64 mixBins[NUM_BINS];
+
+// Essa função é executada uma vez por BBL executado e soma o número de
+// instruções do BBL ao contador da thread.
+VOID PIN_FAST_ANALYSIS_CALL docount(ThreadCount * tc, UINT32 c) { tc->count += c; }
+
+// Variante de "docount" usada com -profile: também soma as instruções ao
+// slot do BBL. O slot é compartilhado entre threads, então a soma é
+// atômica: nenhum incremento se perde, mas um BBL executado ao mesmo tempo
+// por várias threads ainda disputa a linha da cache do seu slot.
+VOID PIN_FAST_ANALYSIS_CALL docountProfile(ThreadCount * tc, BblSlot * slot, UINT32 c)
+{
+    tc->count += c;
+    __sync_fetch_and_add(&slot->icount, (UINT64)c);
 }
 
-KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
-    "o", "inscount.out", "specify output file name");
+// Variante usada com -mix: soma o mix estático do BBL ao histograma da
+// thread. A soma das classes tem tamanho fixo e é vetorizada; a dos iclasses
+// e categorias percorre só as posições usadas pelo BBL.
+VOID PIN_FAST_ANALYSIS_CALL domix(ThreadMix * tm, const BblMix * bm)
+{
+    tm->total.count += bm->numIns;
+    for (UINT32 i = 0; i < MIX_SLOTS; i++)
+        tm->classes[i] += bm->classes[i];
+    for (UINT32 i = 0; i < bm->numBins; i++)
+        tm->bins[bm->bins[i]] += bm->counts[i];
+    if (bm->slot != NULL)
+        __sync_fetch_and_add(&bm->slot->icount, (UINT64)bm->numIns);
+}
+
+// Retorna um slot novo. As funções de instrumentação são serializadas
+// pelo Pin, então não é necessária trava.
+static BblSlot * NewSlot()
+{
+    if (slotsUsed == SLOTS_PER_CHUNK)
+    {
+        slotChunks.push_back(new BblSlot[SLOTS_PER_CHUNK]);
+        slotsUsed = 0;
+    }
+    return &slotChunks.back()[slotsUsed++];
+}
+
+// Retorna o perfil da rotina que contém "addr", criando-o se necessário
+static RtnProfile * FindRoutine(ADDRINT addr)
+{
+    RTN rtn = RTN_FindByAddress(addr);
+    ADDRINT start = RTN_Valid(rtn) ? RTN_Address(rtn) : 0;
+
+    map<ADDRINT, RtnProfile *>::iterator it = routines.find(start);
+    if (it != routines.end())
+        return it->second;
+
+    RtnProfile * rp = new RtnProfile;
+    rp->icount = 0;
+    if (RTN_Valid(rtn))
+    {
+        rp->name = RTN_Name(rtn);
+        rp->image = IMG_Name(SEC_Img(RTN_Sec(rtn)));
+    }
+    else
+    {
+        rp->name = "<unknown>";
+        rp->image = "<unknown>";
+    }
+    routines[start] = rp;
+    return rp;
+}
+
+// Retorna a maior largura, em bits, dos registradores SIMD lidos ou
+// escritos pela instrução (0 se não usar nenhum)
+static UINT32 SimdWidth(INS ins)
+{
+    UINT32 width = 0;
+    for (UINT32 i = 0; i < INS_MaxNumRRegs(ins) + INS_MaxNumWRegs(ins); i++)
+    {
+        REG reg = i < INS_MaxNumRRegs(ins) ? INS_RegR(ins, i) : INS_RegW(ins, i - INS_MaxNumRRegs(ins));
+        if (REG_is_zmm(reg))
+            width = max(width, 512u);
+        else if (REG_is_ymm(reg))
+            width = max(width, 256u);
+        else if (REG_is_xmm(reg))
+            width = max(width, 128u);
+        else if (REG_is_mm(reg))
+            width = max(width, 64u);
+    }
+    return width;
+}
+
+// Soma a instrução às classes do mix
+static VOID ClassifyIns(INS ins, UINT64 * classes)
+{
+    if (INS_IsMemoryRead(ins))
+        classes[MIX_LOAD]++;
+    if (INS_IsMemoryWrite(ins))
+        classes[MIX_STORE]++;
+
+    if (INS_IsRet(ins))
+        classes[MIX_RET]++;
+    else if (INS_IsCall(ins))
+        classes[MIX_CALL]++;
+    else if (INS_IsBranch(ins))
+        classes[INS_HasFallThrough(ins) ? MIX_COND_BRANCH : MIX_UNCOND_BRANCH]++;
+    if (INS_IsIndirectBranchOrCall(ins) && !INS_IsRet(ins))
+        classes[MIX_INDIRECT]++;
+    if (INS_IsSyscall(ins))
+        classes[MIX_SYSCALL]++;
+
+    switch (SimdWidth(ins))
+    {
+      case 64: classes[MIX_SIMD64]++; break;
+      case 128: classes[MIX_SIMD128]++; break;
+      case 256: classes[MIX_SIMD256]++; break;
+      case 512: classes[MIX_SIMD512]++; break;
+    }
+
+    if (INS_Extension(ins) == XED_EXTENSION_X87)
+        classes[MIX_X87]++;
+    if (INS_Category(ins) == XED_CATEGORY_STRINGOP)
+        classes[MIX_STRING]++;
+    if (INS_IsAtomicUpdate(ins))
+        classes[MIX_ATOMIC]++;
+}
+
+// Classifica as instruções do BBL e retorna o seu mix estático. Como os
+// slots, os BblMix nunca são liberados: o código instrumentado pode usá-los
+// até o fim da execução.
+static BblMix * NewBblMix(BBL bbl, BblSlot * slot)
+{
+    BblMix * bm = new BblMix();
+    map<UINT32, UINT32> bins;
+    for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+    {
+        ClassifyIns(ins, bm->classes);
+        bins[INS_Opcode(ins)]++;
+        bins[CATEGORY_BASE + INS_Category(ins)]++;
+    }
+
+    bm->numIns = BBL_NumIns(bbl);
+    bm->numBins = bins.size();
+    bm->bins = new UINT32[bm->numBins];
+    bm->counts = new UINT32[bm->numBins];
+    UINT32 i = 0;
+    for (map<UINT32, UINT32>::iterator it = bins.begin(); it != bins.end(); it++, i++)
+    {
+        bm->bins[i] = it->first;
+        bm->counts[i] = it->second;
+    }
+    bm->slot = slot;
+    return bm;
+}
+
+// Pin calls this function every time a new trace is encountered
+VOID Trace(TRACE trace, VOID *v)
+{
+    UINT64 inicio = EstatisticasInstrumentacao();
+
+    // Insere uma chamada para "docount" em cada BBL do trace, passando o
+    // número de instruções do BBL
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        BblSlot * slot = NULL;
+        if (KnobProfile.Value())
+        {
+            slot = NewSlot();
+            slot->icount = 0;
+            slot->rtn = FindRoutine(BBL_Address(bbl));
+        }
+
+        EstatisticasAntesBbl(bbl, IPOINT_ANYWHERE, KnobMix.Value() ? 2 : (KnobProfile.Value() ? 1 : 0));
+        if (KnobMix.Value())
+        {
+            BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)domix, IARG_FAST_ANALYSIS_CALL,
+                           IARG_REG_VALUE, countReg, IARG_PTR, NewBblMix(bbl, slot), IARG_END);
+        }
+        else if (KnobProfile.Value())
+        {
+            BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)docountProfile, IARG_FAST_ANALYSIS_CALL,
+                           IARG_REG_VALUE, countReg, IARG_PTR, slot,
+                           IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        }
+        else
+        {
+            BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)docount, IARG_FAST_ANALYSIS_CALL,
+                           IARG_REG_VALUE, countReg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        }
+        EstatisticasDepoisBbl(bbl, IPOINT_ANYWHERE);
+    }
+
+    EstatisticasTraceInstrumentado(inicio, trace);
+}
+
+// Aloca o contador da nova thread (com -mix, o seu histograma) e guarda seu
+// endereço no registrador da ferramenta
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    ThreadCount * tc = static_cast<ThreadCount *>(ArenaAloca(&arenaCounts));
+    PIN_SetContextReg(ctxt, countReg, reinterpret_cast<ADDRINT>(tc));
+
+    PIN_GetLock(&countLock, tid + 1);
+    liveCounts.push_back(tc);
+    PIN_ReleaseLock(&countLock);
+}
+
+// Soma o contador da thread que terminou ao total
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    ThreadCount * tc = reinterpret_cast<ThreadCount *>(PIN_GetContextReg(ctxt, countReg));
+
+    PIN_GetLock(&countLock, tid + 1);
+    icount += tc->count;
+    threadTotals.push_back(make_pair(tid, tc->count));
+    liveCounts.erase(find(liveCounts.begin(), liveCounts.end(), tc));
+    if (KnobMix.Value())
+    {
+        ThreadMix * tm = reinterpret_cast<ThreadMix *>(tc);
+        for (UINT32 i = 0; i < MIX_SLOTS; i++)
+            mixClasses[i] += tm->classes[i];
+        for (UINT32 i = 0; i < NUM_BINS; i++)
+            mixBins[i] += tm->bins[i];
+    }
+    PIN_ReleaseLock(&countLock);
+
+    ArenaLibera(&arenaCounts, tc);
+}
+
+// Retrato dos contadores para os relatórios periódicos: o total das threads
+// que terminaram mais o das vivas, lido sem pará-las
+static VOID CollectReport(UINT64 * values)
+{
+    PIN_GetLock(&countLock, 0);
+    values[0] = icount;
+    for (size_t i = 0; i < liveCounts.size(); i++)
+        values[0] += liveCounts[i]->count;
+    values[1] = liveCounts.size();
+    PIN_ReleaseLock(&countLock);
+}
+
+// fork: a thread que chama fork mantém countLock até o fim da chamada, e
+// a saída é esvaziada para que o filho não herde dados pendentes do pai
+static VOID ForkBefore(THREADID tid, const CONTEXT * ctxt, VOID * v)
+{
+    PIN_GetLock(&countLock, tid + 1);
+    ArenaForkAntes(&arenaCounts);
+    OutFile.flush();
+}
+
+static VOID ForkParent(THREADID tid, const CONTEXT * ctxt, VOID * v)
+{
+    ArenaForkPai(&arenaCounts);
+    PIN_ReleaseLock(&countLock);
+}
+
+// No filho só existe a thread que chamou fork: os contadores das demais
+// são descartados, os totais recomeçam do zero e a saída passa a ser
+// <arquivo>.<pid> (ver saida-processo.h)
+static VOID ForkChild(THREADID tid, const CONTEXT * ctxt, VOID * v)
+{
+    PIN_InitLock(&countLock);
+
+    ThreadCount * own = reinterpret_cast<ThreadCount *>(PIN_GetContextReg(ctxt, countReg));
+    ArenaForkFilho(&arenaCounts, ArenaMantemBloco, own);
+    liveCounts.assign(1, own);
+
+    icount = 0;
+    threadTotals.clear();
+    if (KnobMix.Value())
+    {
+        memset(own, 0, sizeof(ThreadMix));
+        memset(mixClasses, 0, sizeof(mixClasses));
+        memset(mixBins, 0, sizeof(mixBins));
+    }
+    else
+        own->count = 0;
+
+    for (size_t c = 0; c < slotChunks.size(); c++)
+    {
+        UINT32 n = (c + 1 == slotChunks.size()) ? slotsUsed : SLOTS_PER_CHUNK;
+        for (UINT32 i = 0; i < n; i++)
+            slotChunks[c][i].icount = 0;
+    }
+
+    OutFile.close();
+    OutFile.open(SaidaProcessoNome(KnobOutputFile.Value()).c_str());
+}
+
+static BOOL CompareRoutines(const RtnProfile * a, const RtnProfile * b)
+{
+    return a->icount > b->icount;
+}
+
+static BOOL CompareCounts(const pair<string, UINT64> & a, const pair<string, UINT64> & b)
+{
+    return a.second > b.second;
+}
+
+// Soma os slots dos BBLs nas rotinas e imagens e imprime as imagens e as
+// KnobTop rotinas com mais instruções executadas
+static VOID PrintProfile()
+{
+    for (size_t c = 0; c < slotChunks.size(); c++)
+    {
+        UINT32 n = (c + 1 == slotChunks.size()) ? slotsUsed : SLOTS_PER_CHUNK;
+        for (UINT32 i = 0; i < n; i++)
+            slotChunks[c][i].rtn->icount += slotChunks[c][i].icount;
+    }
+
+    UINT64 total = 0;
+    vector<RtnProfile *> byCount;
+    map<string, UINT64> imageCounts;
+    for (map<ADDRINT, RtnProfile *>::iterator it = routines.begin(); it != routines.end(); it++)
+    {
+        if (it->second->icount == 0)
+            continue;
+        byCount.push_back(it->second);
+        imageCounts[it->second->image] += it->second->icount;
+        total += it->second->icount;
+    }
+    if (total == 0)
+        return;
+
+    vector<pair<string, UINT64> > images(imageCounts.begin(), imageCounts.end());
+    sort(images.begin(), images.end(), CompareCounts);
+    sort(byCount.begin(), byCount.end(), CompareRoutines);
+
+    OutFile.unsetf(ios::showbase);
+    OutFile << fixed << setprecision(2);
+
+    OutFile << endl << "Images" << endl;
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        OutFile << setw(20) << images[i].second << " " << setw(6)
+                << 100.0 * images[i].second / total << "% " << images[i].first << endl;
+    }
+
+    OutFile << endl << "Top " << KnobTop.Value() << " routines" << endl;
+    for (size_t i = 0; i < byCount.size() && i < KnobTop.Value(); i++)
+    {
+        OutFile << setw(4) << i + 1 << " " << setw(20) << byCount[i]->icount << " " << setw(6)
+                << 100.0 * byCount[i]->icount / total << "% " << byCount[i]->name
+                << " (" << byCount[i]->image << ")" << endl;
+    }
+}
+
+// Imprime uma tabela do mix, em ordem decrescente, com a porcentagem de
+// cada linha em relação ao total de instruções
+static VOID PrintMixTable(const string & title, vector<pair<string, UINT64> > & rows)
+{
+    sort(rows.begin(), rows.end(), CompareCounts);
+
+    OutFile << endl << title << endl;
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        OutFile << setw(20) << rows[i].second << " " << setw(6)
+                << 100.0 * rows[i].second / icount << "% " << rows[i].first << endl;
+    }
+}
+
+// Imprime as classes, as categorias e os iclasses executados (-mix). As
+// classes podem se sobrepor e não somam 100%.
+static VOID PrintMix()
+{
+    if (icount == 0)
+        return;
+
+    OutFile.unsetf(ios::showbase);
+    OutFile << fixed << setprecision(2);
+
+    vector<pair<string, UINT64> > classes;
+    for (UINT32 i = 0; i < MIX_NUM; i++)
+    {
+        if (mixClasses[i] != 0)
+            classes.push_back(make_pair(string(mixNames[i]), mixClasses[i]));
+    }
+    PrintMixTable("Instruction classes", classes);
+
+    vector<pair<string, UINT64> > categories;
+    vector<pair<string, UINT64> > iclasses;
+    for (UINT32 i = 0; i < NUM_BINS; i++)
+    {
+        if (mixBins[i] == 0)
+            continue;
+        if (i < CATEGORY_BASE)
+            iclasses.push_back(make_pair(OPCODE_StringShort(i), mixBins[i]));
+        else
+            categories.push_back(make_pair(CATEGORY_StringShort(i - CATEGORY_BASE), mixBins[i]));
+    }
+    PrintMixTable("XED categories", categories);
+    PrintMixTable("XED iclasses", iclasses);
+}
 
 // This function is called when the application exits
 VOID Fini(INT32 code, VOID *v)
@@ -57,6 +580,16 @@ VOID Fini(INT32 code, VOID *v)
     // Write to a file since cout and cerr maybe closed by the application
     OutFile.setf(ios::showbase);
     OutFile << "Count " << icount << endl;
+
+    for (size_t i = 0; i < threadTotals.size(); i++)
+        OutFile << "Thread " << threadTotals[i].first << " " << threadTotals[i].second << endl;
+
+    if (KnobProfile.Value())
+        PrintProfile();
+
+    if (KnobMix.Value())
+        PrintMix();
+
     OutFile.close();
 }
 
@@ -79,13 +612,48 @@ INT32 Usage()
 
 int main(int argc, char * argv[])
 {
-    // Inicia o pin
+    // Inicia o pin e, para o perfil por rotina, a leitura de símbolos
+    PIN_InitSymbols();
     if (PIN_Init(argc, argv)) return Usage();
 
-    OutFile.open(KnobOutputFile.Value().c_str());
+    // Saídas por processo; as funções de fork da ferramenta vêm antes das
+    // de estatisticas.h e relatorio-intervalo.h (ver saida-processo.h)
+    SaidaProcessoInicia(KnobPidSuffix.Value());
+    OutFile.open(SaidaProcessoNome(KnobOutputFile.Value()).c_str());
+
+    PIN_InitLock(&countLock);
+    ArenaInicia(&arenaCounts, KnobMix.Value() ? sizeof(ThreadMix) : sizeof(ThreadCount));
+    SaidaProcessoAoFork(ForkBefore, ForkParent, ForkChild, 0);
+
+    // Reserva o registrador que aponta para o contador de cada thread
+    countReg = PIN_ClaimToolRegister();
+    if (!REG_valid(countReg))
+    {
+        cerr << "Cannot allocate a scratch register" << endl;
+        return 1;
+    }
+
+    // Mede o custo da instrumentação e das rotinas de análise (-stats)
+    if (!EstatisticasInicia(KnobStats.Value(), "inscount0", rotinasMedidas, 3, KnobStatsSample.Value()))
+    {
+        cerr << "Cannot allocate a scratch register" << endl;
+        return 1;
+    }
+
+    // Relatórios periódicos (-relatorio), registrados antes de Fini para que
+    // o registro final seja escrito primeiro
+    if (!RelatorioInicia(KnobReport.Value(), "inscount0", reportFields, 2, CollectReport,
+                         KnobReportMs.Value(), 0, KnobReportIns.Value()))
+    {
+        cerr << "Cannot start the periodic report " << KnobReport.Value() << endl;
+        return 1;
+    }
+
+    PIN_AddThreadStartFunction(ThreadStart, 0);
+    PIN_AddThreadFiniFunction(ThreadFini, 0);
 
-    // Register Instruction to be called to instrument instructions
-    INS_AddInstrumentFunction(Instruction, 0);
+    // Register Trace to be called to instrument traces
+    TRACE_AddInstrumentFunction(Trace, 0);
 
     // Registra a função "Fini" para ser chamada quando a aplicação termina
     PIN_AddFiniFunction(Fini, 0);
@@ -12,12 +12,17 @@ Criado por: Mateus Felipe Tymburibá Ferreira e Ailton Santos
 // importação de bibliotecas do Pin e de C++
 #include "pin.H"          // para usar APIs do Pin
 #include <stdio.h>        // para usar I/O
-#include <stdlib.h>       // para usar exit()
+#include <stdlib.h>       // para usar exit() e "strtoul"
 #include <string.h>       // para converter números para string
 #include <sstream>        // para converter números para string
 #include <fstream>        // para imprimir no arquivo de saída
 #include <sys/time.h>     // para registro do tempo de processador usado pelo algoritmo
 #include <sys/resource.h> // para registro do tempo de processador usado pelo algoritmo
+#include "alertas-rop.h"  // para registrar os alertas sem escrever no arquivo de saída a partir das funções de análise
+#include "arena-threads.h" // para alocar as janelas das threads, alinhadas e reaproveitadas quando as threads terminam
+#include "estatisticas.h"   // para medir o custo da instrumentação e da análise (opção -stats)
+#include "relatorio-intervalo.h" // para escrever relatórios periódicos (opção -relatorio)
+#include "saida-processo.h" // para separar as saídas dos processos criados por "fork" (opção -sufixo_pid)
 
 
 /**** Variáveis Globais - usa "static" para facilitar as otimizações de compiladores ****/
@@ -26,8 +31,23 @@ static const UINT32 COMPLEMENTO_LINHA_CACHE = 60; // tamanho da linha da cache (
 static const UINT32 limiar_padrao = 10;           // valor de limiar padrao pré-estabelecido para a janela de 32
 static const UINT32 MASCARA_UM = 1;               // máscara usada para setar o bit menos significativo da janela
 static std::ofstream arquivo_saida;               // arquivo onde a saída é escrita
+static string nome_saida;                         // nome do arquivo de saída (opção -o), sem o sufixo do processo
 static UINT32 limiar;                             // valor de limiar checado durante a execução
+static UINT32 tam_janela_usada;                   // tamanho da janela escolhido na linha de comandos (-w)
+static AFUNPTR funcao_desloca;                    // versão de "DeslocaJanela" correspondente ao tamanho da janela
+static AFUNPTR funcao_zera;                       // versão de "ZeraJanela" correspondente ao tamanho da janela
+static AFUNPTR funcao_atualiza;                   // versão de "AtualizaJanela" correspondente ao tamanho da janela
+static AFUNPTR funcao_reinicia;                   // versão de "ReiniciaJanela" correspondente ao tamanho da janela
+static AFUNPTR funcao_reporta;                    // versão de "ReportaJanela" correspondente ao tamanho da janela
 static TLS_KEY chave_tls;                         // chave para acesso ao armazenamento local (TLS) das threads
+static REG reg_janela;                            // registrador reservado que guarda, em cada thread, o endereço da sua janela
+static const UINT32 ALERTA_LIMIAR = 1;            // tipo de alerta (ver "alertas-rop.h"): limiar superado
+static ArenaThreads arena_janelas;                // arena de onde vêm as janelas das threads
+static const char *const rotinas_medidas[] = {"AtualizaJanela", "DeslocaJanela"}; // rotinas medidas com a opção -stats (ver "estatisticas.h")
+static UINT32 (*funcao_densidade)(void *);        // versão de "DensidadeJanela" correspondente ao tamanho da janela
+static UINT64 total_limiares = 0;                 // alertas de limiar superado (incrementado atomicamente)
+static UINT32 pico_densidade = 0;                 // maior nº de bits setados observado nos alertas e nos relatórios
+static const char *const campos_relatorio[] = {"threads", "limiares", "densidade_atual", "densidade_pico"}; // campos da opção -relatorio
 /**** Fim das Variáveis Globais ****/
 
 
@@ -39,11 +59,48 @@ struct JanelaThread{
    UINT8 lixo[COMPLEMENTO_LINHA_CACHE]; // área inútil usada para ocupar uma linha inteira da cache
 };
 
+// Estrutura usada para representar janelas de 64, 128, 256 ou 512 instruções (opção -w).
+// A janela é formada pelas PALAVRAS últimas palavras de 64 bits de "bits"; a primeira delas
+// (ver "Palavras") guarda os bits das instruções mais recentes. As PALAVRAS + 1 palavras
+// iniciais ficam sempre zeradas, de modo que o deslocamento possa ler "abaixo" da janela sem
+// desvios condicionais (ver "AtualizaJanelaLarga"). A estrutura vem da arena "arena_janelas", alinhada
+// e arredondada para linhas inteiras da cache, também para evitar "false sharing".
+template<UINT32 PALAVRAS>
+struct JanelaLarga{
+   UINT64 bits[2 * PALAVRAS + 1];
+
+   UINT64 *Palavras(){ return(&bits[PALAVRAS + 1]); }
+};
+
+// As funções "AtualizaJanela" usam a instrução de HW POPCNT. O atributo garante que o compilador
+// a emita diretamente, em vez de chamar uma rotina da biblioteca, o que impediria o Pin de fazer
+// o "inline" da função de análise.
+#define USA_POPCNT __attribute__((target("popcnt")))
+
 // Imprime mensagem indicando opções de uso no prompt de comandos
 void Uso(){	
-   fprintf(stderr, "\nUso: pin -t <Pintool> [-l <Limiar>] [-o <NomeArquivoSaida>] [-logfile <NomeLogDepuracao>] -- <Programa alvo>\n\n"
+   fprintf(stderr, "\nUso: pin -t <Pintool> [-l <Limiar>] [-w <TamanhoJanela>] [-formato <texto|json>] [-alertas_seg <Linhas>] [-intervalo <ms>] [-relatorio <ArquivoJSON>] [-relatorio_ms <ms>] [-stats <ArquivoJSON>] [-stats_amostra <N>] [-sufixo_pid <0|1>] [-o <NomeArquivoSaida>] [-logfile <NomeLogDepuracao>] -- <Programa alvo>\n\n"
                    "Opções:\n"
                    "  -l       <Limiar>\t"
+                   "Indica o limiar de desvios indiretos na janela; 0 alerta a cada desvio indireto (padrão: 10 para a janela de 32, proporcional nas demais)\n"
+                   "  -w       <TamanhoJanela>\t"
+                   "Indica o tamanho da janela em instruções: 32, 64, 128, 256 ou 512 (padrão: 32)\n"
+                   "  -formato <texto|json>\t"
+                   "Indica o formato dos alertas: texto ou um objeto JSON por linha (padrão: texto)\n"
+                   "  -alertas_seg <Linhas>\t"
+                   "Indica o nº máximo de linhas de alerta escritas por segundo; 0 não limita (padrão: 100)\n"
+                   "  -intervalo <ms>\t"
+                   "Indica o intervalo entre os relatórios de alertas agregados (padrão: 1000)\n"
+                   "  -relatorio <ArquivoJSON>\t"
+                   "Acrescenta ao arquivo, periodicamente, um registro JSON com o estado dos contadores (padrão: desligado)\n"
+                   "  -relatorio_ms <ms>\t"
+                   "Indica o intervalo entre os registros de -relatorio (padrão: 1000)\n"
+                   "  -stats   <ArquivoJSON>\t"
+                   "Mede o custo da instrumentação e das funções de análise e o escreve em JSON no arquivo (padrão: desligado)\n"
+                   "  -stats_amostra <N>\t"
+                   "Indica de quantas em quantas execuções, em média, o custo das funções de análise é medido (padrão: 1000)\n"
+                   "  -sufixo_pid <0|1>\t"
+                   "Acrescenta .<pid> aos arquivos de saída também no processo inicial, como nos criados por fork; necessário com -follow_execv (padrão: 0)\n"
                    "  -o       <NomeArquivoSaida>\t"
                    "Indica o nome do arquivo de saida (padrão: $PASTA_CORRENTE/pintool.out)\n"
                    "  -logfile <NomeLogDepuracao>\t"
@@ -65,17 +122,61 @@ static string converte_ulong_string(unsigned long int valor){
 }
 
 // Função chamada ao iniciar uma nova thread.
-// Aloca espaço para a janela da nova thread no TLS.
+// Obtém da arena a janela da nova thread, já zerada (inclusive as palavras sempre zeradas que
+// precedem as janelas largas), e guarda seu endereço no TLS e no registrador reservado
+// "reg_janela", por onde as funções de análise acessam a janela.
 void IniciaThread(THREADID thread_id, CONTEXT *contexto_registradores, int flags_SO, void *v){
 
-   // Aloca espaço para a janela e guarda endereço em apontador 
-   JanelaThread* janela_ptr = new JanelaThread;
-
-   // Inicializa a janela
-   janela_ptr->janela_bits = 0x00000000;
+   void* janela_ptr = ArenaAloca(&arena_janelas);
 
    // Armazena a janela na área de armazenamento (TLS) da thread
    PIN_SetThreadData(chave_tls, janela_ptr, thread_id);
+
+   // Guarda o endereço da janela no registrador reservado da thread
+   PIN_SetContextReg(contexto_registradores, reg_janela, reinterpret_cast<ADDRINT>(janela_ptr));
+}
+
+// Função chamada quando uma thread termina.
+// Devolve a janela da thread à arena, para ser reaproveitada pelas próximas threads.
+void TerminaThread(THREADID thread_id, const CONTEXT *contexto_registradores, int codigo, void *v){
+   ArenaLibera(&arena_janelas, PIN_GetThreadData(chave_tls, thread_id));
+}
+
+// Abre no modo apêndice o arquivo de saída deste processo (ver "saida-processo.h") e escreve o cabeçalho da execução
+static void AbreSaida(){
+   arquivo_saida.open(SaidaProcessoNome(nome_saida).c_str(), std::ofstream::out | std::ofstream::app);
+
+   // obtem e imprime no arquivo de saída o momento em que a execução está iniciando
+   time_t data_hora = time(0);
+   arquivo_saida << endl << " #### Inicio: " << string(ctime(&data_hora));
+   if(SaidaProcessoFilho()){
+      arquivo_saida << " #### Processo " << PIN_GetPid() << ", criado por fork" << endl;
+   }
+   arquivo_saida << " #### Tamanho da janela: " << converte_ulong_string(static_cast<unsigned long int>(tam_janela_usada)) << endl;
+   arquivo_saida << " #### Valor do limiar: " << converte_ulong_string(static_cast<unsigned long int>(limiar)) << endl;
+}
+
+// Antes de um "fork": mantém a trava da arena das janelas e esvazia o arquivo de saída, para que
+// o filho não herde dados pendentes do pai
+static VOID ForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   ArenaForkAntes(&arena_janelas);
+   arquivo_saida.flush();
+}
+
+// Depois de um "fork", no pai: libera a trava da arena
+static VOID ForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   ArenaForkPai(&arena_janelas);
+}
+
+// Depois de um "fork", no filho: mantém só a janela da thread que chamou "fork", com o histórico
+// das suas últimas instruções, zera os contadores e passa a escrever no arquivo do processo
+static VOID ForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   ArenaForkFilho(&arena_janelas, ArenaMantemBloco, PIN_GetThreadData(chave_tls, tid));
+   total_limiares = 0;
+   pico_densidade = 0;
+
+   arquivo_saida.close();
+   AbreSaida();
 }
 
 // Função chamada quando a aplicação termina de executar.
@@ -91,88 +192,271 @@ void Fim(INT32 codigo, void *v){
    double tempo_fim = static_cast<double>(ru.ru_utime.tv_sec) + static_cast<double>(ru.ru_utime.tv_usec * 0.000001) +
                       static_cast<double>(ru.ru_stime.tv_sec) + static_cast<double>(ru.ru_stime.tv_usec * 0.000001);
 
+   // memória usada pelas janelas das threads
+   EstatisticasArena estatisticas = ArenaEstatisticas(&arena_janelas);
+
    // imprime no arquivo de saída os resultados
+   arquivo_saida << " #### Janelas de threads: " << estatisticas.vivos << " viva(s) (" << estatisticas.vivos * estatisticas.tam_bloco <<
+                    " bytes), pico de " << estatisticas.pico << " (" << estatisticas.pico * estatisticas.tam_bloco << " bytes), " <<
+                    estatisticas.reaproveitados << " reaproveitada(s)" << endl;
    arquivo_saida << " #### Fim: " << string(ctime(&data_hora));
    arquivo_saida << " #### Instrumentação finalizada em " << converte_double_string(tempo_fim) << " segundos" << endl << endl;
 }
 
-// Função registrada junto ao Pin para executar sempre que um BBL for executado.
+// Descreve o alerta de suspeita de ataque ROP, escrito no arquivo de saída pela thread interna de "alertas-rop.h".
+// "limiar" e "num_bits_setados" são os valores da última ocorrência.
+static void DescreveSuspeita(std::ostream &saida, UINT32 tipo, ADDRINT limiar_usado, ADDRINT num_bits_setados){
+   saida << " ####  Suspeita de ataque ROP! O limiar de " << converte_ulong_string(static_cast<unsigned long int>(limiar_usado)) << 
+            " foi superado pelo seguinte valor: " << converte_ulong_string(static_cast<unsigned long int>(num_bits_setados));
+}
+
+// Versão em JSON de "DescreveSuspeita"
+static void DescreveSuspeitaJson(std::ostream &saida, UINT32 tipo, ADDRINT limiar_usado, ADDRINT num_bits_setados){
+   saida << "\"alerta\":\"limiar\",\"limiar\":" << limiar_usado << ",\"valor\":" << num_bits_setados;
+}
+
+// Atualiza o pico de densidade; pode ser chamada por várias threads ao mesmo tempo
+static void AtualizaPico(UINT32 num_bits_setados){
+   UINT32 pico = pico_densidade;
+   while(pico < num_bits_setados && !__sync_bool_compare_and_swap(&pico_densidade, pico, num_bits_setados)){
+      pico = pico_densidade;
+   }
+}
+
+// Registra o alerta de suspeita de ataque ROP. Não escreve no arquivo de saída nem usa travas:
+// o evento é agregado e escrito pela thread interna de "alertas-rop.h".
+// Também contabiliza o alerta e o pico de densidade para os relatórios periódicos (opção -relatorio).
+static void ReportaSuspeita(THREADID tid, ADDRINT local, UINT32 num_bits_setados){
+   AlertaRegistra(tid, ALERTA_LIMIAR, local, limiar, num_bits_setados);
+
+   __sync_fetch_and_add(&total_limiares, 1);
+   AtualizaPico(num_bits_setados);
+}
+
+// Função registrada junto ao Pin para executar ao final de uma sequência de BBLs sem desvio indireto
+// (janela de 32 bits; ver "InstrumentaCodigo"). Apenas desloca a janela: sem um novo bit setado, o nº
+// de bits setados não aumenta e o limiar não precisa ser checado. Não contém chamadas de função nem
+// desvios, para que o Pin possa fazer o seu "inline" no código instrumentado.
 // A opção "PIN_FAST_ANALYSIS_CALL" é utilizada para otimizar a passagem de parâmetros.
-// O 1º parâmetro, "thread_id", é usado para recuperar a janela da thread.
-// O 2º parâmetro, "num_bits_shift", indica o número de instruções executadas no BBL.
+// O 1º parâmetro, "janela_ptr", é a janela da thread, lida do registrador reservado "reg_janela".
+// O 2º parâmetro, "num_bits_shift", indica o número de instruções executadas na sequência de BBLs.
 // Esse valor corresponde ao número de bits que devem ser deslocados na janela de instruções.
-// O 3º parâmetro, "desvio_indireto", indica se a última instrução do BBL é um desvio indireto (TRUE) ou não (FALSE).
-// Se a últ. instr. do BBL for um desvio indireto, o bit menos significativo da janela é setado.
-void PIN_FAST_ANALYSIS_CALL DeslocaJanela(THREADID thread_id, UINT32 num_bits_shift, BOOL desvio_indireto){
-   
-   // variável auxiliar: nº de bits setados na janela
-   UINT32 num_bits_setados;
+void PIN_FAST_ANALYSIS_CALL DeslocaJanela(JanelaThread *janela_ptr, UINT32 num_bits_shift){
+
+   // limita o deslocamento ao tamanho da janela; feito em 64 bits, um deslocamento de 32 zera a janela
+   UINT32 deslocamento = (num_bits_shift < tam_janela) ? num_bits_shift : tam_janela;
+   janela_ptr->janela_bits = static_cast<UINT32>(static_cast<UINT64>(janela_ptr->janela_bits) << deslocamento);
+}
+
+// Versão de "DeslocaJanela" para sequências de pelo menos 32 instruções, que apenas zera a janela
+void PIN_FAST_ANALYSIS_CALL ZeraJanela(JanelaThread *janela_ptr){
+   janela_ptr->janela_bits = 0;
+}
+
+// Função registrada junto ao Pin para executar antes do desvio indireto que termina uma sequência
+// de BBLs (janela de 32 bits). É a parte "If" da instrumentação: desloca a janela pelas instruções
+// da sequência, seta o bit menos significativo (o desvio indireto) e retorna se o limiar foi superado.
+// Também sem chamadas de função nem desvios, para o "inline".
+ADDRINT PIN_FAST_ANALYSIS_CALL USA_POPCNT AtualizaJanela(JanelaThread *janela_ptr, UINT32 num_bits_shift){
+
+   DeslocaJanela(janela_ptr, num_bits_shift);
+   janela_ptr->janela_bits |= MASCARA_UM;
+
+   // usa a instrução de HW POPCNT para contar o número de bits setados na janela
+   return(__builtin_popcount(janela_ptr->janela_bits) > limiar);
+}
 
-   // obtém ponteiro para a janela da thread
-   JanelaThread *janela_ptr = static_cast<JanelaThread *>(PIN_GetThreadData(chave_tls, thread_id));
+// Versão de "AtualizaJanela" para sequências de pelo menos 32 instruções: a janela passa a conter
+// apenas o bit do desvio indireto, que só supera o limiar 0 (nesse caso, "AtualizaJanela" é usada).
+void PIN_FAST_ANALYSIS_CALL ReiniciaJanela(JanelaThread *janela_ptr){
+   janela_ptr->janela_bits = MASCARA_UM;
+}
 
-   // se o nº de bits a deslocar é menor que 32 e maior que 0
-   if(num_bits_shift < tam_janela){
-      // executa shift de num_bits_shift
-      janela_ptr->janela_bits <<= num_bits_shift;
+// Versão de "DeslocaJanela" para janelas de PALAVRAS * 64 bits (opção -w).
+// Especializada em tempo de compilação para cada tamanho: os laços sobre as palavras
+// têm tamanho constante e são desenrolados pelo compilador. O deslocamento é feito palavra
+// a palavra, da mais antiga para a mais recente, levando para cada palavra os bits que
+// "transbordam" da anterior. As leituras abaixo de palavras[0] caem nas palavras sempre
+// zeradas de JanelaLarga, e deslocamentos maiores que a janela são limitados a PALAVRAS
+// palavras inteiras, o que zera a janela sem desvios condicionais.
+template<UINT32 PALAVRAS>
+void PIN_FAST_ANALYSIS_CALL DeslocaJanelaLarga(JanelaLarga<PALAVRAS> *janela_ptr, UINT32 num_bits_shift){
+
+   UINT64 *palavras = janela_ptr->Palavras();
+
+   // nº de palavras inteiras e de bits restantes a deslocar (com sinal: o índice de leitura
+   // pode ficar negativo e cair nas palavras zeradas)
+   INT32 desloc_palavras = static_cast<INT32>(num_bits_shift / 64);
+   desloc_palavras = (desloc_palavras < static_cast<INT32>(PALAVRAS)) ? desloc_palavras : static_cast<INT32>(PALAVRAS);
+   UINT32 desloc_bits = num_bits_shift % 64;
+
+   for(INT32 i = PALAVRAS - 1; i >= 0; i--){
+      // bits que passam da palavra anterior para esta: (x >> 1) >> (63 - n) equivale a
+      // x >> (64 - n), mas é definido (e vale 0) também quando n = 0
+      palavras[i] = (palavras[i - desloc_palavras] << desloc_bits) |
+                    ((palavras[i - desloc_palavras - 1] >> 1) >> (63 - desloc_bits));
    }
-   else{ // se o nº de bits a deslocar é maior ou igual ao tamanho da janela
-      // zera o buffer
-      janela_ptr->janela_bits = 0x00000000;
+}
+
+// Versão de "ZeraJanela" para janelas de PALAVRAS * 64 bits
+template<UINT32 PALAVRAS>
+void PIN_FAST_ANALYSIS_CALL ZeraJanelaLarga(JanelaLarga<PALAVRAS> *janela_ptr){
+   for(UINT32 i = 0; i < PALAVRAS; i++){
+      janela_ptr->Palavras()[i] = 0;
    }
+}
+
+// Versão de "AtualizaJanela" para janelas de PALAVRAS * 64 bits.
+// A contagem de bits usa a instrução POPCNT de 64 bits em cada palavra; com as opções
+// de compilação adequadas (ex.: -mavx512vpopcntdq), o compilador vetoriza a soma.
+template<UINT32 PALAVRAS>
+ADDRINT PIN_FAST_ANALYSIS_CALL USA_POPCNT AtualizaJanelaLarga(JanelaLarga<PALAVRAS> *janela_ptr, UINT32 num_bits_shift){
+
+   UINT64 *palavras = janela_ptr->Palavras();
+
+   DeslocaJanelaLarga<PALAVRAS>(janela_ptr, num_bits_shift);
+   palavras[0] |= MASCARA_UM;
 
-   // seta o bit menos signif. da janela se a última instrução do BBL for um desvio indireto
-   if(desvio_indireto){
-      janela_ptr->janela_bits |= MASCARA_UM;
+   // soma os bits setados em todas as palavras da janela
+   UINT32 num_bits_setados = 0;
+   for(UINT32 i = 0; i < PALAVRAS; i++){
+      num_bits_setados += __builtin_popcountll(palavras[i]);
    }
 
-   // usa a instrução de HW POPCNT para contar o número de bits setados na janela
-   num_bits_setados = __builtin_popcount(janela_ptr->janela_bits);
+   return(num_bits_setados > limiar);
+}
 
-   // se o número de bits setados for maior do que o limiar
-   if(num_bits_setados > limiar){
-      // Ativa uma trava interna do Pin para evitar que threads concorrentes escrevam simultaneamente no arquivo de saída
-      PIN_LockClient();
+// Versão de "ReiniciaJanela" para janelas de PALAVRAS * 64 bits
+template<UINT32 PALAVRAS>
+void PIN_FAST_ANALYSIS_CALL ReiniciaJanelaLarga(JanelaLarga<PALAVRAS> *janela_ptr){
+   ZeraJanelaLarga<PALAVRAS>(janela_ptr);
+   janela_ptr->Palavras()[0] = MASCARA_UM;
+}
 
-      // imprime mensagem no arquivo de saída
-      arquivo_saida << " ####  Suspeita de ataque ROP! O limiar de " << converte_ulong_string(static_cast<unsigned long int>(limiar)) << 
-                       " foi superado pelo seguinte valor: " << converte_ulong_string(static_cast<unsigned long int>(num_bits_setados)) << endl;
+// Conta os bits setados na janela de 32 bits "janela_ptr"
+static UINT32 DensidadeJanela(void *janela_ptr){
+   return(__builtin_popcount(static_cast<JanelaThread *>(janela_ptr)->janela_bits));
+}
 
-      // Libera trava
-      PIN_UnlockClient();
+// Versão de "DensidadeJanela" para janelas de PALAVRAS * 64 bits
+template<UINT32 PALAVRAS>
+static UINT32 DensidadeJanelaLarga(void *janela_ptr){
+   UINT64 *palavras = static_cast<JanelaLarga<PALAVRAS> *>(janela_ptr)->Palavras();
+   UINT32 num_bits_setados = 0;
+   for(UINT32 i = 0; i < PALAVRAS; i++){
+      num_bits_setados += __builtin_popcountll(palavras[i]);
    }
+   return(num_bits_setados);
+}
+
+// Parte "Then" da instrumentação: só é executada quando "AtualizaJanela" indica que o limiar foi
+// superado. Reconta os bits setados na janela e registra o alerta para o BBL "local".
+void ReportaJanela(JanelaThread *janela_ptr, THREADID tid, ADDRINT local){
+   ReportaSuspeita(tid, local, DensidadeJanela(janela_ptr));
+}
+
+// Parte "Then" para janelas de PALAVRAS * 64 bits
+template<UINT32 PALAVRAS>
+void ReportaJanelaLarga(JanelaLarga<PALAVRAS> *janela_ptr, THREADID tid, ADDRINT local){
+   ReportaSuspeita(tid, local, DensidadeJanelaLarga<PALAVRAS>(janela_ptr));
+}
+
+// Guarda em "arg" o maior nº de bits setados entre ele e a janela "janela_ptr" (ver "ColetaContadores")
+static VOID MaiorDensidade(VOID *janela_ptr, VOID *arg){
+   UINT32 *maior = static_cast<UINT32 *>(arg);
+   UINT32 densidade = funcao_densidade(janela_ptr);
+   if(densidade > *maior){
+      *maior = densidade;
+   }
+}
+
+// Preenche um registro da opção -relatorio: threads vivas, alertas, a maior densidade atual entre as
+// janelas das threads vivas (lidas sem pará-las) e o pico de densidade desde o início
+static VOID ColetaContadores(UINT64 *valores){
+   UINT32 densidade_atual = 0;
+   ArenaParaCada(&arena_janelas, MaiorDensidade, &densidade_atual);
+   AtualizaPico(densidade_atual);
+
+   valores[0] = ArenaEstatisticas(&arena_janelas).vivos;
+   valores[1] = total_limiares;
+   valores[2] = densidade_atual;
+   valores[3] = pico_densidade;
+}
+
+// Insere em "ins", no ponto "ponto", o deslocamento da janela por "pendentes" instruções: "DeslocaJanela"
+// ou, se o deslocamento for de pelo menos o tamanho da janela, "ZeraJanela".
+static void InsereDeslocamento(INS ins, IPOINT ponto, UINT32 pendentes){
+   EstatisticasAntesIns(ins, ponto, 1);
+   if(pendentes >= tam_janela_usada){
+      INS_InsertCall(ins, ponto, funcao_zera, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_janela, IARG_END);
+   }
+   else{
+      INS_InsertCall(ins, ponto, funcao_desloca, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_janela, IARG_UINT32, pendentes, IARG_END);
+   }
+   EstatisticasDepoisIns(ins, ponto);
 }
 
 // Função registrada junto ao Pin para executar a instrumentação do código.
-// Registra junto ao Pin a função "DeslocaJanela" para ser disparada sempre
-// que a última instrução de um BBL estiver para ser executada.
-// Usa o conceito de BBLs (Basic Blocks) para evitar a instrumentação de
-// todas as instruções do código. Ao invés disso, checa apenas a última
-// instrução de cada BBL, já que cada BBL possui um único ponto de saída.
+// Usa o conceito de BBLs (Basic Blocks) para evitar a instrumentação de todas as instruções do código,
+// e agrupa em uma única chamada os deslocamentos de uma sequência de BBLs do trace sem desvio indireto:
+// as instruções dos BBLs são somadas em "pendentes", e a janela só é atualizada quando a execução pode
+// deixar a sequência:
+//  - no desvio indireto que termina um BBL, "AtualizaJanela" desloca a janela pelas instruções pendentes,
+//    seta o bit do desvio e checa o limiar; "ReportaJanela" é disparada somente quando ele é superado;
+//  - no desvio condicional que termina um BBL, "DeslocaJanela" desloca a janela apenas quando o desvio
+//    é tomado (IPOINT_TAKEN_BRANCH), saindo do trace; se não for tomado, a execução segue no próximo
+//    BBL do trace, e as instruções continuam pendentes;
+//  - nos demais desvios, nas chamadas de sistema e no último BBL do trace, "DeslocaJanela" desloca a
+//    janela antes da última instrução do BBL.
+// A janela e o limiar são checados exatamente como antes nos BBLs terminados em desvio indireto, onde
+// um bit é setado; sem um novo bit setado, o nº de bits setados não aumenta, então a checagem dos
+// demais BBLs apenas repetia o alerta do desvio indireto anterior, e deixa de ser feita.
 void InstrumentaCodigo(TRACE trace, void *v){
 
+   // opção -stats: marca o início da instrumentação do trace
+   UINT64 inicio = EstatisticasInstrumentacao();
+
+   // nº de instruções executadas desde a última atualização da janela na sequência atual
+   UINT32 pendentes = 0;
+
    // percorre todos os BBLs
    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
-      // se a última instrução do BBL for um desvio indireto
-      if( INS_IsIndirectBranchOrCall(BBL_InsTail(bbl)) ){
-         // Registra a função "DeslocaJanela" para ser chamada quando o BBL executar,
-         // passando o nº de instr. no BBL e que a últ. instr. é um desvio indireto.
-         // A opção IPOINT_ANYWHERE permite que o Pin agende a chamada da função de análise
-         // em qualquer lugar do BBL para obter uma melhor performance. Também por questões
-         // de desempenho (passagem de argumentos otimizada), a opção
-         // "IARG_FAST_ANALYSIS_CALL" é utilizada.
-         BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)DeslocaJanela, IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_UINT32, BBL_NumIns(bbl), IARG_BOOL, TRUE, IARG_END);
+      INS ultima = BBL_InsTail(bbl);
+      pendentes += BBL_NumIns(bbl);
+
+      if(INS_IsIndirectBranchOrCall(ultima)){
+         // Sequências de pelo menos o tamanho da janela deixam nela apenas o bit do desvio indireto,
+         // que só precisa ser checado com o limiar 0
+         if(pendentes >= tam_janela_usada && limiar > 0){
+            EstatisticasAntesIns(ultima, IPOINT_BEFORE, 0);
+            INS_InsertCall(ultima, IPOINT_BEFORE, funcao_reinicia, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_janela, IARG_END);
+            EstatisticasDepoisIns(ultima, IPOINT_BEFORE);
+         }
+         else{
+            // Registra a função "AtualizaJanela", passando a janela da thread (registrador reservado) e o
+            // nº de instruções pendentes. Por questões de desempenho (passagem de argumentos otimizada),
+            // a opção "IARG_FAST_ANALYSIS_CALL" é utilizada.
+            EstatisticasAntesIns(ultima, IPOINT_BEFORE, 0);
+            INS_InsertIfCall(ultima, IPOINT_BEFORE, funcao_atualiza, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_janela, IARG_UINT32, pendentes, IARG_END);
+
+            // Registra a função "ReportaJanela", executada somente se "AtualizaJanela" retornar um valor diferente de zero.
+            // O endereço do BBL identifica o local do alerta.
+            INS_InsertThenCall(ultima, IPOINT_BEFORE, funcao_reporta, IARG_REG_VALUE, reg_janela, IARG_THREAD_ID, IARG_ADDRINT, BBL_Address(bbl), IARG_END);
+            EstatisticasDepoisIns(ultima, IPOINT_BEFORE);
+         }
+         pendentes = 0;
+      }
+      else if(BBL_Valid(BBL_Next(bbl)) && INS_HasFallThrough(ultima) && INS_IsValidForIpointTakenBranch(ultima)){
+         // desvio condicional: só o caminho tomado deixa a sequência
+         InsereDeslocamento(ultima, IPOINT_TAKEN_BRANCH, pendentes);
       }
-      else{// se a última instrução do BBL NÃO for um desvio indireto
-         // Registra a função "DeslocaJanela" para ser chamada quando o BBL executar,
-         // passando o nº de instr. no BBL e que a últ. instr. NÃO é um desvio indireto.
-         // A opção IPOINT_ANYWHERE permite que o Pin agende a chamada da função de análise
-         // em qualquer lugar do BBL para obter uma melhor performance. Também por questões
-         // de desempenho (passagem de argumentos otimizada), a opção
-         // "IARG_FAST_ANALYSIS_CALL" é utilizada.
-         BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)DeslocaJanela,  IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_UINT32, BBL_NumIns(bbl), IARG_BOOL, FALSE, IARG_END);
+      else if(!BBL_Valid(BBL_Next(bbl)) || INS_IsControlFlow(ultima) || INS_IsSyscall(ultima)){
+         InsereDeslocamento(ultima, IPOINT_BEFORE, pendentes);
+         pendentes = 0;
       }
    }
+
+   EstatisticasTraceInstrumentado(inicio, trace);
 }
 
 // Função onde a execução inicia
@@ -181,9 +465,38 @@ int main(int argc, char *argv[]){
    // Usado para receber da linha de comandos (opção -o) o nome do arquivo de saída. Se não for especificado, usa-se o nome "Pintool.out"
    KNOB<string> KnobArquivoSaida(KNOB_MODE_WRITEONCE, "pintool", "o", "pintool.out", "Nome do arquivo de saida");
 
-   // Usado para receber da linha de comandos (opção -l) o valor de limiar a ser usado. Se não for especificado, usa-se o limiar padrão
-   KNOB<UINT32> KnobEntradaLimiar(KNOB_MODE_WRITEONCE, "pintool", "l", converte_ulong_string(static_cast<unsigned long int>(limiar_padrao)),
-                               "Valor de limiar a ser usado pela protecao");
+   // Usado para receber da linha de comandos (opção -l) o valor de limiar a ser usado. Se não for especificado (vazio), usa-se
+   // o limiar padrão, proporcional ao tamanho da janela. Qualquer número, inclusive 0, é usado como o próprio limiar.
+   KNOB<string> KnobEntradaLimiar(KNOB_MODE_WRITEONCE, "pintool", "l", "",
+                               "Valor de limiar a ser usado pela protecao (padrao: proporcional ao tamanho da janela)");
+
+   // Usado para receber da linha de comandos (opção -w) o tamanho da janela em instruções. Se não for especificado, usa-se 32
+   KNOB<UINT32> KnobTamanhoJanela(KNOB_MODE_WRITEONCE, "pintool", "w", converte_ulong_string(static_cast<unsigned long int>(tam_janela)),
+                               "Tamanho da janela em instrucoes: 32, 64, 128, 256 ou 512");
+
+   // Usado para receber da linha de comandos (opção -formato) o formato dos alertas: "texto" ou "json"
+   KNOB<string> KnobFormato(KNOB_MODE_WRITEONCE, "pintool", "formato", "texto", "Formato dos alertas: texto ou json");
+
+   // Usado para receber da linha de comandos (opção -alertas_seg) o nº máximo de linhas de alerta por segundo (0: sem limite)
+   KNOB<UINT32> KnobAlertasSeg(KNOB_MODE_WRITEONCE, "pintool", "alertas_seg", "100", "Numero maximo de linhas de alerta por segundo (0: sem limite)");
+
+   // Usado para receber da linha de comandos (opção -intervalo) o intervalo, em ms, entre os relatórios de alertas agregados
+   KNOB<UINT32> KnobIntervalo(KNOB_MODE_WRITEONCE, "pintool", "intervalo", "1000", "Intervalo (ms) entre os relatorios de alertas agregados");
+
+   // Usado para receber da linha de comandos (opção -relatorio) o arquivo dos relatórios periódicos. Vazio: não escreve
+   KNOB<string> KnobRelatorio(KNOB_MODE_WRITEONCE, "pintool", "relatorio", "", "Arquivo onde registros JSON periodicos dos contadores sao acrescentados (vazio: desligado)");
+
+   // Usado para receber da linha de comandos (opção -relatorio_ms) o intervalo, em ms, entre os relatórios periódicos
+   KNOB<UINT32> KnobRelatorioMs(KNOB_MODE_WRITEONCE, "pintool", "relatorio_ms", "1000", "Intervalo (ms) entre os registros de -relatorio");
+
+   // Usado para receber da linha de comandos (opção -stats) o arquivo onde o custo da ferramenta é escrito. Vazio: não mede
+   KNOB<string> KnobEstatisticas(KNOB_MODE_WRITEONCE, "pintool", "stats", "", "Arquivo JSON com o custo da instrumentacao e da analise (vazio: desligado)");
+
+   // Usado para receber da linha de comandos (opção -stats_amostra) o intervalo médio, em execuções, entre as medições das funções de análise
+   KNOB<UINT32> KnobAmostra(KNOB_MODE_WRITEONCE, "pintool", "stats_amostra", "1000", "Intervalo medio, em execucoes, entre as medicoes das funcoes de analise");
+
+   // Usado para receber da linha de comandos (opção -sufixo_pid) se o processo inicial também acrescenta o pid aos arquivos de saída
+   KNOB<BOOL> KnobSufixoPid(KNOB_MODE_WRITEONCE, "pintool", "sufixo_pid", "0", "Acrescenta .<pid> aos arquivos de saida tambem no processo inicial (use com -follow_execv)");
 
    // Inicializa o Pin e checa os parâmetros
    if(PIN_Init(argc, argv)){
@@ -191,17 +504,123 @@ int main(int argc, char *argv[]){
       Uso();
       return(1);
    }
+
+   // Inicia as saídas por processo, antes de abrir qualquer arquivo de saída
+   SaidaProcessoInicia(KnobSufixoPid.Value());
+
+   // Obtém o formato dos alertas
+   FormatoAlertas formato_alertas;
+   if(!AlertasFormato(KnobFormato.Value(), &formato_alertas)){
+      Uso();
+      return(1);
+   }
+
+   // Escolhe as versões das funções de análise especializadas para o tamanho de janela pedido
+   tam_janela_usada = KnobTamanhoJanela.Value();
+   switch(tam_janela_usada){
+      case 32:
+         funcao_desloca = (AFUNPTR)DeslocaJanela;
+         funcao_zera = (AFUNPTR)ZeraJanela;
+         funcao_atualiza = (AFUNPTR)AtualizaJanela;
+         funcao_reinicia = (AFUNPTR)ReiniciaJanela;
+         funcao_reporta = (AFUNPTR)ReportaJanela;
+         funcao_densidade = DensidadeJanela;
+         break;
+      case 64:
+         funcao_desloca = (AFUNPTR)DeslocaJanelaLarga<1>;
+         funcao_zera = (AFUNPTR)ZeraJanelaLarga<1>;
+         funcao_atualiza = (AFUNPTR)AtualizaJanelaLarga<1>;
+         funcao_reinicia = (AFUNPTR)ReiniciaJanelaLarga<1>;
+         funcao_reporta = (AFUNPTR)ReportaJanelaLarga<1>;
+         funcao_densidade = DensidadeJanelaLarga<1>;
+         break;
+      case 128:
+         funcao_desloca = (AFUNPTR)DeslocaJanelaLarga<2>;
+         funcao_zera = (AFUNPTR)ZeraJanelaLarga<2>;
+         funcao_atualiza = (AFUNPTR)AtualizaJanelaLarga<2>;
+         funcao_reinicia = (AFUNPTR)ReiniciaJanelaLarga<2>;
+         funcao_reporta = (AFUNPTR)ReportaJanelaLarga<2>;
+         funcao_densidade = DensidadeJanelaLarga<2>;
+         break;
+      case 256:
+         funcao_desloca = (AFUNPTR)DeslocaJanelaLarga<4>;
+         funcao_zera = (AFUNPTR)ZeraJanelaLarga<4>;
+         funcao_atualiza = (AFUNPTR)AtualizaJanelaLarga<4>;
+         funcao_reinicia = (AFUNPTR)ReiniciaJanelaLarga<4>;
+         funcao_reporta = (AFUNPTR)ReportaJanelaLarga<4>;
+         funcao_densidade = DensidadeJanelaLarga<4>;
+         break;
+      case 512:
+         funcao_desloca = (AFUNPTR)DeslocaJanelaLarga<8>;
+         funcao_zera = (AFUNPTR)ZeraJanelaLarga<8>;
+         funcao_atualiza = (AFUNPTR)AtualizaJanelaLarga<8>;
+         funcao_reinicia = (AFUNPTR)ReiniciaJanelaLarga<8>;
+         funcao_reporta = (AFUNPTR)ReportaJanelaLarga<8>;
+         funcao_densidade = DensidadeJanelaLarga<8>;
+         break;
+      default:
+         Uso();
+         return(1);
+   }
+
+   // obtém a chave para acesso à área de armazenamento local das threads (TLS)
+   chave_tls = PIN_CreateThreadDataKey(0);
+
+   // Inicia a arena das janelas. As janelas largas incluem as palavras sempre zeradas (ver "JanelaLarga").
+   if(tam_janela_usada == tam_janela){
+      ArenaInicia(&arena_janelas, sizeof(JanelaThread));
+   }
+   else{
+      ArenaInicia(&arena_janelas, (2 * (tam_janela_usada / 64) + 1) * sizeof(UINT64));
+   }
+
+   // reserva o registrador que guarda o endereço da janela de cada thread
+   reg_janela = PIN_ClaimToolRegister();
+   if(!REG_valid(reg_janela)){
+      fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+      return(1);
+   }
  
-   // Abre o arquivo de saída no modo apêndice. Se não for passado um nome para o arquivo na linha de comandos, usa "Pintool.out"
-   arquivo_saida.open(KnobArquivoSaida.Value().c_str(), std::ofstream::out | std::ofstream::app);
+   // Obtém valor do limiar. Se não for passado na linha de comandos, usa limiar padrão, mantendo a mesma densidade
+   // de desvios indiretos (10 em 32) para janelas maiores
+   if(KnobEntradaLimiar.Value().empty()){
+      limiar = limiar_padrao * (tam_janela_usada / tam_janela);
+   }
+   else{
+      char *fim;
+      unsigned long valor = strtoul(KnobEntradaLimiar.Value().c_str(), &fim, 10);
+      if(*fim != '\0' || static_cast<UINT32>(valor) != valor){
+         Uso();
+         return(1);
+      }
+      limiar = static_cast<UINT32>(valor);
+   }
 
-   // obtem e imprime no arquivo de saída o momento em que a execução está iniciando
-   time_t data_hora = time(0);
-   arquivo_saida << endl << " #### Inicio: " << string(ctime(&data_hora));
-   
-   // Obtém valor do limiar. Se não for passado na linha de comandos, usa limiar padrão
-   limiar = KnobEntradaLimiar.Value();
-   arquivo_saida << " #### Valor do limiar: " << converte_ulong_string(static_cast<unsigned long int>(limiar)) << endl;
+   // Abre o arquivo de saída. Se não for passado um nome para o arquivo na linha de comandos, usa "Pintool.out"
+   nome_saida = KnobArquivoSaida.Value();
+   AbreSaida();
+
+   // registra as funções de "fork" antes de iniciar os subsistemas, para que o filho reabra a saída antes deles
+   SaidaProcessoAoFork(ForkAntes, ForkPai, ForkFilho, NULL);
+
+   // inicia o subsistema de alertas antes de registrar a função "Fim", para que os alertas pendentes
+   // sejam escritos antes do resumo final
+   if(!AlertasInicia(&arquivo_saida, formato_alertas, KnobAlertasSeg.Value(), KnobIntervalo.Value(), DescreveSuspeita, DescreveSuspeitaJson)){
+      fprintf(stderr, "Nao foi possivel criar a thread interna de alertas\n");
+      return(1);
+   }
+
+   // opção -relatorio: inicia os relatórios periódicos, também antes da função "Fim"
+   if(!RelatorioInicia(KnobRelatorio.Value(), "janela-deslizante", campos_relatorio, 4, ColetaContadores, KnobRelatorioMs.Value(), -1, 0)){
+      fprintf(stderr, "Nao foi possivel iniciar o relatorio periodico %s\n", KnobRelatorio.Value().c_str());
+      return(1);
+   }
+
+   // opção -stats: inicia a medição do custo da ferramenta
+   if(!EstatisticasInicia(KnobEstatisticas.Value(), "janela-deslizante", rotinas_medidas, 2, KnobAmostra.Value())){
+      fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+      return(1);
+   }
 
    // registra a função "Fim" para ser executada quando a aplicação for terminar
    PIN_AddFiniFunction(Fim, NULL);
@@ -209,6 +628,9 @@ int main(int argc, char *argv[]){
    // registra a função "IniciaThread" para ser executada quando uma nova thread for iniciar
    PIN_AddThreadStartFunction(IniciaThread, NULL);
 
+   // registra a função "TerminaThread" para ser executada quando uma thread terminar
+   PIN_AddThreadFiniFunction(TerminaThread, NULL);
+
    // registra a função "InstrumentaCodigo" para instrumentar os "traces"
    TRACE_AddInstrumentFunction(InstrumentaCodigo, NULL);
 
@@ -9,6 +9,15 @@
 
 #include <iostream>
 #include <fstream>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "estatisticas.h"
+#include "relatorio-intervalo.h"
+#include "saida-processo.h"
 
 using namespace std;
 
@@ -18,58 +27,219 @@ KNOB<string> outFileKnob(KNOB_MODE_WRITEONCE, "pintool", "o", \
 
 // Get the number of entries on each LBR.
 KNOB<unsigned int> lbrSizeKnob(KNOB_MODE_WRITEONCE, "pintool", "s",
-	"32", "Number of entries on each LBR");
+	"32", "Number of entries on each LBR (power of two, 4 to 256)");
+
+// Get the list of LBR depths to simulate in a single run (sweep mode).
+KNOB<string> sweepKnob(KNOB_MODE_WRITEONCE, "pintool", "sweep",
+	"", "Comma-separated LBR depths to simulate in one run, e.g. 4,8,16,32,64 (overrides -s)");
+
+// Get the file where the tool's own overhead is written (see estatisticas.h).
+KNOB<string> statsKnob(KNOB_MODE_WRITEONCE, "pintool", "stats",
+	"", "Write instrumentation and analysis-routine costs to this JSON file (empty: off)");
+
+// Get the mean number of executions between two timed analysis calls.
+KNOB<UINT32> statsSampleKnob(KNOB_MODE_WRITEONCE, "pintool", "stats_amostra",
+	"1000", "Mean number of executions between timed analysis calls (-stats)");
+
+// Get the file where periodic snapshots of the counters are appended.
+KNOB<string> reportKnob(KNOB_MODE_WRITEONCE, "pintool", "relatorio",
+	"", "Append periodic JSON snapshots of the counters to this file (empty: off)");
+
+// Get the interval between two snapshots, in milliseconds.
+KNOB<UINT32> reportMsKnob(KNOB_MODE_WRITEONCE, "pintool", "relatorio_ms",
+	"1000", "Milliseconds between snapshots with -relatorio (0: only by instructions)");
+
+// Get the interval between two snapshots, in instructions.
+KNOB<UINT64> reportInsKnob(KNOB_MODE_WRITEONCE, "pintool", "relatorio_ins",
+	"0", "Also write a snapshot every N instructions with -relatorio (0: off)");
+
+// Get the branch classes recorded by the configurable LBR model.
+KNOB<string> selectKnob(KNOB_MODE_WRITEONCE, "pintool", "lbr_select",
+	"", "Comma-separated branch classes recorded by a configurable LBR of -s entries, "
+	"as with LBR_SELECT: cond, jmp, ijmp, call, icall, ret (overrides the two fixed LBRs)");
+
+// Get whether the configurable LBR model runs in call-stack mode.
+KNOB<BOOL> callStackKnob(KNOB_MODE_WRITEONCE, "pintool", "lbr_callstack",
+	"0", "Call-stack mode for -lbr_select: RETs pop the newest CALL instead of being "
+	"recorded (only call, icall and ret may be selected)");
+
+// Get whether the first process also appends its pid to the output files.
+KNOB<BOOL> pidSuffixKnob(KNOB_MODE_WRITEONCE, "pintool", "sufixo_pid",
+	"0", "Append .<pid> to the output files also in the first process (use with -follow_execv)");
+
+// Analysis routines timed with -stats, in the order of the indices below.
+// The last two only exist in the LBR model (-lbr_select).
+static const char *const statsRoutines[] = {"doCount", "doRET", "doDirectCALL", "doIndirectCALL", \
+	"modelJump", "modelSyscall"};
+enum { STATS_COUNT, STATS_RET, STATS_DIRECT_CALL, STATS_INDIRECT_CALL, STATS_JUMP, STATS_SYSCALL };
 
 /**
  * LBR (Last Branch Record) data structure.
  */
 
 /**
- * A LBR entry is composed by the address of the branch instruction and
- * a boolean that indicates whether this is a direct branch (true) or
- * indirect (false).
+ * A LBR entry is composed by the fall-through address of the CALL
+ * instruction (i.e. the return address it pushes) and a boolean that
+ * indicates whether this is a direct branch (true) or indirect (false).
+ * Storing the fall-through address lets a RET be matched with a single
+ * compare against its target.
  */
-typedef pair<ADDRINT, bool> LBREntry;
+struct LBREntry {
+	ADDRINT fallThrough;
+	bool direct;
+};
 
+/**
+ * Ring buffer with a compile-time, power-of-two capacity, so that every
+ * index is computed with a mask. "count" tracks how many entries are valid
+ * (at most CAPACITY): once the ring is full, a put overwrites the oldest
+ * entry, like the hardware LBR does.
+ */
+template <UINT32 CAPACITY>
 class LBR {
 private:
-	LBREntry *buffer;
-	unsigned int head, tail, size;
+	static const UINT32 MASK = CAPACITY - 1;
+
+	LBREntry buffer[CAPACITY];
+	UINT32 head, count;
 public:
-	LBR(unsigned int size) {
-		this->size = size;
-		head = tail = 0;
-		buffer = (LBREntry*) malloc(sizeof(LBREntry) * (size + 1));
+	LBR() {
+		head = count = 0;
 	}
 	
 	bool empty() {
-		return (head == tail);
+		return (count == 0);
 	}
 	
 	void put(LBREntry item) {
-		buffer[head] = item;
-		head = (unsigned int) (head + 1) % size;
+		buffer[head & MASK] = item;
+		head++;
 		
-		if (head == tail)
-			tail = (unsigned int) (tail + 1) % size;
+		if (count < CAPACITY)
+			count++;
 	}
 	
 	void pop() {
 		if (empty())
 			return; 
 		
-		head = (unsigned int) (head - 1) % size;
+		head--;
+		count--;
 	}
 	
 	LBREntry getLastEntry() {
-		if (empty())
-			return make_pair(0, false);
-		
-		unsigned int index = (unsigned int) (head - 1) % size;
+		if (empty()) {
+			LBREntry none = { 0, false };
+			return none;
+		}
 		
-		return buffer[index];
+		return buffer[(head - 1) & MASK];
 	}
 };
+		
+/**
+ * Per-thread counters, merged at Fini.
+ */
+struct ThreadCounters {
+	unsigned long callLBRDirectCALLMatches;
+	unsigned long callLBRIndirectCALLMatches;
+	unsigned long indirectCallLBRMatches;
+
+	unsigned long instCount; // Total number of instructions
+	unsigned long retCount; // Number of RETs found
+	unsigned long directCallCount; // Number of direct CALLs found
+	unsigned long indirectCallCount; // Number of indirect CALLs found
+};
+
+/**
+ * Per-thread state: the counters (kept first, so that a pointer to the
+ * state is also a pointer to its counters) and the two LBRs.
+ */
+template <UINT32 CAPACITY>
+struct ThreadLBR {
+	ThreadCounters counters;
+	LBR<CAPACITY> callLBR; // CALL LBR
+	LBR<CAPACITY> indirectCallLBR; // Indirect CALLs LBR
+};
+
+/**
+ * Sweep mode (-sweep): a single CALL ring simulates every LBR depth.
+ *
+ * An LBR of depth D is the top of the unbounded call stack, minus the
+ * entries that had D or more entries stacked above them at some point
+ * (those were overwritten). So each entry keeps "height", the maximum
+ * number of entries stacked above it since it was put. When the top
+ * is popped, the entry below inherits max(height, top's height + 1). The
+ * top's height is therefore exact when a RET looks at it: a RET that
+ * matches the top matches in every LBR deeper than that height. The
+ * match counts are kept in a histogram by height, and the matches for
+ * depth D are the sum of the buckets below D.
+ *
+ * The ring only has to hold the largest depth: entries it overwrites
+ * have a height at least that large and never match. Each thread's ring
+ * starts small and doubles when it fills, up to that size, and the
+ * histograms grow to the largest matching height seen, so threads with
+ * shallow call stacks stay small even with depths up to 1<<20.
+ *
+ * The Indirect CALL LBR is never popped, so its last entry is always the
+ * most recent indirect CALL and its matches do not depend on the depth.
+ */
+struct SweepEntry {
+	ADDRINT fallThrough;
+	bool direct;
+	UINT32 height; // Max number of entries stacked above this one
+};
+
+struct ThreadSweep {
+	ThreadCounters counters; // Kept first, as in ThreadLBR
+	SweepEntry *ring;
+	UINT32 head, count;
+	UINT32 ringMask; // Current ring size - 1 (up to sweepRingSize - 1)
+	UINT32 histSize; // Current histogram size (up to sweepMaxDepth)
+	unsigned long *directMatches; // Direct CALL matches by height
+	unsigned long *indirectMatches; // Indirect CALL matches by height
+	ADDRINT lastIndirectCall; // Fall-through of the last indirect CALL
+	bool hasIndirectCall;
+};
+
+/**
+ * LBR model (-lbr_select): a single LBR of -s entries, programmed like the
+ * hardware through LBR_SELECT. Each taken branch of a selected class is
+ * recorded as a from/to pair; conditional branches only when taken. In
+ * call-stack mode only CALLs are recorded, and a RET pops the newest one.
+ * Ring filtering is not modeled: Pin only sees user-mode code.
+ *
+ * What a checker could validate from the history it can read:
+ * - a RET is validated when an open CALL in the LBR (one not paired with
+ *   a later RET entry) returns to its target. The from address of a CALL
+ *   gives its return address once decoded, so the model keeps the latter
+ *   with the entry. The newest open CALL matching is the exact stack
+ *   discipline; an older one still lets the RET be checked.
+ * - an indirect branch (or a recorded RET) is validated when its entry is
+ *   still in the LBR at the next system call, where a kBouncer-like check
+ *   reads the whole history. Entries overwritten before that are lost.
+ */
+enum BranchClass { BR_COND, BR_JMP, BR_IJMP, BR_CALL, BR_ICALL, BR_RET, BR_CLASSES };
+static const char *const branchClassNames[] = {"cond", "jmp", "ijmp", "call", "icall", "ret"};
+
+struct ModelEntry {
+	ADDRINT from;
+	ADDRINT to;
+	ADDRINT fallThrough; // CALLs: the return address they push
+	UINT32 type; // BranchClass
+	bool checked; // Already read at a system call
+};
+
+struct ThreadModel {
+	ThreadCounters counters; // Kept first, as in ThreadLBR
+	ModelEntry *ring;
+	UINT32 head, count;
+	unsigned long taken[BR_CLASSES]; // Taken branches by class
+	unsigned long recorded[BR_CLASSES]; // Entries put in the LBR by class
+	unsigned long checked[BR_CLASSES]; // Entries read at system calls by class
+	unsigned long olderCallMatches; // RETs matching an older open CALL
+	unsigned long syscalls;
+};
 
 /**
  * Global Variables.
@@ -78,91 +248,639 @@ public:
 const string done("\t- Done.");
 static ofstream outputFile; // Output file
 
-LBR callLBR(lbrSizeKnob.Value()); // CALL LBR
-unsigned long callLBRDirectCALLMatches = 0;
-unsigned long callLBRIndirectCALLMatches = 0;
+static TLS_KEY tlsKey; // Per-thread ThreadLBR (TLS)
+static REG lbrReg; // Tool register holding the current thread's ThreadLBR
+
+// The states of the threads still running, the counters of the threads
+// that already finished (merged at thread fini) and the number of threads
+// started.
+static PIN_LOCK countersLock;
+static vector<ThreadCounters *> threadCounters;
+static ThreadCounters finishedCounters;
+static UINT64 startedThreads = 0;
 
-LBR indirectCallLBR(lbrSizeKnob.Value()); // Indirect CALLs LBR
-unsigned long indirectCallLBRMatches = 0;
+// Analysis functions specialized for the LBR size given with -s.
+static AFUNPTR doRETFun;
+static AFUNPTR doDirectCALLFun;
+static AFUNPTR doIndirectCALLFun;
+static ThreadCounters *(*newThreadLBR)();
+static VOID (*deleteThreadLBR)(ThreadCounters *);
+static VOID (*mergeThreadLBR)(ThreadCounters *);
 
-unsigned long instCount = 0; // Total number of instructions
-unsigned long retCount = 0; // Number of RETs found
-unsigned long directCallCount = 0; // Number of direct CALLs found
-unsigned long indirectCallCount = 0; // Number of indirect CALLs found
+// Fields of the periodic snapshots (see relatorio-intervalo.h). In sweep
+// mode the CALL LBR matches are only known per depth, at Fini; in the LBR
+// model they are the RETs matching the newest open CALL.
+static const char *const reportFields[] = {"instructions", "rets", "direct_calls", \
+	"indirect_calls", "call_lbr_matches", "indirect_call_lbr_matches", "threads"};
 
-VOID doRET(ADDRINT returnAddr) {
+// Sweep mode: depths to report, the largest of them and the ring size
+// (a power of two not smaller than it). Rings and histograms start with
+// at most SWEEP_INITIAL_SIZE entries.
+static vector<UINT32> sweepDepths;
+static UINT32 sweepMaxDepth;
+static UINT32 sweepRingSize;
+static const UINT32 SWEEP_INITIAL_SIZE = 64;
+
+// Sweep mode: histograms of the threads that already finished.
+static unsigned long *sweepDirectMatches;
+static unsigned long *sweepIndirectMatches;
+
+// LBR model: classes recorded (one bit per BranchClass, 0 when off), the
+// call-stack mode, and the number of entries.
+static UINT32 modelSelect;
+static bool modelCallStack;
+static UINT32 modelSize;
+
+// LBR model: counts of the threads that already finished (the ring and
+// the common counters of modelTotals are not used).
+static ThreadModel modelTotals;
+
+template <UINT32 CAPACITY>
+VOID PIN_FAST_ANALYSIS_CALL doRET(ThreadLBR<CAPACITY> *t, ADDRINT returnAddr) {
 	/**
 	 * Pintool analysis function for return instructions.
 	 *
+	 * @t: The current thread's LBRs and counters.
 	 * @returnAddr: Return address.
 	 */
 	 
 	LBREntry lastEntry;
-	retCount++;
+	t->counters.retCount++;
 	
 	/**
-	 * Candidate CALL can be from 2 to 7 bytes before the return address.
+	 * The last CALL matches if its fall-through address is the return
+	 * address.
 	 */
 	
-	lastEntry = callLBR.getLastEntry();
-	for (int i = 2; i <= 7; i++) {
-		ADDRINT candidate = returnAddr - i;
-		
-		if (candidate == lastEntry.first) {
-			if (lastEntry.second)
-				callLBRDirectCALLMatches++;
-			else
-				callLBRIndirectCALLMatches++;
-
-			break;
-		}
+	lastEntry = t->callLBR.getLastEntry();
+	if (!t->callLBR.empty() && lastEntry.fallThrough == returnAddr) {
+		if (lastEntry.direct)
+			t->counters.callLBRDirectCALLMatches++;
+		else
+			t->counters.callLBRIndirectCALLMatches++;
 	}
 	
-	lastEntry = indirectCallLBR.getLastEntry();
-	for (int i = 2; i <= 7; i++) {
-		ADDRINT candidate = returnAddr - i;
+	lastEntry = t->indirectCallLBR.getLastEntry();
+	if (!t->indirectCallLBR.empty() && lastEntry.fallThrough == returnAddr)
+		t->counters.indirectCallLBRMatches++;
 		
-		if (candidate == lastEntry.first) {
-			indirectCallLBRMatches++;
-			break;
-		}
-	}
-	
-	callLBR.pop();
+	t->callLBR.pop();
 }
 
-VOID doDirectCALL(ADDRINT addr) {
+template <UINT32 CAPACITY>
+VOID PIN_FAST_ANALYSIS_CALL doDirectCALL(ThreadLBR<CAPACITY> *t, ADDRINT fallThrough) {
 	/**
 	 * Pintool analysis fuction for direct call instructions.
 	 *
-	 * @addr: The instruction's address.
+	 * @t: The current thread's LBRs and counters.
+	 * @fallThrough: The address of the instruction following the CALL.
 	 */
 	
-	directCallCount++;
-	callLBR.put(make_pair(addr, true));
+	LBREntry entry = { fallThrough, true };
+
+	t->counters.directCallCount++;
+	t->callLBR.put(entry);
 }
 
-VOID doIndirectCALL(ADDRINT addr) {
+template <UINT32 CAPACITY>
+VOID PIN_FAST_ANALYSIS_CALL doIndirectCALL(ThreadLBR<CAPACITY> *t, ADDRINT fallThrough) {
 	/**
 	 * Pintool analysis fuction for indirect call instructions.
 	 *
-	 * @addr: The instruction's address.
+	 * @t: The current thread's LBRs and counters.
+	 * @fallThrough: The address of the instruction following the CALL.
 	 */
 	
-	indirectCallCount++;
-	callLBR.put(make_pair(addr, false));
-	indirectCallLBR.put(make_pair(addr, false));
+	LBREntry entry = { fallThrough, false };
+
+	t->counters.indirectCallCount++;
+	t->callLBR.put(entry);
+	t->indirectCallLBR.put(entry);
 }
 
-VOID PIN_FAST_ANALYSIS_CALL doCount(UINT32 numIns) {
+VOID PIN_FAST_ANALYSIS_CALL doCount(ThreadCounters *counters, UINT32 numIns) {
 	/**
 	 * Pintool analysis function for counting the number of instructions in
 	 * each basic block.
 	 *
+	 * @counters: The current thread's counters.
 	 * @numIns: Number of instructions in the current basic block.
 	 */
 	 
-	instCount += numIns;
+	counters->instCount += numIns;
+}
+
+template <UINT32 CAPACITY>
+ThreadCounters *allocThreadLBR() {
+	/**
+	 * Allocate a zeroed ThreadLBR for the given LBR size.
+	 */
+
+	ThreadLBR<CAPACITY> *t = new ThreadLBR<CAPACITY>();
+	return &t->counters;
+}
+
+template <UINT32 CAPACITY>
+VOID freeThreadLBR(ThreadCounters *counters) {
+	/**
+	 * Free a ThreadLBR allocated by allocThreadLBR.
+	 */
+
+	delete (ThreadLBR<CAPACITY> *) counters;
+}
+
+VOID mergeNone(ThreadCounters *) {
+	/**
+	 * The two fixed LBRs have nothing to merge beyond the common counters.
+	 */
+}
+
+static VOID growSweepHistograms(ThreadSweep *t, UINT32 height) {
+	/**
+	 * Double the thread's histograms until they cover height (which is
+	 * below sweepMaxDepth).
+	 */
+
+	UINT32 size = t->histSize;
+	while (size <= height)
+		size = size * 2 < sweepMaxDepth ? size * 2 : sweepMaxDepth;
+
+	unsigned long *directMatches = new unsigned long[size]();
+	unsigned long *indirectMatches = new unsigned long[size]();
+	memcpy(directMatches, t->directMatches, t->histSize * sizeof(unsigned long));
+	memcpy(indirectMatches, t->indirectMatches, t->histSize * sizeof(unsigned long));
+	delete[] t->directMatches;
+	delete[] t->indirectMatches;
+	t->directMatches = directMatches;
+	t->indirectMatches = indirectMatches;
+	t->histSize = size;
+}
+
+static VOID growSweepRing(ThreadSweep *t) {
+	/**
+	 * Double the thread's full ring, moving its entries, oldest first, to
+	 * the start of the new one.
+	 */
+
+	UINT32 size = (t->ringMask + 1) * 2;
+	SweepEntry *ring = new SweepEntry[size]();
+	for (UINT32 i = 0; i < t->count; i++)
+		ring[i] = t->ring[(t->head - t->count + i) & t->ringMask];
+	delete[] t->ring;
+	t->ring = ring;
+	t->head = t->count;
+	t->ringMask = size - 1;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL sweepRET(ThreadSweep *t, ADDRINT returnAddr) {
+	/**
+	 * Sweep mode analysis function for return instructions.
+	 *
+	 * @t: The current thread's sweep state.
+	 * @returnAddr: Return address.
+	 */
+
+	t->counters.retCount++;
+
+	if (t->hasIndirectCall && t->lastIndirectCall == returnAddr)
+		t->counters.indirectCallLBRMatches++;
+
+	if (t->count == 0)
+		return;
+
+	SweepEntry &top = t->ring[(t->head - 1) & t->ringMask];
+	if (top.fallThrough == returnAddr && top.height < sweepMaxDepth) {
+		if (top.height >= t->histSize)
+			growSweepHistograms(t, top.height);
+		if (top.direct)
+			t->directMatches[top.height]++;
+		else
+			t->indirectMatches[top.height]++;
+	}
+
+	// Pop, passing the height of the popped entry to the one below it.
+	UINT32 height = top.height + 1;
+	t->head--;
+	t->count--;
+	if (t->count > 0) {
+		SweepEntry &below = t->ring[(t->head - 1) & t->ringMask];
+		if (below.height < height)
+			below.height = height;
+	}
+}
+
+static inline VOID sweepPut(ThreadSweep *t, ADDRINT fallThrough, bool direct) {
+	/**
+	 * Put a CALL in the sweep ring, overwriting the oldest entry when full.
+	 */
+
+	if (t->count > t->ringMask && t->ringMask < sweepRingSize - 1)
+		growSweepRing(t);
+
+	SweepEntry &entry = t->ring[t->head & t->ringMask];
+	entry.fallThrough = fallThrough;
+	entry.direct = direct;
+	entry.height = 0;
+	t->head++;
+
+	if (t->count <= t->ringMask)
+		t->count++;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL sweepDirectCALL(ThreadSweep *t, ADDRINT fallThrough) {
+	/**
+	 * Sweep mode analysis function for direct call instructions.
+	 */
+
+	t->counters.directCallCount++;
+	sweepPut(t, fallThrough, true);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL sweepIndirectCALL(ThreadSweep *t, ADDRINT fallThrough) {
+	/**
+	 * Sweep mode analysis function for indirect call instructions.
+	 */
+
+	t->counters.indirectCallCount++;
+	sweepPut(t, fallThrough, false);
+	t->lastIndirectCall = fallThrough;
+	t->hasIndirectCall = true;
+}
+
+ThreadCounters *allocThreadSweep() {
+	/**
+	 * Allocate a zeroed ThreadSweep, with its ring and histograms.
+	 */
+
+	ThreadSweep *t = new ThreadSweep();
+	t->ringMask = (sweepRingSize < SWEEP_INITIAL_SIZE ? sweepRingSize : SWEEP_INITIAL_SIZE) - 1;
+	t->histSize = sweepMaxDepth < SWEEP_INITIAL_SIZE ? sweepMaxDepth : SWEEP_INITIAL_SIZE;
+	t->ring = new SweepEntry[t->ringMask + 1]();
+	t->directMatches = new unsigned long[t->histSize]();
+	t->indirectMatches = new unsigned long[t->histSize]();
+	return &t->counters;
+}
+
+VOID freeThreadSweep(ThreadCounters *counters) {
+	/**
+	 * Free a ThreadSweep allocated by allocThreadSweep.
+	 */
+
+	ThreadSweep *t = (ThreadSweep *) counters;
+	delete[] t->ring;
+	delete[] t->directMatches;
+	delete[] t->indirectMatches;
+	delete t;
+}
+
+VOID mergeThreadSweep(ThreadCounters *counters) {
+	/**
+	 * Add a finished ThreadSweep's histograms to sweepDirectMatches and
+	 * sweepIndirectMatches.
+	 */
+
+	ThreadSweep *t = (ThreadSweep *) counters;
+	for (UINT32 h = 0; h < t->histSize; h++) {
+		sweepDirectMatches[h] += t->directMatches[h];
+		sweepIndirectMatches[h] += t->indirectMatches[h];
+	}
+}
+
+bool parseSweepDepths(const string &list) {
+	/**
+	 * Parse the -sweep list into sweepDepths (sorted, without repetitions)
+	 * and size the sweep ring. Returns false if the list is invalid.
+	 */
+
+	istringstream in(list);
+	string item;
+	while (getline(in, item, ',')) {
+		char *end;
+		unsigned long depth = strtoul(item.c_str(), &end, 10);
+		if (item.empty() || *end != '\0' || depth == 0 || depth > (1UL << 20))
+			return false;
+		sweepDepths.push_back((UINT32) depth);
+	}
+	if (sweepDepths.empty())
+		return false;
+
+	sort(sweepDepths.begin(), sweepDepths.end());
+	sweepDepths.erase(unique(sweepDepths.begin(), sweepDepths.end()), sweepDepths.end());
+
+	sweepMaxDepth = sweepDepths.back();
+	for (sweepRingSize = 1; sweepRingSize < sweepMaxDepth; sweepRingSize <<= 1)
+		;
+
+	sweepDirectMatches = new unsigned long[sweepMaxDepth]();
+	sweepIndirectMatches = new unsigned long[sweepMaxDepth]();
+
+	doRETFun = (AFUNPTR) sweepRET;
+	doDirectCALLFun = (AFUNPTR) sweepDirectCALL;
+	doIndirectCALLFun = (AFUNPTR) sweepIndirectCALL;
+	newThreadLBR = allocThreadSweep;
+	deleteThreadLBR = freeThreadSweep;
+	mergeThreadLBR = mergeThreadSweep;
+	return true;
+}
+
+static inline VOID modelPut(ThreadModel *t, UINT32 type, ADDRINT from, ADDRINT to, ADDRINT fallThrough) {
+	/**
+	 * Put a branch in the LBR model, overwriting the oldest entry when full.
+	 */
+
+	ModelEntry &entry = t->ring[t->head & (modelSize - 1)];
+	entry.from = from;
+	entry.to = to;
+	entry.fallThrough = fallThrough;
+	entry.type = type;
+	entry.checked = false;
+	t->head++;
+	if (t->count < modelSize)
+		t->count++;
+	t->recorded[type]++;
+}
+
+VOID PIN_FAST_ANALYSIS_CALL modelRET(ThreadModel *t, ADDRINT from, ADDRINT returnAddr) {
+	/**
+	 * LBR model analysis function for return instructions.
+	 *
+	 * @t: The current thread's LBR model.
+	 * @from: Address of the RET.
+	 * @returnAddr: Return address.
+	 */
+
+	t->counters.retCount++;
+	t->taken[BR_RET]++;
+
+	/**
+	 * Rebuild the open CALLs from the history, newest first: a RET entry
+	 * closes the next older CALL. The scan stops at the first match.
+	 */
+
+	UINT32 closed = 0;
+	bool newest = true;
+	for (UINT32 i = 0; i < t->count; i++) {
+		ModelEntry &entry = t->ring[(t->head - 1 - i) & (modelSize - 1)];
+		if (entry.type == BR_RET) {
+			closed++;
+		} else if (entry.type == BR_CALL || entry.type == BR_ICALL) {
+			if (closed > 0) {
+				closed--;
+			} else if (entry.fallThrough == returnAddr) {
+				if (!newest)
+					t->olderCallMatches++;
+				else if (entry.type == BR_CALL)
+					t->counters.callLBRDirectCALLMatches++;
+				else
+					t->counters.callLBRIndirectCALLMatches++;
+				break;
+			} else {
+				newest = false;
+			}
+		}
+	}
+
+	if (modelCallStack) {
+		if (t->count > 0) {
+			t->head--;
+			t->count--;
+		}
+	} else if (modelSelect & (1 << BR_RET)) {
+		modelPut(t, BR_RET, from, returnAddr, 0);
+	}
+}
+
+VOID PIN_FAST_ANALYSIS_CALL modelCALL(ThreadModel *t, UINT32 type, ADDRINT from, ADDRINT to, ADDRINT fallThrough) {
+	/**
+	 * LBR model analysis function for call instructions.
+	 *
+	 * @t: The current thread's LBR model.
+	 * @type: BR_CALL or BR_ICALL.
+	 * @from: Address of the CALL.
+	 * @to: Target of the CALL.
+	 * @fallThrough: The address of the instruction following the CALL.
+	 */
+
+	if (type == BR_CALL)
+		t->counters.directCallCount++;
+	else
+		t->counters.indirectCallCount++;
+	t->taken[type]++;
+
+	if (modelSelect & (1 << type))
+		modelPut(t, type, from, to, fallThrough);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL modelJump(ThreadModel *t, UINT32 type, ADDRINT from, ADDRINT to) {
+	/**
+	 * LBR model analysis function for taken jumps, conditional or not.
+	 *
+	 * @t: The current thread's LBR model.
+	 * @type: BR_COND, BR_JMP or BR_IJMP.
+	 * @from: Address of the jump.
+	 * @to: Target of the jump.
+	 */
+
+	t->taken[type]++;
+	if (modelSelect & (1 << type))
+		modelPut(t, type, from, to, 0);
+}
+
+VOID PIN_FAST_ANALYSIS_CALL modelSyscall(ThreadModel *t) {
+	/**
+	 * LBR model analysis function for system calls: the checker reads the
+	 * whole history, and every entry still in it is validated.
+	 *
+	 * @t: The current thread's LBR model.
+	 */
+
+	t->syscalls++;
+	for (UINT32 i = 0; i < t->count; i++) {
+		ModelEntry &entry = t->ring[(t->head - 1 - i) & (modelSize - 1)];
+		if (!entry.checked) {
+			entry.checked = true;
+			t->checked[entry.type]++;
+		}
+	}
+}
+
+ThreadCounters *allocThreadModel() {
+	/**
+	 * Allocate a zeroed ThreadModel, with its ring.
+	 */
+
+	ThreadModel *t = new ThreadModel();
+	t->ring = new ModelEntry[modelSize]();
+	return &t->counters;
+}
+
+VOID freeThreadModel(ThreadCounters *counters) {
+	/**
+	 * Free a ThreadModel allocated by allocThreadModel.
+	 */
+
+	ThreadModel *t = (ThreadModel *) counters;
+	delete[] t->ring;
+	delete t;
+}
+
+VOID mergeThreadModel(ThreadCounters *counters) {
+	/**
+	 * Add a finished ThreadModel's counts to modelTotals.
+	 */
+
+	ThreadModel *t = (ThreadModel *) counters;
+	for (UINT32 c = 0; c < BR_CLASSES; c++) {
+		modelTotals.taken[c] += t->taken[c];
+		modelTotals.recorded[c] += t->recorded[c];
+		modelTotals.checked[c] += t->checked[c];
+	}
+	modelTotals.olderCallMatches += t->olderCallMatches;
+	modelTotals.syscalls += t->syscalls;
+}
+
+bool parseLBRSelect(const string &list, bool callStack, UINT32 size) {
+	/**
+	 * Parse the -lbr_select list into modelSelect and check the LBR size.
+	 * Returns false if a class is unknown, the size is not a power of two
+	 * from 4 to 256, or call-stack mode has a class other than CALLs and
+	 * RETs.
+	 */
+
+	istringstream in(list);
+	string item;
+	while (getline(in, item, ',')) {
+		UINT32 type = 0;
+		while (type < BR_CLASSES && item != branchClassNames[type])
+			type++;
+		if (type == BR_CLASSES)
+			return false;
+		modelSelect |= 1 << type;
+	}
+	if (modelSelect == 0 || size < 4 || size > 256 || (size & (size - 1)) != 0)
+		return false;
+	if (callStack && (modelSelect & ~((1 << BR_CALL) | (1 << BR_ICALL) | (1 << BR_RET))) != 0)
+		return false;
+
+	modelCallStack = callStack;
+	modelSize = size;
+	newThreadLBR = allocThreadModel;
+	deleteThreadLBR = freeThreadModel;
+	mergeThreadLBR = mergeThreadModel;
+	return true;
+}
+
+template <UINT32 CAPACITY>
+VOID selectLBRSize() {
+	/**
+	 * Select the analysis functions specialized for the LBR size.
+	 */
+
+	doRETFun = (AFUNPTR) doRET<CAPACITY>;
+	doDirectCALLFun = (AFUNPTR) doDirectCALL<CAPACITY>;
+	doIndirectCALLFun = (AFUNPTR) doIndirectCALL<CAPACITY>;
+	newThreadLBR = allocThreadLBR<CAPACITY>;
+	deleteThreadLBR = freeThreadLBR<CAPACITY>;
+	mergeThreadLBR = mergeNone;
+}
+
+static VOID retireThread(ThreadCounters *t) {
+	/**
+	 * Merge a thread's counters into finishedCounters and the mode's
+	 * totals, and free its state. Called with countersLock held, after
+	 * the state was removed from threadCounters.
+	 */
+
+	finishedCounters.callLBRDirectCALLMatches += t->callLBRDirectCALLMatches;
+	finishedCounters.callLBRIndirectCALLMatches += t->callLBRIndirectCALLMatches;
+	finishedCounters.indirectCallLBRMatches += t->indirectCallLBRMatches;
+	finishedCounters.instCount += t->instCount;
+	finishedCounters.retCount += t->retCount;
+	finishedCounters.directCallCount += t->directCallCount;
+	finishedCounters.indirectCallCount += t->indirectCallCount;
+	mergeThreadLBR(t);
+	deleteThreadLBR(t);
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v) {
+	/**
+	 * Allocate the new thread's LBRs and counters, keep them in TLS and
+	 * in the tool register used by the analysis functions.
+	 */
+
+	ThreadCounters *t = newThreadLBR();
+	PIN_SetThreadData(tlsKey, t, tid);
+	PIN_SetContextReg(ctxt, lbrReg, (ADDRINT) t);
+
+	PIN_GetLock(&countersLock, tid + 1);
+	threadCounters.push_back(t);
+	startedThreads++;
+	PIN_ReleaseLock(&countersLock);
+}
+
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v) {
+	/**
+	 * Merge the finished thread's counters into the totals and free its
+	 * state, so that threads that come and go do not accumulate.
+	 */
+
+	ThreadCounters *t = (ThreadCounters *) PIN_GetThreadData(tlsKey, tid);
+
+	PIN_GetLock(&countersLock, tid + 1);
+	vector<ThreadCounters *>::iterator it = find(threadCounters.begin(), threadCounters.end(), t);
+	if (it != threadCounters.end()) { // Not yet retired by Fini
+		threadCounters.erase(it);
+		retireThread(t);
+	}
+	PIN_ReleaseLock(&countersLock);
+}
+
+VOID InstrumentModel(BBL bbl) {
+	/**
+	 * Instrument the branches of a BBL for the LBR model. Every class is
+	 * counted, so the report can tell the recorded share of each one.
+	 */
+
+	INS tail = BBL_InsTail(bbl);
+
+	if (INS_IsRet(tail)) {
+		EstatisticasAntesIns(tail, IPOINT_BEFORE, STATS_RET);
+		INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) modelRET, \
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+			IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_END);
+		EstatisticasDepoisIns(tail, IPOINT_BEFORE);
+	} else if (INS_IsCall(tail)) {
+		bool direct = INS_IsDirectCall(tail);
+		EstatisticasAntesIns(tail, IPOINT_BEFORE, direct ? STATS_DIRECT_CALL : STATS_INDIRECT_CALL);
+		INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) modelCALL, \
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+			IARG_UINT32, direct ? BR_CALL : BR_ICALL, IARG_INST_PTR, \
+			IARG_BRANCH_TARGET_ADDR, IARG_ADDRINT, INS_NextAddress(tail), IARG_END);
+		EstatisticasDepoisIns(tail, IPOINT_BEFORE);
+	} else if (INS_IsBranch(tail)) {
+		/**
+		 * Conditional branches have a fall-through and are only recorded
+		 * when taken; unconditional ones are always taken.
+		 */
+
+		UINT32 type = INS_HasFallThrough(tail) ? BR_COND : \
+			INS_IsDirectBranchOrCall(tail) ? BR_JMP : BR_IJMP;
+		IPOINT where = type == BR_COND ? IPOINT_TAKEN_BRANCH : IPOINT_BEFORE;
+		EstatisticasAntesIns(tail, where, STATS_JUMP);
+		INS_InsertCall(tail, where, (AFUNPTR) modelJump, \
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+			IARG_UINT32, type, IARG_INST_PTR, IARG_BRANCH_TARGET_ADDR, IARG_END);
+		EstatisticasDepoisIns(tail, where);
+	}
+
+	for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+		if (INS_IsSyscall(ins)) {
+			EstatisticasAntesIns(ins, IPOINT_BEFORE, STATS_SYSCALL);
+			INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR) modelSyscall, \
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, IARG_END);
+			EstatisticasDepoisIns(ins, IPOINT_BEFORE);
+		}
+	}
 }
 
 VOID InstrumentCode(TRACE trace, VOID *v) {
@@ -174,61 +892,276 @@ VOID InstrumentCode(TRACE trace, VOID *v) {
      * of these BBLs.
      */
 	 
+	UINT64 start = EstatisticasInstrumentacao();
+
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+		EstatisticasAntesBbl(bbl, IPOINT_ANYWHERE, STATS_COUNT);
 		BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR) doCount, \
-			IARG_FAST_ANALYSIS_CALL, IARG_UINT32, BBL_NumIns(bbl), IARG_END);	
+			IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+			IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+		EstatisticasDepoisBbl(bbl, IPOINT_ANYWHERE);
+
+		if (modelSelect != 0) {
+			InstrumentModel(bbl);
+			continue;
+		}
 		
         INS tail = BBL_InsTail(bbl);
 		
 		if (INS_IsRet(tail)) {
-			INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) doRET, \
+			EstatisticasAntesIns(tail, IPOINT_BEFORE, STATS_RET);
+			INS_InsertCall(tail, IPOINT_BEFORE, doRETFun, \
+				IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
 				IARG_BRANCH_TARGET_ADDR, IARG_END);
+			EstatisticasDepoisIns(tail, IPOINT_BEFORE);
 		} else if (INS_IsCall(tail)) {
-			if (INS_IsDirectCall(tail))
-				INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) doDirectCALL, \
-					IARG_INST_PTR, IARG_END);
-			else
-				INS_InsertCall(tail, IPOINT_BEFORE, (AFUNPTR) doIndirectCALL, \
-					IARG_INST_PTR, IARG_END);
+			if (INS_IsDirectCall(tail)) {
+				EstatisticasAntesIns(tail, IPOINT_BEFORE, STATS_DIRECT_CALL);
+				INS_InsertCall(tail, IPOINT_BEFORE, doDirectCALLFun, \
+					IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+					IARG_ADDRINT, INS_NextAddress(tail), IARG_END);
+			} else {
+				EstatisticasAntesIns(tail, IPOINT_BEFORE, STATS_INDIRECT_CALL);
+				INS_InsertCall(tail, IPOINT_BEFORE, doIndirectCALLFun, \
+					IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, lbrReg, \
+					IARG_ADDRINT, INS_NextAddress(tail), IARG_END);
+			}
+			EstatisticasDepoisIns(tail, IPOINT_BEFORE);
 		}
 			
     }
+
+	EstatisticasTraceInstrumentado(start, trace);
 }
 
-void printExperimentReport() {
+void printExperimentReport(const ThreadCounters &total) {
 	/**
 	 * Print the report for the LBR experiment.
+	 *
+	 * @total: Counters merged from all threads.
 	 */
 	
 	outputFile << "Reports for experiment \"LBR Match\" with " << \
 		lbrSizeKnob.Value() << " entries" << endl << endl;
+	outputFile << "[+] Number of threads:" << endl << \
+		"\t" << startedThreads << endl << endl;
 	outputFile << "[+] Number of instructions executed:" << endl << \
-		"\t" << instCount << endl << endl;
+		"\t" << total.instCount << endl << endl;
 	outputFile << "[+] Number of RET instructions:" << endl << \
-		"\t" << retCount << endl << endl;
+		"\t" << total.retCount << endl << endl;
 	outputFile << "[+] Number of Direct CALL instructions:" << endl << \
-		"\t" << directCallCount << endl << endl;
+		"\t" << total.directCallCount << endl << endl;
 	outputFile << "[+] Number of Indirect CALL instructions:" << endl << \
-		"\t" << indirectCallCount << endl << endl;
+		"\t" << total.indirectCallCount << endl << endl;
 	outputFile << "[+] CALL LBR Matches:" << endl << \
-		"\t" << callLBRDirectCALLMatches + callLBRIndirectCALLMatches << \
+		"\t" << total.callLBRDirectCALLMatches + total.callLBRIndirectCALLMatches << \
 		endl << endl << \
 		"\t[+] Direct CALL Matches:" << endl << \
-		"\t\t" << callLBRDirectCALLMatches << endl << \
+		"\t\t" << total.callLBRDirectCALLMatches << endl << \
 		"\t[+] Indirect CALL Matches:" << endl << \
-		"\t\t" << callLBRIndirectCALLMatches << endl << endl;
+		"\t\t" << total.callLBRIndirectCALLMatches << endl << endl;
 	outputFile << "[+] Indirect CALL LBR Matches:" << endl << \
-		"\t" << indirectCallLBRMatches << endl << endl;
+		"\t" << total.indirectCallLBRMatches << endl << endl;
+}
+
+void printSweepReport(const ThreadCounters &total) {
+	/**
+	 * Print the report for the LBR experiment in sweep mode: the common
+	 * counts, then one row per depth.
+	 *
+	 * @total: Counters merged from all threads.
+	 */
+
+	outputFile << "Reports for experiment \"LBR Match\" sweeping " << \
+		sweepDepths.size() << " depths" << endl << endl;
+	outputFile << "[+] Number of threads:" << endl << \
+		"\t" << startedThreads << endl << endl;
+	outputFile << "[+] Number of instructions executed:" << endl << \
+		"\t" << total.instCount << endl << endl;
+	outputFile << "[+] Number of RET instructions:" << endl << \
+		"\t" << total.retCount << endl << endl;
+	outputFile << "[+] Number of Direct CALL instructions:" << endl << \
+		"\t" << total.directCallCount << endl << endl;
+	outputFile << "[+] Number of Indirect CALL instructions:" << endl << \
+		"\t" << total.indirectCallCount << endl << endl;
+	outputFile << "[+] LBR Matches by depth:" << endl << \
+		"\tDepth\tCALL LBR\tDirect CALL\tIndirect CALL\tIndirect CALL LBR" << endl;
+
+	// Prefix sums of the histograms, reported at each requested depth.
+	unsigned long direct = 0, indirect = 0;
+	UINT32 h = 0;
+	for (size_t i = 0; i < sweepDepths.size(); i++) {
+		for (; h < sweepDepths[i]; h++) {
+			direct += sweepDirectMatches[h];
+			indirect += sweepIndirectMatches[h];
+		}
+		outputFile << "\t" << sweepDepths[i] << "\t" << direct + indirect << \
+			"\t" << direct << "\t" << indirect << "\t" << \
+			total.indirectCallLBRMatches << endl;
+	}
+	outputFile << endl;
+}
+
+void printModelReport(const ThreadCounters &total) {
+	/**
+	 * Print the report for the LBR model: the common counts, the branches
+	 * of each class, and what could be validated from the history.
+	 *
+	 * @total: Counters merged from all threads.
+	 */
+
+	const unsigned long *taken = modelTotals.taken;
+	const unsigned long *recorded = modelTotals.recorded;
+	const unsigned long *checked = modelTotals.checked;
+	unsigned long olderCallMatches = modelTotals.olderCallMatches;
+	unsigned long syscalls = modelTotals.syscalls;
+
+	outputFile << "Reports for experiment \"LBR Match\" with a " << modelSize << \
+		"-entry LBR model (" << selectKnob.Value() << \
+		(modelCallStack ? ", call-stack mode" : "") << ")" << endl << endl;
+	outputFile << "[+] Number of threads:" << endl << \
+		"\t" << startedThreads << endl << endl;
+	outputFile << "[+] Number of instructions executed:" << endl << \
+		"\t" << total.instCount << endl << endl;
+	outputFile << "[+] Number of RET instructions:" << endl << \
+		"\t" << total.retCount << endl << endl;
+	outputFile << "[+] Number of Direct CALL instructions:" << endl << \
+		"\t" << total.directCallCount << endl << endl;
+	outputFile << "[+] Number of Indirect CALL instructions:" << endl << \
+		"\t" << total.indirectCallCount << endl << endl;
+	outputFile << "[+] Number of system calls:" << endl << \
+		"\t" << syscalls << endl << endl;
+	outputFile << "[+] Branches by class:" << endl << \
+		"\tClass\tSelected\tTaken\tRecorded\tRead at system calls" << endl;
+	for (UINT32 c = 0; c < BR_CLASSES; c++) {
+		outputFile << "\t" << branchClassNames[c] << "\t" << \
+			((modelSelect & (1 << c)) ? "yes" : "no") << "\t" << taken[c] << \
+			"\t" << recorded[c] << "\t" << checked[c] << endl;
+	}
+	outputFile << endl;
+
+	unsigned long newestMatches = total.callLBRDirectCALLMatches + total.callLBRIndirectCALLMatches;
+	outputFile << "[+] RETs validated by an open CALL in the LBR:" << endl << \
+		"\t" << newestMatches + olderCallMatches << endl << endl << \
+		"\t[+] Newest open CALL (Direct CALL):" << endl << \
+		"\t\t" << total.callLBRDirectCALLMatches << endl << \
+		"\t[+] Newest open CALL (Indirect CALL):" << endl << \
+		"\t\t" << total.callLBRIndirectCALLMatches << endl << \
+		"\t[+] Older open CALL:" << endl << \
+		"\t\t" << olderCallMatches << endl << endl;
+	outputFile << "[+] Indirect branches validated at system calls:" << endl << \
+		"\t" << checked[BR_IJMP] + checked[BR_ICALL] << " of " << \
+		taken[BR_IJMP] + taken[BR_ICALL] << endl << endl;
+	outputFile << "[+] RETs validated at system calls:" << endl << \
+		"\t" << checked[BR_RET] << " of " << taken[BR_RET] << endl << endl;
+}
+
+VOID collectReport(UINT64 *values) {
+	/**
+	 * Fill a periodic snapshot with the counters of the finished threads
+	 * plus those of the live threads, read while they run.
+	 *
+	 * @values: One value per entry of reportFields.
+	 */
+
+	PIN_GetLock(&countersLock, 0);
+	values[0] = finishedCounters.instCount;
+	values[1] = finishedCounters.retCount;
+	values[2] = finishedCounters.directCallCount;
+	values[3] = finishedCounters.indirectCallCount;
+	values[4] = finishedCounters.callLBRDirectCALLMatches + finishedCounters.callLBRIndirectCALLMatches;
+	values[5] = finishedCounters.indirectCallLBRMatches;
+	for (size_t i = 0; i < threadCounters.size(); i++) {
+		ThreadCounters *t = threadCounters[i];
+
+		values[0] += t->instCount;
+		values[1] += t->retCount;
+		values[2] += t->directCallCount;
+		values[3] += t->indirectCallCount;
+		values[4] += t->callLBRDirectCALLMatches + t->callLBRIndirectCALLMatches;
+		values[5] += t->indirectCallLBRMatches;
+	}
+	values[6] = threadCounters.size();
+	PIN_ReleaseLock(&countersLock);
+}
+
+VOID ForkBefore(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+	/**
+	 * Before a fork, in the parent: hold the counters and flush the output
+	 * file, so that the child gets a consistent copy with nothing pending.
+	 */
+
+	PIN_GetLock(&countersLock, tid + 1);
+	outputFile.flush();
+}
+
+VOID ForkParent(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+	PIN_ReleaseLock(&countersLock);
+}
+
+VOID ForkChild(THREADID tid, const CONTEXT *ctxt, VOID *v) {
+	/**
+	 * After a fork, in the child: only the forking thread exists. Keep its
+	 * LBRs (the child returns through the same frames), restart the counts
+	 * from zero and write to the child's own output file (see
+	 * saida-processo.h). The other threads' states are freed.
+	 */
+
+	PIN_InitLock(&countersLock);
+
+	ThreadCounters *own = (ThreadCounters *) PIN_GetThreadData(tlsKey, tid);
+	*own = ThreadCounters();
+	if (!sweepDepths.empty()) {
+		ThreadSweep *t = (ThreadSweep *) own;
+		memset(t->directMatches, 0, t->histSize * sizeof(unsigned long));
+		memset(t->indirectMatches, 0, t->histSize * sizeof(unsigned long));
+	}
+	if (modelSelect != 0) {
+		ThreadModel *t = (ThreadModel *) own;
+		memset(t->taken, 0, sizeof(t->taken));
+		memset(t->recorded, 0, sizeof(t->recorded));
+		memset(t->checked, 0, sizeof(t->checked));
+		t->olderCallMatches = t->syscalls = 0;
+	}
+	for (size_t i = 0; i < threadCounters.size(); i++) {
+		if (threadCounters[i] != own)
+			deleteThreadLBR(threadCounters[i]);
+	}
+	threadCounters.assign(1, own);
+	startedThreads = 1;
+	finishedCounters = ThreadCounters();
+	if (!sweepDepths.empty()) {
+		memset(sweepDirectMatches, 0, sweepMaxDepth * sizeof(unsigned long));
+		memset(sweepIndirectMatches, 0, sweepMaxDepth * sizeof(unsigned long));
+	}
+	if (modelSelect != 0)
+		modelTotals = ThreadModel();
+
+	outputFile.close();
+	outputFile.open(SaidaProcessoNome(outFileKnob.Value()).c_str());
 }
 
 VOID Fini(INT32 code, VOID *v) {
 	/**
 	 * Perform necessary operations when the instrumented application is about
-	 * to end execution.
+	 * to end execution. Merges the counters of the threads still
+	 * running into the totals, frees their states and prints the report.
 	 */
 	
+	PIN_GetLock(&countersLock, 0);
+	for (size_t i = 0; i < threadCounters.size(); i++)
+		retireThread(threadCounters[i]);
+	threadCounters.clear();
+	PIN_ReleaseLock(&countersLock);
+	ThreadCounters total = finishedCounters;
+
 	cerr << done << endl;
-	printExperimentReport();
+	if (modelSelect != 0)
+		printModelReport(total);
+	else if (sweepDepths.empty())
+		printExperimentReport(total);
+	else
+		printSweepReport(total);
     outputFile.close();
 }
 
@@ -239,10 +1172,74 @@ int main(int argc, char *argv[])
         cerr << "[Error] Could not start Pin." << endl;
 		return -1;
     }
+
+	// Per-process output files, before any of them is opened.
+	SaidaProcessoInicia(pidSuffixKnob.Value());
 	
+	// Select the LBR implementation for the requested size, the sweep
+	// over a list of depths, or the configurable LBR model.
+	if (!selectKnob.Value().empty()) {
+		if (!sweepKnob.Value().empty()) {
+			cerr << "[Error] -lbr_select and -sweep cannot be used together." << endl;
+			return -1;
+		}
+		if (!parseLBRSelect(selectKnob.Value(), callStackKnob.Value(), lbrSizeKnob.Value())) {
+			cerr << "[Error] Invalid LBR model: " << selectKnob.Value() << \
+				" (classes: cond, jmp, ijmp, call, icall, ret; call-stack mode only" \
+				" with call, icall and ret; -s a power of two from 4 to 256)" << endl;
+			return -1;
+		}
+	} else if (!sweepKnob.Value().empty()) {
+		if (!parseSweepDepths(sweepKnob.Value())) {
+			cerr << "[Error] Invalid list of LBR depths: " << sweepKnob.Value() << endl;
+			return -1;
+		}
+	} else switch (lbrSizeKnob.Value()) {
+	case 4: selectLBRSize<4>(); break;
+	case 8: selectLBRSize<8>(); break;
+	case 16: selectLBRSize<16>(); break;
+	case 32: selectLBRSize<32>(); break;
+	case 64: selectLBRSize<64>(); break;
+	case 128: selectLBRSize<128>(); break;
+	case 256: selectLBRSize<256>(); break;
+	default:
+		cerr << "[Error] The LBR size must be a power of two from 4 to 256." << endl;
+		return -1;
+	}
+
+	tlsKey = PIN_CreateThreadDataKey(0);
+	PIN_InitLock(&countersLock);
+
+	lbrReg = PIN_ClaimToolRegister();
+	if (!REG_valid(lbrReg)) {
+		cerr << "[Error] Could not claim a tool register." << endl;
+		return -1;
+	}
+
 	// Open the output file.
-    outputFile.open(outFileKnob.Value().c_str());
+    outputFile.open(SaidaProcessoNome(outFileKnob.Value()).c_str());
+
+	// Fork handlers, registered before the subsystems below so that the
+	// child resets the counters before the subsystems resume.
+	SaidaProcessoAoFork(ForkBefore, ForkParent, ForkChild, 0);
+
+	// Time the instrumentation and the analysis routines (-stats).
+	if (!EstatisticasInicia(statsKnob.Value(), "lbrmatch", statsRoutines, modelSelect != 0 ? 6 : 4, \
+			statsSampleKnob.Value())) {
+		cerr << "[Error] Could not claim a tool register." << endl;
+		return -1;
+	}
+
+	// Periodic snapshots (-relatorio), registered before Fini so that the
+	// last one is written first.
+	if (!RelatorioInicia(reportKnob.Value(), "lbrmatch", reportFields, 7, collectReport,
+			reportMsKnob.Value(), 0, reportInsKnob.Value())) {
+		cerr << "[Error] Could not start the periodic report " << reportKnob.Value() << endl;
+		return -1;
+	}
 
+	PIN_AddThreadStartFunction(ThreadStart, 0);
+	PIN_AddThreadFiniFunction(ThreadFini, 0);
     TRACE_AddInstrumentFunction(InstrumentCode, 0);
     PIN_AddFiniFunction(Fini, 0);
 	cerr << "[+] Running application." << endl;
@@ -9,6 +9,7 @@ Criado por Mateus Felipe Tymburibá Ferreira
 // importação de bibliotecas do Pin e de C++
 #include "pin.H"          // para usar APIs do Pin
 #include <stack>          // para usar estrutura de dados Pilha
+#include <vector>         // para guardar as pilhas sombra de cada thread no modo rápido
 #include <stdio.h>        // para usar "fprintf" e "snprintf"
 #include <stdlib.h>       // para usar "calloc"
 #include <string.h>       // para usar "memset" e converter números para string
@@ -16,18 +17,123 @@ Criado por Mateus Felipe Tymburibá Ferreira
 #include <fstream>        // para imprimir no arquivo de saída
 #include <sys/time.h>     // para registro do tempo de processador usado pelo algoritmo
 #include <sys/resource.h> // para registro do tempo de processador usado pelo algoritmo
+#include <sys/mman.h>     // para usar "mmap" na pilha sombra do modo rápido
+#include <unistd.h>       // para usar "getpagesize"
+#include <new>            // para construir os objetos das threads nos blocos da arena ("placement new")
+#include "alertas-rop.h"  // para registrar os alertas sem escrever no arquivo de saída a partir das funções de análise
+#include "arena-threads.h" // para alocar o estado das threads, alinhado e reaproveitado quando as threads terminam
+#include "estatisticas.h"   // para medir o custo da instrumentação e da análise (opção -stats)
+#include "relatorio-intervalo.h" // para escrever relatórios periódicos (opção -relatorio)
+#include "saida-processo.h" // para separar as saídas dos processos criados por "fork" (opção -sufixo_pid)
 
 
 /**** Variáveis Globais ****/
 static TLS_KEY chave_tls;           // chave para acesso ao armazenamento local (TLS) das threads
 static std::ofstream arquivo_saida; // arquivo onde a saída é escrita
+static string nome_saida;           // nome do arquivo de saída (opção -o), sem o sufixo do processo
+static REG reg_pilha;               // modo rápido: registrador reservado que guarda o endereço da pilha sombra da thread
+static BOOL modo_rapido;            // indica se o modo rápido (opção -rapido) está ativo
+static size_t capacidade_inicial;   // modo rápido: nº inicial de entradas da pilha sombra (opção -capacidade)
+static ADDRINT distancia_maxima;    // modo rápido: maior distância, em bytes, entre quadros consecutivos de uma mesma pilha (opção -distancia)
+static UINT32 max_contextos;        // modo rápido: nº máximo de pilhas sombra por thread (opção -contextos)
+static PIN_LOCK trava_contadores;   // protege os contadores abaixo, acumulados quando cada thread termina
+static UINT64 total_ressincronizacoes = 0; // RETs em que quadros abandonados (longjmp, exceções) foram descartados
+static UINT64 total_trocas = 0;            // trocas entre pilhas sombra de uma mesma thread (corrotinas, swapcontext)
+static UINT64 total_divergencias = 0;      // alertas de endereço de retorno divergente
+static UINT64 total_vazias = 0;            // alertas de RET com a pilha sombra vazia
+static const UINT32 ALERTA_DIVERGENCIA = 1; // tipo de alerta (ver "alertas-rop.h"): endereço de retorno divergente
+static const UINT32 ALERTA_PILHA_VAZIA = 2; // tipo de alerta: RET com a pilha sombra vazia
+static ArenaThreads arena_threads;  // arena de onde vêm os dados das threads ("ThreadPilhas" ou a pilha do modo original)
+static ArenaThreads arena_pilhas;   // modo rápido: arena de onde vêm as pilhas sombra ("PilhaSombraRapida")
+static const char *const rotinas_medidas[] = {"EmpilhaRapida", "VerificaRapida", "AnaliseCALL", "AnaliseRET"}; // rotinas medidas com a opção -stats
+static const UINT32 ROTINA_EMPILHA_RAPIDA = 0;  // índices de "rotinas_medidas" (ver "estatisticas.h")
+static const UINT32 ROTINA_VERIFICA_RAPIDA = 1;
+static const UINT32 ROTINA_ANALISE_CALL = 2;
+static const UINT32 ROTINA_ANALISE_RET = 3;
+static const char *const campos_relatorio[] = {"threads", "profundidade_max", "entradas", "divergencias", "vazias", "ressincronizacoes", "trocas"}; // campos da opção -relatorio
 /**** Fim das Variáveis Globais ****/
 
+// Entrada da pilha sombra do modo rápido: o endereço de retorno e a posição da pilha da thread
+// onde a instrução CALL o gravou. A posição permite reconhecer, quando um RET não corresponde
+// ao topo, qual entrada corresponde de fato ao retorno (ver "DivergenciaRapida").
+struct EntradaPilha{
+   ADDRINT retorno;  // endereço de retorno empilhado pelo CALL
+   ADDRINT posicao;  // endereço onde o CALL gravou o endereço de retorno (ESP/RSP logo após o CALL)
+};
+
+struct ThreadPilhas;
+
+// Pilha sombra do modo rápido. As entradas ficam em uma área contígua obtida com "mmap",
+// seguida de uma página de guarda (sem permissão de acesso) que interrompe a execução caso
+// a pilha seja usada além do seu limite. Antes da primeira entrada há uma posição extra,
+// nunca usada como entrada e zerada, para que "EmpilhaRapida" e "VerificaRapida" possam ler
+// "topo[-1]" mesmo com a pilha vazia. As posições das entradas são sempre decrescentes, da
+// base para o topo, como os quadros da pilha da thread.
+// Quando a pilha enche, é realocada com o dobro da capacidade ("CresceRapida"), o que só
+// ocorre raramente. A estrutura ocupa uma linha inteira da cache para evitar "false sharing".
+struct PilhaSombraRapida{
+   EntradaPilha *topo;    // próxima posição livre
+   EntradaPilha *base;    // primeira entrada
+   EntradaPilha *limite;  // posição seguinte à última entrada (início da página de guarda)
+   void *mapeamento;      // início da área obtida com "mmap"
+   size_t tam_mapeado;    // tamanho da área obtida com "mmap", incluindo a página de guarda
+   ThreadPilhas *thread;  // thread a que a pilha sombra pertence
+   UINT64 ultimo_uso;     // momento (relógio da thread) em que a pilha sombra passou a ser a atual
+   UINT8 lixo[64 - 3 * sizeof(EntradaPilha *) - sizeof(void *) - sizeof(size_t) - sizeof(ThreadPilhas *) - sizeof(UINT64)]; // completa a linha da cache
+};
+
+// Modo rápido: dados de cada thread. Uma thread pode ter uma pilha sombra para cada pilha que
+// usar (corrotinas, "swapcontext"), identificada pela faixa de posições das suas entradas. A
+// pilha sombra atual fica no registrador reservado; as demais só são consultadas nos casos raros.
+struct ThreadPilhas{
+   vector<PilhaSombraRapida *> contextos; // pilhas sombra da thread
+   UINT64 relogio;                        // nº de trocas de pilha sombra, usado em "ultimo_uso"
+   UINT64 ressincronizacoes;              // contadores da thread, acumulados nos totais quando ela termina
+   UINT64 trocas;
+   UINT64 divergencias;
+   UINT64 vazias;
+};
+
+// Modo original: dados de cada thread. A pilha sombra é a "stack" da implementação original; os
+// contadores, acumulados nos totais quando a thread termina, servem à opção -relatorio.
+struct ThreadPilhaOriginal{
+   stack<ADDRINT> pilha;  // pilha sombra da thread
+   UINT64 profundidade;   // nº de entradas de "pilha", lido pela opção -relatorio sem parar a thread
+   UINT64 divergencias;
+   UINT64 vazias;
+};
+
 
 // Imprime mensagem indicando opções de uso no prompt de comandos
 void Uso(){	
-   fprintf(stderr, "\nUso: pin -t <Pintool> [-o <NomeArquivoSaida>] [-logfile <NomeLogDepuracao>] -- <Programa alvo>\n\n"
+   fprintf(stderr, "\nUso: pin -t <Pintool> [-rapido <0|1>] [-capacidade <Entradas>] [-distancia <Bytes>] [-contextos <Pilhas>] [-formato <texto|json>] [-alertas_seg <Linhas>] [-intervalo <ms>] [-relatorio <ArquivoJSON>] [-relatorio_ms <ms>] [-stats <ArquivoJSON>] [-stats_amostra <N>] [-sufixo_pid <0|1>] [-o <NomeArquivoSaida>] [-logfile <NomeLogDepuracao>] -- <Programa alvo>\n\n"
                    "Opções:\n"
+                   "  -rapido  <0|1>\t"
+                   "Usa a pilha sombra contígua e verificações em linha (padrão: 0, a implementação original). "
+                   "Necessário (1) para programas que usam longjmp, exceções de C++, swapcontext ou corrotinas: só o modo rápido "
+                   "ressincroniza a pilha sombra; no modo original, cada RET posterior a esses desvios gera um alerta falso\n"
+                   "  -capacidade <Entradas>\t"
+                   "Indica o nº inicial de entradas da pilha sombra do modo rápido (padrão: 65536)\n"
+                   "  -distancia <Bytes>\t"
+                   "Indica a maior distância entre quadros consecutivos de uma mesma pilha; acima dela, considera-se uma troca de pilha (padrão: 1048576)\n"
+                   "  -contextos <Pilhas>\t"
+                   "Indica o nº máximo de pilhas sombra por thread no modo rápido (padrão: 64)\n"
+                   "  -formato <texto|json>\t"
+                   "Indica o formato dos alertas: texto ou um objeto JSON por linha (padrão: texto)\n"
+                   "  -alertas_seg <Linhas>\t"
+                   "Indica o nº máximo de linhas de alerta escritas por segundo; 0 não limita (padrão: 100)\n"
+                   "  -intervalo <ms>\t"
+                   "Indica o intervalo entre os relatórios de alertas agregados (padrão: 1000)\n"
+                   "  -relatorio <ArquivoJSON>\t"
+                   "Acrescenta ao arquivo, periodicamente, um registro JSON com o estado dos contadores e das pilhas sombra do modo rápido (padrão: desligado)\n"
+                   "  -relatorio_ms <ms>\t"
+                   "Indica o intervalo entre os registros de -relatorio (padrão: 1000)\n"
+                   "  -stats   <ArquivoJSON>\t"
+                   "Mede o custo da instrumentação e das funções de análise e o escreve em JSON no arquivo (padrão: desligado)\n"
+                   "  -stats_amostra <N>\t"
+                   "Indica de quantas em quantas execuções, em média, o custo das funções de análise é medido (padrão: 1000)\n"
+                   "  -sufixo_pid <0|1>\t"
+                   "Acrescenta .<pid> aos arquivos de saída também no processo inicial, como nos criados por fork; necessário com -follow_execv (padrão: 0)\n"
                    "  -o       <NomeArquivoSaida>\t"
                    "Indica o nome do arquivo de saida (padrão: $PASTA_CORRENTE/pintool.out)\n"
                    "  -logfile <NomeLogDepuracao>\t"
@@ -41,11 +147,174 @@ static string converte_double_string(double valor){
    return(oss.str());
 }
 
+// Modo rápido: mapeia uma área para "capacidade" entradas (mais a posição extra antes da base),
+// arredondada para páginas inteiras e seguida de uma página de guarda, e a associa à pilha.
+// Retorna FALSE se não houver memória disponível.
+static BOOL MapeiaPilhaRapida(PilhaSombraRapida *pilha, size_t capacidade){
+   size_t tam_pagina = getpagesize();
+   size_t tam_entradas = ((capacidade + 1) * sizeof(EntradaPilha) + tam_pagina - 1) / tam_pagina * tam_pagina;
+
+   void *mapeamento = mmap(NULL, tam_entradas + tam_pagina, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(mapeamento == MAP_FAILED){
+      return(FALSE);
+   }
+
+   // protege a página de guarda
+   mprotect(static_cast<UINT8 *>(mapeamento) + tam_entradas, tam_pagina, PROT_NONE);
+
+   pilha->mapeamento = mapeamento;
+   pilha->tam_mapeado = tam_entradas + tam_pagina;
+   pilha->base = static_cast<EntradaPilha *>(mapeamento) + 1;
+   pilha->limite = reinterpret_cast<EntradaPilha *>(static_cast<UINT8 *>(mapeamento) + tam_entradas);
+   pilha->topo = pilha->base;
+   return(TRUE);
+}
+
+// Modo rápido: cria uma nova pilha sombra para a thread, em um bloco da arena "arena_pilhas"
+static PilhaSombraRapida *NovaPilha(ThreadPilhas *thread){
+   PilhaSombraRapida *pilha = static_cast<PilhaSombraRapida *>(ArenaAloca(&arena_pilhas));
+   if(!MapeiaPilhaRapida(pilha, capacidade_inicial)){
+      fprintf(stderr, "Erro ao alocar uma pilha sombra\n");
+      PIN_ExitProcess(1);
+   }
+   pilha->thread = thread;
+   pilha->ultimo_uso = thread->relogio;
+   thread->contextos.push_back(pilha);
+   return(pilha);
+}
+
 // Função chamada ao iniciar uma nova thread
-// Instancia objeto para a pilha sombra da nova thread no TLS
+// Constrói, em um bloco da arena "arena_threads", o objeto para a pilha sombra da nova thread e o guarda no TLS
 void IniciaThread(THREADID tid, CONTEXT * contexto, int flags, void * v){ 
-   stack<ADDRINT> *pilhaSombra = new stack<ADDRINT>();
-   PIN_SetThreadData(chave_tls, pilhaSombra, tid);
+   if(modo_rapido){
+      ThreadPilhas *thread = new(ArenaAloca(&arena_threads)) ThreadPilhas();
+      PilhaSombraRapida *pilha = NovaPilha(thread);
+      PIN_SetThreadData(chave_tls, thread, tid);
+
+      // guarda o endereço da pilha sombra no registrador reservado da thread
+      PIN_SetContextReg(contexto, reg_pilha, reinterpret_cast<ADDRINT>(pilha));
+      return;
+   }
+
+   ThreadPilhaOriginal *thread = new(ArenaAloca(&arena_threads)) ThreadPilhaOriginal();
+   PIN_SetThreadData(chave_tls, thread, tid);
+}
+
+// Função chamada quando uma thread termina
+// Acumula os contadores da thread e devolve às arenas os seus blocos, para serem reaproveitados
+// pelas próximas threads. Modo rápido: libera também as suas pilhas sombra.
+void TerminaThread(THREADID tid, const CONTEXT * contexto, int codigo, void * v){
+   if(!modo_rapido){
+      ThreadPilhaOriginal *original = static_cast<ThreadPilhaOriginal *>(PIN_GetThreadData(chave_tls, tid));
+
+      PIN_GetLock(&trava_contadores, tid + 1);
+      total_divergencias += original->divergencias;
+      total_vazias += original->vazias;
+      original->divergencias = original->vazias = original->profundidade = 0; // já somados (ver "ColetaContadores")
+      PIN_ReleaseLock(&trava_contadores);
+
+      original->~ThreadPilhaOriginal();
+      ArenaLibera(&arena_threads, original);
+      return;
+   }
+
+   ThreadPilhas *thread = static_cast<ThreadPilhas *>(PIN_GetThreadData(chave_tls, tid));
+
+   PIN_GetLock(&trava_contadores, tid + 1);
+   total_ressincronizacoes += thread->ressincronizacoes;
+   total_trocas += thread->trocas;
+   total_divergencias += thread->divergencias;
+   total_vazias += thread->vazias;
+   thread->ressincronizacoes = thread->trocas = thread->divergencias = thread->vazias = 0; // já somados (ver "ColetaContadores")
+   PIN_ReleaseLock(&trava_contadores);
+
+   for(size_t i = 0; i < thread->contextos.size(); i++){
+      munmap(thread->contextos[i]->mapeamento, thread->contextos[i]->tam_mapeado);
+      ArenaLibera(&arena_pilhas, thread->contextos[i]);
+   }
+   thread->~ThreadPilhas();
+   ArenaLibera(&arena_threads, thread);
+}
+
+// Abre no modo apêndice o arquivo de saída deste processo (ver "saida-processo.h") e escreve o início da execução
+static void AbreSaida(){
+   arquivo_saida.open(SaidaProcessoNome(nome_saida).c_str(), std::ofstream::out | std::ofstream::app);
+
+   // obtem e imprime no arquivo de saída o momento em que a execução está iniciando
+   time_t data_hora = time(0);
+   arquivo_saida << endl << " #### Inicio: " << string(ctime(&data_hora));
+   if(SaidaProcessoFilho()){
+      arquivo_saida << " #### Processo " << PIN_GetPid() << ", criado por fork" << endl;
+   }
+}
+
+// Depois de um "fork", no filho: indica se o bloco de "arena_threads" é o da thread que chamou
+// "fork" ("arg"). Os blocos das demais threads, que não existem no filho, são destruídos.
+static BOOL MantemThread(VOID *bloco, VOID *arg){
+   if(bloco == arg){
+      return(TRUE);
+   }
+   if(modo_rapido){
+      static_cast<ThreadPilhas *>(bloco)->~ThreadPilhas();
+   }
+   else{
+      static_cast<ThreadPilhaOriginal *>(bloco)->~ThreadPilhaOriginal();
+   }
+   return(FALSE);
+}
+
+// Modo rápido, depois de um "fork", no filho: indica se a pilha sombra pertence à thread que chamou
+// "fork" ("arg"). As pilhas das demais threads têm as suas áreas liberadas.
+static BOOL MantemPilha(VOID *bloco, VOID *arg){
+   PilhaSombraRapida *pilha = static_cast<PilhaSombraRapida *>(bloco);
+   if(pilha->thread == arg){
+      return(TRUE);
+   }
+   munmap(pilha->mapeamento, pilha->tam_mapeado);
+   return(FALSE);
+}
+
+// Antes de um "fork": mantém as travas dos contadores e das arenas e esvazia o arquivo de saída,
+// para que o filho receba uma cópia consistente e sem dados pendentes do pai
+static VOID ForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_GetLock(&trava_contadores, tid + 1);
+   ArenaForkAntes(&arena_threads);
+   if(modo_rapido){
+      ArenaForkAntes(&arena_pilhas);
+   }
+   arquivo_saida.flush();
+}
+
+// Depois de um "fork", no pai: libera as travas
+static VOID ForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   if(modo_rapido){
+      ArenaForkPai(&arena_pilhas);
+   }
+   ArenaForkPai(&arena_threads);
+   PIN_ReleaseLock(&trava_contadores);
+}
+
+// Depois de um "fork", no filho: mantém só os dados e as pilhas sombra da thread que chamou "fork"
+// (o filho retorna pelos mesmos quadros que ela empilhou), zera os contadores e passa a escrever no
+// arquivo do processo
+static VOID ForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_InitLock(&trava_contadores);
+   total_ressincronizacoes = total_trocas = total_divergencias = total_vazias = 0;
+
+   VOID *propria = PIN_GetThreadData(chave_tls, tid);
+   if(modo_rapido){
+      ThreadPilhas *thread = static_cast<ThreadPilhas *>(propria);
+      thread->ressincronizacoes = thread->trocas = thread->divergencias = thread->vazias = 0;
+      ArenaForkFilho(&arena_pilhas, MantemPilha, thread);
+   }
+   else{
+      ThreadPilhaOriginal *original = static_cast<ThreadPilhaOriginal *>(propria);
+      original->divergencias = original->vazias = 0;
+   }
+   ArenaForkFilho(&arena_threads, MantemThread, propria);
+
+   arquivo_saida.close();
+   AbreSaida();
 }
 
 // Função chamada quando a aplicação termina de executar.
@@ -61,23 +330,139 @@ void Fim(INT32 codigo, void *v){
    double tempo_fim = static_cast<double>(ru.ru_utime.tv_sec) + static_cast<double>(ru.ru_utime.tv_usec * 0.000001) +
                       static_cast<double>(ru.ru_stime.tv_sec) + static_cast<double>(ru.ru_stime.tv_usec * 0.000001);
 
+   // memória usada pelos dados das threads
+   EstatisticasArena threads = ArenaEstatisticas(&arena_threads);
+
    // imprime no arquivo de saída os resultados
+   arquivo_saida << " #### Dados de threads: " << threads.vivos << " vivo(s) (" << threads.vivos * threads.tam_bloco << " bytes), pico de " <<
+                    threads.pico << " (" << threads.pico * threads.tam_bloco << " bytes), " << threads.reaproveitados << " reaproveitado(s)" << endl;
+   arquivo_saida << " #### Retornos divergentes: " << total_divergencias << endl;
+   arquivo_saida << " #### Retornos com a pilha sombra vazia: " << total_vazias << endl;
+   if(modo_rapido){
+      // as entradas das pilhas sombra, obtidas com "mmap", não contam: são liberadas quando cada thread termina
+      EstatisticasArena pilhas = ArenaEstatisticas(&arena_pilhas);
+      arquivo_saida << " #### Pilhas sombra: " << pilhas.vivos << " viva(s) (" << pilhas.vivos * pilhas.tam_bloco << " bytes), pico de " <<
+                       pilhas.pico << " (" << pilhas.pico * pilhas.tam_bloco << " bytes), " << pilhas.reaproveitados << " reaproveitada(s)" << endl;
+      arquivo_saida << " #### Ressincronizações da pilha sombra: " << total_ressincronizacoes << endl;
+      arquivo_saida << " #### Trocas de pilha sombra: " << total_trocas << endl;
+   }
    arquivo_saida << " #### Instrumentação finalizada em " << converte_double_string(tempo_fim) << " segundos" << endl;
    arquivo_saida << " #### Fim: " << string(ctime(&data_hora)) << endl;
 }
 
+// Modo rápido: soma aos valores de um registro da opção -relatorio os contadores da thread "bloco"
+static VOID SomaContadores(VOID *bloco, VOID *arg){
+   ThreadPilhas *thread = static_cast<ThreadPilhas *>(bloco);
+   UINT64 *valores = static_cast<UINT64 *>(arg);
+   valores[3] += thread->divergencias;
+   valores[4] += thread->vazias;
+   valores[5] += thread->ressincronizacoes;
+   valores[6] += thread->trocas;
+}
+
+// Modo original: soma aos valores de um registro da opção -relatorio os contadores e as entradas
+// da pilha sombra da thread "bloco"
+static VOID SomaOriginal(VOID *bloco, VOID *arg){
+   ThreadPilhaOriginal *original = static_cast<ThreadPilhaOriginal *>(bloco);
+   UINT64 *valores = static_cast<UINT64 *>(arg);
+   UINT64 profundidade = original->profundidade;
+   if(profundidade > valores[1]){
+      valores[1] = profundidade;
+   }
+   valores[2] += profundidade;
+   valores[3] += original->divergencias;
+   valores[4] += original->vazias;
+}
+
+// Modo rápido: soma aos valores de um registro da opção -relatorio as entradas da pilha sombra "bloco".
+// A pilha pode estar sendo realocada ("CresceRapida"); nesse caso, é ignorada.
+static VOID SomaProfundidade(VOID *bloco, VOID *arg){
+   PilhaSombraRapida *pilha = static_cast<PilhaSombraRapida *>(bloco);
+   UINT64 *valores = static_cast<UINT64 *>(arg);
+   EntradaPilha *base = pilha->base;
+   EntradaPilha *topo = pilha->topo;
+   if(topo < base || topo > pilha->limite){
+      return;
+   }
+   UINT64 profundidade = topo - base;
+   if(profundidade > valores[1]){
+      valores[1] = profundidade;
+   }
+   valores[2] += profundidade;
+}
+
+// Preenche um registro da opção -relatorio: threads vivas, a maior profundidade entre as pilhas
+// sombra, o total de entradas e os contadores, somando os das threads que terminaram aos das vivas
+// (lidos sem pará-las). As threads que terminam zeram os seus contadores sob "trava_contadores",
+// então nenhum é contado duas vezes. O modo original não tem ressincronizações nem trocas de pilha.
+static VOID ColetaContadores(UINT64 *valores){
+   memset(valores, 0, 7 * sizeof(UINT64));
+   valores[0] = ArenaEstatisticas(&arena_threads).vivos;
+
+   PIN_GetLock(&trava_contadores, 0);
+   if(!modo_rapido){
+      valores[3] = total_divergencias;
+      valores[4] = total_vazias;
+      ArenaParaCada(&arena_threads, SomaOriginal, valores);
+      PIN_ReleaseLock(&trava_contadores);
+      return;
+   }
+   valores[3] = total_divergencias;
+   valores[4] = total_vazias;
+   valores[5] = total_ressincronizacoes;
+   valores[6] = total_trocas;
+   ArenaParaCada(&arena_threads, SomaContadores, valores);
+   PIN_ReleaseLock(&trava_contadores);
+
+   ArenaParaCada(&arena_pilhas, SomaProfundidade, valores);
+}
+
+// Descreve os alertas, escritos no arquivo de saída pela thread interna de "alertas-rop.h".
+// Os endereços são os da última ocorrência.
+static void DescreveAlertaPilha(std::ostream &saida, UINT32 tipo, ADDRINT end_ret_original, ADDRINT end_ret_sombra){
+   if(tipo == ALERTA_DIVERGENCIA){
+      saida << " #### Suspeita de ataque ROP! O endereço de retorno " << hexstr(end_ret_original, sizeof(ADDRINT)) << " não coincide com o endereço anotado na pilha sombra (" << hexstr(end_ret_sombra, sizeof(ADDRINT)) << ")";
+   }
+   else{
+      saida << " #### Suspeita de ataque ROP! Não há nenhum endereço de retorno anotado na pilha sombra e o programa pretende retornar para o endereço de retorno " << hexstr(end_ret_original, sizeof(ADDRINT));
+   }
+}
+
+// Versão em JSON de "DescreveAlertaPilha"
+static void DescreveAlertaPilhaJson(std::ostream &saida, UINT32 tipo, ADDRINT end_ret_original, ADDRINT end_ret_sombra){
+   if(tipo == ALERTA_DIVERGENCIA){
+      saida << "\"alerta\":\"divergencia\",\"retorno\":\"" << hexstr(end_ret_original, sizeof(ADDRINT)) << "\",\"sombra\":\"" << hexstr(end_ret_sombra, sizeof(ADDRINT)) << "\"";
+   }
+   else{
+      saida << "\"alerta\":\"pilha_vazia\",\"retorno\":\"" << hexstr(end_ret_original, sizeof(ADDRINT)) << "\"";
+   }
+}
+
+// Registra o alerta de endereço de retorno que não coincide com o topo da pilha sombra, na instrução RET "local".
+// Não escreve no arquivo de saída nem usa travas: o evento é agregado e escrito pela thread interna de "alertas-rop.h".
+static void ReportaDivergencia(THREADID tid, ADDRINT local, ADDRINT end_ret_original, ADDRINT end_ret_sombra){
+   AlertaRegistra(tid, ALERTA_DIVERGENCIA, local, end_ret_original, end_ret_sombra);
+}
+
+// Registra o alerta de instrução RET executada com a pilha sombra vazia
+static void ReportaPilhaVazia(THREADID tid, ADDRINT local, ADDRINT end_ret_original){
+   AlertaRegistra(tid, ALERTA_PILHA_VAZIA, local, end_ret_original, 0);
+}
+
 // Função registrada junto ao Pin para executar sempre que uma instrução CALL for executada
 // Grava o endereço de retorno na pilha sombra da thread correspondente
 void PIN_FAST_ANALYSIS_CALL AnaliseCALL(THREADID tid, ADDRINT endereco){	
    // obtém ponteiro para a pilha sombra
-   stack<ADDRINT> *pilhaSombra = static_cast<stack<ADDRINT> *>(PIN_GetThreadData(chave_tls, tid));
+   ThreadPilhaOriginal *original = static_cast<ThreadPilhaOriginal *>(PIN_GetThreadData(chave_tls, tid));
+   stack<ADDRINT> *pilhaSombra = &original->pilha;
    // empilha o endereço de retorno na pilha sombra da thread
    pilhaSombra->push(endereco);
+   original->profundidade = pilhaSombra->size();
 }
 
 // Função registrada junto ao Pin para executar sempre que uma instrução RET for executada
 // Checa se o endereço de retorno corresponde ao endereço anotado no topo da pilha sombra
-void PIN_FAST_ANALYSIS_CALL AnaliseRET(THREADID tid, CONTEXT *contexto){
+void PIN_FAST_ANALYSIS_CALL AnaliseRET(THREADID tid, CONTEXT *contexto, ADDRINT local){
    // inicializa endereço de retorno anotado na pilha original da thread
    ADDRINT end_ret_original = 0; 
 
@@ -91,7 +476,8 @@ void PIN_FAST_ANALYSIS_CALL AnaliseRET(THREADID tid, CONTEXT *contexto){
    PIN_SafeCopy(&end_ret_original, ptr_topo_pilha, sizeof(ADDRINT));
 
    // obtém ponteiro para a pilha sombra
-   stack<ADDRINT> *pilhaSombra = static_cast<stack<ADDRINT> *>(PIN_GetThreadData(chave_tls, tid));
+   ThreadPilhaOriginal *original = static_cast<ThreadPilhaOriginal *>(PIN_GetThreadData(chave_tls, tid));
+   stack<ADDRINT> *pilhaSombra = &original->pilha;
 
    // checa se há algum endereço anotado na pilha sombra
    if(pilhaSombra->size() != 0){
@@ -99,30 +485,198 @@ void PIN_FAST_ANALYSIS_CALL AnaliseRET(THREADID tid, CONTEXT *contexto){
       end_ret_sombra = pilhaSombra->top();
       // se os endereços de retorno não coincidirem, sinaliza a suspeita de ataque ROP
       if(end_ret_sombra != end_ret_original){
-
-         // Ativa uma trava interna do Pin para evitar que threads concorrentes escrevam simultaneamente no LOG
-         PIN_LockClient();
-
-         arquivo_saida << " #### Suspeita de ataque ROP! O endereço de retorno " << hexstr(end_ret_original, sizeof(ADDRINT)) << " não coincide com o endereço anotado na pilha sombra (" << hexstr(end_ret_sombra, sizeof(ADDRINT)) << ")" << endl;
-
-         // Libera trava
-         PIN_UnlockClient();
+         original->divergencias++;
+         ReportaDivergencia(tid, local, end_ret_original, end_ret_sombra);
       }
       // desempilha o endereço anotado no topo da pilha sombra
       pilhaSombra->pop();
+      original->profundidade = pilhaSombra->size();
    }
    else{
       /* se uma instrução RET está sendo executada e não há endereço de retorno na pilha sombra,
          significa que a paridade CALL-RET foi violada */
+      original->vazias++;
+      ReportaPilhaVazia(tid, local, end_ret_original);
+   }
+}
 
-      // Ativa uma trava interna do Pin para evitar que threads concorrentes escrevam simultaneamente no LOG
-      PIN_LockClient();
+// Modo rápido: realoca a pilha sombra com o dobro da capacidade, copiando as entradas existentes
+static void CresceRapida(PilhaSombraRapida *pilha){
+   PilhaSombraRapida antiga = *pilha;
+   size_t num_entradas = antiga.topo - antiga.base;
 
-      arquivo_saida << " #### Suspeita de ataque ROP! Não há nenhum endereço de retorno anotado na pilha sombra e o programa pretende retornar para o endereço de retorno " << hexstr(end_ret_original, sizeof(ADDRINT)) << endl;
+   if(!MapeiaPilhaRapida(pilha, 2 * (antiga.limite - antiga.base))){
+      fprintf(stderr, "Erro ao aumentar a pilha sombra (%lu entradas)\n", static_cast<unsigned long>(num_entradas));
+      PIN_ExitProcess(1);
+   }
+
+   memcpy(pilha->base, antiga.base, num_entradas * sizeof(EntradaPilha));
+   pilha->topo = pilha->base + num_entradas;
+   munmap(antiga.mapeamento, antiga.tam_mapeado);
+}
 
-      // Libera trava
-      PIN_UnlockClient();
+// Modo rápido: como as posições das entradas decrescem da base para o topo, usa busca binária
+// para obter a primeira entrada cuja posição não está acima de "posicao". As entradas a partir
+// dela correspondem a quadros que já foram abandonados ou, se a posição for igual, ao próprio quadro.
+static EntradaPilha *BuscaPosicao(PilhaSombraRapida *pilha, ADDRINT posicao){
+   EntradaPilha *inicio = pilha->base;
+   EntradaPilha *fim = pilha->topo;
+   while(inicio < fim){
+      EntradaPilha *meio = inicio + (fim - inicio) / 2;
+      if(meio->posicao > posicao){
+         inicio = meio + 1;
+      }
+      else{
+         fim = meio;
+      }
+   }
+   return(inicio);
+}
+
+// Modo rápido: torna "pilha" a pilha sombra atual da thread, contabilizando a troca
+static PilhaSombraRapida *TrocaPilha(PilhaSombraRapida *pilha){
+   ThreadPilhas *thread = pilha->thread;
+   thread->trocas++;
+   thread->relogio++;
+   pilha->ultimo_uso = thread->relogio;
+   return(pilha);
+}
+
+// Modo rápido: obtém a pilha sombra à qual pertence um novo quadro gravado em "posicao". É a pilha
+// cuja entrada mais próxima acima da posição está a no máximo "distancia_maxima" bytes; as entradas
+// abaixo da posição são de quadros abandonados (longjmp, exceções) e são descartadas. Se nenhuma
+// pilha servir, usa a atual se estiver vazia, uma outra pilha vazia, uma nova pilha (até o limite
+// "max_contextos") ou, por fim, recicla a pilha sombra usada há mais tempo.
+static PilhaSombraRapida *LocalizaPilha(PilhaSombraRapida *atual, ADDRINT posicao){
+   ThreadPilhas *thread = atual->thread;
+   PilhaSombraRapida *escolhida = NULL;
+   EntradaPilha *novo_topo = NULL;
+   ADDRINT menor_distancia = distancia_maxima;
+
+   for(size_t i = 0; i < thread->contextos.size(); i++){
+      PilhaSombraRapida *pilha = thread->contextos[i];
+      EntradaPilha *entrada = BuscaPosicao(pilha, posicao);
+      if(entrada != pilha->base && entrada[-1].posicao - posicao <= menor_distancia){
+         escolhida = pilha;
+         novo_topo = entrada;
+         menor_distancia = entrada[-1].posicao - posicao;
+      }
+   }
+
+   if(escolhida != NULL){
+      if(novo_topo != escolhida->topo){
+         thread->ressincronizacoes++;
+         escolhida->topo = novo_topo;
+      }
+      return(escolhida == atual ? atual : TrocaPilha(escolhida));
+   }
+
+   if(atual->topo == atual->base){
+      return(atual);
+   }
+
+   PilhaSombraRapida *menos_usada = NULL;
+   for(size_t i = 0; i < thread->contextos.size(); i++){
+      PilhaSombraRapida *pilha = thread->contextos[i];
+      if(pilha->topo == pilha->base){
+         return(TrocaPilha(pilha));
+      }
+      if(menos_usada == NULL || pilha->ultimo_uso < menos_usada->ultimo_uso){
+         menos_usada = pilha;
+      }
+   }
+
+   if(thread->contextos.size() < max_contextos){
+      return(TrocaPilha(NovaPilha(thread)));
+   }
+
+   menos_usada->topo = menos_usada->base;
+   return(TrocaPilha(menos_usada));
+}
+
+// Modo rápido: procura em "pilha" a entrada gravada exatamente em "posicao" com o endereço de
+// retorno "alvo". Se existir, desempilha até ela (inclusive) e retorna TRUE.
+static BOOL DesempilhaAte(PilhaSombraRapida *pilha, ADDRINT alvo, ADDRINT posicao){
+   EntradaPilha *entrada = BuscaPosicao(pilha, posicao);
+   if(entrada != pilha->topo && entrada->posicao == posicao && entrada->retorno == alvo){
+      pilha->topo = entrada;
+      return(TRUE);
+   }
+   return(FALSE);
+}
+
+// Modo rápido: parte "If" da instrumentação das instruções CALL. Empilha o endereço de retorno e a
+// posição onde o CALL o grava e retorna se a parte "Then" é necessária: pilha sombra cheia, ou
+// novo quadro que não está logo abaixo do topo (pilha vazia, quadros abandonados por um longjmp
+// ou troca de pilha). Não contém chamadas de função nem desvios, para que o Pin possa fazer o
+// seu "inline" no código instrumentado.
+ADDRINT PIN_FAST_ANALYSIS_CALL EmpilhaRapida(PilhaSombraRapida *pilha, ADDRINT endereco, ADDRINT esp){
+   ADDRINT posicao = esp - sizeof(ADDRINT);
+   ADDRINT anterior = pilha->topo[-1].posicao;
+   pilha->topo->retorno = endereco;
+   pilha->topo->posicao = posicao;
+   pilha->topo++;
+   return((pilha->topo == pilha->limite) | (posicao >= anterior) | (anterior - posicao > distancia_maxima));
+}
+
+// Modo rápido: parte "Then" da instrumentação das instruções CALL. Desfaz o empilhamento feito na
+// parte "If", empilha a entrada na pilha sombra à qual o quadro pertence e aumenta essa pilha se
+// ela encher. Retorna a pilha sombra atual, que o Pin grava no registrador reservado (IARG_RETURN_REGS).
+ADDRINT EmpilhaLenta(PilhaSombraRapida *pilha){
+   pilha->topo--;
+   EntradaPilha entrada = *pilha->topo;
+
+   PilhaSombraRapida *destino = LocalizaPilha(pilha, entrada.posicao);
+   *destino->topo = entrada;
+   destino->topo++;
+   if(destino->topo == destino->limite){
+      CresceRapida(destino);
+   }
+   return(reinterpret_cast<ADDRINT>(destino));
+}
+
+// Modo rápido: parte "If" da instrumentação das instruções RET. Recebe o endereço para onde o RET
+// vai de fato desviar (IARG_BRANCH_TARGET_ADDR) e o topo da pilha da thread, sem precisar do contexto.
+// Se ambos coincidirem com o topo da pilha sombra, desempilha e retorna 0; caso contrário (ou se a
+// pilha estiver vazia), não altera a pilha e retorna 1. Também sem chamadas nem desvios ("inline").
+ADDRINT PIN_FAST_ANALYSIS_CALL VerificaRapida(PilhaSombraRapida *pilha, ADDRINT alvo, ADDRINT esp){
+   ADDRINT divergente = (pilha->topo[-1].retorno != alvo) | (pilha->topo[-1].posicao != esp) | (pilha->topo == pilha->base);
+   pilha->topo -= (divergente ^ 1);
+   return(divergente);
+}
+
+// Modo rápido: parte "Then" da instrumentação das instruções RET, executada apenas quando o retorno
+// não corresponde ao topo da pilha sombra. Antes de reportar, procura a entrada exata (mesmo endereço
+// de retorno, gravado na mesma posição da pilha) abaixo do topo, caso em que os quadros acima dela
+// foram abandonados por um longjmp ou uma exceção, e depois nas demais pilhas sombra da thread, caso
+// em que houve troca de pilha (corrotinas, swapcontext). Um endereço de retorno sobrescrito ou uma
+// pilha deslocada não têm entrada exata e continuam sendo reportados, desempilhando o topo como na
+// implementação original. Retorna a pilha sombra atual (IARG_RETURN_REGS).
+ADDRINT DivergenciaRapida(PilhaSombraRapida *pilha, ADDRINT alvo, ADDRINT esp, THREADID tid, ADDRINT local){
+   ThreadPilhas *thread = pilha->thread;
+
+   if(DesempilhaAte(pilha, alvo, esp)){
+      thread->ressincronizacoes++;
+      return(reinterpret_cast<ADDRINT>(pilha));
+   }
+
+   for(size_t i = 0; i < thread->contextos.size(); i++){
+      PilhaSombraRapida *outra = thread->contextos[i];
+      if(outra != pilha && DesempilhaAte(outra, alvo, esp)){
+         return(reinterpret_cast<ADDRINT>(TrocaPilha(outra)));
+      }
+   }
+
+   if(pilha->topo != pilha->base){
+      pilha->topo--;
+      thread->divergencias++;
+      ReportaDivergencia(tid, local, alvo, pilha->topo->retorno);
+   }
+   else{
+      thread->vazias++;
+      ReportaPilhaVazia(tid, local, alvo);
    }
+   return(reinterpret_cast<ADDRINT>(pilha));
 }
 
 // Função registrada junto ao Pin para executar a instrumentação do código.
@@ -135,12 +689,38 @@ void PIN_FAST_ANALYSIS_CALL AnaliseRET(THREADID tid, CONTEXT *contexto){
 // instrução de cada BBL, já que cada BBL possui um único ponto de saída.
 void InstrumentaCodigo(TRACE trace, void *v){
 
+   // opção -stats: marca o início da instrumentação do trace
+   UINT64 inicio = EstatisticasInstrumentacao();
+
    // percorre todos os BBLs
    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
 
       // obtém a última instrução do BBL
       INS ins = BBL_InsTail(bbl);
 
+      // Modo rápido: as verificações são divididas em uma parte "If", feita em linha, e uma parte
+      // "Then", chamada apenas nos casos raros (pilha cheia, troca de pilha ou retorno divergente).
+      // As duas usam o topo da pilha da thread imediatamente antes da instrução, por isso não podem
+      // usar IPOINT_ANYWHERE. A parte "Then" pode trocar a pilha sombra atual e grava a nova no
+      // registrador reservado com IARG_RETURN_REGS.
+      if(modo_rapido){
+         if( INS_IsCall(ins) ){
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, ROTINA_EMPILHA_RAPIDA);
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)EmpilhaRapida, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_pilha, IARG_ADDRINT, INS_Address(ins) + INS_Size(ins), IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)EmpilhaLenta, IARG_REG_VALUE, reg_pilha, IARG_RETURN_REGS, reg_pilha, IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE);
+         }
+         else if(INS_IsRet(ins)){
+            // IARG_BRANCH_TARGET_ADDR fornece o endereço para onde o RET vai desviar, evitando o uso
+            // de IARG_CONTEXT e a leitura do topo da pilha da thread com PIN_SafeCopy
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, ROTINA_VERIFICA_RAPIDA);
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)VerificaRapida, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_pilha, IARG_BRANCH_TARGET_ADDR, IARG_REG_VALUE, REG_STACK_PTR, IARG_END);
+            INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)DivergenciaRapida, IARG_REG_VALUE, reg_pilha, IARG_BRANCH_TARGET_ADDR, IARG_REG_VALUE, REG_STACK_PTR, IARG_THREAD_ID, IARG_ADDRINT, INS_Address(ins), IARG_RETURN_REGS, reg_pilha, IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE);
+         }
+         continue;
+      }
+
       // se a última instrução do BBL for uma instrução CALL
       if( INS_IsCall(ins) ){
          // Registra a função "AnaliseCALL" para ser chamada quando o BBL executar,
@@ -149,21 +729,28 @@ void InstrumentaCodigo(TRACE trace, void *v){
          // em qualquer lugar do BBL para obter uma melhor performance. Também por questões
          // de desempenho (passagem de argumentos otimizada), a opção
          // "IARG_FAST_ANALYSIS_CALL" é utilizada.
+         EstatisticasAntesBbl(bbl, IPOINT_ANYWHERE, ROTINA_ANALISE_CALL);
          BBL_InsertCall(bbl, IPOINT_ANYWHERE, (AFUNPTR)AnaliseCALL, IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_ADDRINT, INS_Address(ins) + INS_Size(ins), IARG_END);
+         EstatisticasDepoisBbl(bbl, IPOINT_ANYWHERE);
       }
       else{
          // se a última instrução do BBL for uma instrução RET
          if(INS_IsRet(ins)){
             // registra a função "AnaliseRET" para ser chamada imediatamente antes de uma instrução RET executar,
-            // passando o ID da thread e o ponteiro para o contexto de execução (Pilha, regs, etc).
+            // passando o ID da thread, o ponteiro para o contexto de execução (Pilha, regs, etc) e o
+            // endereço da instrução, que identifica o local dos alertas.
             // A opção IPOINT_ANYWHERE não pode ser usada porque o topo da pilha (ESP) pode estar diferente
             // daquele válido no momento em que a instrução RET for executar. Por questões
             // de desempenho (passagem de argumentos otimizada), a opção
             // "IARG_FAST_ANALYSIS_CALL" é utilizada.
-            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AnaliseRET, IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_CONTEXT, IARG_END);
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, ROTINA_ANALISE_RET);
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)AnaliseRET, IARG_FAST_ANALYSIS_CALL, IARG_THREAD_ID, IARG_CONTEXT, IARG_ADDRINT, INS_Address(ins), IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE);
          }
       }
    }
+
+   EstatisticasTraceInstrumentado(inicio, trace);
 }
 
 // Função onde a execução inicia
@@ -172,6 +759,44 @@ int main(int argc, char *argv[]){
    // Usado para receber da linha de comandos (opção -o) o nome do arquivo de saída. Se não for especificado, usa-se o nome "Pintool.out"
    KNOB<string> KnobArquivoSaida(KNOB_MODE_WRITEONCE, "pintool", "o", "pintool.out", "Nome do arquivo de saida");
 
+   // Usado para receber da linha de comandos (opção -rapido) se o modo rápido deve ser usado. Se não for especificado, usa-se a
+   // implementação original
+   KNOB<BOOL> KnobModoRapido(KNOB_MODE_WRITEONCE, "pintool", "rapido", "0",
+                             "Usa a pilha sombra contigua e verificacoes em linha; necessario com longjmp, excecoes ou corrotinas (so este modo ressincroniza)");
+
+   // Usado para receber da linha de comandos (opção -capacidade) o nº inicial de entradas da pilha sombra do modo rápido
+   KNOB<UINT32> KnobCapacidade(KNOB_MODE_WRITEONCE, "pintool", "capacidade", "65536", "Numero inicial de entradas da pilha sombra no modo rapido");
+
+   // Usado para receber da linha de comandos (opção -distancia) a maior distância entre quadros consecutivos de uma mesma pilha
+   KNOB<UINT32> KnobDistancia(KNOB_MODE_WRITEONCE, "pintool", "distancia", "1048576", "Maior distancia (bytes) entre quadros consecutivos de uma mesma pilha");
+
+   // Usado para receber da linha de comandos (opção -contextos) o nº máximo de pilhas sombra por thread
+   KNOB<UINT32> KnobContextos(KNOB_MODE_WRITEONCE, "pintool", "contextos", "64", "Numero maximo de pilhas sombra por thread no modo rapido");
+
+   // Usado para receber da linha de comandos (opção -formato) o formato dos alertas: "texto" ou "json"
+   KNOB<string> KnobFormato(KNOB_MODE_WRITEONCE, "pintool", "formato", "texto", "Formato dos alertas: texto ou json");
+
+   // Usado para receber da linha de comandos (opção -alertas_seg) o nº máximo de linhas de alerta por segundo (0: sem limite)
+   KNOB<UINT32> KnobAlertasSeg(KNOB_MODE_WRITEONCE, "pintool", "alertas_seg", "100", "Numero maximo de linhas de alerta por segundo (0: sem limite)");
+
+   // Usado para receber da linha de comandos (opção -intervalo) o intervalo, em ms, entre os relatórios de alertas agregados
+   KNOB<UINT32> KnobIntervalo(KNOB_MODE_WRITEONCE, "pintool", "intervalo", "1000", "Intervalo (ms) entre os relatorios de alertas agregados");
+
+   // Usado para receber da linha de comandos (opção -relatorio) o arquivo dos relatórios periódicos. Vazio: não escreve
+   KNOB<string> KnobRelatorio(KNOB_MODE_WRITEONCE, "pintool", "relatorio", "", "Arquivo onde registros JSON periodicos dos contadores sao acrescentados (vazio: desligado)");
+
+   // Usado para receber da linha de comandos (opção -relatorio_ms) o intervalo, em ms, entre os relatórios periódicos
+   KNOB<UINT32> KnobRelatorioMs(KNOB_MODE_WRITEONCE, "pintool", "relatorio_ms", "1000", "Intervalo (ms) entre os registros de -relatorio");
+
+   // Usado para receber da linha de comandos (opção -stats) o arquivo onde o custo da ferramenta é escrito. Vazio: não mede
+   KNOB<string> KnobEstatisticas(KNOB_MODE_WRITEONCE, "pintool", "stats", "", "Arquivo JSON com o custo da instrumentacao e da analise (vazio: desligado)");
+
+   // Usado para receber da linha de comandos (opção -stats_amostra) o intervalo médio, em execuções, entre as medições das funções de análise
+   KNOB<UINT32> KnobAmostra(KNOB_MODE_WRITEONCE, "pintool", "stats_amostra", "1000", "Intervalo medio, em execucoes, entre as medicoes das funcoes de analise");
+
+   // Usado para receber da linha de comandos (opção -sufixo_pid) se o processo inicial também acrescenta o pid aos arquivos de saída
+   KNOB<BOOL> KnobSufixoPid(KNOB_MODE_WRITEONCE, "pintool", "sufixo_pid", "0", "Acrescenta .<pid> aos arquivos de saida tambem no processo inicial (use com -follow_execv)");
+
    // Inicializa o Pin e checa os parâmetros
    if(PIN_Init(argc, argv)){
       // imprime mensagem indicando o formato correto dos parâmetros e encerra
@@ -179,16 +804,67 @@ int main(int argc, char *argv[]){
       return(1);
    }
 
-   // Abre o arquivo de saída no modo apêndice. Se não for passado um nome para o arquivo na linha de comandos, usa "Pintool.out"
-   arquivo_saida.open(KnobArquivoSaida.Value().c_str(), std::ofstream::out | std::ofstream::app);
+   // Inicia as saídas por processo, antes de abrir qualquer arquivo de saída
+   SaidaProcessoInicia(KnobSufixoPid.Value());
 
-   // obtem e imprime no arquivo de saída o momento em que a execução está iniciando
-   time_t data_hora = time(0);
-   arquivo_saida << endl << " #### Inicio: " << string(ctime(&data_hora));
+   // Obtém o formato dos alertas
+   FormatoAlertas formato_alertas;
+   if(!AlertasFormato(KnobFormato.Value(), &formato_alertas)){
+      Uso();
+      return(1);
+   }
+
+   // Abre o arquivo de saída. Se não for passado um nome para o arquivo na linha de comandos, usa "Pintool.out"
+   nome_saida = KnobArquivoSaida.Value();
+   AbreSaida();
 
    // obtém a chave para acesso à área de armazenamento local das threads (TLS)
    chave_tls = PIN_CreateThreadDataKey(0);
 
+   // Modo rápido: reserva o registrador que guarda o endereço da pilha sombra de cada thread
+   modo_rapido = KnobModoRapido.Value();
+   capacidade_inicial = KnobCapacidade.Value() > 0 ? KnobCapacidade.Value() : 1;
+   distancia_maxima = KnobDistancia.Value();
+   max_contextos = KnobContextos.Value() > 0 ? KnobContextos.Value() : 1;
+   PIN_InitLock(&trava_contadores);
+   if(modo_rapido){
+      reg_pilha = PIN_ClaimToolRegister();
+      if(!REG_valid(reg_pilha)){
+         fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+         return(1);
+      }
+      ArenaInicia(&arena_threads, sizeof(ThreadPilhas));
+      ArenaInicia(&arena_pilhas, sizeof(PilhaSombraRapida));
+   }
+   else{
+      ArenaInicia(&arena_threads, sizeof(ThreadPilhaOriginal));
+   }
+
+   // registra a função "TerminaThread" para liberar a pilha sombra quando uma thread terminar
+   PIN_AddThreadFiniFunction(TerminaThread, NULL);
+
+   // registra as funções de "fork" antes de iniciar os subsistemas, para que o filho reabra a saída antes deles
+   SaidaProcessoAoFork(ForkAntes, ForkPai, ForkFilho, NULL);
+
+   // inicia o subsistema de alertas antes de registrar a função "Fim", para que os alertas pendentes
+   // sejam escritos antes do resumo final
+   if(!AlertasInicia(&arquivo_saida, formato_alertas, KnobAlertasSeg.Value(), KnobIntervalo.Value(), DescreveAlertaPilha, DescreveAlertaPilhaJson)){
+      fprintf(stderr, "Nao foi possivel criar a thread interna de alertas\n");
+      return(1);
+   }
+
+   // opção -relatorio: inicia os relatórios periódicos, também antes da função "Fim"
+   if(!RelatorioInicia(KnobRelatorio.Value(), "pilha-sombra", campos_relatorio, 7, ColetaContadores, KnobRelatorioMs.Value(), -1, 0)){
+      fprintf(stderr, "Nao foi possivel iniciar o relatorio periodico %s\n", KnobRelatorio.Value().c_str());
+      return(1);
+   }
+
+   // opção -stats: inicia a medição do custo da ferramenta
+   if(!EstatisticasInicia(KnobEstatisticas.Value(), "pilha-sombra", rotinas_medidas, 4, KnobAmostra.Value())){
+      fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+      return(1);
+   }
+
    // registra a função "Fim" para ser executada quando a aplicação for terminar
    PIN_AddFiniFunction(Fim, NULL);
 
@@ -0,0 +1,737 @@
+/*
+ *  Analisador dos traces do pinatrace_instrument, sem dependência do Pin.
+ *
+ *  O trace binário ("-mode buffer", "-mode async" ou "-mode bbl") é
+ *  mapeado com mmap e percorrido uma única vez, sem ser copiado para a
+ *  memória: traces maiores que a RAM são lidos sob demanda, e as páginas
+ *  já processadas são devolvidas ao sistema. Um trace no formato texto é
+ *  convertido uma única vez para o formato binário com "-convert".
+ *
+ *  Uma varredura inicial lê apenas os cabeçalhos dos blocos, carrega as
+ *  definições de BBLs e divide o trace em intervalos de "-w" acessos
+ *  consecutivos no arquivo (nos traces do modo "bbl", de "-w" palavras).
+ *  Os intervalos são distribuídos entre "-j" threads, cada uma com os seus
+ *  próprios acumuladores, somados ao final. São calculados:
+ *
+ *  - mapas de calor por página ("-p", bits do tamanho da página) e por
+ *    linha de cache ("-l"): leituras e escritas de cada uma;
+ *  - o working set ao longo do tempo: nº de páginas e de linhas distintas
+ *    acessadas em cada intervalo, por todas as threads do programa;
+ *  - leituras e escritas por instrução (ip).
+ *
+ *  Cada acesso é atribuído à linha e à página do seu endereço inicial.
+ *  A saída padrão recebe um resumo com as "-top" páginas, linhas e
+ *  instruções mais acessadas; com "-csv <prefixo>", as tabelas completas
+ *  são escritas em <prefixo>.paginas.csv, <prefixo>.linhas.csv,
+ *  <prefixo>.ips.csv e <prefixo>.ws.csv.
+ *
+ *  Compilação:
+ *      g++ -O2 -pthread -o pinatrace_analyze pinatrace_analyze.cpp
+ *
+ *  Uso:
+ *      pinatrace_analyze [-j threads] [-w acessos] [-p bits] [-l bits]
+ *                        [-top N] [-csv prefixo] <trace binário>
+ *      pinatrace_analyze -convert <trace texto> <trace binário>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "pinatrace_format.h"
+
+// Registros por bloco nos traces gerados por "-convert"
+static const size_t REGISTROS_POR_BLOCO = 4096;
+
+static void Uso()
+{
+    fprintf(stderr,
+            "Uso: pinatrace_analyze [-j threads] [-w acessos] [-p bits] [-l bits] [-top N] [-csv prefixo] <trace binario>\n"
+            "     pinatrace_analyze -convert <trace texto> <trace binario>\n");
+}
+
+/* ===================================================================== */
+/* Conversão do formato texto                                            */
+/* ===================================================================== */
+
+// Registros pendentes de uma thread do trace texto
+struct BlocoTexto
+{
+    uint64_t seq;
+    std::vector<PINATRACE_REC> registros;
+};
+
+static bool EscreveBloco(FILE *saida, uint32_t tid, BlocoTexto &bloco)
+{
+    PINATRACE_CHUNK cabecalho;
+    cabecalho.type = PINATRACE_CHUNK_MEMREF;
+    cabecalho.tid = tid;
+    cabecalho.seq = bloco.seq++;
+    cabecalho.count = bloco.registros.size();
+    bool ok = fwrite(&cabecalho, sizeof(cabecalho), 1, saida) == 1 &&
+              fwrite(&bloco.registros[0], sizeof(PINATRACE_REC), bloco.registros.size(), saida) == bloco.registros.size();
+    bloco.registros.clear();
+    return ok;
+}
+
+// Lê um endereço impresso com "%p" ("0x..." ou "(nil)")
+static bool LeEndereco(char *&p, uintptr_t &endereco)
+{
+    if (strncmp(p, "(nil)", 5) == 0)
+    {
+        endereco = 0;
+        p += 5;
+        return true;
+    }
+    char *fim;
+    endereco = (uintptr_t) strtoull(p, &fim, 16);
+    if (fim == p)
+        return false;
+    p = fim;
+    return true;
+}
+
+/**
+ * Converte um trace texto ("ip: R ea", terminado por "#eof") para o formato
+ * binário. Aceita também as linhas de pinatrace_decode: prefixadas pela
+ * thread ("-t") e com o tamanho do acesso ao final ("-s"). Sem o tamanho,
+ * os registros ficam com tamanho 0.
+ */
+static int Converte(const char *nomeEntrada, const char *nomeSaida)
+{
+    FILE *entrada = fopen(nomeEntrada, "r");
+    if (entrada == NULL)
+    {
+        perror(nomeEntrada);
+        return 1;
+    }
+    FILE *saida = fopen(nomeSaida, "wb");
+    if (saida == NULL)
+    {
+        perror(nomeSaida);
+        return 1;
+    }
+
+    PINATRACE_HEADER cabecalho;
+    cabecalho.magic = PINATRACE_MAGIC;
+    cabecalho.version = PINATRACE_VERSION;
+    cabecalho.addrSize = sizeof(uintptr_t);
+    bool ok = fwrite(&cabecalho, sizeof(cabecalho), 1, saida) == 1;
+
+    std::map<uint32_t, BlocoTexto> blocos;
+    char linha[256];
+    uint64_t numLinha = 0;
+    uint64_t registros = 0;
+    while (ok && fgets(linha, sizeof(linha), entrada) != NULL)
+    {
+        numLinha++;
+        char *p = linha;
+
+        // prefixo da thread: um número decimal seguido de espaço
+        uint32_t tid = 0;
+        char *fim;
+        unsigned long long valor = strtoull(p, &fim, 10);
+        if (fim != p && *fim == ' ')
+        {
+            tid = (uint32_t) valor;
+            p = fim + 1;
+        }
+
+        if (strncmp(p, "#eof", 4) == 0)
+            break;
+
+        PINATRACE_REC registro;
+        unsigned long long amostra, instrucoes;
+        if (sscanf(p, "#sample %llu %llu", &amostra, &instrucoes) == 2)
+        {
+            registro.ip = (uintptr_t) instrucoes;
+            registro.ea = (uintptr_t) amostra;
+            registro.size = 0;
+            registro.isWrite = PINATRACE_REC_SAMPLE;
+        }
+        else
+        {
+            if (!LeEndereco(p, registro.ip) || p[0] != ':' || p[1] != ' ' ||
+                (p[2] != 'R' && p[2] != 'W') || p[3] != ' ')
+            {
+                fprintf(stderr, "%s:%llu: linha invalida\n", nomeEntrada, (unsigned long long) numLinha);
+                return 1;
+            }
+            registro.isWrite = p[2] == 'W' ? PINATRACE_REC_WRITE : PINATRACE_REC_READ;
+            p += 4;
+            if (!LeEndereco(p, registro.ea))
+            {
+                fprintf(stderr, "%s:%llu: linha invalida\n", nomeEntrada, (unsigned long long) numLinha);
+                return 1;
+            }
+            registro.size = (uint32_t) strtoul(p, NULL, 10);
+        }
+
+        BlocoTexto &bloco = blocos[tid];
+        bloco.registros.push_back(registro);
+        registros++;
+        if (bloco.registros.size() == REGISTROS_POR_BLOCO)
+            ok = EscreveBloco(saida, tid, bloco);
+    }
+
+    for (std::map<uint32_t, BlocoTexto>::iterator it = blocos.begin(); ok && it != blocos.end(); it++)
+    {
+        if (!it->second.registros.empty())
+            ok = EscreveBloco(saida, it->first, it->second);
+    }
+
+    fclose(entrada);
+    if (fclose(saida) != 0 || !ok)
+    {
+        perror(nomeSaida);
+        return 1;
+    }
+    fprintf(stderr, "%s: %llu registros de %u thread(s)\n", nomeSaida, (unsigned long long) registros,
+            (unsigned) blocos.size());
+    return 0;
+}
+
+/* ===================================================================== */
+/* Análise                                                               */
+/* ===================================================================== */
+
+// Leituras e escritas de uma página, linha ou instrução
+struct Contagem
+{
+    uint64_t leituras;
+    uint64_t escritas;
+};
+
+typedef std::unordered_map<uintptr_t, Contagem> MapaContagens;
+
+// Um BBL definido por um bloco PINATRACE_CHUNK_BBLDEF
+struct Bbl
+{
+    uintptr_t address;
+    std::vector<PINATRACE_BBLOP> ops;
+};
+
+// Parte de um bloco: registros [primeiro, primeiro + quantidade) de um
+// bloco PINATRACE_CHUNK_MEMREF ou todas as palavras de um
+// PINATRACE_CHUNK_BBL. "inicio" é a posição do primeiro registro ou
+// palavra do bloco no arquivo.
+struct Item
+{
+    size_t inicio;
+    uint64_t primeiro;
+    uint64_t quantidade;
+    uint32_t tipo;
+};
+
+// Itens consecutivos do arquivo, processados por uma mesma thread.
+// [inicioArquivo, fimArquivo) é a faixa do arquivo que eles ocupam.
+struct Intervalo
+{
+    size_t primeiroItem;
+    size_t numItens;
+    size_t inicioArquivo;
+    size_t fimArquivo;
+};
+
+// Working set de um intervalo
+struct WorkingSet
+{
+    uint64_t acessos;
+    uint64_t paginas;
+    uint64_t linhas;
+};
+
+// Estado compartilhado pelas threads (somente leitura durante a análise,
+// exceto "proximo", "erro" e as posições de "workingSets")
+static struct
+{
+    const uint8_t *base;
+    std::vector<Bbl> bbls;             // indexados pelo identificador (o 0 não é usado)
+    std::vector<Item> itens;
+    std::vector<Intervalo> intervalos;
+    std::vector<WorkingSet> workingSets;
+    unsigned bitsPagina;
+    unsigned bitsLinha;
+    size_t proximo;                    // próximo intervalo a ser processado
+    volatile int erro;
+} analise;
+
+// Acumuladores de uma thread
+struct Acumulador
+{
+    MapaContagens linhas;              // a contagem das páginas é obtida das linhas ao final
+    MapaContagens ips;
+    std::unordered_set<uintptr_t> linhasIntervalo;
+    std::unordered_set<uintptr_t> paginasIntervalo;
+    uint64_t acessos;
+
+    // última linha acessada: acessos seguidos à mesma linha não consultam as tabelas
+    uintptr_t ultimaLinha;
+    Contagem *contagemUltimaLinha;
+};
+
+static inline void Registra(Acumulador &a, uintptr_t ip, uintptr_t ea, bool escrita)
+{
+    uintptr_t linha = ea >> analise.bitsLinha;
+    if (linha != a.ultimaLinha || a.contagemUltimaLinha == NULL)
+    {
+        a.ultimaLinha = linha;
+        a.contagemUltimaLinha = &a.linhas[linha];
+        a.linhasIntervalo.insert(linha);
+    }
+
+    Contagem &instrucao = a.ips[ip];
+    if (escrita)
+    {
+        a.contagemUltimaLinha->escritas++;
+        instrucao.escritas++;
+    }
+    else
+    {
+        a.contagemUltimaLinha->leituras++;
+        instrucao.leituras++;
+    }
+    a.acessos++;
+}
+
+// Processa um bloco PINATRACE_CHUNK_MEMREF (ou parte dele)
+static void ProcessaRegistros(Acumulador &a, const Item &item)
+{
+    const PINATRACE_REC *registros = (const PINATRACE_REC *) (analise.base + item.inicio) + item.primeiro;
+    for (uint64_t i = 0; i < item.quantidade; i++)
+    {
+        if (registros[i].isWrite != PINATRACE_REC_SAMPLE)
+            Registra(a, registros[i].ip, registros[i].ea, registros[i].isWrite == PINATRACE_REC_WRITE);
+    }
+}
+
+// Processa um bloco PINATRACE_CHUNK_BBL, como pinatrace_decode. Retorna
+// false se encontrar um BBL não definido.
+static bool ProcessaBbls(Acumulador &a, const Item &item)
+{
+    const uintptr_t *palavras = (const uintptr_t *) (analise.base + item.inicio);
+    for (uint64_t i = 0; i < item.quantidade; )
+    {
+        uintptr_t id = palavras[i++];
+        if (id == 0 || id >= analise.bbls.size() || analise.bbls[id].ops.empty() ||
+            i + analise.bbls[id].ops.size() > item.quantidade)
+        {
+            fprintf(stderr, "registro de BBL invalido (id %llu)\n", (unsigned long long) id);
+            return false;
+        }
+
+        const Bbl &bbl = analise.bbls[id];
+        for (size_t op = 0; op < bbl.ops.size(); op++, i++)
+        {
+            // endereço 0: o acesso não executou (ver pinatrace_format.h)
+            if (palavras[i] == 0)
+                continue;
+            Registra(a, bbl.address + bbl.ops[op].offset, palavras[i],
+                     bbl.ops[op].isWrite == PINATRACE_REC_WRITE);
+        }
+    }
+    return true;
+}
+
+// Corpo das threads: processa intervalos até que acabem
+static void *Trabalha(void *arg)
+{
+    Acumulador &a = *(Acumulador *) arg;
+    size_t tamPagina = sysconf(_SC_PAGESIZE);
+
+    for (;;)
+    {
+        size_t indice = __sync_fetch_and_add(&analise.proximo, 1);
+        if (indice >= analise.intervalos.size() || analise.erro)
+            break;
+
+        const Intervalo &intervalo = analise.intervalos[indice];
+        a.linhasIntervalo.clear();
+        a.paginasIntervalo.clear();
+        a.contagemUltimaLinha = NULL;
+        uint64_t acessosAntes = a.acessos;
+
+        for (size_t i = intervalo.primeiroItem; i < intervalo.primeiroItem + intervalo.numItens; i++)
+        {
+            const Item &item = analise.itens[i];
+            if (item.tipo == PINATRACE_CHUNK_MEMREF)
+                ProcessaRegistros(a, item);
+            else if (!ProcessaBbls(a, item))
+            {
+                analise.erro = 1;
+                return NULL;
+            }
+        }
+
+        // as páginas do intervalo são obtidas das suas linhas
+        for (std::unordered_set<uintptr_t>::iterator it = a.linhasIntervalo.begin(); it != a.linhasIntervalo.end(); it++)
+            a.paginasIntervalo.insert(*it >> (analise.bitsPagina - analise.bitsLinha));
+
+        WorkingSet &ws = analise.workingSets[indice];
+        ws.acessos = a.acessos - acessosAntes;
+        ws.linhas = a.linhasIntervalo.size();
+        ws.paginas = a.paginasIntervalo.size();
+
+        // devolve ao sistema as páginas do arquivo já processadas
+        size_t inicio = (intervalo.inicioArquivo + tamPagina - 1) / tamPagina * tamPagina;
+        size_t fim = intervalo.fimArquivo / tamPagina * tamPagina;
+        if (fim > inicio)
+            madvise((void *) (analise.base + inicio), fim - inicio, MADV_DONTNEED);
+    }
+    return NULL;
+}
+
+/**
+ * Percorre os cabeçalhos dos blocos, carrega as definições de BBLs e
+ * divide o trace em itens e intervalos de "porIntervalo" acessos (ou
+ * palavras, nos blocos de BBLs). Blocos de BBLs não são divididos: um
+ * intervalo termina no primeiro bloco que o completa. Retorna false se o
+ * arquivo for inválido; um último bloco incompleto é ignorado com um aviso.
+ */
+static bool Indexa(const char *nome, size_t tamanho, uint64_t porIntervalo)
+{
+    const uint8_t *base = analise.base;
+    size_t pos = sizeof(PINATRACE_HEADER);
+    uint64_t noIntervalo = 0;
+    Intervalo atual;
+    atual.primeiroItem = 0;
+    atual.numItens = 0;
+    atual.inicioArquivo = pos;
+
+    while (pos + sizeof(PINATRACE_CHUNK) <= tamanho)
+    {
+        const PINATRACE_CHUNK *bloco = (const PINATRACE_CHUNK *) (base + pos);
+        size_t inicio = pos + sizeof(PINATRACE_CHUNK);
+        size_t tamRegistro;
+        if (bloco->type == PINATRACE_CHUNK_MEMREF)
+            tamRegistro = sizeof(PINATRACE_REC);
+        else if (bloco->type == PINATRACE_CHUNK_BBL)
+            tamRegistro = sizeof(uintptr_t);
+        else if (bloco->type == PINATRACE_CHUNK_BBLDEF)
+            tamRegistro = sizeof(PINATRACE_BBLOP);
+        else
+        {
+            fprintf(stderr, "%s: bloco de tipo desconhecido (%u)\n", nome, bloco->type);
+            return false;
+        }
+
+        size_t fim = inicio + (bloco->type == PINATRACE_CHUNK_BBLDEF ? sizeof(PINATRACE_BBLDEF) : 0) +
+                     bloco->count * tamRegistro;
+        if (bloco->count > tamanho || fim > tamanho)
+        {
+            fprintf(stderr, "%s: arquivo truncado; o ultimo bloco foi ignorado\n", nome);
+            break;
+        }
+        pos = fim;
+
+        if (bloco->type == PINATRACE_CHUNK_BBLDEF)
+        {
+            const PINATRACE_BBLDEF *definicao = (const PINATRACE_BBLDEF *) (base + inicio);
+            if (definicao->numOps != bloco->count)
+            {
+                fprintf(stderr, "%s: definicao de BBL invalida\n", nome);
+                return false;
+            }
+            if (analise.bbls.size() <= definicao->id)
+                analise.bbls.resize(definicao->id + 1);
+            Bbl &bbl = analise.bbls[definicao->id];
+            bbl.address = definicao->address;
+            const PINATRACE_BBLOP *ops = (const PINATRACE_BBLOP *) (definicao + 1);
+            bbl.ops.assign(ops, ops + definicao->numOps);
+            continue;
+        }
+
+        // divide o bloco nos limites dos intervalos (só os de registros)
+        uint64_t primeiro = 0;
+        while (primeiro < bloco->count)
+        {
+            Item item;
+            item.inicio = inicio;
+            item.primeiro = primeiro;
+            item.tipo = bloco->type;
+            item.quantidade = bloco->count - primeiro;
+            if (bloco->type == PINATRACE_CHUNK_MEMREF && item.quantidade > porIntervalo - noIntervalo)
+                item.quantidade = porIntervalo - noIntervalo;
+
+            analise.itens.push_back(item);
+            atual.numItens++;
+            noIntervalo += item.quantidade;
+            primeiro += item.quantidade;
+
+            if (noIntervalo >= porIntervalo)
+            {
+                atual.fimArquivo = inicio + primeiro * tamRegistro;
+                analise.intervalos.push_back(atual);
+                atual.primeiroItem = analise.itens.size();
+                atual.numItens = 0;
+                atual.inicioArquivo = atual.fimArquivo;
+                noIntervalo = 0;
+            }
+        }
+    }
+
+    if (atual.numItens > 0)
+    {
+        atual.fimArquivo = pos;
+        analise.intervalos.push_back(atual);
+    }
+    return true;
+}
+
+// Soma as contagens de "origem" em "destino"
+static void Soma(MapaContagens &destino, const MapaContagens &origem)
+{
+    for (MapaContagens::const_iterator it = origem.begin(); it != origem.end(); it++)
+    {
+        Contagem &c = destino[it->first];
+        c.leituras += it->second.leituras;
+        c.escritas += it->second.escritas;
+    }
+}
+
+typedef std::pair<uintptr_t, Contagem> Linha;
+
+static bool MaisAcessada(const Linha &a, const Linha &b)
+{
+    uint64_t totalA = a.second.leituras + a.second.escritas;
+    uint64_t totalB = b.second.leituras + b.second.escritas;
+    return totalA != totalB ? totalA > totalB : a.first < b.first;
+}
+
+// Imprime as "top" entradas mais acessadas de "tabela" (ordenada)
+static void ImprimeTopo(const char *titulo, const std::vector<Linha> &tabela, size_t top, unsigned bits,
+                        uint64_t acessos)
+{
+    printf("\n%s (%llu distintas)\n", titulo, (unsigned long long) tabela.size());
+    printf("%18s %14s %7s %14s %14s\n", "endereco", "acessos", "%", "leituras", "escritas");
+    for (size_t i = 0; i < tabela.size() && i < top; i++)
+    {
+        uint64_t total = tabela[i].second.leituras + tabela[i].second.escritas;
+        printf("%#18llx %14llu %6.2f%% %14llu %14llu\n", (unsigned long long) tabela[i].first << bits,
+               (unsigned long long) total, 100.0 * total / acessos,
+               (unsigned long long) tabela[i].second.leituras, (unsigned long long) tabela[i].second.escritas);
+    }
+}
+
+// Escreve uma tabela completa em CSV
+static bool EscreveCsv(const std::string &nome, const std::vector<Linha> &tabela, unsigned bits)
+{
+    FILE *saida = fopen(nome.c_str(), "w");
+    if (saida == NULL)
+    {
+        perror(nome.c_str());
+        return false;
+    }
+    fprintf(saida, "endereco,leituras,escritas\n");
+    for (size_t i = 0; i < tabela.size(); i++)
+        fprintf(saida, "%#llx,%llu,%llu\n", (unsigned long long) tabela[i].first << bits,
+                (unsigned long long) tabela[i].second.leituras, (unsigned long long) tabela[i].second.escritas);
+    return fclose(saida) == 0;
+}
+
+static std::vector<Linha> Ordena(const MapaContagens &mapa)
+{
+    std::vector<Linha> tabela(mapa.begin(), mapa.end());
+    std::sort(tabela.begin(), tabela.end(), MaisAcessada);
+    return tabela;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "-convert") == 0)
+        return Converte(argv[2], argv[3]);
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t porIntervalo = 1000000;
+    unsigned bitsPagina = 12;
+    unsigned bitsLinha = 6;
+    size_t top = 20;
+    const char *prefixoCsv = NULL;
+
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        const char *valor = argv[arg + 1];
+        if (strcmp(argv[arg], "-j") == 0)
+            threads = atol(valor);
+        else if (strcmp(argv[arg], "-w") == 0)
+            porIntervalo = strtoull(valor, NULL, 10);
+        else if (strcmp(argv[arg], "-p") == 0)
+            bitsPagina = atoi(valor);
+        else if (strcmp(argv[arg], "-l") == 0)
+            bitsLinha = atoi(valor);
+        else if (strcmp(argv[arg], "-top") == 0)
+            top = atol(valor);
+        else if (strcmp(argv[arg], "-csv") == 0)
+            prefixoCsv = valor;
+        else
+            break;
+    }
+    if (arg + 1 != argc || threads < 1 || porIntervalo == 0 || bitsLinha > bitsPagina || bitsPagina >= 64)
+    {
+        Uso();
+        return 1;
+    }
+    const char *nome = argv[arg];
+
+    int fd = open(nome, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+    {
+        perror(nome);
+        return 1;
+    }
+    size_t tamanho = info.st_size;
+
+    // valida o cabeçalho do arquivo
+    PINATRACE_HEADER cabecalho;
+    if (tamanho < sizeof(cabecalho) || pread(fd, &cabecalho, sizeof(cabecalho), 0) != sizeof(cabecalho) ||
+        cabecalho.magic != PINATRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: nao e um trace binario do pinatrace (traces texto: use -convert)\n", nome);
+        return 1;
+    }
+    if (cabecalho.version < 1 || cabecalho.version > PINATRACE_VERSION ||
+        cabecalho.addrSize != sizeof(uintptr_t))
+    {
+        fprintf(stderr, "%s: versao %u com enderecos de %u bytes nao suportada\n",
+                nome, cabecalho.version, cabecalho.addrSize);
+        return 1;
+    }
+
+    void *mapa = mmap(NULL, tamanho, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapa == MAP_FAILED)
+    {
+        perror(nome);
+        return 1;
+    }
+    madvise(mapa, tamanho, MADV_SEQUENTIAL);
+    analise.base = (const uint8_t *) mapa;
+    analise.bitsPagina = bitsPagina;
+    analise.bitsLinha = bitsLinha;
+
+    if (!Indexa(nome, tamanho, porIntervalo))
+        return 1;
+    analise.workingSets.resize(analise.intervalos.size());
+
+    // cada thread processa intervalos inteiros, com os seus próprios acumuladores
+    if ((size_t) threads > analise.intervalos.size())
+        threads = analise.intervalos.size() > 0 ? analise.intervalos.size() : 1;
+    std::vector<Acumulador> acumuladores(threads);
+    std::vector<pthread_t> ids(threads);
+    for (long t = 0; t < threads; t++)
+    {
+        acumuladores[t].acessos = 0;
+        acumuladores[t].contagemUltimaLinha = NULL;
+        if (pthread_create(&ids[t], NULL, Trabalha, &acumuladores[t]) != 0)
+        {
+            fprintf(stderr, "nao foi possivel criar as threads\n");
+            return 1;
+        }
+    }
+    for (long t = 0; t < threads; t++)
+        pthread_join(ids[t], NULL);
+    if (analise.erro)
+        return 1;
+
+    // soma os acumuladores das threads no primeiro
+    Acumulador &total = acumuladores[0];
+    for (long t = 1; t < threads; t++)
+    {
+        Soma(total.linhas, acumuladores[t].linhas);
+        Soma(total.ips, acumuladores[t].ips);
+        total.acessos += acumuladores[t].acessos;
+        MapaContagens().swap(acumuladores[t].linhas);
+        MapaContagens().swap(acumuladores[t].ips);
+    }
+
+    MapaContagens paginas;
+    uint64_t leituras = 0;
+    for (MapaContagens::iterator it = total.linhas.begin(); it != total.linhas.end(); it++)
+    {
+        Contagem &c = paginas[it->first >> (bitsPagina - bitsLinha)];
+        c.leituras += it->second.leituras;
+        c.escritas += it->second.escritas;
+        leituras += it->second.leituras;
+    }
+
+    std::vector<Linha> tabelaPaginas = Ordena(paginas);
+    std::vector<Linha> tabelaLinhas = Ordena(total.linhas);
+    std::vector<Linha> tabelaIps = Ordena(total.ips);
+
+    printf("%s: %llu acessos (%llu leituras, %llu escritas), %llu intervalo(s) de %llu, %ld thread(s)\n",
+           nome, (unsigned long long) total.acessos, (unsigned long long) leituras,
+           (unsigned long long) (total.acessos - leituras), (unsigned long long) analise.intervalos.size(),
+           (unsigned long long) porIntervalo, threads);
+    if (total.acessos == 0)
+        return 0;
+
+    ImprimeTopo("Paginas mais acessadas", tabelaPaginas, top, bitsPagina, total.acessos);
+    ImprimeTopo("Linhas mais acessadas", tabelaLinhas, top, bitsLinha, total.acessos);
+
+    printf("\nInstrucoes mais acessadas (%llu distintas)\n", (unsigned long long) tabelaIps.size());
+    printf("%18s %14s %7s %14s %14s %8s\n", "ip", "acessos", "%", "leituras", "escritas", "% escr.");
+    for (size_t i = 0; i < tabelaIps.size() && i < top; i++)
+    {
+        const Contagem &c = tabelaIps[i].second;
+        uint64_t acessos = c.leituras + c.escritas;
+        printf("%#18llx %14llu %6.2f%% %14llu %14llu %7.2f%%\n", (unsigned long long) tabelaIps[i].first,
+               (unsigned long long) acessos, 100.0 * acessos / total.acessos, (unsigned long long) c.leituras,
+               (unsigned long long) c.escritas, 100.0 * c.escritas / acessos);
+    }
+
+    // working set: resumo na saída padrão, série completa no CSV
+    uint64_t maxPaginas = 0, maxLinhas = 0, somaPaginas = 0, somaLinhas = 0;
+    for (size_t i = 0; i < analise.workingSets.size(); i++)
+    {
+        maxPaginas = std::max(maxPaginas, analise.workingSets[i].paginas);
+        maxLinhas = std::max(maxLinhas, analise.workingSets[i].linhas);
+        somaPaginas += analise.workingSets[i].paginas;
+        somaLinhas += analise.workingSets[i].linhas;
+    }
+    printf("\nWorking set por intervalo: paginas media %.1f, maximo %llu; linhas media %.1f, maximo %llu\n",
+           (double) somaPaginas / analise.workingSets.size(), (unsigned long long) maxPaginas,
+           (double) somaLinhas / analise.workingSets.size(), (unsigned long long) maxLinhas);
+
+    if (prefixoCsv != NULL)
+    {
+        std::string prefixo = prefixoCsv;
+        if (!EscreveCsv(prefixo + ".paginas.csv", tabelaPaginas, bitsPagina) ||
+            !EscreveCsv(prefixo + ".linhas.csv", tabelaLinhas, bitsLinha) ||
+            !EscreveCsv(prefixo + ".ips.csv", tabelaIps, 0))
+            return 1;
+
+        std::string nomeWs = prefixo + ".ws.csv";
+        FILE *saida = fopen(nomeWs.c_str(), "w");
+        if (saida == NULL)
+        {
+            perror(nomeWs.c_str());
+            return 1;
+        }
+        fprintf(saida, "intervalo,acessos,paginas,linhas\n");
+        for (size_t i = 0; i < analise.workingSets.size(); i++)
+            fprintf(saida, "%llu,%llu,%llu,%llu\n", (unsigned long long) i,
+                    (unsigned long long) analise.workingSets[i].acessos,
+                    (unsigned long long) analise.workingSets[i].paginas,
+                    (unsigned long long) analise.workingSets[i].linhas);
+        if (fclose(saida) != 0)
+        {
+            perror(nomeWs.c_str());
+            return 1;
+        }
+    }
+
+    munmap(mapa, tamanho);
+    close(fd);
+    return 0;
+}
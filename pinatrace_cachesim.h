@@ -0,0 +1,471 @@
+/*
+ *  Simulador de caches e de distância de reúso usado pelo modo "-mode sim"
+ *  do pinatrace_instrument.
+ *
+ *  Não depende do Pin: recebe os acessos (ip, endereço, tamanho) já
+ *  extraídos dos buffers de trace. Cada thread tem o seu próprio
+ *  simulador, sem travas; os resultados das threads são somados ao final
+ *  (CacheSimStats), como se cada thread executasse em um núcleo com
+ *  caches privadas.
+ *
+ *  - Hierarquia de caches associativas por conjunto, com substituição
+ *    LRU, descrita por uma lista "tamanho:vias:linha" por nível (ex.:
+ *    "32K:8:64,256K:8:64,8M:16:64"). Um acesso que falha em um nível
+ *    segue para o seguinte; escritas são tratadas como leituras
+ *    (write-allocate, sem modelar write-back).
+ *  - Distância de reúso, em linhas do primeiro nível: nº de linhas
+ *    distintas acessadas entre dois acessos à mesma linha. Calculada em
+ *    O(log n) por acesso com uma árvore de Fenwick indexada pelo instante
+ *    do último acesso a cada linha, compactada quando os instantes se
+ *    esgotam. O histograma usa faixas de potências de 2.
+ *  - Falhas por instrução (ip), para listar as instruções que mais falham.
+ */
+
+#ifndef PINATRACE_CACHESIM_H
+#define PINATRACE_CACHESIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+// Nº de faixas do histograma de distâncias: 0, 1, 2-3, 4-7, ..., >= 2^62
+static const unsigned REUSE_BUCKETS = 64;
+
+// Configuração de um nível de cache
+struct CacheLevelConfig
+{
+    uint64_t size;      // tamanho em bytes
+    uint32_t ways;      // associatividade
+    uint32_t lineSize;  // tamanho da linha em bytes (potência de 2)
+};
+
+/**
+ * Lê uma lista "tamanho:vias:linha,..." (tamanhos com sufixos K, M ou G).
+ * Retorna false se a lista for inválida.
+ */
+static bool ParseCacheConfig(const std::string &text, std::vector<CacheLevelConfig> &levels)
+{
+    levels.clear();
+    size_t pos = 0;
+    while (pos <= text.size())
+    {
+        size_t end = text.find(',', pos);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(pos, end - pos);
+
+        char *p;
+        CacheLevelConfig c;
+        c.size = strtoull(item.c_str(), &p, 10);
+        if (*p == 'K' || *p == 'k')
+            c.size <<= 10, p++;
+        else if (*p == 'M' || *p == 'm')
+            c.size <<= 20, p++;
+        else if (*p == 'G' || *p == 'g')
+            c.size <<= 30, p++;
+        if (*p++ != ':')
+            return false;
+        c.ways = (uint32_t) strtoul(p, &p, 10);
+        if (*p++ != ':')
+            return false;
+        c.lineSize = (uint32_t) strtoul(p, &p, 10);
+        if (*p != '\0')
+            return false;
+
+        // o nº de conjuntos precisa ser uma potência de 2 não nula
+        if (c.ways == 0 || c.lineSize == 0 || (c.lineSize & (c.lineSize - 1)) != 0 ||
+            c.size % ((uint64_t) c.ways * c.lineSize) != 0)
+            return false;
+        uint64_t sets = c.size / ((uint64_t) c.ways * c.lineSize);
+        if (sets == 0 || (sets & (sets - 1)) != 0)
+            return false;
+
+        levels.push_back(c);
+        pos = end + 1;
+    }
+    return !levels.empty();
+}
+
+static unsigned Log2(uint64_t x)
+{
+    unsigned n = 0;
+    while (x >>= 1)
+        n++;
+    return n;
+}
+
+/**
+ * Tabela de espalhamento (endereçamento aberto) de chaves de 64 bits para
+ * valores de 64 bits, usada para os instantes de acesso às linhas e para
+ * os índices das instruções. Não remove chaves.
+ */
+class HashU64
+{
+  public:
+    HashU64() : used(0) { Resize(1024); }
+
+    // Retorna o valor da chave, inserindo-a com "absent" se não existir.
+    // "inserted" indica se a chave foi inserida.
+    uint64_t &FindOrInsert(uint64_t key, uint64_t absent, bool &inserted)
+    {
+        if (2 * (used + 1) > keys.size())
+            Resize(2 * keys.size());
+
+        size_t i = Slot(key);
+        inserted = !full[i];
+        if (inserted)
+        {
+            full[i] = 1;
+            keys[i] = key;
+            values[i] = absent;
+            used++;
+        }
+        return values[i];
+    }
+
+    // Chama "f(chave, valor)" para todas as chaves
+    template <class F> void ForEach(F &f)
+    {
+        for (size_t i = 0; i < keys.size(); i++)
+            if (full[i])
+                f(keys[i], values[i]);
+    }
+
+    size_t Size() const { return used; }
+
+  private:
+    size_t Slot(uint64_t key) const
+    {
+        size_t mask = keys.size() - 1;
+        size_t i = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 20) & mask;
+        while (full[i] && keys[i] != key)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void Resize(size_t n)
+    {
+        std::vector<uint64_t> oldKeys, oldValues;
+        std::vector<uint8_t> oldFull;
+        oldKeys.swap(keys);
+        oldValues.swap(values);
+        oldFull.swap(full);
+
+        keys.assign(n, 0);
+        values.assign(n, 0);
+        full.assign(n, 0);
+        for (size_t i = 0; i < oldKeys.size(); i++)
+        {
+            if (oldFull[i])
+            {
+                size_t j = Slot(oldKeys[i]);
+                full[j] = 1;
+                keys[j] = oldKeys[i];
+                values[j] = oldValues[i];
+            }
+        }
+    }
+
+    std::vector<uint64_t> keys;
+    std::vector<uint64_t> values;
+    std::vector<uint8_t> full;
+    size_t used;
+};
+
+/**
+ * Um nível de cache associativa por conjunto com substituição LRU. As
+ * vias de cada conjunto ficam em ordem de uso, da mais recente para a
+ * menos recente; como a associatividade é pequena, a busca é linear.
+ */
+class CacheLevel
+{
+  public:
+    explicit CacheLevel(const CacheLevelConfig &c)
+        : config(c), lineShift(Log2(c.lineSize)), ways(c.ways),
+          setMask(c.size / ((uint64_t) c.ways * c.lineSize) - 1),
+          tags((setMask + 1) * c.ways, ~0ULL), accesses(0), misses(0)
+    {
+    }
+
+    // Acessa a linha que contém "addr". Retorna true em caso de acerto.
+    bool Access(uint64_t addr)
+    {
+        uint64_t line = addr >> lineShift;
+        uint64_t *set = &tags[(line & setMask) * ways];
+        accesses++;
+
+        uint32_t i = 0;
+        while (i < ways && set[i] != line)
+            i++;
+
+        bool hit = i < ways;
+        if (!hit)
+        {
+            misses++;
+            i = ways - 1;   // a via menos recente é substituída
+        }
+
+        for (; i > 0; i--)
+            set[i] = set[i - 1];
+        set[0] = line;
+        return hit;
+    }
+
+    const CacheLevelConfig config;
+    const unsigned lineShift;
+    const uint32_t ways;
+    const uint64_t setMask;
+
+  private:
+    std::vector<uint64_t> tags;    // linhas de cada conjunto (~0: via vazia)
+
+  public:
+    uint64_t accesses;
+    uint64_t misses;
+};
+
+/**
+ * Distância de reúso. Cada linha guarda o instante do seu último acesso,
+ * e a árvore de Fenwick marca os instantes que ainda são o último acesso
+ * de alguma linha: a distância de um acesso é o nº de marcas entre o
+ * último acesso à linha e o instante atual. Quando os instantes se
+ * esgotam, as linhas são renumeradas na ordem dos seus últimos acessos.
+ */
+class ReuseDistance
+{
+  public:
+    ReuseDistance() : cold(0), now(0)
+    {
+        std::fill(histogram, histogram + REUSE_BUCKETS, 0);
+        tree.assign(1 << 16, 0);
+    }
+
+    void Access(uint64_t line)
+    {
+        if (now == tree.size())
+            Compact();
+
+        bool inserted;
+        uint64_t &last = lastAccess.FindOrInsert(line, 0, inserted);
+        if (inserted)
+            cold++;
+        else
+        {
+            uint64_t distance = Prefix(now) - Prefix(last + 1);
+            histogram[distance == 0 ? 0 : 1 + Log2(distance)]++;
+            Add(last, -1);
+        }
+
+        last = now;
+        Add(now, 1);
+        now++;
+    }
+
+    uint64_t histogram[REUSE_BUCKETS];  // faixa 0: distância 0; faixa b > 0: [2^(b-1), 2^b)
+    uint64_t cold;                      // primeiros acessos às linhas
+
+  private:
+    // soma das marcas nos instantes [0, end)
+    int64_t Prefix(uint64_t end) const
+    {
+        int64_t sum = 0;
+        for (uint64_t i = end; i > 0; i &= i - 1)
+            sum += tree[i - 1];
+        return sum;
+    }
+
+    void Add(uint64_t pos, int64_t delta)
+    {
+        for (uint64_t i = pos + 1; i <= tree.size(); i += i & (~i + 1))
+            tree[i - 1] += delta;
+    }
+
+    struct Renumber
+    {
+        std::vector<std::pair<uint64_t, uint64_t *> > order;
+        void operator()(uint64_t, uint64_t &last) { order.push_back(std::make_pair(last, &last)); }
+    };
+
+    // Renumera os últimos acessos em 0..n-1, mantendo a ordem, e reconstrói
+    // a árvore. Dobra o nº de instantes se mais da metade estiver em uso.
+    void Compact()
+    {
+        Renumber r;
+        lastAccess.ForEach(r);
+        std::sort(r.order.begin(), r.order.end());
+
+        uint64_t n = r.order.size();
+        size_t size = tree.size();
+        if (2 * n > size)
+            size *= 2;
+
+        tree.assign(size, 0);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            *r.order[i].second = i;
+            Add(i, 1);
+        }
+        now = n;
+    }
+
+    HashU64 lastAccess;          // linha -> instante do último acesso
+    std::vector<int64_t> tree;   // árvore de Fenwick sobre os instantes
+    uint64_t now;                // instante do próximo acesso
+};
+
+// Falhas de uma instrução
+struct IpMisses
+{
+    uint64_t first;  // falhas no primeiro nível
+    uint64_t last;   // falhas no último nível
+};
+
+// Resultados somados de vários simuladores
+struct CacheSimStats
+{
+    std::vector<CacheLevelConfig> config;
+    std::vector<uint64_t> accesses;        // por nível
+    std::vector<uint64_t> misses;          // por nível
+    std::map<uint64_t, IpMisses> ipMisses;
+    uint64_t histogram[REUSE_BUCKETS];
+    uint64_t cold;
+
+    explicit CacheSimStats(const std::vector<CacheLevelConfig> &levels)
+        : config(levels), accesses(levels.size(), 0), misses(levels.size(), 0), cold(0)
+    {
+        std::fill(histogram, histogram + REUSE_BUCKETS, 0);
+    }
+};
+
+/**
+ * Simulador de uma thread: hierarquia de caches, distância de reúso e
+ * falhas por instrução.
+ */
+class CacheSim
+{
+  public:
+    explicit CacheSim(const std::vector<CacheLevelConfig> &levels)
+    {
+        for (size_t i = 0; i < levels.size(); i++)
+            caches.push_back(new CacheLevel(levels[i]));
+    }
+
+    ~CacheSim()
+    {
+        for (size_t i = 0; i < caches.size(); i++)
+            delete caches[i];
+    }
+
+    // Simula um acesso de "size" bytes, dividido nas linhas do primeiro nível que ele toca
+    void Access(uint64_t ip, uint64_t addr, uint32_t size)
+    {
+        unsigned shift = caches[0]->lineShift;
+        uint64_t firstLine = addr >> shift;
+        uint64_t lastLine = (addr + (size > 0 ? size - 1 : 0)) >> shift;
+
+        for (uint64_t line = firstLine; line <= lastLine; line++)
+        {
+            reuse.Access(line);
+
+            uint64_t a = line << shift;
+            size_t level = 0;
+            while (level < caches.size() && !caches[level]->Access(a))
+                level++;
+
+            if (level > 0)
+            {
+                bool inserted;
+                uint64_t &index = ipIndex.FindOrInsert(ip, ipMisses.size(), inserted);
+                if (inserted)
+                {
+                    IpMisses m = {0, 0};
+                    ipMisses.push_back(m);
+                    ipList.push_back(ip);
+                }
+                ipMisses[index].first++;
+                if (level == caches.size())
+                    ipMisses[index].last++;
+            }
+        }
+    }
+
+    // Soma os resultados desta thread em "stats"
+    void MergeInto(CacheSimStats &stats) const
+    {
+        for (size_t i = 0; i < caches.size(); i++)
+        {
+            stats.accesses[i] += caches[i]->accesses;
+            stats.misses[i] += caches[i]->misses;
+        }
+        for (size_t i = 0; i < ipList.size(); i++)
+        {
+            IpMisses &m = stats.ipMisses[ipList[i]];
+            m.first += ipMisses[i].first;
+            m.last += ipMisses[i].last;
+        }
+        for (unsigned b = 0; b < REUSE_BUCKETS; b++)
+            stats.histogram[b] += reuse.histogram[b];
+        stats.cold += reuse.cold;
+    }
+
+  private:
+    std::vector<CacheLevel *> caches;
+    ReuseDistance reuse;
+    HashU64 ipIndex;                  // ip -> índice em ipMisses
+    std::vector<IpMisses> ipMisses;
+    std::vector<uint64_t> ipList;     // ip de cada índice
+};
+
+static bool CompareLastMisses(const std::pair<uint64_t, IpMisses> &a, const std::pair<uint64_t, IpMisses> &b)
+{
+    if (a.second.last != b.second.last)
+        return a.second.last > b.second.last;
+    return a.second.first > b.second.first;
+}
+
+/**
+ * Escreve o relatório: taxa de falhas por nível, as "top" instruções com
+ * mais falhas no último nível e o histograma de distâncias de reúso.
+ */
+static void WriteCacheSimReport(FILE *out, const CacheSimStats &stats, size_t top)
+{
+    fprintf(out, "# cache simulation\n");
+    fprintf(out, "# level size ways line accesses misses miss_rate\n");
+    for (size_t i = 0; i < stats.config.size(); i++)
+    {
+        fprintf(out, "L%u %llu %u %u %llu %llu %.6f\n", (unsigned)(i + 1),
+                (unsigned long long) stats.config[i].size, stats.config[i].ways, stats.config[i].lineSize,
+                (unsigned long long) stats.accesses[i], (unsigned long long) stats.misses[i],
+                stats.accesses[i] ? (double) stats.misses[i] / stats.accesses[i] : 0.0);
+    }
+
+    std::vector<std::pair<uint64_t, IpMisses> > ips(stats.ipMisses.begin(), stats.ipMisses.end());
+    std::sort(ips.begin(), ips.end(), CompareLastMisses);
+    if (ips.size() > top)
+        ips.resize(top);
+
+    fprintf(out, "# top %u missing ips: ip L1_misses L%u_misses\n", (unsigned) ips.size(),
+            (unsigned) stats.config.size());
+    for (size_t i = 0; i < ips.size(); i++)
+        fprintf(out, "%p %llu %llu\n", (void *)(uintptr_t) ips[i].first,
+                (unsigned long long) ips[i].second.first, (unsigned long long) ips[i].second.last);
+
+    fprintf(out, "# reuse distance (%u-byte lines): distance count\n", stats.config[0].lineSize);
+    fprintf(out, "cold %llu\n", (unsigned long long) stats.cold);
+    for (unsigned b = 0; b < REUSE_BUCKETS; b++)
+    {
+        if (stats.histogram[b] == 0)
+            continue;
+        if (b <= 1)
+            fprintf(out, "%u %llu\n", b, (unsigned long long) stats.histogram[b]);
+        else
+            fprintf(out, "%llu-%llu %llu\n", 1ULL << (b - 1), (1ULL << b) - 1,
+                    (unsigned long long) stats.histogram[b]);
+    }
+    fprintf(out, "#eof\n");
+}
+
+#endif // PINATRACE_CACHESIM_H
@@ -0,0 +1,223 @@
+/*
+ *  Decodificador do trace binário gerado pelo pinatrace_instrument
+ *  (opções "-mode buffer", "-mode async" e "-mode bbl"). Converte os
+ *  registros de volta para o formato texto original ("ip: R ea",
+ *  terminado por "#eof").
+ *
+ *  Não depende do Pin. Compilação:
+ *      g++ -O2 -o pinatrace_decode pinatrace_decode.cpp
+ *
+ *  Uso:
+ *      pinatrace_decode [-t] [-s] <trace binário> [<saída texto>]
+ *
+ *  Com "-t", cada linha é prefixada pelo identificador da thread ("3 0x...:
+ *  R 0x..."), o que permite separar as threads de um arquivo combinado.
+ *  Com "-s", o tamanho do acesso em bytes é acrescentado ao fim da linha
+ *  ("0x...: R 0x... 8").
+ *
+ *  Nos traces do modo "bbl", cada execução de BBL é expandida em uma linha
+ *  por acesso, usando as definições dos BBLs gravadas no próprio arquivo.
+ *  Acessos com endereço 0, que não executaram (instruções com predicado,
+ *  instruções REP sem nenhuma iteração e acessos posteriores a uma falha
+ *  no meio do BBL), são omitidos; de uma instrução REP, só a
+ *  primeira iteração é impressa.
+ *
+ *  Nos traces amostrados (opção -sample_skip), o início de cada amostra é
+ *  impresso como "#sample <amostra> <instruções>" (com "-t", precedido do
+ *  identificador da thread, como no modo texto).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "pinatrace_format.h"
+
+// Quantidade de registros lidos do arquivo por vez
+static const size_t REGISTROS_POR_LEITURA = 4096;
+
+static void Uso()
+{
+    fprintf(stderr, "Uso: pinatrace_decode [-t] [-s] <trace binario> [<saida texto>]\n");
+}
+
+// Um BBL definido por um bloco PINATRACE_CHUNK_BBLDEF
+struct Bbl
+{
+    uintptr_t address;
+    std::vector<PINATRACE_BBLOP> ops;
+};
+
+static void ImprimeAcesso(FILE *saida, bool imprimeThread, bool imprimeTamanho, uint32_t tid,
+                          uintptr_t ip, uint32_t isWrite, uintptr_t ea, uint32_t tamanho)
+{
+    if (imprimeThread)
+        fprintf(saida, "%u ", tid);
+    fprintf(saida, "%p: %c %p", (void *) ip, isWrite ? 'W' : 'R', (void *) ea);
+    if (imprimeTamanho)
+        fprintf(saida, " %u", tamanho);
+    fputc('\n', saida);
+}
+
+int main(int argc, char *argv[])
+{
+    bool imprimeThread = false;
+    bool imprimeTamanho = false;
+    while (argc > 1 && (strcmp(argv[1], "-t") == 0 || strcmp(argv[1], "-s") == 0))
+    {
+        if (argv[1][1] == 't')
+            imprimeThread = true;
+        else
+            imprimeTamanho = true;
+        argv++;
+        argc--;
+    }
+
+    if (argc < 2 || argc > 3)
+    {
+        Uso();
+        return 1;
+    }
+
+    FILE *entrada = fopen(argv[1], "rb");
+    if (entrada == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    FILE *saida = stdout;
+    if (argc == 3 && (saida = fopen(argv[2], "w")) == NULL)
+    {
+        perror(argv[2]);
+        return 1;
+    }
+
+    // valida o cabeçalho do arquivo
+    PINATRACE_HEADER cabecalho;
+    if (fread(&cabecalho, sizeof(cabecalho), 1, entrada) != 1 ||
+        cabecalho.magic != PINATRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: nao e um trace binario do pinatrace\n", argv[1]);
+        return 1;
+    }
+    // a versão 1 difere apenas por não ter registros de amostra, e a 2 por
+    // não ter os blocos do modo "bbl"
+    if (cabecalho.version < 1 || cabecalho.version > PINATRACE_VERSION ||
+        cabecalho.addrSize != sizeof(uintptr_t))
+    {
+        fprintf(stderr, "%s: versao %u com enderecos de %u bytes nao suportada\n",
+                argv[1], cabecalho.version, cabecalho.addrSize);
+        return 1;
+    }
+
+    PINATRACE_REC *registros = (PINATRACE_REC *) malloc(sizeof(PINATRACE_REC) * REGISTROS_POR_LEITURA);
+    PINATRACE_CHUNK bloco;
+    std::vector<Bbl> bbls;            // indexados pelo identificador (o 0 não é usado)
+    std::vector<uintptr_t> palavras;  // conteúdo de um bloco PINATRACE_CHUNK_BBL
+
+    // percorre os blocos na ordem em que foram escritos
+    while (fread(&bloco, sizeof(bloco), 1, entrada) == 1)
+    {
+        if (bloco.type == PINATRACE_CHUNK_BBLDEF)
+        {
+            PINATRACE_BBLDEF definicao;
+            if (fread(&definicao, sizeof(definicao), 1, entrada) != 1 || definicao.numOps != bloco.count)
+            {
+                fprintf(stderr, "%s: definicao de BBL invalida\n", argv[1]);
+                return 1;
+            }
+            if (bbls.size() <= definicao.id)
+                bbls.resize(definicao.id + 1);
+            Bbl &bbl = bbls[definicao.id];
+            bbl.address = definicao.address;
+            bbl.ops.resize(definicao.numOps);
+            if (definicao.numOps > 0 &&
+                fread(&bbl.ops[0], sizeof(PINATRACE_BBLOP), definicao.numOps, entrada) != definicao.numOps)
+            {
+                fprintf(stderr, "%s: arquivo truncado\n", argv[1]);
+                return 1;
+            }
+            continue;
+        }
+
+        if (bloco.type == PINATRACE_CHUNK_BBL)
+        {
+            palavras.resize((size_t) bloco.count);
+            if (bloco.count > 0 &&
+                fread(&palavras[0], sizeof(uintptr_t), palavras.size(), entrada) != palavras.size())
+            {
+                fprintf(stderr, "%s: arquivo truncado\n", argv[1]);
+                return 1;
+            }
+
+            // cada execução: identificador do BBL seguido de um endereço por acesso
+            for (size_t i = 0; i < palavras.size(); )
+            {
+                uintptr_t id = palavras[i++];
+                if (id == 0 || id >= bbls.size() || bbls[id].ops.empty() ||
+                    i + bbls[id].ops.size() > palavras.size())
+                {
+                    fprintf(stderr, "%s: registro de BBL invalido (id %llu)\n", argv[1],
+                            (unsigned long long) id);
+                    return 1;
+                }
+
+                const Bbl &bbl = bbls[id];
+                for (size_t op = 0; op < bbl.ops.size(); op++, i++)
+                {
+                    // endereço 0: o acesso não executou (ver pinatrace_format.h)
+                    if (palavras[i] == 0)
+                        continue;
+                    ImprimeAcesso(saida, imprimeThread, imprimeTamanho, bloco.tid,
+                                  bbl.address + bbl.ops[op].offset, bbl.ops[op].isWrite,
+                                  palavras[i], bbl.ops[op].size);
+                }
+            }
+            continue;
+        }
+
+        if (bloco.type != PINATRACE_CHUNK_MEMREF)
+        {
+            fprintf(stderr, "%s: bloco de tipo desconhecido (%u)\n", argv[1], bloco.type);
+            return 1;
+        }
+
+        uint64_t restantes = bloco.count;
+        while (restantes > 0)
+        {
+            size_t pedidos = restantes < REGISTROS_POR_LEITURA ? (size_t) restantes : REGISTROS_POR_LEITURA;
+            size_t lidos = fread(registros, sizeof(PINATRACE_REC), pedidos, entrada);
+            if (lidos == 0)
+            {
+                fprintf(stderr, "%s: arquivo truncado\n", argv[1]);
+                return 1;
+            }
+
+            for (size_t i = 0; i < lidos; i++)
+            {
+                if (registros[i].isWrite == PINATRACE_REC_SAMPLE)
+                {
+                    if (imprimeThread)
+                        fprintf(saida, "%u ", bloco.tid);
+                    fprintf(saida, "#sample %llu %llu\n", (unsigned long long) registros[i].ea,
+                            (unsigned long long) registros[i].ip);
+                }
+                else
+                    ImprimeAcesso(saida, imprimeThread, imprimeTamanho, bloco.tid, registros[i].ip,
+                                  registros[i].isWrite, registros[i].ea, registros[i].size);
+            }
+
+            restantes -= lidos;
+        }
+    }
+
+    fprintf(saida, "#eof\n");
+
+    free(registros);
+    fclose(entrada);
+    if (saida != stdout)
+        fclose(saida);
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *  Formato binário do arquivo de saída do pinatrace_instrument.
+ *
+ *  Compartilhado entre a pintool e o decodificador (pinatrace_decode.cpp),
+ *  que não depende do Pin. Por isso, usa apenas tipos de <stdint.h>.
+ *
+ *  O arquivo começa com um PINATRACE_HEADER e é seguido por uma sequência
+ *  de blocos. Cada bloco tem um PINATRACE_CHUNK seguido de "count" registros
+ *  PINATRACE_REC, todos de uma mesma thread.
+ *
+ *  No modo "-mode bbl" (versão 3), os acessos são agrupados por BBL: cada
+ *  BBL instrumentado é descrito uma única vez por um bloco
+ *  PINATRACE_CHUNK_BBLDEF, e cada execução dele ocupa, em um bloco
+ *  PINATRACE_CHUNK_BBL, uma palavra com o identificador do BBL seguida de
+ *  uma palavra por acesso com o endereço efetivo, ou 0 se o acesso não
+ *  executou (predicado falso, REP sem iterações ou uma falha no meio do
+ *  BBL). A definição de um BBL sempre aparece no arquivo antes do primeiro
+ *  bloco que o usa.
+ */
+
+#ifndef PINATRACE_FORMAT_H
+#define PINATRACE_FORMAT_H
+
+#include <stdint.h>
+
+// "PINATRCE" em little-endian
+#define PINATRACE_MAGIC   0x45435254414e4950ULL
+#define PINATRACE_VERSION 3
+
+// Cabeçalho do arquivo. "addrSize" é o tamanho de um endereço na
+// arquitetura que gerou o trace, usado para validar o decodificador.
+struct PINATRACE_HEADER
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t addrSize;
+};
+
+// Tipos de bloco
+enum
+{
+    PINATRACE_CHUNK_MEMREF = 1, // "count" registros PINATRACE_REC
+    PINATRACE_CHUNK_BBLDEF = 2, // um PINATRACE_BBLDEF e "count" PINATRACE_BBLOP (versão 3)
+    PINATRACE_CHUNK_BBL    = 3  // "count" palavras (uintptr_t) de execuções de BBLs (versão 3)
+};
+
+// Cabeçalho de um bloco. "seq" é o número de sequência do bloco dentro
+// da thread "tid", permitindo reordenar blocos de uma mesma thread.
+struct PINATRACE_CHUNK
+{
+    uint32_t type;
+    uint32_t tid;
+    uint64_t seq;
+    uint64_t count;
+};
+
+// Valores de PINATRACE_REC.isWrite
+enum
+{
+    PINATRACE_REC_READ   = 0,
+    PINATRACE_REC_WRITE  = 1,
+    PINATRACE_REC_SAMPLE = 2  // início de uma amostra (versão 2, opção -sample_skip)
+};
+
+// Um acesso à memória. Os campos são preenchidos diretamente pelo Pin
+// (INS_InsertFillBuffer), por isso "ip" e "ea" têm o tamanho de um
+// endereço da arquitetura alvo.
+//
+// Um registro PINATRACE_REC_SAMPLE marca o início de uma amostra da
+// thread: "ea" é o número da amostra e "ip" é o número de instruções que a
+// thread já havia executado quando ela começou (em 32 bits, módulo 2^32),
+// o que permite posicionar as amostras em uma linha do tempo.
+struct PINATRACE_REC
+{
+    uintptr_t ip;      // endereço da instrução
+    uintptr_t ea;      // endereço efetivo acessado
+    uint32_t  size;    // tamanho do acesso em bytes
+    uint32_t  isWrite; // PINATRACE_REC_READ, PINATRACE_REC_WRITE ou PINATRACE_REC_SAMPLE
+};
+
+// Definição de um BBL (modo "bbl"). Os identificadores começam em 1 e
+// "address" é o endereço da primeira instrução do BBL.
+struct PINATRACE_BBLDEF
+{
+    uintptr_t address;
+    uint32_t  id;
+    uint32_t  numOps;  // acessos registrados a cada execução
+};
+
+// Valores de PINATRACE_BBLOP.flags
+enum
+{
+    PINATRACE_OP_PREDICATED = 1, // instrução com predicado: endereço 0 se não executou
+    PINATRACE_OP_REP        = 2  // prefixo REP: endereço da primeira iteração (0 se nenhuma)
+};
+
+// Um acesso de um BBL, na ordem em que os endereços aparecem na execução
+struct PINATRACE_BBLOP
+{
+    uint32_t offset;   // distância da instrução ao início do BBL
+    uint16_t size;     // tamanho do acesso em bytes (de cada iteração, com REP)
+    uint8_t  isWrite;  // PINATRACE_REC_READ ou PINATRACE_REC_WRITE
+    uint8_t  flags;    // PINATRACE_OP_PREDICATED, PINATRACE_OP_REP
+};
+
+#endif // PINATRACE_FORMAT_H
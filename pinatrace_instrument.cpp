@@ -33,11 +33,246 @@ END_LEGAL */
  */
 
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
 #include "pin.H"
+#include "pinatrace_format.h"
+#include "pinatrace_cachesim.h"
+#include "estatisticas.h"
+#include "saida-processo.h"
 
+KNOB<string> KnobOutputFile(KNOB_MODE_WRITEONCE, "pintool",
+    "o", "pinatrace.out", "specify trace file name (report file with -mode sim)");
+
+KNOB<string> KnobMode(KNOB_MODE_WRITEONCE, "pintool",
+    "mode", "text", "trace mode: text (one line per access), buffer "
+    "(binary records in per-thread buffers, see pinatrace_decode), async "
+    "(like buffer, written by a background thread), bbl (binary, one record "
+    "per basic block execution) or sim (no trace: the buffers feed an "
+    "in-tool cache and reuse-distance simulator)");
+
+KNOB<UINT32> KnobNumPages(KNOB_MODE_WRITEONCE, "pintool",
+    "pages", "256", "number of pages in each per-thread trace buffer");
+
+KNOB<UINT32> KnobRingSize(KNOB_MODE_WRITEONCE, "pintool",
+    "ring", "8", "async mode: number of trace buffers in each thread's ring");
+
+KNOB<BOOL> KnobSplit(KNOB_MODE_WRITEONCE, "pintool",
+    "split", "0", "async mode: write one file per thread (<o>.<tid>)");
+
+KNOB<string> KnobCache(KNOB_MODE_WRITEONCE, "pintool",
+    "cache", "32K:8:64,256K:8:64,8M:16:64", "sim mode: cache levels as "
+    "size:ways:line, from L1 to the last level");
+
+KNOB<UINT32> KnobTop(KNOB_MODE_WRITEONCE, "pintool",
+    "top", "20", "sim mode: number of instructions with most last-level misses to report");
+
+KNOB<UINT64> KnobSampleTrace(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_trace", "1000000", "sampling: number of instructions traced in each sample");
+
+KNOB<UINT64> KnobSampleSkip(KNOB_MODE_WRITEONCE, "pintool",
+    "sample_skip", "0", "sampling: number of instructions run without tracing between "
+    "samples (0: trace everything)");
+
+KNOB<string> KnobStats(KNOB_MODE_WRITEONCE, "pintool",
+    "stats", "", "write instrumentation and analysis-routine costs to this JSON file (empty: off)");
+
+KNOB<UINT32> KnobStatsSample(KNOB_MODE_WRITEONCE, "pintool",
+    "stats_amostra", "1000", "mean number of executions between timed analysis calls (-stats)");
+
+KNOB<string> KnobImage(KNOB_MODE_APPEND, "pintool",
+    "img", "", "filter: only trace images whose path or base name matches this glob "
+    "(\"main\": the main executable; may be repeated)");
+
+KNOB<string> KnobRoutine(KNOB_MODE_APPEND, "pintool",
+    "rtn", "", "filter: only trace routines whose name matches this glob (may be repeated)");
+
+KNOB<string> KnobRange(KNOB_MODE_APPEND, "pintool",
+    "range", "", "filter: only trace instructions in this address range, as hex lo-hi "
+    "with hi exclusive (may be repeated)");
+
+KNOB<BOOL> KnobSkipStack(KNOB_MODE_WRITEONCE, "pintool",
+    "skip_stack", "0", "do not trace accesses through the stack or frame pointer");
+
+KNOB<BOOL> KnobPidSuffix(KNOB_MODE_WRITEONCE, "pintool",
+    "sufixo_pid", "0", "append .<pid> to the output files also in the first process "
+    "(use with -follow_execv)");
 
 FILE * trace;
 
+enum TraceMode
+{
+    MODE_TEXT,   // fprintf a cada acesso (comportamento original)
+    MODE_BUFFER, // buffers do Pin esvaziados pela própria thread
+    MODE_ASYNC,  // anel de buffers por thread, esvaziado pela thread escritora
+    MODE_SIM,    // buffers consumidos em memória pelo simulador de caches
+    MODE_BBL     // um registro por execução de BBL, em buffers da própria ferramenta
+};
+
+static TraceMode mode = MODE_TEXT;
+
+// Pontos de análise medidos com -stats (ver estatisticas.h): as rotinas do
+// modo texto ou o preenchimento em linha dos buffers nos modos binários
+static const char * const textRoutines[] = {"RecordMemRead", "RecordMemWrite"};
+static const char * const bufferRoutines[] = {"FillBufferRead", "FillBufferWrite"};
+static const char * const bblRoutines[] = {"BblBegin", "BblStoreEa"};
+
+// Identificador do buffer de trace do Pin (modos "buffer" e "async")
+static BUFFER_ID bufId;
+
+// Modo "buffer": trava que serializa a escrita dos blocos no arquivo e
+// número de sequência do próximo bloco de cada thread.
+static PIN_LOCK traceLock;
+static vector<UINT64> chunkSeq;
+
+/**
+ * Modo "async": cada thread da aplicação possui um anel com KnobRingSize
+ * buffers do Pin. Quando o buffer em uso enche, ele é enfileirado no anel
+ * e a thread segue com o próximo buffer livre; uma thread interna do Pin
+ * ("escritora") esvazia os anéis no arquivo. A thread da aplicação só
+ * bloqueia quando todos os buffers do seu anel estão cheios.
+ *
+ * "prod" só é alterado pela thread dona do anel e "cons" só pela thread
+ * que o esvazia, de modo que o anel não precisa de trava.
+ *
+ * O buffer em uso pela thread pertence ao Pin: é sempre o da posição
+ * "prod % size" (ou, antes do primeiro buffer cheio, o buffer inicial,
+ * alocado pelo Pin e ainda fora do anel). Quando a thread termina, o Pin
+ * libera esse buffer assim que o último é entregue, então ele é escrito
+ * pela própria thread em vez de enfileirado. Os demais buffers do anel
+ * são liberados pela ferramenta.
+ */
+struct ThreadRing
+{
+    THREADID tid;
+    FILE * out;               // arquivo da thread (-split) ou o arquivo comum
+    UINT64 seq;               // número de sequência do próximo bloco
+    UINT32 size;              // número de buffers no anel
+    VOID ** bufs;             // buffers do anel
+    UINT64 * counts;          // registros em cada buffer cheio
+    volatile UINT64 prod;     // buffers já enfileirados pela thread
+    volatile UINT64 cons;     // buffers já escritos no arquivo
+    UINT64 stalls;            // vezes em que a thread esperou por um buffer livre
+    BOOL exited;              // a thread já terminou
+    PIN_SEMAPHORE space;      // sinalizado quando um buffer é liberado
+};
+
+static TLS_KEY ringKey;
+static vector<ThreadRing *> rings;     // anéis ainda não liberados
+static PIN_LOCK ringsLock;             // protege "rings" e a escrita nos arquivos
+static PIN_SEMAPHORE writerWake;       // acorda a thread escritora
+static PIN_THREAD_UID writerUid;
+static volatile BOOL writerStop = FALSE;
+static BOOL writerDone = FALSE;        // protegido por ringsLock
+static UINT64 totalStalls = 0;         // protegido por ringsLock
+static UINT64 totalChunks = 0;         // protegido por ringsLock
+
+/**
+ * Amostragem (-sample_skip > 0): cada thread alterna entre períodos de
+ * KnobSampleTrace instruções rastreadas e KnobSampleSkip instruções sem
+ * rastreamento. Cada trace é instrumentado em duas versões do Pin
+ * (TRACE_Version): VERSION_TRACE, com o código de rastreamento, e
+ * VERSION_SKIP, só com a contagem regressiva. No início de cada BBL, uma
+ * rotina "If" em linha desconta as instruções do BBL; quando a contagem
+ * acaba, a parte "Then" troca de período e grava o novo período em
+ * "versionReg", e INS_InsertVersionCase desvia para a outra versão do
+ * código. As duas versões ficam na cache de código, e a troca não exige
+ * esvaziá-la. A outra versão recomeça pelo mesmo BBL, cujas instruções
+ * já foram descontadas: a sua rotina "If" não desconta de novo.
+ *
+ * O início de cada amostra é marcado no trace: no modo texto, por uma
+ * linha "<tid> #sample <amostra> <instruções>" (como na saída de
+ * "pinatrace_decode -t"); nos modos binários, por um
+ * registro PINATRACE_REC_SAMPLE gravado no buffer da thread e completado
+ * com o número da amostra e de instruções quando o buffer é esvaziado.
+ */
+enum
+{
+    VERSION_TRACE = 0,  // versão inicial de todo trace
+    VERSION_SKIP = 1
+};
+
+struct ThreadSample
+{
+    INT64 remaining;          // instruções restantes no período atual
+    UINT32 tickMask;          // 0 logo após uma troca de período, ~0 nos demais BBLs
+    THREADID tid;
+    UINT64 periodStart;       // instruções executadas antes do período atual
+    UINT64 periodLength;      // tamanho do período atual
+    ADDRINT phase;            // VERSION_TRACE ou VERSION_SKIP
+    ADDRINT markPending;      // há um marcador de amostra a gravar no buffer
+    vector<UINT64> offsets;   // instruções executadas no início de cada amostra
+    UINT64 marked;            // marcadores já completados nos buffers
+};
+
+static BOOL sampling = FALSE;
+static REG sampleReg;        // ThreadSample da thread
+static REG versionReg;       // período atual da thread, comparado por INS_InsertVersionCase
+static TLS_KEY sampleKey;
+
+/**
+ * Modo "sim": nenhum trace é escrito. Quando o buffer de uma thread enche,
+ * os registros alimentam o simulador da thread (pinatrace_cachesim.h), e
+ * o buffer é devolvido ao Pin. Os resultados de cada thread são somados
+ * em "simTotals" quando ela termina, e o relatório é escrito ao final.
+ */
+static vector<CacheLevelConfig> cacheLevels;
+static TLS_KEY simKey;
+static PIN_LOCK simLock;                 // protege "simThreads" e "simTotals"
+static vector<CacheSim *> simThreads;    // simuladores das threads ainda vivas
+static CacheSimStats * simTotals;
+
+/**
+ * Modo "bbl": em vez de um registro por acesso, um registro por execução
+ * de BBL, com o identificador do BBL e os endereços efetivos dos seus
+ * acessos. Tamanho, leitura/escrita e instrução de cada acesso não mudam
+ * entre execuções e são escritos uma única vez, em um bloco de definição,
+ * quando o BBL é instrumentado (ver pinatrace_format.h).
+ *
+ * Cada thread tem um buffer próprio, cujo cursor fica no registrador
+ * "bblCursorReg" e o fim em "bblLimitReg". No início do BBL, uma rotina
+ * "If" em linha verifica se o registro cabe no buffer (a parte "Then"
+ * esvazia o buffer no arquivo), e BblBegin grava o identificador e avança
+ * o cursor sobre o registro inteiro. Cada acesso grava então o seu
+ * endereço na sua posição, abaixo do cursor, também em linha.
+ *
+ * O buffer fica zerado além do cursor (é zerado na alocação e de novo até
+ * o cursor a cada esvaziamento), de modo que as posições dos acessos que
+ * não chegaram a executar, por uma falha no meio do BBL, valem 0 em vez
+ * de um endereço antigo. Zerar no esvaziamento, e não em BblBegin, mantém
+ * BblBegin sem chamadas, em linha.
+ */
+struct BblThread
+{
+    THREADID tid;
+    UINT8 * base;             // início do buffer
+    UINT64 seq;               // número de sequência do próximo bloco
+    ADDRINT forkCursor;       // fim dos registros anteriores ao "fork" (0: nenhum)
+};
+
+static REG bblCursorReg;
+static REG bblLimitReg;
+static TLS_KEY bblKey;
+static map<pair<ADDRINT, USIZE>, UINT32> bblIds; // BBLs já definidos, por endereço e tamanho
+static UINT64 bblChunks = 0;   // protegido por traceLock
+static UINT64 bblWords = 0;    // protegido por traceLock
+static vector<UINT8> bblDefs;  // blocos de definição já escritos, protegido por traceLock
+
+/**
+ * Processos criados por "fork" (ver saida-processo.h): o filho escreve o
+ * seu trace em <o>.<pid>, só com os acessos posteriores ao "fork". Só a
+ * thread que chamou "fork" existe no filho, e o buffer dela ainda contém
+ * os registros gravados antes do "fork", que o pai também escreve. O
+ * cursor do buffer no momento do "fork" é guardado, e esses registros são
+ * descartados quando o buffer é entregue no filho. No modo "bbl", as
+ * definições dos BBLs já instrumentados (o filho herda a cache de código)
+ * são copiadas para o início do novo arquivo.
+ */
+static THREADID forkTid = INVALID_THREADID; // thread com registros anteriores ao "fork"
+static VOID * forkCursor;                    // fim desses registros no buffer do Pin
+
 // Print a memory read record
 VOID RecordMemRead(VOID * ip, VOID * addr)
 {
@@ -50,6 +285,727 @@ VOID RecordMemWrite(VOID * ip, VOID * addr)
     fprintf(trace,"%p: W %p\n", ip, addr);
 }
 
+/**
+ * Amostragem: desconta as instruções do BBL e indica se o período acabou.
+ * O primeiro BBL depois de uma troca, já descontado na outra versão, não
+ * é descontado de novo ("tickMask" é 0). Sem chamadas nem desvios, para
+ * que o Pin faça o "inline".
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL SampleTick(ThreadSample * ts, UINT32 numIns)
+{
+    ts->remaining -= numIns & ts->tickMask;
+    ts->tickMask = ~0U;
+    return ts->remaining <= 0;
+}
+
+/**
+ * Amostragem: troca de período e retorna o novo, gravado em "versionReg".
+ * Ao iniciar uma amostra, anota o número de instruções já executadas.
+ */
+ADDRINT SampleSwitch(ThreadSample * ts)
+{
+    ts->periodStart += ts->periodLength - ts->remaining;
+
+    if (ts->phase == VERSION_TRACE)
+    {
+        ts->phase = VERSION_SKIP;
+        ts->periodLength = KnobSampleSkip.Value();
+    }
+    else
+    {
+        ts->phase = VERSION_TRACE;
+        ts->periodLength = KnobSampleTrace.Value();
+        ts->offsets.push_back(ts->periodStart);
+        if (mode == MODE_TEXT)
+            fprintf(trace, "%u #sample %llu %llu\n", ts->tid, (unsigned long long)(ts->offsets.size() - 1),
+                    (unsigned long long)ts->periodStart);
+        else
+            ts->markPending = 1;
+    }
+
+    ts->remaining = ts->periodLength;
+    ts->tickMask = 0;
+    return ts->phase;
+}
+
+/**
+ * Amostragem, modos binários: indica (uma única vez) que o marcador da
+ * amostra que começou deve ser gravado no buffer.
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL SampleMarkPending(ThreadSample * ts)
+{
+    ADDRINT pending = ts->markPending;
+    ts->markPending = 0;
+    return pending;
+}
+
+/**
+ * Descarta do buffer entregue os registros anteriores ao "fork" (só na
+ * primeira entrega da thread que chamou "fork", no filho). Os marcadores
+ * de amostra devem ser completados antes. Retorna o número de registros
+ * restantes, movidos para o início do buffer.
+ */
+static UINT64 DropPreForkRecords(THREADID tid, VOID * buf, UINT64 numElements)
+{
+    if (tid != forkTid)
+        return numElements;
+    forkTid = INVALID_THREADID;
+
+    PINATRACE_REC * recs = static_cast<PINATRACE_REC *>(buf);
+    PINATRACE_REC * end = static_cast<PINATRACE_REC *>(forkCursor);
+    if (end < recs || end > recs + numElements)
+        return numElements;
+
+    UINT64 skip = end - recs;
+    memmove(recs, end, (numElements - skip) * sizeof(PINATRACE_REC));
+    return numElements - skip;
+}
+
+/**
+ * Amostragem, modos binários: completa os marcadores de amostra de um
+ * buffer cheio com o número da amostra e de instruções, na ordem em que
+ * as amostras começaram.
+ */
+static VOID FillSampleMarks(THREADID tid, VOID * buf, UINT64 numElements)
+{
+    ThreadSample * ts = static_cast<ThreadSample *>(PIN_GetThreadData(sampleKey, tid));
+    PINATRACE_REC * recs = static_cast<PINATRACE_REC *>(buf);
+
+    for (UINT64 i = 0; i < numElements; i++)
+    {
+        if (recs[i].isWrite == PINATRACE_REC_SAMPLE)
+        {
+            recs[i].ea = ts->marked;
+            recs[i].ip = ts->offsets[ts->marked];
+            ts->marked++;
+        }
+    }
+}
+
+VOID SampleThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    // Toda thread começa rastreando a amostra 0
+    ThreadSample * ts = new ThreadSample;
+    ts->periodStart = 0;
+    ts->periodLength = KnobSampleTrace.Value();
+    ts->remaining = ts->periodLength;
+    ts->tickMask = ~0U;
+    ts->tid = tid;
+    ts->phase = VERSION_TRACE;
+    ts->offsets.push_back(0);
+    ts->marked = 0;
+    ts->markPending = (mode != MODE_TEXT);
+    if (mode == MODE_TEXT)
+        fprintf(trace, "%u #sample 0 0\n", tid);
+
+    PIN_SetThreadData(sampleKey, ts, tid);
+    PIN_SetContextReg(ctxt, sampleReg, reinterpret_cast<ADDRINT>(ts));
+    PIN_SetContextReg(ctxt, versionReg, VERSION_TRACE);
+}
+
+/**
+ * O Pin entrega o último buffer da thread antes desta chamada, de modo que
+ * todos os marcadores já foram completados.
+ */
+VOID SampleThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    delete static_cast<ThreadSample *>(PIN_GetThreadData(sampleKey, tid));
+}
+
+static VOID WriteHeader(FILE * out)
+{
+    PINATRACE_HEADER header;
+    header.magic = PINATRACE_MAGIC;
+    header.version = PINATRACE_VERSION;
+    header.addrSize = sizeof(ADDRINT);
+    fwrite(&header, sizeof(header), 1, out);
+}
+
+/**
+ * Escreve em "out" um bloco com "count" registros da thread "tid".
+ * O chamador deve garantir acesso exclusivo ao arquivo.
+ */
+static VOID WriteChunk(FILE * out, THREADID tid, UINT64 seq,
+                       const VOID * records, UINT64 count)
+{
+    PINATRACE_CHUNK chunk;
+    chunk.type = PINATRACE_CHUNK_MEMREF;
+    chunk.tid = tid;
+    chunk.seq = seq;
+    chunk.count = count;
+
+    fwrite(&chunk, sizeof(chunk), 1, out);
+    fwrite(records, sizeof(PINATRACE_REC), count, out);
+}
+
+/**
+ * Modo "buffer": chamada pelo Pin quando o buffer de uma thread enche e
+ * quando a thread termina. Os registros são escritos de uma só vez, e o
+ * mesmo buffer é devolvido ao Pin para ser reutilizado pela thread.
+ */
+VOID * BufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
+                  UINT64 numElements, VOID *v)
+{
+    if (sampling)
+        FillSampleMarks(tid, buf, numElements);
+    numElements = DropPreForkRecords(tid, buf, numElements);
+    if (numElements == 0)
+        return buf;
+
+    PIN_GetLock(&traceLock, tid + 1);
+    if (chunkSeq.size() <= tid)
+        chunkSeq.resize(tid + 1, 0);
+    WriteChunk(trace, tid, chunkSeq[tid]++, buf, numElements);
+    PIN_ReleaseLock(&traceLock);
+
+    return buf;
+}
+
+/**
+ * Modo "async": escreve no arquivo os buffers enfileirados no anel e os
+ * devolve à thread dona. Deve ser chamada com "ringsLock" adquirida.
+ */
+static VOID DrainRing(ThreadRing * ring)
+{
+    UINT64 prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    UINT64 cons = ring->cons;
+
+    if (cons == prod)
+        return;
+
+    for (; cons != prod; cons++)
+    {
+        UINT32 slot = cons % ring->size;
+        WriteChunk(ring->out, ring->tid, ring->seq++, ring->bufs[slot], ring->counts[slot]);
+        totalChunks++;
+    }
+
+    __atomic_store_n(&ring->cons, cons, __ATOMIC_RELEASE);
+    PIN_SemaphoreSet(&ring->space);
+}
+
+/**
+ * Libera o anel de uma thread que já terminou e cujos buffers já foram
+ * escritos. Deve ser chamada com "ringsLock" adquirida.
+ */
+static VOID FreeRing(ThreadRing * ring)
+{
+    // O buffer em uso pela thread é liberado pelo Pin
+    UINT32 pinSlot = ring->prod % ring->size;
+    for (UINT32 i = 0; i < ring->size; i++)
+    {
+        if (i != pinSlot && ring->bufs[i] != NULL)
+            PIN_DeallocateBuffer(bufId, ring->bufs[i]);
+    }
+
+    if (ring->out != trace)
+        fclose(ring->out);
+
+    totalStalls += ring->stalls;
+    rings.erase(find(rings.begin(), rings.end(), ring));
+
+    PIN_SemaphoreFini(&ring->space);
+    delete [] ring->bufs;
+    delete [] ring->counts;
+    delete ring;
+}
+
+/**
+ * Esvazia todos os anéis e libera os de threads que já terminaram.
+ * Deve ser chamada com "ringsLock" adquirida.
+ */
+static VOID DrainAll()
+{
+    for (size_t i = 0; i < rings.size(); )
+    {
+        ThreadRing * ring = rings[i];
+        DrainRing(ring);
+
+        if (ring->exited)
+            FreeRing(ring);
+        else
+            i++;
+    }
+}
+
+/**
+ * Thread interna do Pin que esvazia os anéis das threads da aplicação.
+ * Acorda quando algum buffer é enfileirado ou, no máximo, a cada 10 ms.
+ */
+static VOID WriterThread(VOID * arg)
+{
+    while (!writerStop)
+    {
+        PIN_SemaphoreTimedWait(&writerWake, 10);
+        PIN_SemaphoreClear(&writerWake);
+
+        PIN_GetLock(&ringsLock, 0);
+        DrainAll();
+        PIN_ReleaseLock(&ringsLock);
+    }
+
+    // A partir daqui, as próprias threads da aplicação esvaziam seus anéis
+    PIN_GetLock(&ringsLock, 0);
+    DrainAll();
+    writerDone = TRUE;
+    PIN_ReleaseLock(&ringsLock);
+}
+
+/**
+ * Modo "async": enfileira o buffer cheio no anel da thread e devolve ao
+ * Pin o próximo buffer livre, esperando pela thread escritora se o anel
+ * estiver cheio. O último buffer de uma thread que termina (o Pin passa
+ * "ctxt" nulo) é escrito aqui mesmo, depois dos que estão no anel.
+ */
+VOID * RingBufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
+                      UINT64 numElements, VOID *v)
+{
+    ThreadRing * ring = static_cast<ThreadRing *>(PIN_GetThreadData(ringKey, tid));
+
+    if (sampling)
+        FillSampleMarks(tid, buf, numElements);
+    numElements = DropPreForkRecords(tid, buf, numElements);
+
+    if (ctxt == NULL)
+    {
+        PIN_GetLock(&ringsLock, tid + 1);
+        DrainRing(ring);
+        if (numElements > 0)
+        {
+            WriteChunk(ring->out, ring->tid, ring->seq++, buf, numElements);
+            totalChunks++;
+        }
+        PIN_ReleaseLock(&ringsLock);
+        return buf;
+    }
+
+    if (numElements == 0)
+        return buf;
+
+    // O primeiro buffer da thread é alocado pelo próprio Pin
+    UINT64 prod = ring->prod;
+    if (ring->bufs[prod % ring->size] == NULL)
+        ring->bufs[prod % ring->size] = buf;
+
+    ring->counts[prod % ring->size] = numElements;
+    prod++;
+    __atomic_store_n(&ring->prod, prod, __ATOMIC_RELEASE);
+    PIN_SemaphoreSet(&writerWake);
+
+    // O próximo buffer só está livre depois que a escritora o consumiu
+    if (prod - __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE) == ring->size)
+    {
+        ring->stalls++;
+
+        while (TRUE)
+        {
+            PIN_SemaphoreClear(&ring->space);
+            if (prod - __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE) < ring->size)
+                break;
+
+            // A escritora já terminou (aplicação encerrando): esvazia o
+            // próprio anel.
+            PIN_GetLock(&ringsLock, tid + 1);
+            if (writerDone)
+                DrainRing(ring);
+            PIN_ReleaseLock(&ringsLock);
+
+            PIN_SemaphoreTimedWait(&ring->space, 10);
+        }
+    }
+
+    return ring->bufs[prod % ring->size];
+}
+
+/**
+ * Modo "sim": passa os acessos do buffer cheio ao simulador da thread,
+ * ignorando os marcadores de amostra.
+ */
+VOID * SimBufferFull(BUFFER_ID id, THREADID tid, const CONTEXT *ctxt, VOID *buf,
+                     UINT64 numElements, VOID *v)
+{
+    CacheSim * sim = static_cast<CacheSim *>(PIN_GetThreadData(simKey, tid));
+    const PINATRACE_REC * recs = static_cast<const PINATRACE_REC *>(buf);
+
+    numElements = DropPreForkRecords(tid, buf, numElements);
+    for (UINT64 i = 0; i < numElements; i++)
+    {
+        if (recs[i].isWrite != PINATRACE_REC_SAMPLE)
+            sim->Access(recs[i].ip, recs[i].ea, recs[i].size);
+    }
+
+    return buf;
+}
+
+VOID SimThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    CacheSim * sim = new CacheSim(cacheLevels);
+    PIN_SetThreadData(simKey, sim, tid);
+
+    PIN_GetLock(&simLock, tid + 1);
+    simThreads.push_back(sim);
+    PIN_ReleaseLock(&simLock);
+}
+
+/**
+ * O Pin entrega o último buffer da thread antes desta chamada: soma os
+ * resultados da thread e libera o seu simulador.
+ */
+VOID SimThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    CacheSim * sim = static_cast<CacheSim *>(PIN_GetThreadData(simKey, tid));
+
+    PIN_GetLock(&simLock, tid + 1);
+    sim->MergeInto(*simTotals);
+    simThreads.erase(find(simThreads.begin(), simThreads.end(), sim));
+    PIN_ReleaseLock(&simLock);
+
+    delete sim;
+}
+
+/**
+ * Modo "bbl": escreve os registros do buffer da thread, até "cursor", em
+ * um bloco PINATRACE_CHUNK_BBL. No filho de um "fork", os registros
+ * anteriores ao "fork", já escritos pelo pai, são pulados.
+ */
+static VOID WriteBblChunk(BblThread * bt, ADDRINT cursor)
+{
+    ADDRINT begin = bt->forkCursor != 0 ? bt->forkCursor : reinterpret_cast<ADDRINT>(bt->base);
+    bt->forkCursor = 0;
+
+    UINT64 count = (cursor - begin) / sizeof(ADDRINT);
+    if (count == 0)
+        return;
+
+    PINATRACE_CHUNK chunk;
+    chunk.type = PINATRACE_CHUNK_BBL;
+    chunk.tid = bt->tid;
+    chunk.seq = bt->seq++;
+    chunk.count = count;
+
+    PIN_GetLock(&traceLock, bt->tid + 1);
+    fwrite(&chunk, sizeof(chunk), 1, trace);
+    fwrite(reinterpret_cast<VOID *>(begin), sizeof(ADDRINT), count, trace);
+    bblChunks++;
+    bblWords += count;
+    PIN_ReleaseLock(&traceLock);
+}
+
+/**
+ * Modo "bbl": indica se o registro de "bytes" bytes não cabe no buffer.
+ * Sem chamadas nem desvios, para que o Pin faça o "inline".
+ */
+ADDRINT PIN_FAST_ANALYSIS_CALL BblFull(ADDRINT cursor, ADDRINT limit, ADDRINT bytes)
+{
+    return cursor + bytes > limit;
+}
+
+// Modo "bbl": esvazia o buffer da thread e retorna o novo cursor
+ADDRINT BblFlush(THREADID tid, ADDRINT cursor)
+{
+    BblThread * bt = static_cast<BblThread *>(PIN_GetThreadData(bblKey, tid));
+    WriteBblChunk(bt, cursor);
+    memset(bt->base, 0, cursor - reinterpret_cast<ADDRINT>(bt->base));
+    return reinterpret_cast<ADDRINT>(bt->base);
+}
+
+// Modo "bbl": grava o identificador do BBL e reserva o registro inteiro,
+// cujas posições dos acessos já estão zeradas (ver BblThread)
+ADDRINT PIN_FAST_ANALYSIS_CALL BblBegin(ADDRINT cursor, ADDRINT id, ADDRINT bytes)
+{
+    *reinterpret_cast<ADDRINT *>(cursor) = id;
+    return cursor + bytes;
+}
+
+/**
+ * Modo "bbl": grava o endereço de um acesso "back" bytes abaixo do cursor,
+ * ou 0 se a instrução (com predicado) não executou.
+ */
+VOID PIN_FAST_ANALYSIS_CALL BblStoreEa(ADDRINT cursor, ADDRINT back, ADDRINT ea, BOOL executing)
+{
+    *reinterpret_cast<ADDRINT *>(cursor - back) = ea & (0 - (ADDRINT)(executing != 0));
+}
+
+// Modo "bbl": só a primeira iteração de uma instrução REP grava o endereço
+ADDRINT PIN_FAST_ANALYSIS_CALL BblFirstRep(BOOL first)
+{
+    return first;
+}
+
+VOID BblThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    size_t size = (size_t)KnobNumPages.Value() * 4096;
+
+    BblThread * bt = new BblThread;
+    bt->tid = tid;
+    bt->base = static_cast<UINT8 *>(calloc(1, size));
+    bt->seq = 0;
+    bt->forkCursor = 0;
+    if (bt->base == NULL)
+    {
+        PIN_ERROR("Could not allocate the trace buffer\n");
+        PIN_ExitProcess(1);
+    }
+
+    PIN_SetThreadData(bblKey, bt, tid);
+    PIN_SetContextReg(ctxt, bblCursorReg, reinterpret_cast<ADDRINT>(bt->base));
+    PIN_SetContextReg(ctxt, bblLimitReg, reinterpret_cast<ADDRINT>(bt->base + size));
+}
+
+VOID BblThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    BblThread * bt = static_cast<BblThread *>(PIN_GetThreadData(bblKey, tid));
+
+    // Os registros ainda no buffer terminam no cursor da thread
+    if (ctxt != NULL)
+        WriteBblChunk(bt, PIN_GetContextReg(ctxt, bblCursorReg));
+
+    free(bt->base);
+    delete bt;
+}
+
+VOID ThreadStart(THREADID tid, CONTEXT *ctxt, INT32 flags, VOID *v)
+{
+    ThreadRing * ring = new ThreadRing;
+    ring->tid = tid;
+    ring->seq = 0;
+    ring->size = KnobRingSize.Value();
+    ring->bufs = new VOID * [ring->size];
+    ring->counts = new UINT64 [ring->size];
+    ring->prod = 0;
+    ring->cons = 0;
+    ring->stalls = 0;
+    ring->exited = FALSE;
+    PIN_SemaphoreInit(&ring->space);
+
+    ring->bufs[0] = NULL;
+    for (UINT32 i = 1; i < ring->size; i++)
+        ring->bufs[i] = PIN_AllocateBuffer(bufId);
+
+    if (KnobSplit.Value())
+    {
+        ring->out = fopen((SaidaProcessoNome(KnobOutputFile.Value()) + "." + decstr(tid)).c_str(), "wb");
+        WriteHeader(ring->out);
+    }
+    else
+        ring->out = trace;
+
+    PIN_SetThreadData(ringKey, ring, tid);
+
+    PIN_GetLock(&ringsLock, tid + 1);
+    rings.push_back(ring);
+    PIN_ReleaseLock(&ringsLock);
+}
+
+/**
+ * O último buffer (parcial) da thread já foi escrito antes desta chamada.
+ * Se a escritora ainda está ativa, ela libera o anel; caso contrário,
+ * a própria thread o libera.
+ */
+VOID ThreadFini(THREADID tid, const CONTEXT *ctxt, INT32 code, VOID *v)
+{
+    ThreadRing * ring = static_cast<ThreadRing *>(PIN_GetThreadData(ringKey, tid));
+
+    PIN_GetLock(&ringsLock, tid + 1);
+    ring->exited = TRUE;
+    if (writerDone)
+    {
+        DrainRing(ring);
+        FreeRing(ring);
+    }
+    PIN_ReleaseLock(&ringsLock);
+
+    PIN_SemaphoreSet(&writerWake);
+}
+
+/**
+ * Chamada antes do término da aplicação: encerra a thread escritora, como
+ * exigido pelo Pin para threads internas.
+ */
+VOID PrepareForFini(VOID *v)
+{
+    writerStop = TRUE;
+    PIN_SemaphoreSet(&writerWake);
+    PIN_WaitForThreadTermination(writerUid, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+/**
+ * Modo "buffer": em vez de chamar uma rotina de análise, o Pin grava o
+ * registro diretamente no buffer da thread (código inline).
+ */
+static VOID InsertFillBuffer(INS ins, UINT32 memOp, UINT32 isWrite)
+{
+    INS_InsertFillBufferPredicated(
+        ins, IPOINT_BEFORE, bufId,
+        IARG_INST_PTR, offsetof(PINATRACE_REC, ip),
+        IARG_MEMORYOP_EA, memOp, offsetof(PINATRACE_REC, ea),
+        IARG_UINT32, (UINT32)INS_MemoryOperandSize(ins, memOp), offsetof(PINATRACE_REC, size),
+        IARG_UINT32, isWrite, offsetof(PINATRACE_REC, isWrite),
+        IARG_END);
+}
+
+/* ===================================================================== */
+/* Filtros (-img, -rtn, -range, -skip_stack)                             */
+/* ===================================================================== */
+
+/**
+ * Os filtros são aplicados uma única vez, quando a instrução é
+ * instrumentada: o código filtrado não recebe nenhuma chamada de
+ * análise. Todos os filtros ativos precisam aceitar a instrução. As
+ * decisões por imagem e por rotina ficam guardadas, de modo que os
+ * padrões só são comparados na primeira instrução de cada uma (as
+ * funções de instrumentação do Pin nunca executam em paralelo).
+ */
+struct AddressRange
+{
+    ADDRINT low;
+    ADDRINT high; // exclusivo
+};
+
+static vector<string> imagePatterns;
+static vector<string> routinePatterns;
+static vector<AddressRange> ranges;
+static map<UINT32, BOOL> imageDecisions;  // por IMG_Id
+static map<ADDRINT, BOOL> routineDecisions; // por RTN_Address
+
+// Compara "text" com um padrão em que '*' aceita qualquer sequência e '?' um caractere
+static BOOL GlobMatch(const char * pattern, const char * text)
+{
+    const char * star = NULL;
+    const char * resume = NULL;
+
+    while (*text)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            resume = text;
+        }
+        else if (*pattern == '?' || *pattern == *text)
+        {
+            pattern++;
+            text++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            text = ++resume;
+        }
+        else
+            return FALSE;
+    }
+
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+// Lê os padrões de um knob repetível, ignorando o valor vazio padrão
+static VOID ReadPatterns(KNOB<string> & knob, vector<string> & patterns)
+{
+    for (UINT32 i = 0; i < knob.NumberOfValues(); i++)
+        if (!knob.Value(i).empty())
+            patterns.push_back(knob.Value(i));
+}
+
+// Lê as faixas "lo-hi" em hexadecimal de -range
+static BOOL ParseRanges()
+{
+    for (UINT32 i = 0; i < KnobRange.NumberOfValues(); i++)
+    {
+        const string & value = KnobRange.Value(i);
+        if (value.empty())
+            continue;
+
+        const char * text = value.c_str();
+        char * end;
+        AddressRange range;
+        range.low = (ADDRINT)strtoull(text, &end, 16);
+        if (end == text || *end != '-')
+            return FALSE;
+        text = end + 1;
+        range.high = (ADDRINT)strtoull(text, &end, 16);
+        if (end == text || *end != '\0' || range.high <= range.low)
+            return FALSE;
+        ranges.push_back(range);
+    }
+    return TRUE;
+}
+
+static BOOL ImageSelected(IMG img)
+{
+    if (!IMG_Valid(img))
+        return FALSE;
+
+    map<UINT32, BOOL>::iterator it = imageDecisions.find(IMG_Id(img));
+    if (it != imageDecisions.end())
+        return it->second;
+
+    const string & path = IMG_Name(img);
+    string::size_type slash = path.find_last_of("/\\");
+    string base = slash == string::npos ? path : path.substr(slash + 1);
+
+    BOOL selected = FALSE;
+    for (size_t i = 0; i < imagePatterns.size() && !selected; i++)
+    {
+        const char * pattern = imagePatterns[i].c_str();
+        if (imagePatterns[i] == "main")
+            selected = IMG_IsMainExecutable(img);
+        else
+            selected = GlobMatch(pattern, path.c_str()) || GlobMatch(pattern, base.c_str());
+    }
+
+    imageDecisions[IMG_Id(img)] = selected;
+    return selected;
+}
+
+static BOOL RoutineSelected(RTN rtn)
+{
+    if (!RTN_Valid(rtn))
+        return FALSE;
+
+    map<ADDRINT, BOOL>::iterator it = routineDecisions.find(RTN_Address(rtn));
+    if (it != routineDecisions.end())
+        return it->second;
+
+    const string & name = RTN_Name(rtn);
+    BOOL selected = FALSE;
+    for (size_t i = 0; i < routinePatterns.size() && !selected; i++)
+        selected = GlobMatch(routinePatterns[i].c_str(), name.c_str());
+
+    routineDecisions[RTN_Address(rtn)] = selected;
+    return selected;
+}
+
+static BOOL ShouldInstrument(INS ins)
+{
+    ADDRINT address = INS_Address(ins);
+
+    if (!ranges.empty())
+    {
+        BOOL inside = FALSE;
+        for (size_t i = 0; i < ranges.size() && !inside; i++)
+            inside = address >= ranges[i].low && address < ranges[i].high;
+        if (!inside)
+            return FALSE;
+    }
+
+    if (!imagePatterns.empty() && !ImageSelected(IMG_FindByAddress(address)))
+        return FALSE;
+
+    if (!routinePatterns.empty() && !RoutineSelected(INS_Rtn(ins)))
+        return FALSE;
+
+    return TRUE;
+}
+
+// Acesso pelo ponteiro de pilha ou de quadro (inclui push, pop, call e ret)
+static BOOL IsStackOperand(INS ins, UINT32 memOp)
+{
+    REG base = INS_OperandMemoryBaseReg(ins, INS_MemoryOperandIndexToOperandIndex(ins, memOp));
+    return base == REG_STACK_PTR || base == REG_GBP;
+}
+
 /**
  * Chamada para toda instrução e somente adiciona código de
  * análise para instruções de leitura e escrita em memória.
@@ -61,18 +1017,30 @@ VOID Instruction(INS ins, VOID *v)
      * que a instrumentação seja chamada se, e somente se,
      * a instrução da aplicação alvo for de fato executada.
      */
+    if (!ShouldInstrument(ins))
+        return;
+
+    UINT64 start = EstatisticasInstrumentacao();
     UINT32 memOperands = INS_MemoryOperandCount(ins);
 
 	  // Itera sobre cada operando de memória da instrução.
     for (UINT32 memOp = 0; memOp < memOperands; memOp++)
     {
+        if (KnobSkipStack.Value() && IsStackOperand(ins, memOp))
+            continue;
+
         if (INS_MemoryOperandIsRead(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
-                IARG_END);
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, 0, TRUE);
+            if (mode != MODE_TEXT)
+                InsertFillBuffer(ins, memOp, 0);
+            else
+                INS_InsertPredicatedCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)RecordMemRead,
+                    IARG_INST_PTR,
+                    IARG_MEMORYOP_EA, memOp,
+                    IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE, TRUE);
         }
         
         /**
@@ -84,19 +1052,387 @@ VOID Instruction(INS ins, VOID *v)
          */
         if (INS_MemoryOperandIsWritten(ins, memOp))
         {
-            INS_InsertPredicatedCall(
-                ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
-                IARG_INST_PTR,
-                IARG_MEMORYOP_EA, memOp,
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, 1, TRUE);
+            if (mode != MODE_TEXT)
+                InsertFillBuffer(ins, memOp, 1);
+            else
+                INS_InsertPredicatedCall(
+                    ins, IPOINT_BEFORE, (AFUNPTR)RecordMemWrite,
+                    IARG_INST_PTR,
+                    IARG_MEMORYOP_EA, memOp,
+                    IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE, TRUE);
+        }
+    }
+
+    EstatisticasInsInstrumentada(start);
+}
+
+/**
+ * Modo "bbl": escreve a definição de um BBL no arquivo. Como a escrita
+ * ocorre durante a instrumentação, antes que o código do BBL execute, a
+ * definição sempre precede os registros que a usam. As definições também
+ * são guardadas em "bblDefs", para o arquivo dos processos filhos.
+ */
+static VOID WriteBblDef(ADDRINT address, UINT32 id, const vector<PINATRACE_BBLOP> & ops)
+{
+    PINATRACE_CHUNK chunk;
+    chunk.type = PINATRACE_CHUNK_BBLDEF;
+    chunk.tid = PIN_ThreadId();
+    chunk.seq = 0;
+    chunk.count = ops.size();
+
+    PINATRACE_BBLDEF def;
+    def.address = address;
+    def.id = id;
+    def.numOps = (UINT32)ops.size();
+
+    PIN_GetLock(&traceLock, PIN_ThreadId() + 1);
+    size_t start = bblDefs.size();
+    bblDefs.insert(bblDefs.end(), reinterpret_cast<UINT8 *>(&chunk), reinterpret_cast<UINT8 *>(&chunk + 1));
+    bblDefs.insert(bblDefs.end(), reinterpret_cast<UINT8 *>(&def), reinterpret_cast<UINT8 *>(&def + 1));
+    bblDefs.insert(bblDefs.end(), reinterpret_cast<const UINT8 *>(&ops[0]),
+                   reinterpret_cast<const UINT8 *>(&ops[0] + ops.size()));
+    fwrite(&bblDefs[start], 1, bblDefs.size() - start, trace);
+    PIN_ReleaseLock(&traceLock);
+}
+
+/**
+ * Modo "bbl": reúne os acessos selecionados (mesmos filtros de
+ * "Instruction") de cada BBL em um único registro por execução.
+ */
+VOID TraceBbl(TRACE trace, VOID *v)
+{
+    UINT64 start = EstatisticasInstrumentacao();
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        // Acessos do BBL, na ordem de execução
+        vector<PINATRACE_BBLOP> ops;
+        vector<INS> opIns;
+        vector<UINT32> opMemOp;
+
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins))
+        {
+            if (!ShouldInstrument(ins))
+                continue;
+
+            for (UINT32 memOp = 0; memOp < INS_MemoryOperandCount(ins); memOp++)
+            {
+                if (KnobSkipStack.Value() && IsStackOperand(ins, memOp))
+                    continue;
+
+                PINATRACE_BBLOP op;
+                op.offset = (UINT32)(INS_Address(ins) - BBL_Address(bbl));
+                op.size = (UINT16)INS_MemoryOperandSize(ins, memOp);
+                op.flags = (INS_IsPredicated(ins) ? PINATRACE_OP_PREDICATED : 0) |
+                           (INS_HasRealRep(ins) ? PINATRACE_OP_REP : 0);
+
+                // Um operando lido e escrito ocupa duas posições
+                for (UINT32 isWrite = 0; isWrite < 2; isWrite++)
+                {
+                    if (isWrite ? !INS_MemoryOperandIsWritten(ins, memOp) : !INS_MemoryOperandIsRead(ins, memOp))
+                        continue;
+                    op.isWrite = isWrite;
+                    ops.push_back(op);
+                    opIns.push_back(ins);
+                    opMemOp.push_back(memOp);
+                }
+            }
+        }
+
+        if (ops.empty())
+            continue;
+
+        pair<ADDRINT, USIZE> key(BBL_Address(bbl), BBL_Size(bbl));
+        map<pair<ADDRINT, USIZE>, UINT32>::iterator it = bblIds.find(key);
+        UINT32 id;
+        if (it != bblIds.end())
+            id = it->second;
+        else
+        {
+            id = (UINT32)bblIds.size() + 1;
+            bblIds[key] = id;
+            WriteBblDef(BBL_Address(bbl), id, ops);
+        }
+
+        ADDRINT bytes = (1 + ops.size()) * sizeof(ADDRINT);
+        INS head = BBL_InsHead(bbl);
+
+        EstatisticasAntesIns(head, IPOINT_BEFORE, 0);
+        INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)BblFull, IARG_FAST_ANALYSIS_CALL,
+                         IARG_REG_VALUE, bblCursorReg, IARG_REG_VALUE, bblLimitReg,
+                         IARG_ADDRINT, bytes, IARG_END);
+        INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)BblFlush,
+                           IARG_THREAD_ID, IARG_REG_VALUE, bblCursorReg,
+                           IARG_RETURN_REGS, bblCursorReg, IARG_END);
+        INS_InsertCall(head, IPOINT_BEFORE, (AFUNPTR)BblBegin, IARG_FAST_ANALYSIS_CALL,
+                       IARG_REG_VALUE, bblCursorReg, IARG_ADDRINT, (ADDRINT)id,
+                       IARG_ADDRINT, bytes, IARG_RETURN_REGS, bblCursorReg, IARG_END);
+        EstatisticasDepoisIns(head, IPOINT_BEFORE);
+
+        for (size_t i = 0; i < ops.size(); i++)
+        {
+            INS ins = opIns[i];
+            ADDRINT back = bytes - (1 + i) * sizeof(ADDRINT);
+
+            EstatisticasAntesIns(ins, IPOINT_BEFORE, 1);
+            if (ops[i].flags & PINATRACE_OP_REP)
+            {
+                INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)BblFirstRep, IARG_FAST_ANALYSIS_CALL,
+                                 IARG_FIRST_REP_ITERATION, IARG_END);
+                INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)BblStoreEa, IARG_FAST_ANALYSIS_CALL,
+                                   IARG_REG_VALUE, bblCursorReg, IARG_ADDRINT, back,
+                                   IARG_MEMORYOP_EA, opMemOp[i], IARG_EXECUTING, IARG_END);
+            }
+            else
+                INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)BblStoreEa, IARG_FAST_ANALYSIS_CALL,
+                               IARG_REG_VALUE, bblCursorReg, IARG_ADDRINT, back,
+                               IARG_MEMORYOP_EA, opMemOp[i], IARG_EXECUTING, IARG_END);
+            EstatisticasDepoisIns(ins, IPOINT_BEFORE);
+        }
+    }
+
+    EstatisticasTraceInstrumentado(start, trace);
+}
+
+/**
+ * Amostragem: instrumenta as duas versões de cada trace. Em ambas, o
+ * início de cada BBL desconta as instruções do período e, quando ele
+ * acaba, desvia para a outra versão. Só VERSION_TRACE recebe o código de
+ * rastreamento de "Instruction" e, nos modos binários, o marcador de
+ * início de amostra.
+ */
+VOID Trace(TRACE trace, VOID *v)
+{
+    ADDRINT version = TRACE_Version(trace);
+
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl))
+    {
+        INS head = BBL_InsHead(bbl);
+
+        INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)SampleTick, IARG_FAST_ANALYSIS_CALL,
+                         IARG_REG_VALUE, sampleReg, IARG_UINT32, BBL_NumIns(bbl), IARG_END);
+        INS_InsertThenCall(head, IPOINT_BEFORE, (AFUNPTR)SampleSwitch,
+                           IARG_REG_VALUE, sampleReg, IARG_RETURN_REGS, versionReg, IARG_END);
+
+        if (version == VERSION_SKIP)
+        {
+            INS_InsertVersionCase(head, versionReg, VERSION_TRACE, VERSION_TRACE, IARG_END);
+            continue;
+        }
+
+        INS_InsertVersionCase(head, versionReg, VERSION_SKIP, VERSION_SKIP, IARG_END);
+
+        if (mode != MODE_TEXT)
+        {
+            INS_InsertIfCall(head, IPOINT_BEFORE, (AFUNPTR)SampleMarkPending, IARG_FAST_ANALYSIS_CALL,
+                             IARG_REG_VALUE, sampleReg, IARG_END);
+            INS_InsertFillBufferThen(
+                head, IPOINT_BEFORE, bufId,
+                IARG_INST_PTR, offsetof(PINATRACE_REC, ip),
+                IARG_ADDRINT, (ADDRINT)0, offsetof(PINATRACE_REC, ea),
+                IARG_UINT32, 0, offsetof(PINATRACE_REC, size),
+                IARG_UINT32, (UINT32)PINATRACE_REC_SAMPLE, offsetof(PINATRACE_REC, isWrite),
                 IARG_END);
         }
+
+        for (INS ins = head; INS_Valid(ins); ins = INS_Next(ins))
+            Instruction(ins, v);
+    }
+}
+
+/**
+ * Antes de um "fork", no pai: adquire as travas dos arquivos e esvazia os
+ * buffers do stdio, para que o filho não escreva de novo dados do pai.
+ */
+VOID ForkBefore(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    if (mode == MODE_TEXT)
+    {
+        flockfile(trace);
+        fflush(trace);
+    }
+    else if (mode == MODE_BUFFER || mode == MODE_BBL)
+    {
+        PIN_GetLock(&traceLock, tid + 1);
+        fflush(trace);
+    }
+    else if (mode == MODE_ASYNC)
+    {
+        PIN_GetLock(&ringsLock, tid + 1);
+        fflush(trace);
+        for (size_t i = 0; i < rings.size(); i++)
+        {
+            if (rings[i]->out != trace)
+                fflush(rings[i]->out);
+        }
+    }
+    else
+        PIN_GetLock(&simLock, tid + 1);
+}
+
+VOID ForkParent(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    if (mode == MODE_TEXT)
+        funlockfile(trace);
+    else if (mode == MODE_BUFFER || mode == MODE_BBL)
+        PIN_ReleaseLock(&traceLock);
+    else if (mode == MODE_ASYNC)
+        PIN_ReleaseLock(&ringsLock);
+    else
+        PIN_ReleaseLock(&simLock);
+}
+
+/**
+ * Depois de um "fork", no filho: reabre o trace (ou o relatório) com o
+ * nome do processo e mantém só o estado da thread que chamou "fork". Os
+ * buffers do modo "bbl" das demais threads não são liberados, pois a
+ * ferramenta não guarda a lista deles.
+ */
+VOID ForkChild(THREADID tid, const CONTEXT *ctxt, VOID *v)
+{
+    string name = SaidaProcessoNome(KnobOutputFile.Value());
+
+    // Anéis das threads que não existem no filho, liberados antes que o
+    // arquivo comum seja reaberto
+    ThreadRing * own = NULL;
+    if (mode == MODE_ASYNC)
+    {
+        PIN_InitLock(&ringsLock);
+        own = static_cast<ThreadRing *>(PIN_GetThreadData(ringKey, tid));
+
+        vector<ThreadRing *> others;
+        for (size_t i = 0; i < rings.size(); i++)
+        {
+            if (rings[i] != own)
+                others.push_back(rings[i]);
+        }
+        for (size_t i = 0; i < others.size(); i++)
+            FreeRing(others[i]);
+    }
+
+    if (mode == MODE_SIM)
+    {
+        PIN_InitLock(&simLock);
+        for (size_t i = 0; i < simThreads.size(); i++)
+            delete simThreads[i];
+
+        CacheSim * sim = new CacheSim(cacheLevels);
+        PIN_SetThreadData(simKey, sim, tid);
+        simThreads.assign(1, sim);
+
+        delete simTotals;
+        simTotals = new CacheSimStats(cacheLevels);
+    }
+    else
+    {
+        if (mode == MODE_TEXT)
+            funlockfile(trace);
+        fclose(trace);
+        trace = fopen(name.c_str(), mode == MODE_TEXT ? "w" : "wb");
+        if (trace == NULL)
+        {
+            PIN_ERROR("Could not create " + name + "\n");
+            PIN_ExitProcess(1);
+        }
+        if (mode != MODE_TEXT && !(mode == MODE_ASYNC && KnobSplit.Value()))
+            WriteHeader(trace);
+    }
+
+    if (mode == MODE_BUFFER || mode == MODE_ASYNC || mode == MODE_SIM)
+    {
+        CONTEXT copy;
+        PIN_SaveContext(ctxt, &copy);
+        forkCursor = PIN_GetBufferPointer(&copy, bufId);
+        forkTid = tid;
+    }
+
+    if (mode == MODE_BUFFER)
+    {
+        PIN_InitLock(&traceLock);
+        chunkSeq.clear();
+    }
+    else if (mode == MODE_BBL)
+    {
+        PIN_InitLock(&traceLock);
+        if (!bblDefs.empty())
+            fwrite(&bblDefs[0], 1, bblDefs.size(), trace);
+        bblChunks = 0;
+        bblWords = 0;
+
+        BblThread * bt = static_cast<BblThread *>(PIN_GetThreadData(bblKey, tid));
+        bt->seq = 0;
+        bt->forkCursor = PIN_GetContextReg(ctxt, bblCursorReg);
+    }
+    else if (mode == MODE_ASYNC)
+    {
+        // Os buffers enfileirados e ainda não escritos são do pai
+        own->cons = own->prod;
+        own->seq = 0;
+        own->stalls = 0;
+        PIN_SemaphoreInit(&own->space);
+        if (KnobSplit.Value())
+        {
+            fclose(own->out);
+            own->out = fopen((name + "." + decstr(tid)).c_str(), "wb");
+            WriteHeader(own->out);
+        }
+        else
+            own->out = trace;
+
+        totalStalls = 0;
+        totalChunks = 0;
+        writerStop = FALSE;
+        writerDone = FALSE;
+        PIN_SemaphoreInit(&writerWake);
+        if (PIN_SpawnInternalThread(WriterThread, 0, 0, &writerUid) == INVALID_THREADID)
+        {
+            PIN_ERROR("Could not start the writer thread\n");
+            PIN_ExitProcess(1);
+        }
     }
 }
 
 VOID Fini(INT32 code, VOID *v)
 {
-    fprintf(trace, "#eof\n");
+    if (mode == MODE_SIM)
+    {
+        // Threads que ainda não terminaram
+        for (size_t i = 0; i < simThreads.size(); i++)
+            simThreads[i]->MergeInto(*simTotals);
+
+        string name = SaidaProcessoNome(KnobOutputFile.Value());
+        FILE * report = fopen(name.c_str(), "w");
+        if (report == NULL)
+        {
+            perror(name.c_str());
+            return;
+        }
+        WriteCacheSimReport(report, *simTotals, KnobTop.Value());
+        fclose(report);
+        return;
+    }
+
+    // Nos modos binários, o Pin já esvaziou os buffers de todas as threads
+    // ao encerrá-las; o fim do arquivo é o próprio fim dos dados.
+    if (mode == MODE_TEXT)
+        fprintf(trace, "#eof\n");
     fclose(trace);
+
+    if (mode == MODE_BBL)
+        fprintf(stderr, "pinatrace: %llu basic blocks defined, %llu chunks written, %llu words\n",
+                (unsigned long long)bblIds.size(), (unsigned long long)bblChunks,
+                (unsigned long long)bblWords);
+
+    if (mode == MODE_ASYNC)
+    {
+        for (size_t i = 0; i < rings.size(); i++)
+            totalStalls += rings[i]->stalls;
+
+        fprintf(stderr, "pinatrace: %llu chunks written, %llu ring-full stalls\n",
+                (unsigned long long)totalChunks, (unsigned long long)totalStalls);
+    }
 }
 
 /* ===================================================================== */
@@ -118,9 +1454,141 @@ int main(int argc, char *argv[])
 {
     if (PIN_Init(argc, argv)) return Usage();
 
-    trace = fopen("pinatrace.out", "w");
+    // Saídas por processo, antes de abrir qualquer arquivo
+    SaidaProcessoInicia(KnobPidSuffix.Value());
+
+    if (KnobMode.Value() == "buffer")
+        mode = MODE_BUFFER;
+    else if (KnobMode.Value() == "async")
+        mode = MODE_ASYNC;
+    else if (KnobMode.Value() == "sim")
+        mode = MODE_SIM;
+    else if (KnobMode.Value() == "bbl")
+        mode = MODE_BBL;
+    else if (KnobMode.Value() != "text")
+        return Usage();
+
+    if (mode == MODE_SIM && !ParseCacheConfig(KnobCache.Value(), cacheLevels))
+        return Usage();
+
+    if (mode == MODE_ASYNC && KnobRingSize.Value() < 2)
+        return Usage();
+
+    sampling = KnobSampleSkip.Value() > 0;
+    if (sampling && KnobSampleTrace.Value() == 0)
+        return Usage();
+
+    // O modo "bbl" não grava marcadores de amostra
+    if (sampling && mode == MODE_BBL)
+        return Usage();
+
+    ReadPatterns(KnobImage, imagePatterns);
+    ReadPatterns(KnobRoutine, routinePatterns);
+    if (!ParseRanges())
+        return Usage();
+
+    // Os nomes das rotinas só estão disponíveis com a tabela de símbolos
+    if (!routinePatterns.empty())
+        PIN_InitSymbols();
+
+    // No modo "sim", só o relatório é escrito, ao final
+    if (mode != MODE_SIM)
+        trace = fopen(SaidaProcessoNome(KnobOutputFile.Value()).c_str(), mode == MODE_TEXT ? "w" : "wb");
+
+    if (mode == MODE_BBL)
+        WriteHeader(trace);
+
+    if (mode != MODE_TEXT && mode != MODE_BBL)
+    {
+        // No modo "async" com -split, o arquivo comum fica vazio
+        if (mode == MODE_BUFFER || (mode == MODE_ASYNC && !KnobSplit.Value()))
+            WriteHeader(trace);
+
+        // Cada thread recebe seu próprio buffer de KnobNumPages páginas
+        bufId = PIN_DefineTraceBuffer(sizeof(PINATRACE_REC), KnobNumPages.Value(),
+                                      mode == MODE_BUFFER ? BufferFull :
+                                      mode == MODE_ASYNC ? RingBufferFull : SimBufferFull, 0);
+        if (bufId == BUFFER_ID_INVALID)
+        {
+            PIN_ERROR("Could not allocate the trace buffer\n");
+            return -1;
+        }
+    }
+
+    if (mode == MODE_BUFFER || mode == MODE_BBL)
+        PIN_InitLock(&traceLock);
+
+    if (mode == MODE_BBL)
+    {
+        bblCursorReg = PIN_ClaimToolRegister();
+        bblLimitReg = PIN_ClaimToolRegister();
+        if (!REG_valid(bblCursorReg) || !REG_valid(bblLimitReg))
+        {
+            PIN_ERROR("Could not claim the tool registers for the bbl mode\n");
+            return -1;
+        }
+        bblKey = PIN_CreateThreadDataKey(0);
+
+        PIN_AddThreadStartFunction(BblThreadStart, 0);
+        PIN_AddThreadFiniFunction(BblThreadFini, 0);
+    }
+
+    if (mode == MODE_SIM)
+    {
+        PIN_InitLock(&simLock);
+        simKey = PIN_CreateThreadDataKey(0);
+        simTotals = new CacheSimStats(cacheLevels);
+
+        PIN_AddThreadStartFunction(SimThreadStart, 0);
+        PIN_AddThreadFiniFunction(SimThreadFini, 0);
+    }
+
+    if (mode == MODE_ASYNC)
+    {
+        PIN_InitLock(&ringsLock);
+        PIN_SemaphoreInit(&writerWake);
+        ringKey = PIN_CreateThreadDataKey(0);
 
-    INS_AddInstrumentFunction(Instruction, 0);
+        PIN_AddThreadStartFunction(ThreadStart, 0);
+        PIN_AddThreadFiniFunction(ThreadFini, 0);
+        PIN_AddPrepareForFiniFunction(PrepareForFini, 0);
+
+        if (PIN_SpawnInternalThread(WriterThread, 0, 0, &writerUid) == INVALID_THREADID)
+        {
+            PIN_ERROR("Could not start the writer thread\n");
+            return -1;
+        }
+    }
+
+    // Registrada antes de EstatisticasInicia (ver saida-processo.h)
+    SaidaProcessoAoFork(ForkBefore, ForkParent, ForkChild, 0);
+
+    if (!EstatisticasInicia(KnobStats.Value(), "pinatrace", mode == MODE_TEXT ? textRoutines :
+                            mode == MODE_BBL ? bblRoutines : bufferRoutines, 2, KnobStatsSample.Value()))
+    {
+        PIN_ERROR("Could not claim a tool register for -stats\n");
+        return -1;
+    }
+
+    if (sampling)
+    {
+        sampleReg = PIN_ClaimToolRegister();
+        versionReg = PIN_ClaimToolRegister();
+        if (!REG_valid(sampleReg) || !REG_valid(versionReg))
+        {
+            PIN_ERROR("Could not claim the tool registers for sampling\n");
+            return -1;
+        }
+        sampleKey = PIN_CreateThreadDataKey(0);
+
+        PIN_AddThreadStartFunction(SampleThreadStart, 0);
+        PIN_AddThreadFiniFunction(SampleThreadFini, 0);
+        TRACE_AddInstrumentFunction(Trace, 0);
+    }
+    else if (mode == MODE_BBL)
+        TRACE_AddInstrumentFunction(TraceBbl, 0);
+    else
+        INS_AddInstrumentFunction(Instruction, 0);
     PIN_AddFiniFunction(Fini, 0);
 
     // Never returns
@@ -0,0 +1,751 @@
+/*
+Proteção unificada contra ROP: executa, em uma única passagem do Pin, os detectores da pilha sombra
+(pilha-sombra.cpp), da janela deslizante de desvios indiretos (janela-deslizante.cpp) e do LBR de
+instruções CALL (lbrmatch.cpp), cada um ativado por uma opção (-pilha, -janela, -lbr).
+
+A instrumentação percorre a última instrução de cada BBL uma única vez e insere, conforme o tipo de
+desvio, uma única função de análise que atualiza todos os detectores ativos: "VerificaRET" nos RETs,
+"EmpilhaCALL" nos CALLs, "AtualizaIndireto" nos demais desvios indiretos e "DeslocaJanela" onde a
+janela só precisa ser deslocada. As funções são especializadas em tempo de compilação para cada
+combinação de detectores (templates) e não contêm chamadas nem desvios, para que o Pin faça o seu
+"inline". Cada uma grava em "pendencias" os detectores que precisam de atenção (limiar superado,
+retorno divergente, pilha sombra cheia etc.) e, só nesses casos raros, a parte "Then" compartilhada
+("TrataPendencias") trata cada um deles.
+
+Todo o estado de uma thread (janela, topo da pilha sombra, LBR e contadores) fica em um único bloco
+da arena de "arena-threads.h", alinhado a uma linha da cache, cujo endereço fica no registrador
+reservado "reg_estado". Apenas as entradas da pilha sombra, que crescem sob demanda, ficam fora dele.
+
+Diferenças em relação às ferramentas separadas:
+ - a janela tem 32 instruções (-w não é suportada);
+ - a pilha sombra é a do modo rápido de pilha-sombra.cpp com um único contexto: quadros abandonados
+   (longjmp, exceções) são descartados, mas trocas de pilha (corrotinas) não são reconhecidas;
+ - o LBR, em vez de apenas contar as correspondências, reporta os RETs cujo destino não é o endereço
+   de retorno do último CALL anotado nele (a memória é limitada ao tamanho do LBR, -s).
+
+Versão para Linux.
+*/
+
+// importação de bibliotecas do Pin e de C++
+#include "pin.H"          // para usar APIs do Pin
+#include <stdio.h>        // para usar "fprintf"
+#include <string.h>       // para usar "memcpy"
+#include <sstream>        // para converter números para string
+#include <fstream>        // para imprimir no arquivo de saída
+#include <sys/time.h>     // para registro do tempo de processador usado pelo algoritmo
+#include <sys/resource.h> // para registro do tempo de processador usado pelo algoritmo
+#include <sys/mman.h>     // para usar "mmap" nas entradas da pilha sombra
+#include <unistd.h>       // para usar "getpagesize"
+#include "alertas-rop.h"  // para registrar os alertas sem escrever no arquivo de saída a partir das funções de análise
+#include "arena-threads.h" // para alocar o estado das threads, alinhado e reaproveitado quando as threads terminam
+#include "estatisticas.h"   // para medir o custo da instrumentação e da análise (opção -stats)
+#include "saida-processo.h" // para separar as saídas dos processos criados por "fork" (opção -sufixo_pid)
+
+
+/**** Variáveis Globais ****/
+static const UINT32 tam_janela = 32;      // tamanho da janela em bits (instruções)
+static const UINT32 MASCARA_UM = 1;       // máscara usada para setar o bit menos significativo da janela
+static std::ofstream arquivo_saida;       // arquivo onde a saída é escrita
+static string nome_saida;                 // nome do arquivo de saída (opção -o), sem o sufixo do processo
+static TLS_KEY chave_tls;                 // chave para acesso ao armazenamento local (TLS) das threads
+static REG reg_estado;                    // registrador reservado que guarda, em cada thread, o endereço do seu estado
+static BOOL usa_pilha;                    // detectores ativos (opções -pilha, -janela e -lbr)
+static BOOL usa_janela;
+static BOOL usa_lbr;
+static UINT32 limiar;                     // janela: limiar de desvios indiretos (opção -l)
+static size_t capacidade_inicial;         // pilha sombra: nº inicial de entradas (opção -capacidade)
+static UINT32 tam_lbr;                    // LBR: nº de entradas, potência de 2 (opção -s)
+static UINT32 mascara_lbr;                // LBR: tam_lbr - 1, usada para calcular os índices
+static AFUNPTR funcao_ret;                // versões das funções de análise para os detectores ativos
+static AFUNPTR funcao_call;
+static AFUNPTR funcao_call_indireto;
+static ArenaThreads arena_estados;        // arena de onde vêm os estados das threads
+static PIN_LOCK trava_contadores;         // protege os totais abaixo, acumulados quando cada thread termina
+static UINT64 total_limiares = 0;         // alertas de limiar da janela superado
+static UINT64 total_divergencias = 0;     // alertas de endereço de retorno divergente da pilha sombra
+static UINT64 total_vazias = 0;           // alertas de RET com a pilha sombra vazia
+static UINT64 total_ressincronizacoes = 0; // RETs e CALLs em que quadros abandonados foram descartados
+static UINT64 total_lbr_acertos = 0;      // RETs que correspondem ao último CALL do LBR
+static UINT64 total_lbr_falhas = 0;       // alertas de RET que não corresponde ao último CALL do LBR
+static const UINT32 ALERTA_LIMIAR = 1;      // tipos de alerta (ver "alertas-rop.h"): limiar da janela superado
+static const UINT32 ALERTA_DIVERGENCIA = 2; // endereço de retorno divergente da pilha sombra
+static const UINT32 ALERTA_PILHA_VAZIA = 3; // RET com a pilha sombra vazia
+static const UINT32 ALERTA_LBR = 4;         // RET que não corresponde ao último CALL do LBR
+static const UINT32 PENDENCIA_LIMIAR = 1;   // motivos para executar a parte "Then" ("EstadoThread::pendencias")
+static const UINT32 PENDENCIA_RET = 2;      // RET que não corresponde ao topo da pilha sombra
+static const UINT32 PENDENCIA_CALL = 4;     // CALL com a pilha sombra cheia ou quadro fora de ordem
+static const UINT32 PENDENCIA_LBR = 8;      // RET que não corresponde ao último CALL do LBR
+static const char *const rotinas_medidas[] = {"VerificaRET", "EmpilhaCALL", "AtualizaIndireto", "DeslocaJanela"}; // rotinas medidas com a opção -stats
+static const UINT32 ROTINA_VERIFICA_RET = 0;  // índices de "rotinas_medidas" (ver "estatisticas.h")
+static const UINT32 ROTINA_EMPILHA_CALL = 1;
+static const UINT32 ROTINA_ATUALIZA_INDIRETO = 2;
+static const UINT32 ROTINA_DESLOCA_JANELA = 3;
+/**** Fim das Variáveis Globais ****/
+
+// Entrada da pilha sombra: o endereço de retorno e a posição da pilha da thread onde a instrução
+// CALL o gravou (ver pilha-sombra.cpp)
+struct EntradaPilha{
+   ADDRINT retorno;  // endereço de retorno empilhado pelo CALL
+   ADDRINT posicao;  // endereço onde o CALL gravou o endereço de retorno (ESP/RSP logo após o CALL)
+};
+
+// Estado de uma thread, em um bloco da arena "arena_estados". Os campos usados pelas funções de
+// análise vêm primeiro, na mesma linha da cache; as "tam_lbr" entradas do LBR vêm logo após a
+// estrutura, no mesmo bloco.
+struct EstadoThread{
+   UINT32 janela_bits;       // janela: 1 bit por instrução, setado nos desvios indiretos
+   UINT32 pendencias;        // motivos da última execução da parte "Then" (PENDENCIA_*)
+   EntradaPilha *topo;       // pilha sombra: próxima posição livre
+   EntradaPilha *base;       // pilha sombra: primeira entrada
+   EntradaPilha *limite;     // pilha sombra: posição seguinte à última entrada
+   UINT32 lbr_cabeca;        // LBR: posição da próxima entrada (módulo tam_lbr)
+   UINT32 lbr_validas;       // LBR: nº de entradas válidas (no máximo tam_lbr)
+   UINT64 lbr_acertos;       // LBR: RETs que correspondem ao último CALL anotado
+   void *mapeamento;         // pilha sombra: área obtida com "mmap"
+   size_t tam_mapeado;       // pilha sombra: tamanho da área obtida com "mmap"
+   UINT64 limiares;          // contadores da thread, acumulados nos totais quando ela termina
+   UINT64 divergencias;
+   UINT64 vazias;
+   UINT64 ressincronizacoes;
+   UINT64 lbr_falhas;
+
+   ADDRINT *Lbr(){ return(reinterpret_cast<ADDRINT *>(this + 1)); }
+};
+
+// As funções de análise usam a instrução de HW POPCNT. O atributo garante que o compilador a emita
+// diretamente, em vez de chamar uma rotina da biblioteca, o que impediria o "inline".
+#define USA_POPCNT __attribute__((target("popcnt")))
+
+// Imprime mensagem indicando opções de uso no prompt de comandos
+void Uso(){
+   fprintf(stderr, "\nUso: pin -t <Pintool> [-pilha <0|1>] [-janela <0|1>] [-lbr <0|1>] [-l <Limiar>] [-s <EntradasLBR>] [-capacidade <Entradas>] [-formato <texto|json>] [-alertas_seg <Linhas>] [-intervalo <ms>] [-stats <ArquivoJSON>] [-stats_amostra <N>] [-sufixo_pid <0|1>] [-o <NomeArquivoSaida>] [-logfile <NomeLogDepuracao>] -- <Programa alvo>\n\n"
+                   "Opções:\n"
+                   "  -pilha   <0|1>\t"
+                   "Ativa a pilha sombra (padrão: 1)\n"
+                   "  -janela  <0|1>\t"
+                   "Ativa a janela deslizante de desvios indiretos (padrão: 1)\n"
+                   "  -lbr     <0|1>\t"
+                   "Ativa a verificação dos RETs com o LBR de instruções CALL (padrão: 1)\n"
+                   "  -l       <Limiar>\t"
+                   "Indica o limiar de desvios indiretos na janela de 32 instruções (padrão: 10)\n"
+                   "  -s       <EntradasLBR>\t"
+                   "Indica o nº de entradas do LBR: potência de 2, de 4 a 1024 (padrão: 16)\n"
+                   "  -capacidade <Entradas>\t"
+                   "Indica o nº inicial de entradas da pilha sombra (padrão: 65536)\n"
+                   "  -formato <texto|json>\t"
+                   "Indica o formato dos alertas: texto ou um objeto JSON por linha (padrão: texto)\n"
+                   "  -alertas_seg <Linhas>\t"
+                   "Indica o nº máximo de linhas de alerta escritas por segundo; 0 não limita (padrão: 100)\n"
+                   "  -intervalo <ms>\t"
+                   "Indica o intervalo entre os relatórios de alertas agregados (padrão: 1000)\n"
+                   "  -stats   <ArquivoJSON>\t"
+                   "Mede o custo da instrumentação e das funções de análise e o escreve em JSON no arquivo (padrão: desligado)\n"
+                   "  -stats_amostra <N>\t"
+                   "Indica de quantas em quantas execuções, em média, o custo das funções de análise é medido (padrão: 1000)\n"
+                   "  -sufixo_pid <0|1>\t"
+                   "Acrescenta .<pid> aos arquivos de saída também no processo inicial, como nos criados por fork; necessário com -follow_execv (padrão: 0)\n"
+                   "  -o       <NomeArquivoSaida>\t"
+                   "Indica o nome do arquivo de saida (padrão: $PASTA_CORRENTE/pintool.out)\n"
+                   "  -logfile <NomeLogDepuracao>\t"
+                   "Indica o nome do arquivo de log de depuracao (padrão: $PASTA_CORRENTE/pintool.log)\n\n");
+}
+
+// Função usada para converter um valor do tipo "double" para o tipo "string"
+static string converte_double_string(double valor){
+   ostringstream oss;
+   oss << valor;
+   return(oss.str());
+}
+
+// Pilha sombra: mapeia uma área para "capacidade" entradas, mais a posição extra antes da base,
+// nunca usada como entrada e zerada, para que as funções de análise possam ler "topo[-1]" mesmo
+// com a pilha vazia. Retorna FALSE se não houver memória disponível.
+static BOOL MapeiaPilha(EstadoThread *estado, size_t capacidade){
+   size_t tam_pagina = getpagesize();
+   size_t tam_entradas = ((capacidade + 1) * sizeof(EntradaPilha) + tam_pagina - 1) / tam_pagina * tam_pagina;
+
+   void *mapeamento = mmap(NULL, tam_entradas, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if(mapeamento == MAP_FAILED){
+      return(FALSE);
+   }
+
+   estado->mapeamento = mapeamento;
+   estado->tam_mapeado = tam_entradas;
+   estado->base = static_cast<EntradaPilha *>(mapeamento) + 1;
+   estado->limite = reinterpret_cast<EntradaPilha *>(static_cast<UINT8 *>(mapeamento) + tam_entradas);
+   estado->topo = estado->base;
+   return(TRUE);
+}
+
+// Pilha sombra: realoca as entradas com o dobro da capacidade, copiando as existentes
+static void CrescePilha(EstadoThread *estado){
+   EstadoThread antigo = *estado;
+   size_t num_entradas = antigo.topo - antigo.base;
+
+   if(!MapeiaPilha(estado, 2 * (antigo.limite - antigo.base))){
+      fprintf(stderr, "Erro ao aumentar a pilha sombra (%lu entradas)\n", static_cast<unsigned long>(num_entradas));
+      PIN_ExitProcess(1);
+   }
+
+   memcpy(estado->base, antigo.base, num_entradas * sizeof(EntradaPilha));
+   estado->topo = estado->base + num_entradas;
+   munmap(antigo.mapeamento, antigo.tam_mapeado);
+}
+
+// Pilha sombra: como as posições das entradas decrescem da base para o topo, usa busca binária para
+// obter a primeira entrada cuja posição não está acima de "posicao". As entradas a partir dela
+// correspondem a quadros que já foram abandonados ou, se a posição for igual, ao próprio quadro.
+static EntradaPilha *BuscaPosicao(EstadoThread *estado, ADDRINT posicao){
+   EntradaPilha *inicio = estado->base;
+   EntradaPilha *fim = estado->topo;
+   while(inicio < fim){
+      EntradaPilha *meio = inicio + (fim - inicio) / 2;
+      if(meio->posicao > posicao){
+         inicio = meio + 1;
+      }
+      else{
+         fim = meio;
+      }
+   }
+   return(inicio);
+}
+
+// Função chamada ao iniciar uma nova thread.
+// Obtém da arena o estado da nova thread, já zerado, mapeia a sua pilha sombra e guarda o endereço
+// do estado no TLS e no registrador reservado "reg_estado".
+void IniciaThread(THREADID tid, CONTEXT *contexto, int flags, void *v){
+   EstadoThread *estado = static_cast<EstadoThread *>(ArenaAloca(&arena_estados));
+   if(usa_pilha && !MapeiaPilha(estado, capacidade_inicial)){
+      fprintf(stderr, "Erro ao alocar uma pilha sombra\n");
+      PIN_ExitProcess(1);
+   }
+
+   PIN_SetThreadData(chave_tls, estado, tid);
+   PIN_SetContextReg(contexto, reg_estado, reinterpret_cast<ADDRINT>(estado));
+}
+
+// Função chamada quando uma thread termina.
+// Acumula os contadores da thread, libera a sua pilha sombra e devolve o estado à arena.
+void TerminaThread(THREADID tid, const CONTEXT *contexto, int codigo, void *v){
+   EstadoThread *estado = static_cast<EstadoThread *>(PIN_GetThreadData(chave_tls, tid));
+
+   PIN_GetLock(&trava_contadores, tid + 1);
+   total_limiares += estado->limiares;
+   total_divergencias += estado->divergencias;
+   total_vazias += estado->vazias;
+   total_ressincronizacoes += estado->ressincronizacoes;
+   total_lbr_acertos += estado->lbr_acertos;
+   total_lbr_falhas += estado->lbr_falhas;
+   PIN_ReleaseLock(&trava_contadores);
+
+   if(estado->mapeamento != NULL){
+      munmap(estado->mapeamento, estado->tam_mapeado);
+   }
+   ArenaLibera(&arena_estados, estado);
+}
+
+// Abre no modo apêndice o arquivo de saída deste processo (ver "saida-processo.h") e escreve o
+// início da execução e os detectores ativos
+static void AbreSaida(){
+   arquivo_saida.open(SaidaProcessoNome(nome_saida).c_str(), std::ofstream::out | std::ofstream::app);
+
+   // obtem e imprime no arquivo de saída o momento em que a execução está iniciando e os detectores ativos
+   time_t data_hora = time(0);
+   arquivo_saida << endl << " #### Inicio: " << string(ctime(&data_hora));
+   if(SaidaProcessoFilho()){
+      arquivo_saida << " #### Processo " << PIN_GetPid() << ", criado por fork" << endl;
+   }
+   arquivo_saida << " #### Detectores:";
+   if(usa_pilha){
+      arquivo_saida << " pilha sombra;";
+   }
+   if(usa_janela){
+      arquivo_saida << " janela (limiar " << limiar << ");";
+   }
+   if(usa_lbr){
+      arquivo_saida << " LBR (" << tam_lbr << " entradas);";
+   }
+   arquivo_saida << endl;
+}
+
+// Depois de um "fork", no filho: indica se o estado é o da thread que chamou "fork" ("arg"). Os
+// estados das demais threads, que não existem no filho, têm as suas pilhas sombra liberadas.
+static BOOL MantemEstado(VOID *bloco, VOID *arg){
+   if(bloco == arg){
+      return(TRUE);
+   }
+   EstadoThread *estado = static_cast<EstadoThread *>(bloco);
+   if(estado->mapeamento != NULL){
+      munmap(estado->mapeamento, estado->tam_mapeado);
+   }
+   return(FALSE);
+}
+
+// Antes de um "fork": mantém as travas dos contadores e da arena e esvazia o arquivo de saída,
+// para que o filho receba uma cópia consistente e sem dados pendentes do pai
+static VOID ForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_GetLock(&trava_contadores, tid + 1);
+   ArenaForkAntes(&arena_estados);
+   arquivo_saida.flush();
+}
+
+// Depois de um "fork", no pai: libera as travas
+static VOID ForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   ArenaForkPai(&arena_estados);
+   PIN_ReleaseLock(&trava_contadores);
+}
+
+// Depois de um "fork", no filho: mantém só o estado da thread que chamou "fork" (a pilha sombra, a
+// janela e o LBR continuam valendo, pois o filho retorna pelos mesmos quadros), zera os contadores
+// e passa a escrever no arquivo do processo
+static VOID ForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_InitLock(&trava_contadores);
+   total_limiares = total_divergencias = total_vazias = total_ressincronizacoes = total_lbr_acertos = total_lbr_falhas = 0;
+
+   EstadoThread *estado = static_cast<EstadoThread *>(PIN_GetThreadData(chave_tls, tid));
+   estado->limiares = estado->divergencias = estado->vazias = estado->ressincronizacoes = 0;
+   estado->lbr_acertos = estado->lbr_falhas = 0;
+   ArenaForkFilho(&arena_estados, MantemEstado, estado);
+
+   arquivo_saida.close();
+   AbreSaida();
+}
+
+// Função chamada quando a aplicação termina de executar.
+// Imprime os resultados no arquivo de saída.
+void Fim(INT32 codigo, void *v){
+
+   // salva instante atual para registrar o momento de término
+   time_t data_hora = time(0);
+
+   // calcula consumo total de tempo de CPU pelo processo (usuário + sistema)
+   struct rusage ru;
+   getrusage(RUSAGE_SELF, &ru);
+   double tempo_fim = static_cast<double>(ru.ru_utime.tv_sec) + static_cast<double>(ru.ru_utime.tv_usec * 0.000001) +
+                      static_cast<double>(ru.ru_stime.tv_sec) + static_cast<double>(ru.ru_stime.tv_usec * 0.000001);
+
+   // memória usada pelos estados das threads
+   EstatisticasArena estatisticas = ArenaEstatisticas(&arena_estados);
+
+   // imprime no arquivo de saída os resultados
+   arquivo_saida << " #### Estados de threads: " << estatisticas.vivos << " vivo(s) (" << estatisticas.vivos * estatisticas.tam_bloco <<
+                    " bytes), pico de " << estatisticas.pico << " (" << estatisticas.pico * estatisticas.tam_bloco << " bytes), " <<
+                    estatisticas.reaproveitados << " reaproveitado(s)" << endl;
+   if(usa_janela){
+      arquivo_saida << " #### Limiares superados: " << total_limiares << endl;
+   }
+   if(usa_pilha){
+      arquivo_saida << " #### Retornos divergentes: " << total_divergencias << endl;
+      arquivo_saida << " #### Retornos com a pilha sombra vazia: " << total_vazias << endl;
+      arquivo_saida << " #### Ressincronizações da pilha sombra: " << total_ressincronizacoes << endl;
+   }
+   if(usa_lbr){
+      arquivo_saida << " #### Retornos correspondentes ao LBR: " << total_lbr_acertos << endl;
+      arquivo_saida << " #### Retornos sem CALL correspondente no LBR: " << total_lbr_falhas << endl;
+   }
+   arquivo_saida << " #### Instrumentação finalizada em " << converte_double_string(tempo_fim) << " segundos" << endl;
+   arquivo_saida << " #### Fim: " << string(ctime(&data_hora)) << endl;
+}
+
+// Descreve os alertas, escritos no arquivo de saída pela thread interna de "alertas-rop.h".
+// Os valores são os da última ocorrência.
+static void DescreveAlertaRop(std::ostream &saida, UINT32 tipo, ADDRINT valor1, ADDRINT valor2){
+   if(tipo == ALERTA_LIMIAR){
+      saida << " #### Suspeita de ataque ROP! O limiar de " << valor1 << " foi superado pelo seguinte valor: " << valor2;
+   }
+   else if(tipo == ALERTA_DIVERGENCIA){
+      saida << " #### Suspeita de ataque ROP! O endereço de retorno " << hexstr(valor1, sizeof(ADDRINT)) << " não coincide com o endereço anotado na pilha sombra (" << hexstr(valor2, sizeof(ADDRINT)) << ")";
+   }
+   else if(tipo == ALERTA_PILHA_VAZIA){
+      saida << " #### Suspeita de ataque ROP! Não há nenhum endereço de retorno anotado na pilha sombra e o programa pretende retornar para o endereço de retorno " << hexstr(valor1, sizeof(ADDRINT));
+   }
+   else{
+      saida << " #### Suspeita de ataque ROP! O endereço de retorno " << hexstr(valor1, sizeof(ADDRINT)) << " não corresponde ao último CALL do LBR (" << hexstr(valor2, sizeof(ADDRINT)) << ")";
+   }
+}
+
+// Versão em JSON de "DescreveAlertaRop"
+static void DescreveAlertaRopJson(std::ostream &saida, UINT32 tipo, ADDRINT valor1, ADDRINT valor2){
+   if(tipo == ALERTA_LIMIAR){
+      saida << "\"alerta\":\"limiar\",\"limiar\":" << valor1 << ",\"valor\":" << valor2;
+   }
+   else if(tipo == ALERTA_DIVERGENCIA){
+      saida << "\"alerta\":\"divergencia\",\"retorno\":\"" << hexstr(valor1, sizeof(ADDRINT)) << "\",\"sombra\":\"" << hexstr(valor2, sizeof(ADDRINT)) << "\"";
+   }
+   else if(tipo == ALERTA_PILHA_VAZIA){
+      saida << "\"alerta\":\"pilha_vazia\",\"retorno\":\"" << hexstr(valor1, sizeof(ADDRINT)) << "\"";
+   }
+   else{
+      saida << "\"alerta\":\"lbr\",\"retorno\":\"" << hexstr(valor1, sizeof(ADDRINT)) << "\",\"lbr\":\"" << hexstr(valor2, sizeof(ADDRINT)) << "\"";
+   }
+}
+
+// Janela: desloca a janela em "num_bits_shift" instruções. Feito em 64 bits, um deslocamento de 32
+// (o máximo, pelo limite abaixo) zera a janela.
+static inline void Desloca(EstadoThread *estado, UINT32 num_bits_shift){
+   UINT32 deslocamento = (num_bits_shift < tam_janela) ? num_bits_shift : tam_janela;
+   estado->janela_bits = static_cast<UINT32>(static_cast<UINT64>(estado->janela_bits) << deslocamento);
+}
+
+// Janela: desloca a janela, seta o bit do desvio indireto e retorna PENDENCIA_LIMIAR se o limiar foi superado
+static inline UINT32 USA_POPCNT AtualizaJanela(EstadoThread *estado, UINT32 num_bits_shift){
+   Desloca(estado, num_bits_shift);
+   estado->janela_bits |= MASCARA_UM;
+   return(static_cast<UINT32>(__builtin_popcount(estado->janela_bits) > limiar) * PENDENCIA_LIMIAR);
+}
+
+// Parte "If" da instrumentação das instruções RET. Atualiza, para os detectores ativos (parâmetros do
+// template), a janela (o RET é um desvio indireto), a pilha sombra (desempilha se o destino e a posição
+// coincidirem com o topo) e o LBR (sempre desempilha, como em lbrmatch.cpp, contando o acerto). Grava
+// e retorna os detectores que precisam da parte "Then". Sem chamadas nem desvios ("inline").
+// "alvo" é o endereço para onde o RET vai desviar (IARG_BRANCH_TARGET_ADDR) e "esp", o topo da pilha.
+template<BOOL PILHA, BOOL JANELA, BOOL LBR>
+ADDRINT PIN_FAST_ANALYSIS_CALL USA_POPCNT VerificaRET(EstadoThread *estado, ADDRINT alvo, ADDRINT esp, UINT32 num_bits_shift){
+   UINT32 pendencias = 0;
+
+   if(JANELA){
+      pendencias |= AtualizaJanela(estado, num_bits_shift);
+   }
+
+   if(PILHA){
+      UINT32 divergente = (estado->topo[-1].retorno != alvo) | (estado->topo[-1].posicao != esp) | (estado->topo == estado->base);
+      estado->topo -= (divergente ^ 1);
+      pendencias |= divergente * PENDENCIA_RET;
+   }
+
+   if(LBR){
+      UINT32 ocupado = (estado->lbr_validas != 0);
+      UINT32 falha = ocupado & (estado->Lbr()[(estado->lbr_cabeca - 1) & mascara_lbr] != alvo);
+      estado->lbr_acertos += ocupado & (falha ^ 1);
+      estado->lbr_cabeca -= ocupado;
+      estado->lbr_validas -= ocupado;
+      pendencias |= falha * PENDENCIA_LBR;
+   }
+
+   estado->pendencias = pendencias;
+   return(pendencias);
+}
+
+// Parte "If" da instrumentação das instruções CALL. Desloca a janela (e, em um CALL indireto, seta o
+// bit do desvio e checa o limiar), empilha o endereço de retorno e a posição onde o CALL o grava na
+// pilha sombra e anota o endereço de retorno no LBR. A pilha sombra precisa da parte "Then" quando
+// enche ou quando o novo quadro não está abaixo do topo (pilha vazia ou quadros abandonados).
+template<BOOL PILHA, BOOL JANELA, BOOL LBR, BOOL INDIRETO>
+ADDRINT PIN_FAST_ANALYSIS_CALL USA_POPCNT EmpilhaCALL(EstadoThread *estado, ADDRINT retorno, ADDRINT esp, UINT32 num_bits_shift){
+   UINT32 pendencias = 0;
+
+   if(JANELA){
+      if(INDIRETO){
+         pendencias |= AtualizaJanela(estado, num_bits_shift);
+      }
+      else{
+         Desloca(estado, num_bits_shift);
+      }
+   }
+
+   if(PILHA){
+      ADDRINT posicao = esp - sizeof(ADDRINT);
+      ADDRINT anterior = estado->topo[-1].posicao;
+      estado->topo->retorno = retorno;
+      estado->topo->posicao = posicao;
+      estado->topo++;
+      pendencias |= ((estado->topo == estado->limite) | (posicao >= anterior)) * PENDENCIA_CALL;
+   }
+
+   if(LBR){
+      estado->Lbr()[estado->lbr_cabeca & mascara_lbr] = retorno;
+      estado->lbr_cabeca++;
+      estado->lbr_validas += (estado->lbr_validas < tam_lbr);
+   }
+
+   estado->pendencias = pendencias;
+   return(pendencias);
+}
+
+// Parte "If" da instrumentação dos demais desvios indiretos (JMP indireto), usada só com a janela
+ADDRINT PIN_FAST_ANALYSIS_CALL USA_POPCNT AtualizaIndireto(EstadoThread *estado, UINT32 num_bits_shift){
+   estado->pendencias = AtualizaJanela(estado, num_bits_shift);
+   return(estado->pendencias);
+}
+
+// Desloca a janela ao final de uma sequência de BBLs sem desvio indireto (ver "InstrumentaCodigo")
+void PIN_FAST_ANALYSIS_CALL DeslocaJanela(EstadoThread *estado, UINT32 num_bits_shift){
+   Desloca(estado, num_bits_shift);
+}
+
+// Parte "Then" compartilhada por todas as funções "If", executada apenas quando algum detector precisa
+// de atenção ("pendencias"). "alvo" é o destino do RET ou o endereço de retorno do CALL, e "esp", o topo
+// da pilha da thread antes da instrução. "local_bbl" identifica o local dos alertas da janela e
+// "local_ins", o dos alertas da pilha sombra e do LBR. Pode trocar a área da pilha sombra (ao crescer),
+// mas nunca o estado da thread.
+void TrataPendencias(EstadoThread *estado, ADDRINT alvo, ADDRINT esp, THREADID tid, ADDRINT local_bbl, ADDRINT local_ins){
+   UINT32 pendencias = estado->pendencias;
+
+   if(pendencias & PENDENCIA_LIMIAR){
+      estado->limiares++;
+      AlertaRegistra(tid, ALERTA_LIMIAR, local_bbl, limiar, __builtin_popcount(estado->janela_bits));
+   }
+
+   // RET: procura a entrada exata abaixo do topo (quadros abandonados por um longjmp ou uma exceção)
+   // antes de reportar, desempilhando o topo como em pilha-sombra.cpp
+   if(pendencias & PENDENCIA_RET){
+      EntradaPilha *entrada = BuscaPosicao(estado, esp);
+      if(entrada != estado->topo && entrada->posicao == esp && entrada->retorno == alvo){
+         estado->topo = entrada;
+         estado->ressincronizacoes++;
+      }
+      else if(estado->topo != estado->base){
+         estado->topo--;
+         estado->divergencias++;
+         AlertaRegistra(tid, ALERTA_DIVERGENCIA, local_ins, alvo, estado->topo->retorno);
+      }
+      else{
+         estado->vazias++;
+         AlertaRegistra(tid, ALERTA_PILHA_VAZIA, local_ins, alvo, 0);
+      }
+   }
+
+   // CALL: descarta as entradas de quadros abandonados e aumenta a pilha sombra se ela encher
+   if(pendencias & PENDENCIA_CALL){
+      estado->topo--;
+      EntradaPilha nova = *estado->topo;
+      EntradaPilha *novo_topo = BuscaPosicao(estado, nova.posicao);
+      if(novo_topo != estado->topo){
+         estado->ressincronizacoes++;
+         estado->topo = novo_topo;
+      }
+      *estado->topo = nova;
+      estado->topo++;
+      if(estado->topo == estado->limite){
+         CrescePilha(estado);
+      }
+   }
+
+   // o CALL desempilhado pela parte "If" continua na posição "lbr_cabeca" do LBR
+   if(pendencias & PENDENCIA_LBR){
+      estado->lbr_falhas++;
+      AlertaRegistra(tid, ALERTA_LBR, local_ins, alvo, estado->Lbr()[estado->lbr_cabeca & mascara_lbr]);
+   }
+}
+
+// Insere em "ins", no ponto "ponto", a parte "If" "funcao" e a parte "Then" compartilhada
+static void InsereVerificacao(INS ins, IPOINT ponto, AFUNPTR funcao, UINT32 rotina, ADDRINT alvo_fixo, BOOL alvo_do_desvio,
+                              UINT32 pendentes, ADDRINT local_bbl){
+   EstatisticasAntesIns(ins, ponto, rotina);
+   if(alvo_do_desvio){
+      INS_InsertIfCall(ins, ponto, funcao, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_estado, IARG_BRANCH_TARGET_ADDR,
+                       IARG_REG_VALUE, REG_STACK_PTR, IARG_UINT32, pendentes, IARG_END);
+      INS_InsertThenCall(ins, ponto, (AFUNPTR)TrataPendencias, IARG_REG_VALUE, reg_estado, IARG_BRANCH_TARGET_ADDR,
+                         IARG_REG_VALUE, REG_STACK_PTR, IARG_THREAD_ID, IARG_ADDRINT, local_bbl, IARG_ADDRINT, INS_Address(ins), IARG_END);
+   }
+   else{
+      INS_InsertIfCall(ins, ponto, funcao, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_estado, IARG_ADDRINT, alvo_fixo,
+                       IARG_REG_VALUE, REG_STACK_PTR, IARG_UINT32, pendentes, IARG_END);
+      INS_InsertThenCall(ins, ponto, (AFUNPTR)TrataPendencias, IARG_REG_VALUE, reg_estado, IARG_ADDRINT, alvo_fixo,
+                         IARG_REG_VALUE, REG_STACK_PTR, IARG_THREAD_ID, IARG_ADDRINT, local_bbl, IARG_ADDRINT, INS_Address(ins), IARG_END);
+   }
+   EstatisticasDepoisIns(ins, ponto);
+}
+
+// Insere em "ins", no ponto "ponto", o deslocamento da janela pelas instruções pendentes
+static void InsereDeslocamento(INS ins, IPOINT ponto, UINT32 pendentes){
+   EstatisticasAntesIns(ins, ponto, ROTINA_DESLOCA_JANELA);
+   INS_InsertCall(ins, ponto, (AFUNPTR)DeslocaJanela, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_estado, IARG_UINT32, pendentes, IARG_END);
+   EstatisticasDepoisIns(ins, ponto);
+}
+
+// Função registrada junto ao Pin para executar a instrumentação do código.
+// Percorre a última instrução de cada BBL uma única vez e insere, conforme o tipo de desvio, a função
+// que atualiza todos os detectores ativos. As verificações usam o topo da pilha da thread
+// imediatamente antes da instrução, por isso não podem usar IPOINT_ANYWHERE.
+// Como em janela-deslizante.cpp, as instruções dos BBLs sem desvio indireto são somadas em
+// "pendentes", e a janela só é deslocada onde a execução pode deixar a sequência: nos CALLs, RETs e
+// desvios indiretos (junto com os demais detectores), no caminho tomado dos desvios condicionais e
+// antes dos demais desvios, das chamadas de sistema e do fim do trace.
+void InstrumentaCodigo(TRACE trace, void *v){
+
+   // opção -stats: marca o início da instrumentação do trace
+   UINT64 inicio = EstatisticasInstrumentacao();
+
+   // nº de instruções executadas desde a última atualização da janela na sequência atual
+   UINT32 pendentes = 0;
+
+   // percorre todos os BBLs
+   for(BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)){
+      INS ins = BBL_InsTail(bbl);
+      pendentes += BBL_NumIns(bbl);
+
+      if(INS_IsRet(ins)){
+         // IARG_BRANCH_TARGET_ADDR fornece o endereço para onde o RET vai desviar
+         InsereVerificacao(ins, IPOINT_BEFORE, funcao_ret, ROTINA_VERIFICA_RET, 0, TRUE, pendentes, BBL_Address(bbl));
+         pendentes = 0;
+      }
+      else if(INS_IsCall(ins)){
+         AFUNPTR funcao = INS_IsIndirectBranchOrCall(ins) ? funcao_call_indireto : funcao_call;
+         InsereVerificacao(ins, IPOINT_BEFORE, funcao, ROTINA_EMPILHA_CALL, INS_Address(ins) + INS_Size(ins), FALSE, pendentes, BBL_Address(bbl));
+         pendentes = 0;
+      }
+      else if(!usa_janela){
+         // sem a janela, os demais desvios não precisam de instrumentação
+         continue;
+      }
+      else if(INS_IsIndirectBranchOrCall(ins)){
+         EstatisticasAntesIns(ins, IPOINT_BEFORE, ROTINA_ATUALIZA_INDIRETO);
+         INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)AtualizaIndireto, IARG_FAST_ANALYSIS_CALL, IARG_REG_VALUE, reg_estado, IARG_UINT32, pendentes, IARG_END);
+         INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)TrataPendencias, IARG_REG_VALUE, reg_estado, IARG_ADDRINT, 0, IARG_ADDRINT, 0,
+                            IARG_THREAD_ID, IARG_ADDRINT, BBL_Address(bbl), IARG_ADDRINT, INS_Address(ins), IARG_END);
+         EstatisticasDepoisIns(ins, IPOINT_BEFORE);
+         pendentes = 0;
+      }
+      else if(BBL_Valid(BBL_Next(bbl)) && INS_HasFallThrough(ins) && INS_IsValidForIpointTakenBranch(ins)){
+         // desvio condicional: só o caminho tomado deixa a sequência
+         InsereDeslocamento(ins, IPOINT_TAKEN_BRANCH, pendentes);
+      }
+      else if(!BBL_Valid(BBL_Next(bbl)) || INS_IsControlFlow(ins) || INS_IsSyscall(ins)){
+         InsereDeslocamento(ins, IPOINT_BEFORE, pendentes);
+         pendentes = 0;
+      }
+   }
+
+   EstatisticasTraceInstrumentado(inicio, trace);
+}
+
+// Escolhe as versões das funções de análise especializadas para os detectores ativos
+template<BOOL PILHA, BOOL JANELA, BOOL LBR>
+static void SelecionaFuncoes(){
+   funcao_ret = (AFUNPTR)VerificaRET<PILHA, JANELA, LBR>;
+   funcao_call = (AFUNPTR)EmpilhaCALL<PILHA, JANELA, LBR, FALSE>;
+   funcao_call_indireto = (AFUNPTR)EmpilhaCALL<PILHA, JANELA, LBR, TRUE>;
+}
+
+// Função onde a execução inicia
+int main(int argc, char *argv[]){
+
+   // Usado para receber da linha de comandos (opção -o) o nome do arquivo de saída. Se não for especificado, usa-se o nome "Pintool.out"
+   KNOB<string> KnobArquivoSaida(KNOB_MODE_WRITEONCE, "pintool", "o", "pintool.out", "Nome do arquivo de saida");
+
+   // Usados para receber da linha de comandos (opções -pilha, -janela e -lbr) os detectores ativos
+   KNOB<BOOL> KnobPilha(KNOB_MODE_WRITEONCE, "pintool", "pilha", "1", "Ativa a pilha sombra");
+   KNOB<BOOL> KnobJanela(KNOB_MODE_WRITEONCE, "pintool", "janela", "1", "Ativa a janela deslizante de desvios indiretos");
+   KNOB<BOOL> KnobLbr(KNOB_MODE_WRITEONCE, "pintool", "lbr", "1", "Ativa a verificacao dos RETs com o LBR de instrucoes CALL");
+
+   // Usado para receber da linha de comandos (opção -l) o limiar da janela
+   KNOB<UINT32> KnobEntradaLimiar(KNOB_MODE_WRITEONCE, "pintool", "l", "10", "Limiar de desvios indiretos na janela de 32 instrucoes");
+
+   // Usado para receber da linha de comandos (opção -s) o nº de entradas do LBR
+   KNOB<UINT32> KnobTamanhoLbr(KNOB_MODE_WRITEONCE, "pintool", "s", "16", "Numero de entradas do LBR (potencia de 2, de 4 a 1024)");
+
+   // Usado para receber da linha de comandos (opção -capacidade) o nº inicial de entradas da pilha sombra
+   KNOB<UINT32> KnobCapacidade(KNOB_MODE_WRITEONCE, "pintool", "capacidade", "65536", "Numero inicial de entradas da pilha sombra");
+
+   // Usado para receber da linha de comandos (opção -formato) o formato dos alertas: "texto" ou "json"
+   KNOB<string> KnobFormato(KNOB_MODE_WRITEONCE, "pintool", "formato", "texto", "Formato dos alertas: texto ou json");
+
+   // Usado para receber da linha de comandos (opção -alertas_seg) o nº máximo de linhas de alerta por segundo (0: sem limite)
+   KNOB<UINT32> KnobAlertasSeg(KNOB_MODE_WRITEONCE, "pintool", "alertas_seg", "100", "Numero maximo de linhas de alerta por segundo (0: sem limite)");
+
+   // Usado para receber da linha de comandos (opção -intervalo) o intervalo, em ms, entre os relatórios de alertas agregados
+   KNOB<UINT32> KnobIntervalo(KNOB_MODE_WRITEONCE, "pintool", "intervalo", "1000", "Intervalo (ms) entre os relatorios de alertas agregados");
+
+   // Usado para receber da linha de comandos (opção -stats) o arquivo onde o custo da ferramenta é escrito. Vazio: não mede
+   KNOB<string> KnobEstatisticas(KNOB_MODE_WRITEONCE, "pintool", "stats", "", "Arquivo JSON com o custo da instrumentacao e da analise (vazio: desligado)");
+
+   // Usado para receber da linha de comandos (opção -stats_amostra) o intervalo médio, em execuções, entre as medições das funções de análise
+   KNOB<UINT32> KnobAmostra(KNOB_MODE_WRITEONCE, "pintool", "stats_amostra", "1000", "Intervalo medio, em execucoes, entre as medicoes das funcoes de analise");
+
+   // Usado para receber da linha de comandos (opção -sufixo_pid) se o processo inicial também acrescenta o pid aos arquivos de saída
+   KNOB<BOOL> KnobSufixoPid(KNOB_MODE_WRITEONCE, "pintool", "sufixo_pid", "0", "Acrescenta .<pid> aos arquivos de saida tambem no processo inicial (use com -follow_execv)");
+
+   // Inicializa o Pin e checa os parâmetros
+   if(PIN_Init(argc, argv)){
+      // imprime mensagem indicando o formato correto dos parâmetros e encerra
+      Uso();
+      return(1);
+   }
+
+   // Inicia as saídas por processo, antes de abrir qualquer arquivo de saída
+   SaidaProcessoInicia(KnobSufixoPid.Value());
+
+   // Obtém o formato dos alertas
+   FormatoAlertas formato_alertas;
+   if(!AlertasFormato(KnobFormato.Value(), &formato_alertas)){
+      Uso();
+      return(1);
+   }
+
+   // Obtém os detectores ativos e seus parâmetros; o limiar é de pelo menos 1 e o LBR tem de 4 a 1024 entradas
+   usa_pilha = KnobPilha.Value();
+   usa_janela = KnobJanela.Value();
+   usa_lbr = KnobLbr.Value();
+   limiar = KnobEntradaLimiar.Value();
+   tam_lbr = KnobTamanhoLbr.Value();
+   mascara_lbr = tam_lbr - 1;
+   capacidade_inicial = KnobCapacidade.Value() > 0 ? KnobCapacidade.Value() : 1;
+   if((!usa_pilha && !usa_janela && !usa_lbr) || limiar == 0 || tam_lbr < 4 || tam_lbr > 1024 || (tam_lbr & mascara_lbr) != 0){
+      Uso();
+      return(1);
+   }
+
+   // Escolhe as versões das funções de análise especializadas para os detectores ativos
+   switch((usa_pilha ? 4 : 0) | (usa_janela ? 2 : 0) | (usa_lbr ? 1 : 0)){
+      case 1: SelecionaFuncoes<FALSE, FALSE, TRUE>(); break;
+      case 2: SelecionaFuncoes<FALSE, TRUE, FALSE>(); break;
+      case 3: SelecionaFuncoes<FALSE, TRUE, TRUE>(); break;
+      case 4: SelecionaFuncoes<TRUE, FALSE, FALSE>(); break;
+      case 5: SelecionaFuncoes<TRUE, FALSE, TRUE>(); break;
+      case 6: SelecionaFuncoes<TRUE, TRUE, FALSE>(); break;
+      case 7: SelecionaFuncoes<TRUE, TRUE, TRUE>(); break;
+   }
+
+   // obtém a chave para acesso à área de armazenamento local das threads (TLS)
+   chave_tls = PIN_CreateThreadDataKey(0);
+   PIN_InitLock(&trava_contadores);
+
+   // Inicia a arena dos estados das threads, com espaço para as entradas do LBR após a estrutura
+   ArenaInicia(&arena_estados, sizeof(EstadoThread) + (usa_lbr ? tam_lbr * sizeof(ADDRINT) : 0));
+
+   // reserva o registrador que guarda o endereço do estado de cada thread
+   reg_estado = PIN_ClaimToolRegister();
+   if(!REG_valid(reg_estado)){
+      fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+      return(1);
+   }
+
+   // Abre o arquivo de saída. Se não for passado um nome para o arquivo na linha de comandos, usa "Pintool.out"
+   nome_saida = KnobArquivoSaida.Value();
+   AbreSaida();
+
+   // registra a função "TerminaThread" para liberar o estado quando uma thread terminar
+   PIN_AddThreadFiniFunction(TerminaThread, NULL);
+
+   // registra as funções de "fork" antes de iniciar os subsistemas, para que o filho reabra a saída antes deles
+   SaidaProcessoAoFork(ForkAntes, ForkPai, ForkFilho, NULL);
+
+   // inicia o subsistema de alertas antes de registrar a função "Fim", para que os alertas pendentes
+   // sejam escritos antes do resumo final
+   if(!AlertasInicia(&arquivo_saida, formato_alertas, KnobAlertasSeg.Value(), KnobIntervalo.Value(), DescreveAlertaRop, DescreveAlertaRopJson)){
+      fprintf(stderr, "Nao foi possivel criar a thread interna de alertas\n");
+      return(1);
+   }
+
+   // opção -stats: inicia a medição do custo da ferramenta
+   if(!EstatisticasInicia(KnobEstatisticas.Value(), "protecao-rop", rotinas_medidas, 4, KnobAmostra.Value())){
+      fprintf(stderr, "Nao foi possivel reservar um registrador para a ferramenta\n");
+      return(1);
+   }
+
+   // registra a função "Fim" para ser executada quando a aplicação for terminar
+   PIN_AddFiniFunction(Fim, NULL);
+
+   // registra a função "IniciaThread" para ser executada quando uma nova thread for iniciar
+   PIN_AddThreadStartFunction(IniciaThread, NULL);
+
+   // registra a função "InstrumentaCodigo" para instrumentar os "traces"
+   TRACE_AddInstrumentFunction(InstrumentaCodigo, NULL);
+
+   // inicia a execução do programa a ser instrumentado e só retorna quando ele terminar
+   PIN_StartProgram();
+
+   // encerra a execução do Pin
+   return(0);
+}
@@ -0,0 +1,218 @@
+/*
+Relatórios periódicos das pintools (opções -relatorio, -relatorio_ms e -relatorio_ins).
+
+As ferramentas só escreviam os resultados nas suas funções de término, e processos longos
+(servidores) costumam ser encerrados por um sinal, sem executá-las. Com este subsistema, uma thread
+interna do Pin obtém, a cada "intervalo_ms" milissegundos, um retrato dos contadores da ferramenta
+e o acrescenta ao arquivo do relatório, sem interromper a aplicação. Cada registro é um objeto
+JSON em uma linha, escrito de uma só vez e seguido de "fflush", então um processo morto deixa
+todos os registros anteriores intactos:
+
+   {"ferramenta":"pilha-sombra","registro":3,"ms":3001,"motivo":"intervalo","divergencias":0,...}
+
+Os contadores são cumulativos; taxas (ex.: acertos do LBR por RET) são obtidas dividindo-os ou
+subtraindo registros consecutivos. "motivo" é "intervalo", "instrucoes", "sinal" ou "fim".
+
+O retrato é obtido pela função "coleta" da ferramenta, que lê os contadores das threads vivas
+(ex.: com "ArenaParaCada") e soma os das threads que já terminaram, sem parar a aplicação: os
+valores das threads em execução podem estar alguns eventos atrasados. Ferramentas que contam
+instruções indicam o campo correspondente ("campo_instrucoes"); com "intervalo_instrucoes", a
+thread interna consulta os contadores a cada RELATORIO_CONSULTA_MS e escreve um registro sempre
+que o total de instruções avança "intervalo_instrucoes" desde o último.
+
+Um último registro é escrito quando a aplicação termina e quando o processo recebe SIGTERM (o
+sinal continua sendo entregue à aplicação normalmente).
+
+Em um "fork" (ver "saida-processo.h"), o filho escreve os seus registros em <arquivo>.<pid>, a
+partir do registro 0, com os contadores zerados pela ferramenta. A ferramenta deve registrar as suas
+funções de "fork" antes de chamar "RelatorioInicia", para que a coleta, que usa as travas dela,
+não seja feita durante o "fork".
+*/
+
+#ifndef RELATORIO_INTERVALO_H
+#define RELATORIO_INTERVALO_H
+
+#include "pin.H"          // para usar APIs do Pin
+#include <stdio.h>        // para escrever o arquivo do relatório
+#include <signal.h>       // para usar SIGTERM
+#include <time.h>         // para usar "clock_gettime"
+#include <vector>         // para guardar o retrato dos contadores
+#include "saida-processo.h" // para tratar o "fork" e obter o nome do arquivo
+
+// Intervalo, em ms, entre as consultas ao nº de instruções (opção -relatorio_ins)
+static const UINT32 RELATORIO_CONSULTA_MS = 10;
+
+// Função da ferramenta que preenche "valores" (um por campo) com o estado atual dos contadores
+typedef VOID (*ColetaRelatorio)(UINT64 *valores);
+
+// Estado do subsistema de relatórios
+static struct{
+   FILE *saida;                       // arquivo do relatório (NULL: desligado)
+   string arquivo;                    // nome do arquivo (opção -relatorio), sem o sufixo do processo
+   const char *ferramenta;
+   const char *const *campos;         // nomes dos campos preenchidos por "coleta"
+   UINT32 num_campos;
+   INT32 campo_instrucoes;            // campo com o total de instruções (-1: nenhum)
+   UINT32 intervalo_ms;               // intervalo entre os registros (0: só por instruções)
+   UINT64 intervalo_instrucoes;       // instruções entre os registros (0: só por tempo)
+   ColetaRelatorio coleta;
+   struct timespec inicio;            // referência do campo "ms"
+   PIN_LOCK trava;                    // protege os campos abaixo e a escrita
+   std::vector<UINT64> valores;       // último retrato
+   UINT64 registros;                  // registros já escritos
+   UINT64 ultimo_ms;                  // instante do último registro
+   UINT64 ultimas_instrucoes;         // total de instruções no último registro
+   PIN_SEMAPHORE acorda;              // acorda a thread interna para terminar
+   PIN_THREAD_UID uid_relatora;
+   volatile BOOL parar;
+} relatorio;
+
+// Instante atual, em milissegundos desde "RelatorioInicia"
+static UINT64 RelatorioInstante(){
+   struct timespec agora;
+   clock_gettime(CLOCK_MONOTONIC, &agora);
+   return(static_cast<UINT64>(agora.tv_sec - relatorio.inicio.tv_sec) * 1000 + (agora.tv_nsec - relatorio.inicio.tv_nsec) / 1000000);
+}
+
+// Obtém um retrato dos contadores e, se "motivo" não for NULL ou se o nº de instruções tiver
+// avançado o suficiente, o escreve no arquivo do relatório. "tid" identifica a thread que chama.
+static VOID RelatorioRegistra(THREADID tid, const char *motivo){
+   PIN_GetLock(&relatorio.trava, tid + 1);
+
+   relatorio.coleta(&relatorio.valores[0]);
+   if(motivo == NULL && relatorio.campo_instrucoes >= 0 && relatorio.intervalo_instrucoes > 0 &&
+      relatorio.valores[relatorio.campo_instrucoes] - relatorio.ultimas_instrucoes >= relatorio.intervalo_instrucoes){
+      motivo = "instrucoes";
+   }
+
+   if(motivo != NULL){
+      relatorio.ultimo_ms = RelatorioInstante();
+      fprintf(relatorio.saida, "{\"ferramenta\":\"%s\",\"registro\":%llu,\"ms\":%llu,\"motivo\":\"%s\"", relatorio.ferramenta,
+              static_cast<unsigned long long>(relatorio.registros), static_cast<unsigned long long>(relatorio.ultimo_ms), motivo);
+      for(UINT32 i = 0; i < relatorio.num_campos; i++){
+         fprintf(relatorio.saida, ",\"%s\":%llu", relatorio.campos[i], static_cast<unsigned long long>(relatorio.valores[i]));
+      }
+      fprintf(relatorio.saida, "}\n");
+      fflush(relatorio.saida);
+
+      relatorio.registros++;
+      if(relatorio.campo_instrucoes >= 0){
+         relatorio.ultimas_instrucoes = relatorio.valores[relatorio.campo_instrucoes];
+      }
+   }
+
+   PIN_ReleaseLock(&relatorio.trava);
+}
+
+// Thread interna que escreve os registros periódicos
+static VOID RelatorioRelatora(VOID *arg){
+   UINT32 espera = relatorio.intervalo_ms;
+   if(relatorio.intervalo_instrucoes > 0 && (espera == 0 || espera > RELATORIO_CONSULTA_MS)){
+      espera = RELATORIO_CONSULTA_MS;
+   }
+
+   while(!relatorio.parar){
+      PIN_SemaphoreTimedWait(&relatorio.acorda, espera);
+      if(relatorio.parar){
+         break;
+      }
+      BOOL vencido = relatorio.intervalo_ms > 0 && RelatorioInstante() - relatorio.ultimo_ms >= relatorio.intervalo_ms;
+      RelatorioRegistra(PIN_ThreadId(), vencido ? "intervalo" : NULL);
+   }
+}
+
+// Encerra a thread interna antes do término da aplicação
+static VOID RelatorioPreparaFim(VOID *v){
+   relatorio.parar = TRUE;
+   PIN_SemaphoreSet(&relatorio.acorda);
+   PIN_WaitForThreadTermination(relatorio.uid_relatora, PIN_INFINITE_TIMEOUT, NULL);
+}
+
+// Escreve o registro final
+static VOID RelatorioFim(INT32 codigo, VOID *v){
+   RelatorioRegistra(0, "fim");
+   fclose(relatorio.saida);
+}
+
+// Escreve um registro quando o processo recebe SIGTERM, que costuma encerrá-lo sem que as funções
+// de término sejam executadas. Retorna TRUE para que o sinal seja entregue à aplicação.
+static BOOL RelatorioSinal(THREADID tid, INT32 sinal, CONTEXT *contexto, BOOL tem_tratador, const EXCEPTION_INFO *excecao, VOID *v){
+   RelatorioRegistra(tid, "sinal");
+   return(TRUE);
+}
+
+// Antes de um "fork": espera o registro em andamento (já esvaziado no arquivo) e mantém a trava
+static VOID RelatorioForkAntes(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_GetLock(&relatorio.trava, tid + 1);
+}
+
+// Depois de um "fork", no pai: libera a trava
+static VOID RelatorioForkPai(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_ReleaseLock(&relatorio.trava);
+}
+
+// Depois de um "fork", no filho: passa a escrever no arquivo do processo, com os registros e o
+// tempo contados do "fork", e recria a thread interna
+static VOID RelatorioForkFilho(THREADID tid, const CONTEXT *contexto, VOID *arg){
+   PIN_InitLock(&relatorio.trava);
+   fclose(relatorio.saida);
+   string arquivo = SaidaProcessoNome(relatorio.arquivo);
+   relatorio.saida = fopen(arquivo.c_str(), "a");
+   if(relatorio.saida == NULL){
+      fprintf(stderr, "Nao foi possivel criar o arquivo %s\n", arquivo.c_str());
+      PIN_ExitProcess(1);
+   }
+
+   relatorio.registros = 0;
+   relatorio.ultimo_ms = 0;
+   relatorio.ultimas_instrucoes = 0;
+   clock_gettime(CLOCK_MONOTONIC, &relatorio.inicio);
+
+   relatorio.parar = FALSE;
+   PIN_SemaphoreInit(&relatorio.acorda);
+   if(PIN_SpawnInternalThread(RelatorioRelatora, NULL, 0, &relatorio.uid_relatora) == INVALID_THREADID){
+      fprintf(stderr, "Nao foi possivel criar a thread do relatorio periodico no processo %d\n", PIN_GetPid());
+      PIN_ExitProcess(1);
+   }
+}
+
+// Inicia os relatórios periódicos no arquivo "arquivo" (vazio: desligado). "campos" são os nomes dos
+// "num_campos" valores preenchidos por "coleta". Os registros são escritos a cada "intervalo_ms"
+// milissegundos e, se "campo_instrucoes" indicar o campo com o total de instruções, a cada
+// "intervalo_instrucoes" instruções. Retorna FALSE se o arquivo não puder ser aberto ou a thread
+// interna não puder ser criada.
+static BOOL RelatorioInicia(const string &arquivo, const char *ferramenta, const char *const *campos, UINT32 num_campos,
+                            ColetaRelatorio coleta, UINT32 intervalo_ms, INT32 campo_instrucoes, UINT64 intervalo_instrucoes){
+   if(arquivo.empty()){
+      return(TRUE);
+   }
+
+   relatorio.arquivo = arquivo;
+   relatorio.saida = fopen(SaidaProcessoNome(arquivo).c_str(), "a");
+   if(relatorio.saida == NULL){
+      return(FALSE);
+   }
+   relatorio.ferramenta = ferramenta;
+   relatorio.campos = campos;
+   relatorio.num_campos = num_campos;
+   relatorio.coleta = coleta;
+   relatorio.campo_instrucoes = campo_instrucoes;
+   relatorio.intervalo_instrucoes = campo_instrucoes >= 0 ? intervalo_instrucoes : 0;
+   relatorio.intervalo_ms = intervalo_ms;
+   if(relatorio.intervalo_ms == 0 && relatorio.intervalo_instrucoes == 0){
+      relatorio.intervalo_ms = 1000;
+   }
+   relatorio.valores.resize(num_campos);
+   clock_gettime(CLOCK_MONOTONIC, &relatorio.inicio);
+   PIN_InitLock(&relatorio.trava);
+   PIN_SemaphoreInit(&relatorio.acorda);
+
+   PIN_AddPrepareForFiniFunction(RelatorioPreparaFim, NULL);
+   PIN_AddFiniFunction(RelatorioFim, NULL);
+   PIN_InterceptSignal(SIGTERM, RelatorioSinal, NULL);
+   SaidaProcessoAoFork(RelatorioForkAntes, RelatorioForkPai, RelatorioForkFilho, NULL);
+
+   return(PIN_SpawnInternalThread(RelatorioRelatora, NULL, 0, &relatorio.uid_relatora) != INVALID_THREADID);
+}
+
+#endif // RELATORIO_INTERVALO_H
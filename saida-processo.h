@@ -0,0 +1,116 @@
+/*
+Saída por processo e tratamento de "fork" nas pintools (opção -sufixo_pid).
+
+Com "pin -follow_execv", um servidor que cria processos filhos com "fork" continua instrumentado em
+todos eles, mas o filho herda do pai o arquivo de saída já aberto, os contadores e o estado de
+todas as threads, inclusive das que não existem no filho (só a thread que chamou "fork" é
+copiada). As saídas se misturavam e os eventos anteriores ao "fork" eram contados nos dois
+processos. Com este subsistema, cada processo tem as suas próprias saídas e contadores:
+
+   - o processo inicial escreve em <nome>; os filhos criados por "fork", em <nome>.<pid>. Com a
+     opção -sufixo_pid, o processo inicial também usa <nome>.<pid>. A opção é necessária com
+     "-follow_execv": após "exec", o Pin inicia a ferramenta de novo, no mesmo pid, e ela não tem
+     como saber que não é o processo inicial;
+   - a ferramenta e os subsistemas compartilhados registram funções para as três fases do "fork"
+     ("SaidaProcessoAoFork"). Antes do "fork", no pai, as funções adquirem as travas dos seus
+     dados e esvaziam os buffers dos arquivos, para que o filho receba uma cópia consistente e
+     sem dados pendentes do pai. Depois, o pai libera as travas; o filho as reinicia, descarta o
+     estado das threads que não existem nele, zera os contadores, reabre as saídas com o seu
+     próprio nome e recria as threads internas do Pin, que também não são copiadas.
+
+As funções de antes do "fork" são chamadas na ordem inversa do registro, e as de depois, na ordem do
+registro (como em "pthread_atfork"): um subsistema registrado depois de outro pode usar as travas
+dele (ex.: a coleta de "relatorio-intervalo.h" usa as travas dos contadores da ferramenta) sem risco
+de ordem inversa, e a ferramenta, que registra as suas funções primeiro, reabre o arquivo de saída
+antes que os subsistemas voltem a escrever nele.
+
+Uso: chamar "SaidaProcessoInicia" no "main", logo depois de PIN_Init, antes de abrir as saídas e de
+iniciar os demais subsistemas, e abrir todas as saídas com o nome dado por "SaidaProcessoNome".
+*/
+
+#ifndef SAIDA_PROCESSO_H
+#define SAIDA_PROCESSO_H
+
+#include "pin.H"          // para usar APIs do Pin
+#include <vector>         // para guardar as funções registradas
+
+// Função chamada em uma das fases do "fork", na thread que o chamou
+typedef VOID (*FuncaoFork)(THREADID tid, const CONTEXT *contexto, VOID *arg);
+
+// Funções de um subsistema para as três fases do "fork" (NULL: nada a fazer na fase)
+struct TratadorFork{
+   FuncaoFork antes;     // no pai, antes do "fork"
+   FuncaoFork pai;       // no pai, depois do "fork"
+   FuncaoFork filho;     // no filho, depois do "fork"
+   VOID *arg;
+};
+
+// Estado do subsistema
+static struct{
+   BOOL sufixo;                          // opção -sufixo_pid: todos os processos acrescentam o pid
+   INT32 pid_inicial;                    // processo em que a ferramenta foi iniciada
+   std::vector<TratadorFork> tratadores; // na ordem do registro
+} saida_processo;
+
+// Obtém o nome da saída "nome" neste processo: <nome> no processo inicial (sem -sufixo_pid) e
+// <nome>.<pid> nos demais. Um nome vazio (saída desligada) não é alterado.
+static string SaidaProcessoNome(const string &nome){
+   if(nome.empty() || (!saida_processo.sufixo && PIN_GetPid() == saida_processo.pid_inicial)){
+      return(nome);
+   }
+   return(nome + "." + decstr(PIN_GetPid()));
+}
+
+// Indica se este processo foi criado por um "fork" instrumentado pela ferramenta
+static BOOL SaidaProcessoFilho(){
+   return(PIN_GetPid() != saida_processo.pid_inicial);
+}
+
+// Registra as funções de um subsistema para as fases do "fork"
+static VOID SaidaProcessoAoFork(FuncaoFork antes, FuncaoFork pai, FuncaoFork filho, VOID *arg){
+   TratadorFork tratador = {antes, pai, filho, arg};
+   saida_processo.tratadores.push_back(tratador);
+}
+
+// Antes do "fork": chama as funções "antes", na ordem inversa do registro
+static VOID SaidaProcessoAntes(THREADID tid, const CONTEXT *contexto, VOID *v){
+   for(size_t i = saida_processo.tratadores.size(); i > 0; i--){
+      const TratadorFork &tratador = saida_processo.tratadores[i - 1];
+      if(tratador.antes != NULL){
+         tratador.antes(tid, contexto, tratador.arg);
+      }
+   }
+}
+
+// Depois do "fork", no pai: chama as funções "pai", na ordem do registro
+static VOID SaidaProcessoDepoisPai(THREADID tid, const CONTEXT *contexto, VOID *v){
+   for(size_t i = 0; i < saida_processo.tratadores.size(); i++){
+      const TratadorFork &tratador = saida_processo.tratadores[i];
+      if(tratador.pai != NULL){
+         tratador.pai(tid, contexto, tratador.arg);
+      }
+   }
+}
+
+// Depois do "fork", no filho: chama as funções "filho", na ordem do registro
+static VOID SaidaProcessoDepoisFilho(THREADID tid, const CONTEXT *contexto, VOID *v){
+   for(size_t i = 0; i < saida_processo.tratadores.size(); i++){
+      const TratadorFork &tratador = saida_processo.tratadores[i];
+      if(tratador.filho != NULL){
+         tratador.filho(tid, contexto, tratador.arg);
+      }
+   }
+}
+
+// Inicia o subsistema: guarda o pid do processo inicial e registra as funções de "fork" do Pin.
+// "sufixo" é o valor da opção -sufixo_pid.
+static VOID SaidaProcessoInicia(BOOL sufixo){
+   saida_processo.sufixo = sufixo;
+   saida_processo.pid_inicial = PIN_GetPid();
+
+   PIN_AddForkFunction(FPOINT_BEFORE, SaidaProcessoAntes, NULL);
+   PIN_AddForkFunction(FPOINT_AFTER_IN_PARENT, SaidaProcessoDepoisPai, NULL);
+   PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, SaidaProcessoDepoisFilho, NULL);
+}
+
+#endif // SAIDA_PROCESSO_H